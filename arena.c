@@ -0,0 +1,212 @@
+/*
+ * arena.c
+ *
+ * Contains a simple bump allocator used for per-request data such as
+ * decoded form fields. Allocations are carved out of ARENA_BLOCK_SIZE
+ * blocks and are never freed individually; the whole arena is reset
+ * when the request ends. The most recent allocation can be extended in
+ * place, which lets a decoder write a field of unknown length directly
+ * into its final location.
+ */
+
+#include "headerfile.h"
+
+/*
+ * Function: arena_new_block
+ * ----------------------------
+ *   Allocates a block large enough for the requested size and puts it
+ *   at the head of the arena's block list.
+ *
+ *	 Parameters:
+ *   mem: The arena
+ *   size: The number of bytes the block must hold
+ *
+ *   Returns: the new block, or NULL if memory could not be allocated
+ */
+static arena_block *arena_new_block(arena *mem, size_t size)
+{
+	arena_block *block;
+
+	if (size < ARENA_BLOCK_SIZE)
+	{
+		size = ARENA_BLOCK_SIZE;
+	}
+
+	block = (arena_block *) malloc(sizeof(arena_block) + size);
+	if (block == NULL)
+	{
+		return NULL;
+	}
+
+	block->size = size;
+	block->used = 0;
+	block->next = mem->head;
+	mem->head = block;
+	return block;
+}
+
+/*
+ * Function: arena_init
+ * ----------------------------
+ *   Initializes an empty arena. No memory is allocated until the first
+ *   allocation.
+ *
+ *	 Parameters:
+ *   mem: The arena
+ *
+ *   Returns: nothing
+ */
+void arena_init(arena *mem)
+{
+	mem->head = NULL;
+	mem->last = NULL;
+}
+
+/*
+ * Function: arena_alloc
+ * ----------------------------
+ *   Allocates memory from the arena, aligned for any type.
+ *
+ *	 Parameters:
+ *   mem: The arena
+ *   size: The number of bytes to allocate
+ *
+ *   Returns: the memory, or NULL if it could not be allocated
+ */
+void *arena_alloc(arena *mem, size_t size)
+{
+	arena_block *block = mem->head;
+	size_t start;
+
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+
+	if (block == NULL || block->size - block->used < size)
+	{
+		block = arena_new_block(mem, size);
+		if (block == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	start = block->used;
+	block->used += size;
+	mem->last = block->data + start;
+	return mem->last;
+}
+
+/*
+ * Function: arena_append
+ * ----------------------------
+ *   Appends bytes to a string being built at the top of the arena and
+ *   keeps it null terminated. If the string is not the most recent
+ *   allocation, or its block is full, it is moved to a new location.
+ *   Passing a NULL string starts a new one.
+ *
+ *	 Parameters:
+ *   mem: The arena
+ *   string: The string to extend, or NULL
+ *   length: The string's length, updated on return
+ *   data: The bytes to append
+ *   count: The number of bytes to append
+ *
+ *   Returns: the string, which may have moved, or NULL if memory could
+ *   not be allocated
+ */
+char *arena_append(arena *mem, char *string, size_t *length, const char *data, size_t count)
+{
+	arena_block *block = mem->head;
+	char *moved;
+	size_t oldsize;
+
+	if (string == NULL)
+	{
+		*length = 0;
+		string = (char *) arena_alloc(mem, count + 1);
+		if (string == NULL)
+		{
+			return NULL;
+		}
+	}
+	else if (string == mem->last &&
+			(size_t) (block->data + block->size - string) >= *length + count + 1)
+	{
+		// Extend the most recent allocation in place
+		oldsize = (block->data + block->used) - string;
+		if (*length + count + 1 > oldsize)
+		{
+			block->used += ((*length + count + 1 - oldsize) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+			if (block->used > block->size)
+			{
+				block->used = block->size;
+			}
+		}
+	}
+	else
+	{
+		// Move the string somewhere with room to grow
+		moved = (char *) arena_alloc(mem, (*length + count) * 2 + 1);
+		if (moved == NULL)
+		{
+			return NULL;
+		}
+		memcpy(moved, string, *length);
+		string = moved;
+	}
+
+	memcpy(string + *length, data, count);
+	*length += count;
+	string[*length] = '\0';
+	return string;
+}
+
+/*
+ * Function: arena_reset
+ * ----------------------------
+ *   Releases every allocation. The oldest block is kept for reuse and
+ *   the rest are freed.
+ *
+ *	 Parameters:
+ *   mem: The arena
+ *
+ *   Returns: nothing
+ */
+void arena_reset(arena *mem)
+{
+	arena_block *block;
+
+	while (mem->head != NULL && mem->head->next != NULL)
+	{
+		block = mem->head;
+		mem->head = block->next;
+		free(block);
+	}
+
+	if (mem->head != NULL)
+	{
+		mem->head->used = 0;
+	}
+	mem->last = NULL;
+}
+
+/*
+ * Function: arena_destroy
+ * ----------------------------
+ *   Frees every block in the arena.
+ *
+ *	 Parameters:
+ *   mem: The arena
+ *
+ *   Returns: nothing
+ */
+void arena_destroy(arena *mem)
+{
+	arena_block *block;
+
+	while ((block = mem->head) != NULL)
+	{
+		mem->head = block->next;
+		free(block);
+	}
+	mem->last = NULL;
+}
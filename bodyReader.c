@@ -0,0 +1,394 @@
+/*
+ * bodyReader.c
+ *
+ * Contains the streaming request body reader. The body's framing comes
+ * from the Content-Length or Transfer-Encoding: chunked header; the
+ * reader hands back the body a piece at a time, straight out of the
+ * connection's input buffer, so a body of any permitted size is read
+ * with a fixed amount of memory. Bodies larger than the configured
+ * maximum are refused before they are read. The same reader takes
+ * response bodies from upstream servers for the reverse proxy.
+ */
+
+#include "headerfile.h"
+#include <limits.h>
+
+/*
+ * Function: isChunked
+ * ----------------------------
+ *   Determines if a Transfer-Encoding value is exactly "chunked", the only
+ *   coding the reader understands.
+ *
+ *	 Parameters:
+ *   value: The field value, ending at a carriage return or newline
+ *
+ *   Returns: 1 if the value is "chunked", 0 otherwise
+ */
+static int isChunked(const char *value)
+{
+	if (strncasecmp(value, "chunked", 7) != 0)
+	{
+		return 0;
+	}
+	for (value += 7; *value == ' ' || *value == '\t'; value++)
+	{
+	}
+	return *value == '\r' || *value == '\n' || *value == '\0';
+}
+
+/*
+ * Function: body_reader_init
+ * ----------------------------
+ *   Works out how the request body is framed and checks it against the
+ *   maximum body size. A request that gives both a Transfer-Encoding and a
+ *   Content-Length is refused, since the two could be read differently by
+ *   a proxy in front of the server. If the client sent "Expect: 100-continue" and the
+ *   body is acceptable, the interim 100 Continue response is sent so the
+ *   client starts transmitting.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header
+ *
+ *   Returns: 0 if the body can be read, otherwise the HTTP status code to
+ *   send: 411 if the length is missing, 413 if the body is too large,
+ *   400 if the framing headers are malformed, or 417 for an
+ *   unsupported expectation
+ */
+int body_reader_init(connection *conn)
+{
+	char *value;
+	char *end;
+	long long length;
+
+	conn->bodyMode = BODY_NONE;
+	conn->bodyRemaining = 0;
+	conn->bodyTotal = 0;
+	conn->bodyLimit = config_current()->settings.maxBodySize;
+	conn->chunkState = CHUNK_SIZE_START;
+
+	// Chunked framing may not come with a length
+	value = connection_header(conn, "Transfer-Encoding");
+	if (value != NULL)
+	{
+		if (!isChunked(value) || connection_header(conn, "Content-Length") != NULL)
+		{
+			return 400;
+		}
+		conn->bodyMode = BODY_CHUNKED;
+	}
+	else
+	{
+		value = connection_header(conn, "Content-Length");
+		if (value == NULL)
+		{
+			return 411;
+		}
+
+		errno = 0;
+		length = strtoll(value, &end, 10);
+		if (end == value || errno != 0 || length < 0 || (*end != '\r' && *end != '\n' && *end != ' '))
+		{
+			return 400;
+		}
+		if (length > conn->bodyLimit)
+		{
+			return 413;
+		}
+		conn->bodyMode = BODY_LENGTH;
+		conn->bodyRemaining = length;
+	}
+
+	// Let a waiting client know it can send the body
+	value = connection_header(conn, "Expect");
+	if (value != NULL)
+	{
+		if (strncasecmp(value, "100-continue", 12) != 0)
+		{
+			return 417;
+		}
+		if (conn->inpos == conn->inlen)
+		{
+			connection_write(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+			connection_flush(conn);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: body_reader_response
+ * ----------------------------
+ *   Works out how a response body is framed, for a connection that has
+ *   received a response header rather than a request, such as one to an
+ *   upstream server. Unlike a request body, a response body may run
+ *   until the connection closes, and its size is not limited.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the response header
+ *   bodyless: Nonzero if the response has no body whatever its header
+ *   says, as for the answer to a HEAD request or a 204 or 304 status
+ *
+ *   Returns: 0 if the body can be read, -1 if the framing headers are
+ *   malformed
+ */
+int body_reader_response(connection *conn, int bodyless)
+{
+	char *value;
+	char *end;
+	long long length;
+
+	conn->bodyMode = BODY_NONE;
+	conn->bodyRemaining = 0;
+	conn->bodyTotal = 0;
+	conn->bodyLimit = LLONG_MAX;
+	conn->chunkState = CHUNK_SIZE_START;
+
+	if (bodyless)
+	{
+		return 0;
+	}
+
+	// Chunked framing takes precedence over a length
+	value = connection_header(conn, "Transfer-Encoding");
+	if (value != NULL)
+	{
+		if (!isChunked(value))
+		{
+			return -1;
+		}
+		conn->bodyMode = BODY_CHUNKED;
+		return 0;
+	}
+
+	value = connection_header(conn, "Content-Length");
+	if (value == NULL)
+	{
+		conn->bodyMode = BODY_CLOSE;
+		return 0;
+	}
+
+	errno = 0;
+	length = strtoll(value, &end, 10);
+	if (end == value || errno != 0 || length < 0 || (*end != '\r' && *end != '\n' && *end != ' '))
+	{
+		return -1;
+	}
+	conn->bodyMode = BODY_LENGTH;
+	conn->bodyRemaining = length;
+	return 0;
+}
+
+/*
+ * Function: body_next
+ * ----------------------------
+ *   Returns the next piece of the request body, receiving more data from
+ *   the socket when the input buffer is empty. The piece points into the
+ *   connection's input buffer and is only valid until the next call.
+ *   Each wait for data is held to the body-read deadline.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   data: Set to the start of the piece
+ *
+ *   Returns: the length of the piece, 0 at the end of the body, or -1 if
+ *   the connection closed early or timed out, the chunked framing is
+ *   invalid, or the body exceeds the maximum size
+ */
+ssize_t body_next(connection *conn, char **data)
+{
+	char *raw;
+	size_t available;
+	size_t i;
+	size_t take;
+	ssize_t received;
+	int digit;
+
+	for (;;)
+	{
+		if (conn->bodyMode == BODY_NONE ||
+				(conn->bodyMode == BODY_LENGTH && conn->bodyRemaining == 0) ||
+				(conn->bodyMode == BODY_CHUNKED && conn->chunkState == CHUNK_DONE))
+		{
+			// The body is complete; the response deadline applies again
+			if (conn->bodyMode != BODY_NONE)
+			{
+				conn->bodyMode = BODY_NONE;
+				connection_set_deadline(conn, CONN_TIMER_RESPONSE);
+			}
+			return 0;
+		}
+
+		// Wait for more of the body
+		if (conn->inpos == conn->inlen)
+		{
+			connection_set_deadline(conn, CONN_TIMER_BODY);
+			received = connection_fill(conn);
+
+			// A body that runs to the end of the connection is complete
+			// when the peer closes it
+			if (received == 0 && conn->bodyMode == BODY_CLOSE && !conn->timedOut)
+			{
+				conn->bodyMode = BODY_NONE;
+				connection_set_deadline(conn, CONN_TIMER_RESPONSE);
+				return 0;
+			}
+			if (received <= 0)
+			{
+				return -1;
+			}
+		}
+
+		raw = conn->inbuf + conn->inpos;
+		available = conn->inlen - conn->inpos;
+
+		if (conn->bodyMode == BODY_CLOSE)
+		{
+			conn->inpos = conn->inlen;
+			conn->bodyTotal += available;
+			*data = raw;
+			return available;
+		}
+
+		if (conn->bodyMode == BODY_LENGTH)
+		{
+			take = available < (size_t) conn->bodyRemaining ? available : (size_t) conn->bodyRemaining;
+			conn->inpos += take;
+			conn->bodyRemaining -= take;
+			conn->bodyTotal += take;
+			*data = raw;
+			return take;
+		}
+
+		// Chunked: step through the framing until chunk data is reached
+		for (i = 0; i < available; i++)
+		{
+			if (conn->chunkState == CHUNK_DATA)
+			{
+				take = available - i < (size_t) conn->bodyRemaining ? available - i : (size_t) conn->bodyRemaining;
+				conn->inpos += i + take;
+				conn->bodyRemaining -= take;
+				conn->bodyTotal += take;
+				if (conn->bodyRemaining == 0)
+				{
+					conn->chunkState = CHUNK_DATA_END;
+				}
+				*data = raw + i;
+				return take;
+			}
+
+			switch (conn->chunkState)
+			{
+				case CHUNK_SIZE_START:
+				case CHUNK_SIZE:
+					digit = hexDigit(raw[i]);
+					if (digit >= 0)
+					{
+						conn->chunkState = CHUNK_SIZE;
+
+						// A response's limit is LLONG_MAX, so the size itself must not overflow
+						if (conn->bodyRemaining > (LLONG_MAX - 15) / 16)
+						{
+							return -1;
+						}
+						conn->bodyRemaining = conn->bodyRemaining * 16 + digit;
+						if (conn->bodyRemaining > conn->bodyLimit - conn->bodyTotal)
+						{
+							return -1;
+						}
+					}
+					else if (conn->chunkState == CHUNK_SIZE_START)
+					{
+						// A size line must start with a digit
+						return -1;
+					}
+					else if (raw[i] == ';' || raw[i] == ' ' || raw[i] == '\t' || raw[i] == '\r')
+					{
+						conn->chunkState = CHUNK_EXTENSION;
+					}
+					else if (raw[i] == '\n')
+					{
+						conn->chunkState = conn->bodyRemaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+						conn->trailerLineLen = 0;
+					}
+					else
+					{
+						return -1;
+					}
+					break;
+				case CHUNK_EXTENSION:
+					// Chunk extensions are ignored
+					if (raw[i] == '\n')
+					{
+						conn->chunkState = conn->bodyRemaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+						conn->trailerLineLen = 0;
+					}
+					break;
+				case CHUNK_DATA_END:
+					// The CRLF after the chunk data
+					if (raw[i] == '\n')
+					{
+						conn->chunkState = CHUNK_SIZE_START;
+						conn->bodyRemaining = 0;
+					}
+					else if (raw[i] != '\r')
+					{
+						return -1;
+					}
+					break;
+				case CHUNK_TRAILER:
+					// Trailer fields are ignored; a blank line ends the body
+					if (raw[i] == '\n')
+					{
+						if (conn->trailerLineLen == 0)
+						{
+							conn->chunkState = CHUNK_DONE;
+							conn->inpos += i + 1;
+							break;
+						}
+						conn->trailerLineLen = 0;
+					}
+					else if (raw[i] != '\r')
+					{
+						conn->trailerLineLen += 1;
+					}
+					break;
+			}
+
+			if (conn->chunkState == CHUNK_DONE)
+			{
+				break;
+			}
+		}
+
+		// All the framing in the buffer has been consumed
+		if (conn->chunkState != CHUNK_DONE)
+		{
+			conn->inpos = conn->inlen;
+		}
+	}
+}
+
+/*
+ * Function: body_discard
+ * ----------------------------
+ *   Reads and throws away whatever is left of the request body so the
+ *   connection is positioned at the next request.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: 0 if the whole body was read, -1 otherwise
+ */
+int body_discard(connection *conn)
+{
+	char *data;
+	ssize_t count;
+
+	while ((count = body_next(conn, &data)) > 0)
+	{
+		// nothing to do
+	}
+
+	return count == 0 ? 0 : -1;
+}
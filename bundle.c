@@ -0,0 +1,703 @@
+/*
+ * bundle.c
+ *
+ * Contains the static bundle: the whole home directory packed into one
+ * read-only file that the server maps into memory at startup and serves
+ * from, instead of looking files up on disk.
+ *
+ * A bundle starts with a bundle_header, followed by a bundle_entry for
+ * each file sorted by the hash of its path, then the paths, MIME types
+ * and prebuilt response headers. Each file's contents start on a page
+ * boundary after that, so they can be sent with sendfile() straight
+ * from the bundle's descriptor. A file with a "<name>.gz" sibling also
+ * carries that as a precompressed variant, sent to clients that accept
+ * gzip. Every file and variant has an ETag computed from its contents.
+ *
+ * Bundles are made with the -pack option, which writes a temporary file
+ * and renames it into place, so a deploy is a single atomic file swap.
+ */
+
+#include "headerfile.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define BUNDLE_MAGIC "WSBUNDL1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_PAGE_SIZE 4096
+
+// Define type of struct for the start of a bundle file
+typedef struct bundle_header {
+	char magic[8];			// BUNDLE_MAGIC
+	uint32_t version;		// BUNDLE_VERSION
+	uint32_t entryCount;	// files in the bundle
+	uint64_t indexOffset;	// where the bundle_entry array starts
+	uint64_t size;			// size of the whole bundle, to detect truncation
+	} bundle_header;
+
+// Define type of struct for a file in a bundle; offsets are from the start of the bundle
+struct bundle_entry {
+	uint64_t hash;				// hashString() of the path
+	uint64_t pathOffset;		// the normalized path, null terminated
+	uint64_t typeOffset;		// the MIME type, null terminated
+	uint64_t headerOffset;		// the prebuilt header for the file
+	uint64_t headerLength;
+	uint64_t bodyOffset;		// the file's contents, page aligned
+	uint64_t bodyLength;
+	uint64_t gzipHeaderOffset;	// the prebuilt header for the gzip variant
+	uint64_t gzipHeaderLength;	// 0 if there is no gzip variant
+	uint64_t gzipOffset;		// the gzip variant's contents, page aligned
+	uint64_t gzipLength;
+	char etag[24];				// quoted ETag, null terminated
+	char gzipEtag[24];			// quoted ETag of the gzip variant
+	};
+
+// Define type of struct for a file found while packing
+typedef struct pack_file {
+	char *path;				// path relative to the home directory
+	char *gzipPath;			// path of the precompressed variant, or NULL
+	char *type;				// MIME type
+	off_t size;
+	off_t gzipSize;
+	} pack_file;
+
+/*
+ * Struct that holds the mapped bundle.
+ */
+static struct {
+	const char *base;			// the mapping, or NULL if no bundle is loaded
+	size_t size;
+	const bundle_header *header;
+	const bundle_entry *entries;
+	file_cache_entry file;		// the bundle's descriptor, shared by every transfer
+} bundle;
+
+/*
+ * Function: bundle_open
+ * ----------------------------
+ *   Maps a bundle so files are served from it. The bundle is checked
+ *   for a valid header and index before it is used.
+ *
+ *	 Parameters:
+ *   path: The bundle file
+ *
+ *   Returns: 0 if successful, -1 if the bundle cannot be used
+ */
+int bundle_open(const char *path)
+{
+	char logbuff[BUFSIZE];
+	struct stat fileInfo;
+	const bundle_header *header;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &fileInfo) != 0 || fileInfo.st_size < (off_t) sizeof(bundle_header))
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		sprintf(logbuff, "Unable to open the bundle %s.", path);
+		logger(logbuff);
+		return -1;
+	}
+
+	base = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		close(fd);
+		sprintf(logbuff, "Unable to map the bundle %s.", path);
+		logger(logbuff);
+		return -1;
+	}
+
+	header = (const bundle_header *) base;
+	if (memcmp(header->magic, BUNDLE_MAGIC, 8) != 0 || header->version != BUNDLE_VERSION ||
+			header->size != (uint64_t) fileInfo.st_size ||
+			header->indexOffset + (uint64_t) header->entryCount * sizeof(bundle_entry) > header->size)
+	{
+		munmap(base, fileInfo.st_size);
+		close(fd);
+		sprintf(logbuff, "%s is not a valid bundle.", path);
+		logger(logbuff);
+		return -1;
+	}
+
+	bundle.base = (const char *) base;
+	bundle.size = fileInfo.st_size;
+	bundle.header = header;
+	bundle.entries = (const bundle_entry *) (bundle.base + header->indexOffset);
+	bundle.file.fd = fd;
+	bundle.file.size = fileInfo.st_size;
+	bundle.file.cached = 1;		// never closed by file_cache_release
+
+	sprintf(logbuff, "Serving %u files from the bundle %s.", header->entryCount, path);
+	logger(logbuff);
+	return 0;
+}
+
+/*
+ * Function: bundle_active
+ * ----------------------------
+ *   Determines if files are served from a bundle.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 1 if a bundle is loaded, 0 otherwise
+ */
+int bundle_active()
+{
+	return bundle.base != NULL;
+}
+
+/*
+ * Function: bundle_lookup
+ * ----------------------------
+ *   Finds a file in the bundle by its normalized path, with a binary
+ *   search of the index.
+ *
+ *	 Parameters:
+ *   path: The path relative to the home directory
+ *
+ *   Returns: the file's entry, or NULL if it is not in the bundle
+ */
+const bundle_entry *bundle_lookup(const char *path)
+{
+	uint64_t hash = hashString(path);
+	uint32_t low = 0;
+	uint32_t high;
+	uint32_t middle;
+
+	if (bundle.base == NULL)
+	{
+		return NULL;
+	}
+
+	// Find the first entry with the hash
+	high = bundle.header->entryCount;
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		if (bundle.entries[middle].hash < hash)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	// Paths that share a hash are next to each other
+	for (; low < bundle.header->entryCount && bundle.entries[low].hash == hash; low++)
+	{
+		if (strcmp(bundle.base + bundle.entries[low].pathOffset, path) == 0)
+		{
+			return &(bundle.entries[low]);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: bundle_body
+ * ----------------------------
+ *   Gets a bundled file's contents, straight from the mapping.
+ *
+ *	 Parameters:
+ *   entry: The file's entry
+ *   length: Set to the length of the contents
+ *
+ *   Returns: the contents
+ */
+const char *bundle_body(const bundle_entry *entry, size_t *length)
+{
+	*length = entry->bodyLength;
+	return bundle.base + entry->bodyOffset;
+}
+
+/*
+ * Function: bundle_type
+ * ----------------------------
+ *   Gets a bundled file's MIME type.
+ *
+ *	 Parameters:
+ *   entry: The file's entry
+ *
+ *   Returns: the MIME type
+ */
+const char *bundle_type(const bundle_entry *entry)
+{
+	return bundle.base + entry->typeOffset;
+}
+
+/*
+ * Function: headerHas
+ * ----------------------------
+ *   Determines if a request header's value contains a token.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header
+ *   name: The header field name
+ *   token: The text to look for
+ *
+ *   Returns: a pointer to the token in the header, or NULL
+ */
+static char *headerHas(connection *conn, const char *name, const char *token)
+{
+	char *value = connection_header(conn, name);
+	size_t length;
+
+	if (value == NULL)
+	{
+		return NULL;
+	}
+
+	length = strcspn(value, "\r\n");
+	return memmem(value, length, token, strlen(token));
+}
+
+/*
+ * Function: bundle_send
+ * ----------------------------
+ *   Sends a file from the bundle. The prebuilt header is sent with the
+ *   Date and Connection fields added, and the contents follow with
+ *   sendfile() from the bundle's descriptor. Clients that accept gzip
+ *   get the precompressed variant if there is one, and a client that
+ *   already has the file, going by its ETag, gets a 304.
+ *
+ *	 Parameters:
+ *   conn: The connection to send the file to
+ *   entry: The file's entry
+ *
+ *   Returns: nothing
+ */
+void bundle_send(connection *conn, const bundle_entry *entry)
+{
+	char response[200];
+	char dateAndTime[30];
+	const char *etag;
+	char *accept;
+	int gzip = 0;
+	int size;
+
+	getHttpDate(dateAndTime);
+
+	// The client's copy of either variant is current
+	etag = NULL;
+	if (headerHas(conn, "If-None-Match", entry->etag) != NULL)
+	{
+		etag = entry->etag;
+	}
+	else if (entry->gzipHeaderLength > 0 && headerHas(conn, "If-None-Match", entry->gzipEtag) != NULL)
+	{
+		etag = entry->gzipEtag;
+	}
+	if (etag != NULL)
+	{
+		conn->span.status = 304;
+		size = sprintf(response, "HTTP/1.1 304 Not Modified\r\nDate: %s\r\nETag: %s\r\nConnection: %s\r\n\r\n",
+				dateAndTime, etag, conn->keepAlive ? "keep-alive" : "close");
+		connection_write(conn, response, size);
+		return;
+	}
+
+	// Use the gzip variant unless the client refuses it with q=0
+	if (entry->gzipHeaderLength > 0 && (accept = headerHas(conn, "Accept-Encoding", "gzip")) != NULL)
+	{
+		gzip = strncmp(accept + 4, ";q=0", 4) != 0 || accept[8] == '.';
+	}
+
+	if (gzip)
+	{
+		connection_write(conn, bundle.base + entry->gzipHeaderOffset, entry->gzipHeaderLength);
+	}
+	else
+	{
+		connection_write(conn, bundle.base + entry->headerOffset, entry->headerLength);
+	}
+	size = sprintf(response, "Date: %s\r\nConnection: %s\r\n\r\n",
+			dateAndTime, conn->keepAlive ? "keep-alive" : "close");
+	connection_write(conn, response, size);
+
+	// The worker streams the contents from the bundle behind the header
+	connection_close_file(conn);
+	file_cache_retain(&(bundle.file));
+	conn->file = &(bundle.file);
+	if (gzip)
+	{
+		connection_attach_file(conn, entry->gzipOffset, entry->gzipLength);
+	}
+	else
+	{
+		connection_attach_file(conn, entry->bodyOffset, entry->bodyLength);
+	}
+}
+
+/*
+ * Function: pack_add
+ * ----------------------------
+ *   Adds a file to the list being packed, growing the list as needed.
+ *
+ *	 Parameters:
+ *   files: The list
+ *   count: The number of files in the list
+ *   capacity: The allocated size of the list
+ *   file: The file to add
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int pack_add(pack_file **files, uint32_t *count, uint32_t *capacity, pack_file *file)
+{
+	pack_file *grown;
+
+	if (*count == *capacity)
+	{
+		*capacity = *capacity == 0 ? 256 : *capacity * 2;
+		grown = (pack_file *) realloc(*files, sizeof(pack_file) * *capacity);
+		if (grown == NULL)
+		{
+			return -1;
+		}
+		*files = grown;
+	}
+
+	(*files)[*count] = *file;
+	*count += 1;
+	return 0;
+}
+
+/*
+ * Function: pack_scan
+ * ----------------------------
+ *   Finds every file below a directory that has a MIME type. A file
+ *   named "<name>.gz" next to "<name>" becomes its gzip variant instead
+ *   of a file of its own.
+ *
+ *	 Parameters:
+ *   path: The directory, relative to the home directory ("" for the
+ *   home directory itself)
+ *   files: The list of files found
+ *   count: The number of files in the list
+ *   capacity: The allocated size of the list
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int pack_scan(const char *path, pack_file **files, uint32_t *count, uint32_t *capacity)
+{
+	DIR *directory = opendir(path[0] == '\0' ? "." : path);
+	struct dirent *item;
+	struct stat fileInfo;
+	pack_file file;
+	char child[BUFSIZE];
+	char sibling[BUFSIZE + 3];
+	size_t length;
+	int result = 0;
+
+	if (directory == NULL)
+	{
+		return 0;
+	}
+
+	while (result == 0 && (item = readdir(directory)) != NULL)
+	{
+		if (!strcmp(item->d_name, ".") || !strcmp(item->d_name, ".."))
+		{
+			continue;
+		}
+
+		if (path[0] == '\0')
+		{
+			snprintf(child, sizeof(child), "%s", item->d_name);
+		}
+		else
+		{
+			snprintf(child, sizeof(child), "%s/%s", path, item->d_name);
+		}
+
+		if (stat(child, &fileInfo) != 0)
+		{
+			continue;
+		}
+		if (S_ISDIR(fileInfo.st_mode))
+		{
+			result = pack_scan(child, files, count, capacity);
+			continue;
+		}
+		if (!S_ISREG(fileInfo.st_mode))
+		{
+			continue;
+		}
+
+		// A precompressed copy is packed with the file it belongs to
+		length = strlen(child);
+		if (length > 3 && !strcmp(child + length - 3, ".gz"))
+		{
+			child[length - 3] = '\0';
+			if (access(child, F_OK) == 0)
+			{
+				continue;
+			}
+			child[length - 3] = '.';
+		}
+
+		// Files without a type would only ever get a 415
+		if (strlen(getContentType(child)) == 0)
+		{
+			continue;
+		}
+
+		file.path = strdup(child);
+		file.type = getContentType(child);
+		file.size = fileInfo.st_size;
+		file.gzipPath = NULL;
+		file.gzipSize = 0;
+		snprintf(sibling, sizeof(sibling), "%s.gz", child);
+		if (stat(sibling, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode))
+		{
+			file.gzipPath = strdup(sibling);
+			file.gzipSize = fileInfo.st_size;
+		}
+
+		if (file.path == NULL || pack_add(files, count, capacity, &file) != 0)
+		{
+			result = -1;
+		}
+	}
+
+	closedir(directory);
+	return result;
+}
+
+/*
+ * Function: pack_copy
+ * ----------------------------
+ *   Copies a file into the bundle, computing its ETag on the way. A file
+ *   that has shrunk since it was found is padded with zeros.
+ *
+ *	 Parameters:
+ *   out: The bundle being written
+ *   offset: Where the file's contents go in the bundle
+ *   path: The file to copy
+ *   size: The number of bytes to copy
+ *   etag: Set to the quoted ETag
+ *
+ *   Returns: 0 if successful, -1 on a write error
+ */
+static int pack_copy(int out, off_t offset, const char *path, off_t size, char *etag)
+{
+	char buffer[65536];
+	unsigned long long hash = 14695981039346656037ULL;
+	ssize_t count;
+	off_t copied = 0;
+	ssize_t i;
+	int in = open(path, O_RDONLY);
+
+	while (copied < size)
+	{
+		count = in >= 0 ? read(in, buffer, size - copied < (off_t) sizeof(buffer) ? size - copied : (off_t) sizeof(buffer)) : 0;
+		if (count <= 0)
+		{
+			count = size - copied < (off_t) sizeof(buffer) ? size - copied : (off_t) sizeof(buffer);
+			memset(buffer, 0, count);
+		}
+		for (i = 0; i < count; i++)
+		{
+			hash = (hash ^ (unsigned char) buffer[i]) * 1099511628211ULL;
+		}
+		if (pwrite(out, buffer, count, offset + copied) != count)
+		{
+			if (in >= 0)
+			{
+				close(in);
+			}
+			return -1;
+		}
+		copied += count;
+	}
+
+	if (in >= 0)
+	{
+		close(in);
+	}
+	sprintf(etag, "\"%016llx\"", hash ^ (unsigned long long) size);
+	return 0;
+}
+
+/*
+ * Function: pack_compare
+ * ----------------------------
+ *   Orders bundle entries by hash for qsort().
+ *
+ *	 Parameters:
+ *   a: The first entry
+ *   b: The second entry
+ *
+ *   Returns: less than, equal to or greater than zero
+ */
+static int pack_compare(const void *a, const void *b)
+{
+	uint64_t first = ((const bundle_entry *) a)->hash;
+	uint64_t second = ((const bundle_entry *) b)->hash;
+
+	return first < second ? -1 : first > second;
+}
+
+/*
+ * Function: pageAlign
+ * ----------------------------
+ *   Rounds an offset up to a page boundary.
+ *
+ *	 Parameters:
+ *   offset: The offset
+ *
+ *   Returns: the aligned offset
+ */
+static uint64_t pageAlign(uint64_t offset)
+{
+	return (offset + BUNDLE_PAGE_SIZE - 1) & ~((uint64_t) BUNDLE_PAGE_SIZE - 1);
+}
+
+/*
+ * Function: bundle_pack
+ * ----------------------------
+ *   Packs the home directory, which must be the current directory, into
+ *   a bundle. The bundle is written to a temporary file that replaces
+ *   the output file only once it is complete.
+ *
+ *	 Parameters:
+ *   output: The bundle file to write
+ *
+ *   Returns: 0 if successful, otherwise CONFIG_FILE_ERR
+ */
+int bundle_pack(const char *output)
+{
+	char logbuff[BUFSIZE];
+	char temporary[BUFSIZE];
+	char header[500];
+	pack_file *files = NULL;
+	uint32_t count = 0;
+	uint32_t capacity = 0;
+	bundle_entry *entries;
+	bundle_header start;
+	char *strings;				// paths, types and headers, written after the index
+	size_t stringsSize = 0;
+	size_t stringsUsed = 0;
+	uint64_t stringsOffset;
+	uint64_t offset;
+	uint32_t i;
+	int length;
+	int out;
+	int failed = 0;
+
+	if (pack_scan("", &files, &count, &capacity) != 0)
+	{
+		logger("Out of memory while looking for files to pack.");
+		return CONFIG_FILE_ERR;
+	}
+
+	// Every string has a known maximum size, so the layout is fixed up front
+	for (i = 0; i < count; i++)
+	{
+		stringsSize += strlen(files[i].path) + 1 + strlen(files[i].type) + 1 + 2 * sizeof(header);
+	}
+
+	entries = (bundle_entry *) calloc(count > 0 ? count : 1, sizeof(bundle_entry));
+	strings = (char *) malloc(stringsSize > 0 ? stringsSize : 1);
+	snprintf(temporary, sizeof(temporary), "%s.tmp", output);
+	out = open(temporary, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (entries == NULL || strings == NULL || out < 0)
+	{
+		sprintf(logbuff, "Unable to create the bundle %s.", output);
+		logger(logbuff);
+		printf("%s\n", logbuff);
+		return CONFIG_FILE_ERR;
+	}
+
+	stringsOffset = sizeof(bundle_header) + (uint64_t) count * sizeof(bundle_entry);
+	offset = pageAlign(stringsOffset + stringsSize);
+
+	for (i = 0; i < count && !failed; i++)
+	{
+		entries[i].hash = hashString(files[i].path);
+
+		entries[i].pathOffset = stringsOffset + stringsUsed;
+		strcpy(strings + stringsUsed, files[i].path);
+		stringsUsed += strlen(files[i].path) + 1;
+
+		entries[i].typeOffset = stringsOffset + stringsUsed;
+		strcpy(strings + stringsUsed, files[i].type);
+		stringsUsed += strlen(files[i].type) + 1;
+
+		// The contents, then the gzip variant, each on a page boundary
+		entries[i].bodyOffset = offset;
+		entries[i].bodyLength = files[i].size;
+		failed = pack_copy(out, offset, files[i].path, files[i].size, entries[i].etag) != 0;
+		offset = pageAlign(offset + files[i].size);
+
+		length = sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\nETag: %s\r\n%s",
+				files[i].type, (long long) files[i].size, entries[i].etag,
+				files[i].gzipPath != NULL ? "Vary: Accept-Encoding\r\n" : "");
+		entries[i].headerOffset = stringsOffset + stringsUsed;
+		entries[i].headerLength = length;
+		memcpy(strings + stringsUsed, header, length);
+		stringsUsed += length;
+
+		if (files[i].gzipPath != NULL && !failed)
+		{
+			entries[i].gzipOffset = offset;
+			entries[i].gzipLength = files[i].gzipSize;
+			failed = pack_copy(out, offset, files[i].gzipPath, files[i].gzipSize, entries[i].gzipEtag) != 0;
+			offset = pageAlign(offset + files[i].gzipSize);
+
+			length = sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\nContent-Encoding: gzip\r\n"
+					"ETag: %s\r\nVary: Accept-Encoding\r\n",
+					files[i].type, (long long) files[i].gzipSize, entries[i].gzipEtag);
+			entries[i].gzipHeaderOffset = stringsOffset + stringsUsed;
+			entries[i].gzipHeaderLength = length;
+			memcpy(strings + stringsUsed, header, length);
+			stringsUsed += length;
+		}
+	}
+
+	// The index is sorted by hash for binary search
+	qsort(entries, count, sizeof(bundle_entry), pack_compare);
+
+	memset(&start, 0, sizeof(start));
+	memcpy(start.magic, BUNDLE_MAGIC, 8);
+	start.version = BUNDLE_VERSION;
+	start.entryCount = count;
+	start.indexOffset = sizeof(bundle_header);
+	start.size = offset > stringsOffset + stringsUsed ? offset : stringsOffset + stringsUsed;
+
+	if (failed ||
+			pwrite(out, &start, sizeof(start), 0) != sizeof(start) ||
+			pwrite(out, entries, (size_t) count * sizeof(bundle_entry), start.indexOffset) != (ssize_t) (count * sizeof(bundle_entry)) ||
+			pwrite(out, strings, stringsUsed, stringsOffset) != (ssize_t) stringsUsed ||
+			ftruncate(out, start.size) != 0 || fsync(out) != 0 || close(out) != 0 ||
+			rename(temporary, output) != 0)
+	{
+		unlink(temporary);
+		sprintf(logbuff, "Unable to write the bundle %s.", output);
+		logger(logbuff);
+		printf("%s\n", logbuff);
+		return CONFIG_FILE_ERR;
+	}
+
+	sprintf(logbuff, "Packed %u files into %s (%llu bytes).", count, output, (unsigned long long) start.size);
+	logger(logbuff);
+	printf("%s\n", logbuff);
+
+	for (i = 0; i < count; i++)
+	{
+		free(files[i].path);
+		free(files[i].gzipPath);
+	}
+	free(files);
+	free(entries);
+	free(strings);
+	return 0;
+}
@@ -0,0 +1,406 @@
+/*
+ * configReload.c
+ *
+ * Contains the configuration in effect and its reload on SIGHUP. A
+ * loaded configuration is never changed. A reload reads the config file
+ * into a new one and publishes it with a single pointer store, so a
+ * request sees either the old configuration or the new one, never a mix,
+ * and reading it takes no lock.
+ *
+ * The old configuration is freed after a grace period. Every thread that
+ * reads the configuration registers itself and records the reload count
+ * whenever it holds nothing from the configuration (between requests),
+ * or zero while it is idle. Once each thread has recorded the new count
+ * or gone idle, nothing can still point into the old configuration. A
+ * coroutine has a slot of its own, which its worker switches to while it
+ * runs, so a connection parked mid-request keeps its configuration alive.
+ * A request can stay parked for a long time, so the signal thread does
+ * not wait for the grace period: a replaced configuration is retired,
+ * and retired ones are freed by config_reclaim once their grace period
+ * has passed.
+ *
+ * The port, the home directory, the bundle, the handoff socket, the
+ * listening sockets and their options, the TLS certificate, the error pages, and
+ * the proxy and gateway routes are set up once at startup, so changes to
+ * them are logged and take effect on the next restart.
+ */
+
+#include "headerfile.h"
+
+// Define type of struct for a registered reader, one cache line each
+typedef struct config_reader {
+	unsigned long seen;		// reload count at the last quiescent point, 0 while idle
+	} __attribute__ ((aligned(64))) config_reader;
+
+// Define type of struct for a replaced configuration waiting to be freed
+typedef struct config_retired {
+	server_config *config;
+	unsigned long epoch;			// the reload count after it was replaced
+	struct config_retired *next;
+	} config_retired;
+
+/*
+ * Struct that holds the published configuration, the readers, and the
+ * config file to reload.
+ */
+static struct {
+	server_config *current;		// the configuration in effect
+	unsigned long epoch;		// bumped by every publish, starts at 1
+	config_reader readers[CONFIG_MAX_READERS];
+	int readerCount;			// slots handed out, may pass CONFIG_MAX_READERS
+	config_retired *retired;	// replaced configurations, newest first, signal thread only
+	char file[BUFSIZE];			// absolute path of the config file
+} published = { .epoch = 1 };
+
+// The calling thread's reader slot, or NULL if it has none
+static __thread config_reader *self;
+
+/*
+ * Function prototypes for the configReload.c file
+ */
+static int config_passed(unsigned long epoch);
+
+/*
+ * Function: config_create
+ * ----------------------------
+ *   Allocates a configuration holding the default settings and an empty
+ *   MIME table.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the configuration, or NULL if it cannot be allocated
+ */
+server_config *config_create()
+{
+	server_config *config = (server_config *) calloc(1, sizeof(server_config));
+
+	if (config == NULL)
+	{
+		return NULL;
+	}
+
+	config->settings.headerTimeout = DEFAULT_HEADER_TIMEOUT;
+	config->settings.bodyTimeout = DEFAULT_BODY_TIMEOUT;
+	config->settings.keepaliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+	config->settings.responseTimeout = DEFAULT_RESPONSE_TIMEOUT;
+	config->settings.maxBodySize = DEFAULT_MAX_BODY_SIZE;
+	config->settings.fileCacheSize = DEFAULT_FILE_CACHE_SIZE;
+	config->settings.fileCacheValid = DEFAULT_FILE_CACHE_VALID;
+	config->settings.negativeCacheSize = DEFAULT_NEGATIVE_CACHE_SIZE;
+	config->settings.docrootIndexSize = DEFAULT_DOCROOT_INDEX_SIZE;
+	config->settings.drainTimeout = DEFAULT_DRAIN_TIMEOUT;
+	config->settings.logLevel = DEFAULT_LOG_LEVEL;
+	config->settings.logSample = DEFAULT_LOG_SAMPLE;
+	config->settings.traceRingSize = DEFAULT_TRACE_RING_SIZE;
+	config->settings.slowRequest = DEFAULT_SLOW_REQUEST;
+	config->settings.tlsSessionCache = DEFAULT_TLS_SESSION_CACHE;
+	config->settings.http2 = DEFAULT_HTTP2;
+	config->settings.listenBacklog = DEFAULT_LISTEN_BACKLOG;
+	config->settings.tcpNoDelay = DEFAULT_TCP_NODELAY;
+	config->settings.tcpNoPush = DEFAULT_TCP_NOPUSH;
+	config->settings.tcpListen = 1;
+	config->settings.unixSocketMode = DEFAULT_UNIX_SOCKET_MODE;
+	config->settings.largeResponse = DEFAULT_LARGE_RESPONSE;
+
+	return config;
+}
+
+/*
+ * Function: config_current
+ * ----------------------------
+ *   Gets the configuration in effect. The result stays valid until the
+ *   calling thread's next quiescent point.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the configuration
+ */
+const server_config *config_current()
+{
+	return __atomic_load_n(&(published.current), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Function: config_publish
+ * ----------------------------
+ *   Puts a configuration into effect, including its log level. The
+ *   caller owns the old one and must not free it before a grace period
+ *   has passed.
+ *
+ *	 Parameters:
+ *   config: The new configuration
+ *
+ *   Returns: the configuration that was in effect, or NULL
+ */
+server_config *config_publish(server_config *config)
+{
+	log_set_level(config->settings.logLevel, config->settings.logSample);
+	return __atomic_exchange_n(&(published.current), config, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Function: config_reader_register
+ * ----------------------------
+ *   Gives the calling thread a reader slot. Must be called by every
+ *   thread that reads the configuration after startup, before it first
+ *   reads it. The thread starts out idle.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void config_reader_register()
+{
+	int slot = __atomic_fetch_add(&(published.readerCount), 1, __ATOMIC_SEQ_CST);
+
+	// Without a slot the thread is unprotected, so nothing is freed again
+	if (slot >= CONFIG_MAX_READERS)
+	{
+		logger("Too many configuration readers; old configurations will not be freed.");
+		return;
+	}
+
+	self = &(published.readers[slot]);
+}
+
+/*
+ * Function: config_reader_swap
+ * ----------------------------
+ *   Switches the calling thread to another reader slot, for a worker
+ *   about to run a coroutine or back from one.
+ *
+ *	 Parameters:
+ *   reader: The slot to switch to, from an earlier call, or NULL for none
+ *
+ *   Returns: the slot the thread had
+ */
+void *config_reader_swap(void *reader)
+{
+	config_reader *previous = self;
+
+	self = (config_reader *) reader;
+	return previous;
+}
+
+/*
+ * Function: config_quiescent
+ * ----------------------------
+ *   Marks a point where the calling thread holds nothing from the
+ *   configuration, and marks it busy again.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void config_quiescent()
+{
+	if (self != NULL)
+	{
+		__atomic_store_n(&(self->seen), __atomic_load_n(&(published.epoch), __ATOMIC_SEQ_CST),
+				__ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Function: config_offline
+ * ----------------------------
+ *   Marks the calling thread idle, holding nothing from the
+ *   configuration, until its next quiescent point.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void config_offline()
+{
+	if (self != NULL)
+	{
+		__atomic_store_n(&(self->seen), 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Function: config_passed
+ * ----------------------------
+ *   Determines if every registered thread has passed a quiescent point
+ *   since a configuration was published, or gone idle.
+ *
+ *	 Parameters:
+ *   epoch: The reload count after the publish
+ *
+ *   Returns: 1 if the grace period has passed, 0 otherwise
+ */
+static int config_passed(unsigned long epoch)
+{
+	unsigned long seen;
+	int count = __atomic_load_n(&(published.readerCount), __ATOMIC_SEQ_CST);
+	int i;
+
+	// Without a slot a thread is unprotected, so nothing is ever freed
+	if (count > CONFIG_MAX_READERS)
+	{
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		seen = __atomic_load_n(&(published.readers[i].seen), __ATOMIC_SEQ_CST);
+		if (seen != 0 && seen < epoch)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Function: config_reclaim
+ * ----------------------------
+ *   Frees the retired configurations whose grace period has passed.
+ *   Called on the signal thread, after each reload and then from time to
+ *   time while any are left.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the number of configurations still retired
+ */
+int config_reclaim()
+{
+	config_retired **link = &(published.retired);
+	config_retired *entry;
+	int freed = 0;
+	int left = 0;
+
+	while ((entry = *link) != NULL)
+	{
+		if (config_passed(entry->epoch))
+		{
+			*link = entry->next;
+			free(entry->config);
+			free(entry);
+			freed += 1;
+		}
+		else
+		{
+			link = &(entry->next);
+			left += 1;
+		}
+	}
+
+	// A request still using an old table may have added a missing type since
+	if (freed > 0)
+	{
+		negative_cache_invalidate(NEGATIVE_TYPE, NULL);
+	}
+	return left;
+}
+
+/*
+ * Function: config_reload_init
+ * ----------------------------
+ *   Remembers the config file for later reloads. Must be called before
+ *   the current directory changes.
+ *
+ *	 Parameters:
+ *   filename: The config file, absolute or relative to the current
+ *   directory
+ *
+ *   Returns: nothing
+ */
+void config_reload_init(char *filename)
+{
+	if (realpath(filename, published.file) == NULL)
+	{
+		snprintf(published.file, sizeof(published.file), "%s", filename);
+	}
+}
+
+/*
+ * Function: config_reload
+ * ----------------------------
+ *   Reads the config file into a new configuration, publishes it, and
+ *   retires the old one to be freed after the grace period. If the file
+ *   cannot be read the configuration in effect is kept. Called on the
+ *   signal thread, so reloads are handled one at a time.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void config_reload()
+{
+	const server_config *current = config_current();
+	server_config *config;
+	server_config *old;
+	config_retired *entry;
+	char port[BUFSIZE] = "\0";
+	char dir[BUFSIZE] = "\0";
+	char home[BUFSIZE];
+	char logbuff[BUFSIZE + 100];
+	unsigned long epoch;
+
+	sprintf(logbuff, "Reloading configuration from %s", published.file);
+	logger(logbuff);
+
+	config = config_create();
+	if (config == NULL || readConfigFile(published.file, port, dir, config) != 0)
+	{
+		logger("Configuration not reloaded; keeping the current configuration.");
+		free(config);
+		return;
+	}
+
+	// Settings used only at startup keep their current values
+	strcpy(config->home, current->home);
+	strcpy(config->settings.bundle, current->settings.bundle);
+	strcpy(config->settings.handoff, current->settings.handoff);
+	config->settings.negativeCacheSize = current->settings.negativeCacheSize;
+	config->settings.traceRingSize = current->settings.traceRingSize;
+	strcpy(config->settings.tlsCertificate, current->settings.tlsCertificate);
+	strcpy(config->settings.tlsKey, current->settings.tlsKey);
+	config->settings.tlsSessionCache = current->settings.tlsSessionCache;
+	config->settings.listenBacklog = current->settings.listenBacklog;
+	config->settings.deferAccept = current->settings.deferAccept;
+	config->settings.fastOpen = current->settings.fastOpen;
+	config->settings.tcpNoDelay = current->settings.tcpNoDelay;
+	config->settings.busyPoll = current->settings.busyPoll;
+	config->settings.tcpListen = current->settings.tcpListen;
+	strcpy(config->settings.unixSocket, current->settings.unixSocket);
+	config->settings.unixSocketMode = current->settings.unixSocketMode;
+
+	if (dir[0] != '\0' && (realpath(dir, home) == NULL || strcmp(home, current->home) != 0))
+	{
+		sprintf(logbuff, "The home directory stays %s until the server is restarted.", current->home);
+		logger(logbuff);
+	}
+
+	old = config_publish(config);
+	epoch = __atomic_add_fetch(&(published.epoch), 1, __ATOMIC_SEQ_CST);
+
+	// Extensions with no type may have one now
+	negative_cache_invalidate(NEGATIVE_TYPE, NULL);
+
+	// The old configuration is freed once no request can still use it
+	entry = (config_retired *) malloc(sizeof(config_retired));
+	if (entry == NULL)
+	{
+		logger("Unable to retire the old configuration; it will not be freed.");
+	}
+	else
+	{
+		entry->config = old;
+		entry->epoch = epoch;
+		entry->next = published.retired;
+		published.retired = entry;
+	}
+	config_reclaim();
+
+	logger("Configuration reloaded.");
+}
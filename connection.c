@@ -0,0 +1,1039 @@
+/*
+ * connection.c
+ *
+ * Contains the functions that manage per-connection context objects.
+ * Each worker thread keeps its own free list of connection contexts so
+ * that a context can be reused without going back to the allocator or
+ * taking a lock. The input and output buffers start at CONN_BUF_INITIAL
+ * bytes and only grow when a request has large headers or a response
+ * needs more room; they are shrunk again when the context is released so
+ * an idle connection object stays small.
+ *
+ * Sockets are non-blocking. Where a call would block, the connection
+ * waits for its socket with coroutine_poll(), so a connection served in
+ * a coroutine gives its worker to the others meanwhile, and the code
+ * above still reads and writes as if the calls blocked.
+ *
+ * Every connection carries one timer wheel entry for whichever deadline
+ * currently applies to it. When a deadline passes the timer thread shuts
+ * the socket down, which ends any wait on it so the connection can be
+ * released.
+ *
+ * A response is queued in the output buffer and sent once its handler
+ * returns. The worker then sends whatever the socket takes at once; if
+ * a slow client leaves some of it behind, the rest is queued for the
+ * sender to finish as the socket drains, so no worker waits on it.
+ */
+
+#include "headerfile.h"
+
+/*
+ * Function: connection_grow
+ * ----------------------------
+ *   Grows a connection buffer so it can hold at least the number of
+ *   bytes needed, doubling the allocation until it is large enough.
+ *
+ *	 Parameters:
+ *   buf: The buffer to grow
+ *   size: The allocated size of the buffer
+ *   needed: The number of bytes the buffer must hold
+ *   limit: The largest size the buffer may grow to
+ *
+ *   Returns: 0 if successful, -1 if the limit would be exceeded or
+ *   memory could not be allocated
+ */
+static int connection_grow(char **buf, size_t *size, size_t needed, size_t limit)
+{
+	size_t newsize = *size;
+	char *newbuf;
+
+	if (needed <= *size)
+	{
+		return 0;
+	}
+
+	if (needed > limit)
+	{
+		return -1;
+	}
+
+	while (newsize < needed)
+	{
+		newsize *= 2;
+	}
+
+	if (newsize > limit)
+	{
+		newsize = limit;
+	}
+
+	newbuf = (char *) realloc(*buf, newsize);
+	if (newbuf == NULL)
+	{
+		return -1;
+	}
+
+	*buf = newbuf;
+	*size = newsize;
+	return 0;
+}
+
+/*
+ * Function: connection_shrink
+ * ----------------------------
+ *   Returns a grown buffer to the initial size.
+ *
+ *	 Parameters:
+ *   buf: The buffer to shrink
+ *   size: The allocated size of the buffer
+ *
+ *   Returns: nothing
+ */
+static void connection_shrink(char **buf, size_t *size)
+{
+	char *newbuf;
+
+	if (*size > CONN_BUF_INITIAL)
+	{
+		newbuf = (char *) realloc(*buf, CONN_BUF_INITIAL);
+		if (newbuf != NULL)
+		{
+			*buf = newbuf;
+			*size = CONN_BUF_INITIAL;
+		}
+	}
+}
+
+/*
+ * Function: connection_timeout
+ * ----------------------------
+ *   Called on the timer thread when a connection's deadline passes.
+ *   Marks the connection and shuts the socket down so the worker
+ *   blocked on it returns.
+ *
+ *	 Parameters:
+ *   arg: The connection that timed out
+ *
+ *   Returns: nothing
+ */
+static void connection_timeout(void *arg)
+{
+	connection *conn = (connection *) arg;
+
+	conn->timedOut = 1;
+	shutdown(conn->sockfd, SHUT_RDWR);
+}
+
+/*
+ * Function: connection_set_deadline
+ * ----------------------------
+ *   Arms the connection's timer for one of its deadlines, replacing
+ *   whichever deadline was armed before.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   which: CONN_TIMER_HEADER, CONN_TIMER_BODY, CONN_TIMER_KEEPALIVE
+ *   or CONN_TIMER_RESPONSE
+ *
+ *   Returns: nothing
+ */
+void connection_set_deadline(connection *conn, int which)
+{
+	const server_settings *limits;
+	int seconds;
+
+	// An HTTP/2 stream is held to its session's deadlines
+	if (conn->http2)
+	{
+		return;
+	}
+
+	limits = &(config_current()->settings);
+	switch (which)
+	{
+		case CONN_TIMER_HEADER:
+			seconds = limits->headerTimeout;
+			break;
+		case CONN_TIMER_BODY:
+			seconds = limits->bodyTimeout;
+			break;
+		case CONN_TIMER_KEEPALIVE:
+			seconds = limits->keepaliveTimeout;
+			break;
+		default:
+			seconds = limits->responseTimeout;
+			break;
+	}
+
+	timer_set(&(conn->timer), seconds * 1000, connection_timeout, conn);
+}
+
+/*
+ * Function: connection_pool_init
+ * ----------------------------
+ *   Initializes an empty connection pool.
+ *
+ *	 Parameters:
+ *   pool: The pool to initialize
+ *
+ *   Returns: nothing
+ */
+void connection_pool_init(connection_pool *pool)
+{
+	pool->free_list = NULL;
+	pool->free_count = 0;
+}
+
+/*
+ * Function: connection_acquire
+ * ----------------------------
+ *   Takes a connection context from the pool, or allocates a new one
+ *   if the pool is empty, and attaches it to a socket.
+ *
+ *	 Parameters:
+ *   pool: The worker's connection pool
+ *   sockfd: The socket for the connection
+ *
+ *   Returns: the connection context, or NULL if memory could not be
+ *   allocated
+ */
+connection *connection_acquire(connection_pool *pool, int sockfd)
+{
+	connection *conn;
+
+	if (pool->free_list != NULL)
+	{
+		// Reuse an idle context
+		conn = pool->free_list;
+		pool->free_list = conn->next;
+		pool->free_count -= 1;
+	}
+	else
+	{
+		// Allocate a new context with small buffers
+		conn = (connection *) calloc(1, sizeof(connection));
+		if (conn == NULL)
+		{
+			return NULL;
+		}
+
+		conn->inbuf = (char *) malloc(CONN_BUF_INITIAL);
+		conn->outbuf = (char *) malloc(CONN_BUF_INITIAL);
+		if (conn->inbuf == NULL || conn->outbuf == NULL)
+		{
+			free(conn->inbuf);
+			free(conn->outbuf);
+			free(conn);
+			return NULL;
+		}
+		conn->insize = CONN_BUF_INITIAL;
+		conn->outsize = CONN_BUF_INITIAL;
+		arena_init(&(conn->requestArena));
+	}
+
+	// Reset the per-connection state
+	conn->sockfd = sockfd;
+	conn->state = CONN_READING_HEADER;
+	conn->inlen = 0;
+	conn->headerlen = 0;
+	conn->inpos = 0;
+	conn->outlen = 0;
+	conn->outpos = 0;
+	conn->inbuf[0] = '\0';
+	conn->bodyMode = BODY_NONE;
+	conn->requests = 0;
+	conn->bytesIn = 0;
+	conn->bytesOut = 0;
+	conn->file = NULL;
+	conn->fileOffset = 0;
+	conn->fileRemaining = 0;
+	conn->keepAlive = 0;
+	conn->timedOut = 0;
+	conn->timer.next = NULL;
+	conn->timer.prev = NULL;
+	conn->next = NULL;
+	memset(&(conn->span), 0, sizeof(conn->span));
+	conn->tls = NULL;
+	conn->ktls = 0;
+	conn->secure = 0;
+	conn->local = 0;
+	conn->http2 = 0;
+	conn->limits.client = 0;
+	conn->limits.network = 0;
+	clock_gettime(CLOCK_MONOTONIC, &(conn->accepted));
+	conn->lastActive = conn->accepted;
+
+	return conn;
+}
+
+/*
+ * Function: connection_detach
+ * ----------------------------
+ *   Closes the connection's socket and file and gives back its place
+ *   in the rate limiter, leaving the context idle.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+static void connection_detach(connection *conn)
+{
+	// The timer must be disarmed before the socket number can be reused
+	timer_cancel(&(conn->timer));
+
+	connection_close_file(conn);
+	tls_close(conn);
+
+	if (conn->sockfd >= 0)
+	{
+		close(conn->sockfd);
+		conn->sockfd = -1;
+	}
+
+	// The client may open another connection in its place
+	rate_limit_release(&(conn->limits));
+
+	conn->state = CONN_IDLE;
+}
+
+/*
+ * Function: connection_release
+ * ----------------------------
+ *   Closes the connection's socket and returns the context to the pool.
+ *   Buffers that grew for a large request are shrunk back to their
+ *   initial size. If the pool is already holding CONN_POOL_MAX idle
+ *   contexts the context is freed instead.
+ *
+ *	 Parameters:
+ *   pool: The worker's connection pool
+ *   conn: The connection to release
+ *
+ *   Returns: nothing
+ */
+void connection_release(connection_pool *pool, connection *conn)
+{
+	if (pool->free_count >= CONN_POOL_MAX)
+	{
+		connection_discard(conn);
+		return;
+	}
+
+	connection_detach(conn);
+
+	arena_reset(&(conn->requestArena));
+	connection_shrink(&(conn->inbuf), &(conn->insize));
+	connection_shrink(&(conn->outbuf), &(conn->outsize));
+
+	conn->next = pool->free_list;
+	pool->free_list = conn;
+	pool->free_count += 1;
+}
+
+/*
+ * Function: connection_discard
+ * ----------------------------
+ *   Closes the connection's socket and frees its context, for a thread
+ *   that has no pool of its own to keep it in.
+ *
+ *	 Parameters:
+ *   conn: The connection to free
+ *
+ *   Returns: nothing
+ */
+void connection_discard(connection *conn)
+{
+	connection_detach(conn);
+	arena_destroy(&(conn->requestArena));
+	free(conn->inbuf);
+	free(conn->outbuf);
+	free(conn);
+}
+
+/*
+ * Function: connection_pool_destroy
+ * ----------------------------
+ *   Frees every idle connection context held by the pool.
+ *
+ *	 Parameters:
+ *   pool: The pool to empty
+ *
+ *   Returns: nothing
+ */
+void connection_pool_destroy(connection_pool *pool)
+{
+	connection *conn;
+
+	while ((conn = pool->free_list) != NULL)
+	{
+		pool->free_list = conn->next;
+		arena_destroy(&(conn->requestArena));
+		free(conn->inbuf);
+		free(conn->outbuf);
+		free(conn);
+	}
+
+	pool->free_count = 0;
+}
+
+/*
+ * Function: connection_recv
+ * ----------------------------
+ *   Receives data from the connection's socket, through TLS if the
+ *   connection uses it, waiting until some arrives.
+ *
+ *	 Parameters:
+ *   conn: The connection to read from
+ *   buffer: Where to put the data
+ *   length: The most bytes to receive
+ *
+ *   Returns: the number of bytes received, 0 if the peer closed the
+ *   connection, or -1 on error
+ */
+static ssize_t connection_recv(connection *conn, void *buffer, size_t length)
+{
+	ssize_t received;
+
+	if (conn->tls != NULL)
+	{
+		return tls_recv(conn, buffer, length);
+	}
+
+	for (;;)
+	{
+		received = recv(conn->sockfd, buffer, length, 0);
+		if (received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || connection_wait(conn, POLLIN) != 0)
+		{
+			return received;
+		}
+	}
+}
+
+/*
+ * Function: connection_read_header
+ * ----------------------------
+ *   Receives data from the socket until the blank line that ends the
+ *   request header has arrived. The input buffer grows as needed up to
+ *   MAX_HEADER_SIZE and is always kept null terminated. Any bytes that
+ *   arrive after the header stay in the buffer following headerlen.
+ *
+ *   A connection waiting for its next request is held to the keep-alive
+ *   deadline until the first byte arrives; from then on the whole header
+ *   must arrive within the header deadline, however slowly it trickles in.
+ *   Once the header is complete the response deadline is armed. A
+ *   pipelined request already in the buffer is parsed without waiting for
+ *   the socket. While it waits for the first byte the connection holds
+ *   nothing from the configuration, so an idle connection does not hold
+ *   up a reload, and a drain closes it.
+ *
+ *	 Parameters:
+ *   conn: The connection to read from
+ *
+ *   Returns: CONN_OK if a complete header was received, CONN_ERR_CLOSED
+ *   if the peer closed the connection or an error occurred,
+ *   CONN_ERR_TIMEOUT if a deadline passed, or CONN_ERR_TOO_LARGE if the
+ *   header exceeded MAX_HEADER_SIZE
+ */
+int connection_read_header(connection *conn)
+{
+	ssize_t received;	// bytes returned by recv
+	size_t searchFrom;	// where to resume looking for the end of the header
+	char *end;			// end of header marker
+	struct pollfd waitfds[2];	// the socket and the drain descriptor
+	int idle;			// nonzero while waiting for a keep-alive request to start
+
+	conn->state = CONN_READING_HEADER;
+
+	// Idle keep-alive connections get the keep-alive deadline until data arrives
+	idle = (conn->requests > 0 && conn->inlen == 0);
+	connection_set_deadline(conn, idle ? CONN_TIMER_KEEPALIVE : CONN_TIMER_HEADER);
+
+	// A TLS handshake counts against the first request's header deadline.
+	// A proxy on the Unix socket has already taken TLS off.
+	if (conn->requests == 0 && conn->tls == NULL && !conn->local && tls_active() && tls_handshake(conn) != 0)
+	{
+		return conn->timedOut ? CONN_ERR_TIMEOUT : CONN_ERR_TLS;
+	}
+
+	// An idle connection waits for its next request or the start of a
+	// drain, which closes it
+	if (idle && !tls_pending(conn))
+	{
+		waitfds[0].fd = conn->sockfd;
+		waitfds[0].events = POLLIN;
+		waitfds[1].fd = server_drain_fd();
+		waitfds[1].events = POLLIN;
+		config_offline();
+		coroutine_poll(waitfds, 2, -1);
+		config_quiescent();
+		if (!(waitfds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			return CONN_ERR_CLOSED;
+		}
+	}
+
+	// Pipelined bytes left by the previous request are searched first
+	searchFrom = 0;
+	for (;;)
+	{
+		// Look for the blank line that ends the header
+		if ((end = memmem(conn->inbuf + searchFrom, conn->inlen - searchFrom, "\r\n\r\n", 4)) != NULL)
+		{
+			conn->headerlen = end + 4 - conn->inbuf;
+			break;
+		}
+		if ((end = memmem(conn->inbuf + searchFrom, conn->inlen - searchFrom, "\n\n", 2)) != NULL)
+		{
+			conn->headerlen = end + 2 - conn->inbuf;
+			break;
+		}
+
+		// Back up far enough to catch a terminator split across reads
+		searchFrom = conn->inlen > 3 ? conn->inlen - 3 : 0;
+
+		// Make sure there is room for more data and the terminating null
+		if (conn->inlen + 1 >= conn->insize)
+		{
+			if (connection_grow(&(conn->inbuf), &(conn->insize), conn->insize + 1, MAX_HEADER_SIZE + 1) != 0)
+			{
+				return CONN_ERR_TOO_LARGE;
+			}
+		}
+
+		received = connection_recv(conn, conn->inbuf + conn->inlen, conn->insize - conn->inlen - 1);
+		if (received < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (received <= 0)
+		{
+			return conn->timedOut ? CONN_ERR_TIMEOUT : CONN_ERR_CLOSED;
+		}
+
+		// The request has started, so the header deadline now applies
+		if (idle)
+		{
+			connection_set_deadline(conn, CONN_TIMER_HEADER);
+			idle = 0;
+		}
+
+		conn->inlen += received;
+		conn->bytesIn += received;
+		conn->inbuf[conn->inlen] = '\0';
+		clock_gettime(CLOCK_MONOTONIC, &(conn->lastActive));
+	}
+
+	conn->inpos = conn->headerlen;
+
+	conn->state = CONN_PROCESSING;
+	conn->requests += 1;
+	connection_set_deadline(conn, CONN_TIMER_RESPONSE);
+	return CONN_OK;
+}
+
+/*
+ * Function: connection_header
+ * ----------------------------
+ *   Finds a field in the request header. The name is matched without
+ *   regard to case.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header
+ *   name: The field name, without the colon
+ *
+ *   Returns: a pointer to the field's value within the input buffer,
+ *   past any leading spaces, or NULL if the field is not present. The
+ *   value ends at the next carriage return or newline.
+ */
+char *connection_header(connection *conn, const char *name)
+{
+	size_t nameLen = strlen(name);
+	char *line = conn->inbuf;
+	char *end = conn->inbuf + conn->headerlen;
+	char *value;
+
+	// Skip the request line, then check each header line in turn
+	while ((line = memchr(line, '\n', end - line)) != NULL)
+	{
+		line++;
+		if ((size_t) (end - line) > nameLen && line[nameLen] == ':' &&
+				!strncasecmp(line, name, nameLen))
+		{
+			value = line + nameLen + 1;
+			while (value < end && (*value == ' ' || *value == '\t'))
+			{
+				value++;
+			}
+			return value;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: connection_fill
+ * ----------------------------
+ *   Receives more data into the input buffer. Once everything after the
+ *   header has been consumed the space is reused, so reading a body
+ *   takes no more memory than the header plus one buffer's worth.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: the number of bytes received, 0 if the peer closed the
+ *   connection, or -1 on error or timeout
+ */
+ssize_t connection_fill(connection *conn)
+{
+	ssize_t received;
+
+	// An HTTP/2 stream's request arrives whole from its session
+	if (conn->http2)
+	{
+		return 0;
+	}
+
+	// Reuse the space after the header once it has all been consumed
+	if (conn->inpos == conn->inlen)
+	{
+		conn->inpos = conn->headerlen;
+		conn->inlen = conn->headerlen;
+	}
+
+	// Keep at least a quarter of the initial buffer size free
+	if (conn->insize - conn->inlen - 1 < CONN_BUF_INITIAL / 4)
+	{
+		if (connection_grow(&(conn->inbuf), &(conn->insize), conn->inlen + CONN_BUF_INITIAL + 1, (size_t) -1) != 0)
+		{
+			return -1;
+		}
+	}
+
+	do
+	{
+		received = connection_recv(conn, conn->inbuf + conn->inlen, conn->insize - conn->inlen - 1);
+	} while (received < 0 && errno == EINTR);
+
+	if (received <= 0)
+	{
+		return conn->timedOut ? -1 : received;
+	}
+
+	conn->inlen += received;
+	conn->bytesIn += received;
+	conn->inbuf[conn->inlen] = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &(conn->lastActive));
+	return received;
+}
+
+/*
+ * Function: connection_next_request
+ * ----------------------------
+ *   Prepares a keep-alive connection for its next request. Any pipelined
+ *   bytes that arrived after the previous request are moved to the front
+ *   of the input buffer and the request arena is emptied.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+void connection_next_request(connection *conn)
+{
+	conn->inlen -= conn->inpos;
+	memmove(conn->inbuf, conn->inbuf + conn->inpos, conn->inlen);
+	conn->inbuf[conn->inlen] = '\0';
+	conn->headerlen = 0;
+	conn->inpos = 0;
+	conn->bodyMode = BODY_NONE;
+	connection_close_file(conn);
+	arena_reset(&(conn->requestArena));
+	conn->outlen = 0;
+	conn->outpos = 0;
+	conn->keepAlive = 0;
+	conn->state = CONN_READING_HEADER;
+}
+
+/*
+ * Function: connection_feed
+ * ----------------------------
+ *   Appends data to the input buffer as if it had been received, for
+ *   requests that arrive some other way than on the connection's own
+ *   socket, such as HTTP/2 streams.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   data: The data to add
+ *   length: The number of bytes to add
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+int connection_feed(connection *conn, const void *data, size_t length)
+{
+	if (connection_grow(&(conn->inbuf), &(conn->insize), conn->inlen + length + 1, (size_t) -1) != 0)
+	{
+		return -1;
+	}
+
+	memcpy(conn->inbuf + conn->inlen, data, length);
+	conn->inlen += length;
+	conn->inbuf[conn->inlen] = '\0';
+	return 0;
+}
+
+/*
+ * Function: connection_write
+ * ----------------------------
+ *   Appends data to the connection's output buffer, growing it if needed.
+ *   Nothing is sent until the connection is flushed or the handler
+ *   returns.
+ *
+ *	 Parameters:
+ *   conn: The connection to write to
+ *   data: The data to queue
+ *   length: The number of bytes to queue
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+int connection_write(connection *conn, const void *data, size_t length)
+{
+	if (connection_grow(&(conn->outbuf), &(conn->outsize), conn->outlen + length, (size_t) -1) != 0)
+	{
+		return -1;
+	}
+
+	memcpy(conn->outbuf + conn->outlen, data, length);
+	conn->outlen += length;
+	return 0;
+}
+
+/*
+ * Function: connection_flush
+ * ----------------------------
+ *   Sends everything waiting in the output buffer to the socket,
+ *   continuing after partial writes and waiting while the socket is
+ *   full. Used where nothing may happen until the client has the data,
+ *   such as between the pieces of a relayed body; a finished response
+ *   is left queued for the worker instead.
+ *
+ *	 Parameters:
+ *   conn: The connection to flush
+ *
+ *   Returns: 0 if successful, -1 if the socket returned an error
+ */
+int connection_flush(connection *conn)
+{
+	ssize_t count;
+
+	// The first bytes of a response are its header
+	if (conn->outlen > 0 && conn->span.at[SPAN_HEADERS] == 0)
+	{
+		trace_mark(conn, SPAN_HEADERS);
+	}
+
+	// An HTTP/2 stream's response is framed by its session once the
+	// handler returns
+	if (conn->http2)
+	{
+		return 0;
+	}
+
+	while (conn->outpos < conn->outlen)
+	{
+		count = conn->tls != NULL ? tls_send(conn, conn->outbuf + conn->outpos, conn->outlen - conn->outpos)
+				: send(conn->sockfd, conn->outbuf + conn->outpos, conn->outlen - conn->outpos, MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && connection_wait(conn, POLLOUT) == 0)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			conn->outlen = 0;
+			conn->outpos = 0;
+			return -1;
+		}
+
+		conn->outpos += count;
+		conn->bytesOut += count;
+	}
+
+	conn->outlen = 0;
+	conn->outpos = 0;
+	return 0;
+}
+
+/*
+ * Function: connection_sendv
+ * ----------------------------
+ *   Sends several pieces of data with one system call without waiting
+ *   on the socket. Whatever it does not take at once is copied into the
+ *   output buffer and sent after the handler returns, so the pieces can
+ *   live anywhere, such as in responses built at startup or on the
+ *   caller's stack.
+ *
+ *	 Parameters:
+ *   conn: The connection to send to
+ *   pieces: The data to send; the array is modified as data is sent
+ *   count: The number of pieces
+ *
+ *   Returns: 0 if successful, -1 if the socket returned an error or
+ *   memory could not be allocated
+ */
+int connection_sendv(connection *conn, struct iovec *pieces, int count)
+{
+	struct msghdr message;
+	ssize_t sent;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = pieces;
+	message.msg_iovlen = count;
+
+	if (conn->span.at[SPAN_HEADERS] == 0)
+	{
+		trace_mark(conn, SPAN_HEADERS);
+	}
+
+	// Over TLS the pieces are joined so they go out in as few records as
+	// possible, an HTTP/2 stream's are kept for its session, and none
+	// may overtake output already queued
+	while (message.msg_iovlen > 0 && conn->tls == NULL && !conn->http2 && conn->outlen == 0)
+	{
+		sent = sendmsg(conn->sockfd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+		if (sent < 0 || (sent == 0 && message.msg_iov->iov_len > 0))
+		{
+			return -1;
+		}
+		conn->bytesOut += sent;
+
+		// Skip the pieces that went out in full and trim the next one
+		while (message.msg_iovlen > 0 && (size_t) sent >= message.msg_iov->iov_len)
+		{
+			sent -= message.msg_iov->iov_len;
+			message.msg_iov++;
+			message.msg_iovlen--;
+		}
+		if (message.msg_iovlen > 0)
+		{
+			message.msg_iov->iov_base = (char *) message.msg_iov->iov_base + sent;
+			message.msg_iov->iov_len -= sent;
+		}
+	}
+
+	for (; message.msg_iovlen > 0; message.msg_iovlen--, message.msg_iov++)
+	{
+		if (connection_write(conn, message.msg_iov->iov_base, message.msg_iov->iov_len) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: connection_wait
+ * ----------------------------
+ *   Waits until the connection's socket can be read or can take more. In
+ *   a coroutine the worker serves its other connections meanwhile. A
+ *   deadline that passes shuts the socket down, which ends the wait.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   events: POLLIN to wait for data, POLLOUT to wait for room
+ *
+ *   Returns: 0 once the socket is ready, -1 on error
+ */
+int connection_wait(connection *conn, short events)
+{
+	struct pollfd waitfd;
+
+	waitfd.fd = conn->sockfd;
+	waitfd.events = events;
+	waitfd.revents = 0;
+
+	return coroutine_poll(&waitfd, 1, -1) > 0 && !(waitfd.revents & POLLNVAL) ? 0 : -1;
+}
+
+/*
+ * Function: connection_sendfile
+ * ----------------------------
+ *   Sends part of a file to the connection's socket with sendfile(),
+ *   through TLS if the connection uses it, retrying if interrupted.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   fd: The file
+ *   offset: The first byte to send, advanced past the bytes sent
+ *   count: The most bytes to send
+ *
+ *   Returns: the number of bytes sent, 0 at the end of the file, or -1
+ *   on error
+ */
+ssize_t connection_sendfile(connection *conn, int fd, off_t *offset, size_t count)
+{
+	ssize_t sent;
+
+	do
+	{
+		sent = conn->tls != NULL ? tls_sendfile(conn, fd, offset, count) : sendfile(conn->sockfd, fd, offset, count);
+	} while (sent < 0 && errno == EINTR);
+
+	return sent;
+}
+
+/*
+ * Function: connection_close_file
+ * ----------------------------
+ *   Gives the connection's file back to the open file cache.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+void connection_close_file(connection *conn)
+{
+	if (conn->file != NULL)
+	{
+		file_cache_release(conn->file);
+		conn->file = NULL;
+	}
+	conn->fileRemaining = 0;
+}
+
+/*
+ * Function: connection_attach_file
+ * ----------------------------
+ *   Starts streaming a range of the connection's file, the one taken
+ *   from the open file cache when the response was sized. The file goes
+ *   back to the cache when the transfer ends.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   offset: The first byte to send
+ *   length: The number of bytes to send
+ *
+ *   Returns: nothing
+ */
+void connection_attach_file(connection *conn, off_t offset, off_t length)
+{
+	conn->fileOffset = offset;
+	conn->fileRemaining = length;
+	conn->state = CONN_SENDING;
+}
+
+/*
+ * Function: connection_send_file
+ * ----------------------------
+ *   Takes a turn at sending a response: what is left of the output
+ *   buffer, then up to STREAM_SLICE_SIZE bytes of the attached file with
+ *   sendfile(), STREAM_CHUNK_SIZE bytes per call, so memory use stays the
+ *   same however large the file is. A plaintext turn ends early rather
+ *   than wait on a client that cannot take more; over TLS the turn
+ *   waits. The response deadline restarts whenever anything is sent, so
+ *   a large transfer is bounded by its progress rather than its size.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: SEND_DONE, SEND_BLOCKED, SEND_YIELDED or SEND_FAILED. The
+ *   state stays CONN_SENDING until the response has been sent or has
+ *   failed, and then becomes CONN_DONE.
+ */
+int connection_send_file(connection *conn)
+{
+	off_t slice = STREAM_SLICE_SIZE;	// bytes left to send in this turn
+	size_t chunk;	// bytes to send in this call
+	ssize_t count;
+	int more;
+	int result = SEND_YIELDED;
+
+	// An HTTP/2 stream's file is sent in DATA frames by its session
+	if (conn->http2)
+	{
+		return conn->fileRemaining > 0 ? SEND_YIELDED : SEND_DONE;
+	}
+
+	// The first bytes of a response are its header
+	if (conn->outlen > 0 && conn->span.at[SPAN_HEADERS] == 0)
+	{
+		trace_mark(conn, SPAN_HEADERS);
+	}
+
+	// The header shares its packet with the start of the file rather
+	// than going out alone
+	more = conn->fileRemaining > 0 && config_current()->settings.tcpNoPush;
+	while (conn->outpos < conn->outlen && result == SEND_YIELDED)
+	{
+		count = conn->tls != NULL ? tls_send(conn, conn->outbuf + conn->outpos, conn->outlen - conn->outpos)
+				: send(conn->sockfd, conn->outbuf + conn->outpos, conn->outlen - conn->outpos,
+				MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if (count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (count <= 0)
+		{
+			result = count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? SEND_BLOCKED : SEND_FAILED;
+			break;
+		}
+		conn->outpos += count;
+		conn->bytesOut += count;
+		slice -= count;
+	}
+	if (conn->outpos == conn->outlen)
+	{
+		conn->outlen = 0;
+		conn->outpos = 0;
+	}
+
+	while (result == SEND_YIELDED && conn->fileRemaining > 0 && slice > 0)
+	{
+		chunk = conn->fileRemaining < STREAM_CHUNK_SIZE ? (size_t) conn->fileRemaining : STREAM_CHUNK_SIZE;
+		count = connection_sendfile(conn, conn->file->fd, &(conn->fileOffset), chunk);
+		if (count <= 0)
+		{
+			// The client went away, its deadline passed, or the file shrank
+			result = count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? SEND_BLOCKED : SEND_FAILED;
+			break;
+		}
+		conn->fileRemaining -= count;
+		conn->bytesOut += count;
+		slice -= count;
+	}
+
+	if (slice < STREAM_SLICE_SIZE && result != SEND_FAILED)
+	{
+		connection_set_deadline(conn, CONN_TIMER_RESPONSE);
+	}
+	if (result == SEND_YIELDED && conn->outlen == 0 && conn->fileRemaining == 0)
+	{
+		result = SEND_DONE;
+	}
+
+	if (result == SEND_FAILED)
+	{
+		conn->outlen = 0;
+		conn->outpos = 0;
+		conn->keepAlive = 0;
+	}
+	if (result == SEND_DONE || result == SEND_FAILED)
+	{
+		connection_close_file(conn);
+		conn->state = CONN_DONE;
+	}
+	return result;
+}
@@ -0,0 +1,708 @@
+/*
+ * coroutine.c
+ *
+ * Contains the coroutines that let one worker serve many connections at
+ * once while each is still handled by straight-line code. Every
+ * connection a worker takes runs in a coroutine of its own, on a small
+ * stack kept for reuse. Sockets are non-blocking, and where a handler
+ * would block on one it calls coroutine_poll() instead, which parks the
+ * coroutine and switches back to its worker.
+ *
+ * Each worker is a scheduler: it gives every coroutine that can go on a
+ * turn, then waits on one epoll set for the sockets its coroutines are
+ * parked on, the deadline of any timed wait, and the thread pool's
+ * queue. A connection waiting for its client costs a stack and an epoll
+ * registration rather than a thread, so an idle keep-alive connection
+ * no longer holds a worker.
+ *
+ * Coroutines never move between threads. Each has its own configuration
+ * reader slot, so one parked in the middle of a request keeps the
+ * configuration it is using alive while the others pass quiescent
+ * points. Nothing may be held across a wait that another coroutine on
+ * the same thread could disturb, such as a lock or a per-thread buffer.
+ */
+
+#include "headerfile.h"
+#include <ucontext.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+
+#define COROUTINE_READY 0 // can run
+#define COROUTINE_WAITING 1 // parked in coroutine_poll
+#define COROUTINE_DONE 2 // finished, its stack can be reused
+
+typedef struct coroutine coroutine;
+
+// Define type of struct for a descriptor a parked coroutine waits on
+typedef struct coroutine_watch {
+	coroutine *owner;
+	int index;				// the descriptor's place in the wait
+	} coroutine_watch;
+
+// Define type of struct for a coroutine
+struct coroutine {
+	ucontext_t context;
+	char *stack;			// the stack's mapping, guard page first, or NULL
+	void (*entry)(void *);	// the function the coroutine runs
+	void *arg;
+	void *reader;			// configuration reader slot, NULL until first run
+	int state;				// COROUTINE_READY, COROUTINE_WAITING or COROUTINE_DONE
+	struct pollfd *waitfds;	// what a parked coroutine waits on
+	int waitCount;
+	unsigned long long wakeAt;	// when a timed wait ends, in milliseconds, 0 for never
+	int drainWait;			// nonzero while waiting for a drain to start
+	coroutine_watch watches[COROUTINE_MAX_WAIT];
+	struct coroutine *next;		// ready list or free list link
+	struct coroutine *timedNext;	// link in the list of timed and drain waits
+	};
+
+/*
+ * Struct that holds a worker's scheduler: its epoll set, its coroutines
+ * and the context it runs them from.
+ */
+static __thread struct {
+	int epollfd;				// sockets parked coroutines wait on, -1 without a scheduler
+	int wakefd;					// the thread pool's queue, readable while connections wait
+	int watchingWake;			// set while wakefd is in the epoll set
+	int drainWatched;			// set while the drain descriptor is in the epoll set
+	int drained;				// set once a drain has started
+	ucontext_t context;			// the worker's own context
+	coroutine *current;			// the coroutine running, or NULL on the worker's stack
+	coroutine *ready;			// coroutines that can go on, oldest first
+	coroutine *readyTail;
+	coroutine *timed;			// coroutines in a timed or drain wait
+	coroutine *free;			// finished coroutines kept for reuse
+	int stacks;					// stacks kept on the free list
+	int count;					// coroutines started and not yet finished
+} scheduler = { .epollfd = -1, .wakefd = -1 };
+
+/*
+ * Function prototypes for the coroutine.c file
+ */
+static void coroutine_main();
+static void coroutine_resume(coroutine *co);
+static void coroutine_ready(coroutine *co);
+static void coroutine_untime(coroutine *co);
+static unsigned long long coroutine_clock();
+static int coroutine_timeout();
+
+/*
+ * Function: coroutine_scheduler_init
+ * ----------------------------
+ *   Makes the calling worker a scheduler that runs its connections in
+ *   coroutines.
+ *
+ *	 Parameters:
+ *   wakefd: A semaphore eventfd that is readable while connections wait
+ *   in the queue
+ *
+ *   Returns: 0 if successful, -1 if the worker must serve one connection
+ *   at a time
+ */
+int coroutine_scheduler_init(int wakefd)
+{
+	struct epoll_event event;
+
+	scheduler.wakefd = wakefd;
+	scheduler.epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (scheduler.epollfd < 0)
+	{
+		return -1;
+	}
+
+	// Every waiting worker is woken, so each sees a pool that is stopping
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(scheduler.epollfd, EPOLL_CTL_ADD, wakefd, &event) != 0)
+	{
+		close(scheduler.epollfd);
+		scheduler.epollfd = -1;
+		return -1;
+	}
+	scheduler.watchingWake = 1;
+	return 0;
+}
+
+/*
+ * Function: coroutine_scheduler_destroy
+ * ----------------------------
+ *   Frees the calling worker's scheduler once all of its coroutines have
+ *   finished.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void coroutine_scheduler_destroy()
+{
+	coroutine *co;
+
+	while ((co = scheduler.free) != NULL)
+	{
+		scheduler.free = co->next;
+		if (co->stack != NULL)
+		{
+			munmap(co->stack, COROUTINE_STACK_SIZE);
+		}
+		free(co);
+	}
+	if (scheduler.epollfd >= 0)
+	{
+		close(scheduler.epollfd);
+		scheduler.epollfd = -1;
+	}
+}
+
+/*
+ * Function: coroutine_start
+ * ----------------------------
+ *   Starts a coroutine on the calling worker. It first runs on the
+ *   worker's next call to coroutine_schedule.
+ *
+ *	 Parameters:
+ *   entry: The function to run
+ *   arg: Passed to the function
+ *
+ *   Returns: 0 if successful, -1 if the worker has no scheduler, already
+ *   runs COROUTINE_MAX coroutines, or is out of memory
+ */
+int coroutine_start(void (*entry)(void *), void *arg)
+{
+	coroutine *volatile co;	// getcontext() may return twice, so co is kept in memory
+
+	if (scheduler.epollfd < 0 || scheduler.count >= COROUTINE_MAX)
+	{
+		return -1;
+	}
+
+	// Reuse a finished coroutine, which keeps its reader slot
+	co = scheduler.free;
+	if (co != NULL)
+	{
+		scheduler.free = co->next;
+	}
+	else if ((co = (coroutine *) calloc(1, sizeof(coroutine))) == NULL)
+	{
+		return -1;
+	}
+
+	// The stack is only backed by memory as far as it is used. The page
+	// at its low end is left inaccessible, so an overflow faults.
+	if (co->stack == NULL)
+	{
+		co->stack = (char *) mmap(NULL, COROUTINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (co->stack == MAP_FAILED || mprotect(co->stack, sysconf(_SC_PAGESIZE), PROT_NONE) != 0)
+		{
+			if (co->stack != MAP_FAILED)
+			{
+				munmap(co->stack, COROUTINE_STACK_SIZE);
+			}
+			co->stack = NULL;
+			co->next = scheduler.free;
+			scheduler.free = co;
+			return -1;
+		}
+	}
+	else
+	{
+		scheduler.stacks -= 1;
+	}
+
+	getcontext(&(co->context));
+	co->context.uc_stack.ss_sp = co->stack;
+	co->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+	co->context.uc_link = NULL;
+	makecontext(&(co->context), coroutine_main, 0);
+
+	co->entry = entry;
+	co->arg = arg;
+	co->waitfds = NULL;
+	co->waitCount = 0;
+	co->wakeAt = 0;
+	co->drainWait = 0;
+	scheduler.count += 1;
+	coroutine_ready(co);
+	return 0;
+}
+
+/*
+ * Function: coroutine_main
+ * ----------------------------
+ *   Runs a coroutine's function, then goes back to the worker for good.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+static void coroutine_main()
+{
+	coroutine *co = scheduler.current;
+
+	// A new coroutine gets a slot of its own the first time it runs
+	if (co->reader == NULL)
+	{
+		config_reader_register();
+	}
+
+	co->entry(co->arg);
+
+	// A finished coroutine holds nothing from the configuration
+	config_offline();
+	co->state = COROUTINE_DONE;
+	swapcontext(&(co->context), &(scheduler.context));
+}
+
+/*
+ * Function: coroutine_resume
+ * ----------------------------
+ *   Runs a coroutine until it parks, yields or finishes. A finished one
+ *   goes on the free list, keeping its stack if fewer than
+ *   COROUTINE_POOL_MAX are kept.
+ *
+ *	 Parameters:
+ *   co: The coroutine
+ *
+ *   Returns: nothing
+ */
+static void coroutine_resume(coroutine *co)
+{
+	void *worker;
+
+	scheduler.current = co;
+	worker = config_reader_swap(co->reader);
+	swapcontext(&(scheduler.context), &(co->context));
+	co->reader = config_reader_swap(worker);
+	scheduler.current = NULL;
+
+	if (co->state != COROUTINE_DONE)
+	{
+		return;
+	}
+
+	scheduler.count -= 1;
+	if (scheduler.stacks < COROUTINE_POOL_MAX)
+	{
+		scheduler.stacks += 1;
+	}
+	else
+	{
+		munmap(co->stack, COROUTINE_STACK_SIZE);
+		co->stack = NULL;
+	}
+	co->next = scheduler.free;
+	scheduler.free = co;
+}
+
+/*
+ * Function: coroutine_ready
+ * ----------------------------
+ *   Adds a coroutine to the end of the list of those that can go on.
+ *
+ *	 Parameters:
+ *   co: The coroutine
+ *
+ *   Returns: nothing
+ */
+static void coroutine_ready(coroutine *co)
+{
+	co->state = COROUTINE_READY;
+	co->next = NULL;
+	if (scheduler.readyTail == NULL)
+	{
+		scheduler.ready = co;
+	}
+	else
+	{
+		scheduler.readyTail->next = co;
+	}
+	scheduler.readyTail = co;
+}
+
+/*
+ * Function: coroutine_untime
+ * ----------------------------
+ *   Takes a coroutine off the list of timed and drain waits.
+ *
+ *	 Parameters:
+ *   co: The coroutine
+ *
+ *   Returns: nothing
+ */
+static void coroutine_untime(coroutine *co)
+{
+	coroutine **link;
+
+	for (link = &(scheduler.timed); *link != NULL; link = &((*link)->timedNext))
+	{
+		if (*link == co)
+		{
+			*link = co->timedNext;
+			break;
+		}
+	}
+	co->timedNext = NULL;
+}
+
+/*
+ * Function: coroutine_active
+ * ----------------------------
+ *   Determines if the caller is running in a coroutine.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 1 in a coroutine, 0 on a thread's own stack
+ */
+int coroutine_active()
+{
+	return scheduler.current != NULL;
+}
+
+/*
+ * Function: coroutine_count
+ * ----------------------------
+ *   Gets the number of coroutines the calling worker has started that
+ *   have not finished.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the number of coroutines
+ */
+int coroutine_count()
+{
+	return scheduler.count;
+}
+
+/*
+ * Function: coroutine_yield
+ * ----------------------------
+ *   Lets the worker's other coroutines have a turn before the calling
+ *   one goes on. Does nothing outside a coroutine.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void coroutine_yield()
+{
+	coroutine *co = scheduler.current;
+
+	if (co == NULL)
+	{
+		return;
+	}
+
+	coroutine_ready(co);
+	swapcontext(&(co->context), &(scheduler.context));
+}
+
+/*
+ * Function: coroutine_poll
+ * ----------------------------
+ *   Waits like poll(). In a coroutine the caller is parked until one of
+ *   the descriptors is ready or the time runs out, and the worker serves
+ *   its other coroutines meanwhile; elsewhere it calls poll(). With no
+ *   descriptors it sleeps.
+ *
+ *   The drain descriptor is shared by every connection that waits on it,
+ *   and a descriptor can only be in an epoll set once, so the scheduler
+ *   watches it for all of them.
+ *
+ *	 Parameters:
+ *   fds: The descriptors and the events to wait for, as for poll()
+ *   count: The number of descriptors, at most COROUTINE_MAX_WAIT
+ *   timeout: The longest wait in milliseconds, or -1 for no limit
+ *
+ *   Returns: the number of descriptors with events, 0 if the time ran
+ *   out, or -1 on error
+ */
+int coroutine_poll(struct pollfd *fds, int count, int timeout)
+{
+	coroutine *co = scheduler.current;
+	struct epoll_event event;
+	int result = 0;
+	int i;
+
+	if (co == NULL || count > COROUTINE_MAX_WAIT)
+	{
+		do
+		{
+			result = poll(fds, count, timeout);
+		} while (result < 0 && errno == EINTR);
+		return result;
+	}
+
+	// Watch each descriptor for one event. One already in the set from
+	// an earlier wait is rearmed; a new one is added.
+	for (i = 0; i < count; i++)
+	{
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+		{
+			continue;
+		}
+		if (fds[i].fd == server_drain_fd())
+		{
+			if (scheduler.drained || server_draining())
+			{
+				fds[i].revents = POLLIN;
+				result += 1;
+				continue;
+			}
+			if (!scheduler.drainWatched)
+			{
+				memset(&event, 0, sizeof(event));
+				event.events = EPOLLIN;
+				event.data.ptr = &scheduler;
+				scheduler.drainWatched = epoll_ctl(scheduler.epollfd, EPOLL_CTL_ADD, fds[i].fd, &event) == 0;
+			}
+			co->drainWait = 1;
+			continue;
+		}
+
+		co->watches[i].owner = co;
+		co->watches[i].index = i;
+		memset(&event, 0, sizeof(event));
+		event.events = (fds[i].events & (POLLIN | POLLOUT)) | EPOLLONESHOT;
+		event.data.ptr = &(co->watches[i]);
+		if (epoll_ctl(scheduler.epollfd, EPOLL_CTL_MOD, fds[i].fd, &event) != 0 &&
+				(errno != ENOENT || epoll_ctl(scheduler.epollfd, EPOLL_CTL_ADD, fds[i].fd, &event) != 0))
+		{
+			fds[i].revents = POLLNVAL;
+			result += 1;
+		}
+	}
+
+	// Park until something happens; a wait that is already over is not
+	// parked, but its descriptors still have to be disarmed below
+	if (result == 0)
+	{
+		co->waitfds = fds;
+		co->waitCount = count;
+		co->wakeAt = timeout >= 0 ? coroutine_clock() + timeout : 0;
+		if (co->wakeAt != 0 || co->drainWait)
+		{
+			co->timedNext = scheduler.timed;
+			scheduler.timed = co;
+		}
+		co->state = COROUTINE_WAITING;
+		swapcontext(&(co->context), &(scheduler.context));
+		if (co->wakeAt != 0 || co->drainWait)
+		{
+			coroutine_untime(co);
+		}
+		co->waitfds = NULL;
+		co->wakeAt = 0;
+		co->drainWait = 0;
+	}
+
+	// A descriptor that did not fire is still armed and must not wake
+	// this coroutine later
+	result = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (fds[i].revents != 0)
+		{
+			result += 1;
+		}
+		else if (fds[i].fd >= 0 && fds[i].fd != server_drain_fd())
+		{
+			epoll_ctl(scheduler.epollfd, EPOLL_CTL_DEL, fds[i].fd, NULL);
+		}
+	}
+	return result;
+}
+
+/*
+ * Function: coroutine_schedule
+ * ----------------------------
+ *   Gives each of the worker's coroutines that can go on a turn, then
+ *   waits for sockets, timed waits and the queue. Coroutines woken by
+ *   the wait run on the next call.
+ *
+ *	 Parameters:
+ *   nowait: Nonzero to only collect what is ready without waiting
+ *
+ *   Returns: nothing
+ */
+void coroutine_schedule(int nowait)
+{
+	struct epoll_event events[COROUTINE_MAX_EVENTS];
+	struct epoll_event event;
+	struct pollfd waitfd;
+	coroutine_watch *watch;
+	coroutine *co;
+	coroutine *next;
+	unsigned long long now;
+	unsigned long long token;
+	int room;
+	int running;
+	int count;
+	int i;
+	int j;
+
+	// Without a scheduler the worker only waits for the queue
+	if (scheduler.epollfd < 0)
+	{
+		if (!nowait)
+		{
+			waitfd.fd = scheduler.wakefd;
+			waitfd.events = POLLIN;
+			poll(&waitfd, 1, -1);
+		}
+		if (read(scheduler.wakefd, &token, sizeof(token)) < 0)
+		{
+			// Another worker took it
+		}
+		return;
+	}
+
+	// A worker with no room for another coroutine leaves the queue to
+	// others. So does one still finishing connections in a drain, which
+	// would otherwise take the token that wakes an idle worker to exit;
+	// it looks at the queue again as its connections finish.
+	room = scheduler.count < COROUTINE_MAX && (scheduler.count == 0 || !server_draining());
+	if (room != scheduler.watchingWake)
+	{
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(scheduler.epollfd, room ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, scheduler.wakefd, &event) == 0)
+		{
+			scheduler.watchingWake = room;
+		}
+	}
+
+	// One turn each; those that yield or wake meanwhile go next time
+	running = scheduler.count;
+	co = scheduler.ready;
+	scheduler.ready = NULL;
+	scheduler.readyTail = NULL;
+	for (; co != NULL; co = next)
+	{
+		next = co->next;
+		coroutine_resume(co);
+	}
+
+	// A worker whose coroutines finished looks at the queue again first,
+	// in case it has room now or is draining
+	count = epoll_wait(scheduler.epollfd, events, COROUTINE_MAX_EVENTS,
+			nowait || scheduler.ready != NULL || scheduler.count < running ? 0 : coroutine_timeout());
+
+	for (i = 0; i < count; i++)
+	{
+		// A queued connection; the worker takes it on its next pass
+		if (events[i].data.ptr == NULL)
+		{
+			if (read(scheduler.wakefd, &token, sizeof(token)) < 0)
+			{
+				// Another worker took it
+			}
+			continue;
+		}
+
+		// A drain has started; every coroutine waiting for one goes on
+		if (events[i].data.ptr == &scheduler)
+		{
+			scheduler.drained = 1;
+			epoll_ctl(scheduler.epollfd, EPOLL_CTL_DEL, server_drain_fd(), NULL);
+			for (co = scheduler.timed; co != NULL; co = co->timedNext)
+			{
+				if (co->drainWait && co->state == COROUTINE_WAITING)
+				{
+					for (j = 0; j < co->waitCount; j++)
+					{
+						if (co->waitfds[j].fd == server_drain_fd())
+						{
+							co->waitfds[j].revents = POLLIN;
+						}
+					}
+					coroutine_ready(co);
+				}
+			}
+			continue;
+		}
+
+		watch = (coroutine_watch *) events[i].data.ptr;
+		co = watch->owner;
+		if (co->waitfds == NULL || watch->index >= co->waitCount)
+		{
+			continue;
+		}
+		co->waitfds[watch->index].revents = events[i].events & (POLLIN | POLLOUT | POLLERR | POLLHUP);
+		if (co->state == COROUTINE_WAITING)
+		{
+			coroutine_ready(co);
+		}
+	}
+
+	// Timed waits that have run out
+	if (scheduler.timed != NULL)
+	{
+		now = coroutine_clock();
+		for (co = scheduler.timed; co != NULL; co = co->timedNext)
+		{
+			if (co->state == COROUTINE_WAITING && co->wakeAt != 0 && co->wakeAt <= now)
+			{
+				coroutine_ready(co);
+			}
+		}
+	}
+}
+
+/*
+ * Function: coroutine_clock
+ * ----------------------------
+ *   Gets the monotonic time in milliseconds.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the time
+ */
+static unsigned long long coroutine_clock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Function: coroutine_timeout
+ * ----------------------------
+ *   Gets how long the scheduler may wait before a timed wait runs out.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the time in milliseconds, or -1 if no wait is timed
+ */
+static int coroutine_timeout()
+{
+	unsigned long long now;
+	unsigned long long soonest = 0;
+	coroutine *co;
+
+	for (co = scheduler.timed; co != NULL; co = co->timedNext)
+	{
+		if (co->wakeAt != 0 && (soonest == 0 || co->wakeAt < soonest))
+		{
+			soonest = co->wakeAt;
+		}
+	}
+	if (soonest == 0)
+	{
+		return -1;
+	}
+
+	now = coroutine_clock();
+	return soonest <= now ? 0 : (int) (soonest - now);
+}
@@ -0,0 +1,492 @@
+/*
+ * docrootIndex.c
+ *
+ * Contains the index of servable files. At startup every regular file
+ * below the home directory is recorded by its normalized path, and the
+ * file watcher keeps the index current from then on. A request whose
+ * path is not in the index is refused without any file system lookup,
+ * and since only files inside the home directory are ever indexed, a
+ * symbolic link cannot lead a request outside it.
+ *
+ * The index is only trusted while the file watcher is running. Without
+ * it, or if the home directory holds more files than the configured
+ * limit, requests are looked up on disk as before.
+ */
+
+#include "headerfile.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/inotify.h>
+
+// Define type of struct for an indexed file
+typedef struct docroot_entry {
+	char *path;					// normalized path relative to the home directory
+	unsigned long hash;			// hash of the path
+	struct docroot_entry *next;	// hash bucket link
+	} docroot_entry;
+
+/*
+ * Struct that holds the hash table and the lock protecting it. Requests
+ * only read the table; the watcher thread is the only writer.
+ */
+static struct {
+	pthread_rwlock_t lock;
+	docroot_entry **buckets;
+	unsigned long bucketCount;	// a power of two
+	long count;					// files in the index
+	int active;					// nonzero while the index is complete and current
+	int overflowed;				// set when a scan finds too many files
+	char home[PATH_MAX];		// resolved path of the home directory
+} docroot = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/*
+ * Function prototypes for the docrootIndex.c file
+ */
+static void docroot_changed(const char *path, unsigned int mask);
+
+/*
+ * Function: docroot_servable
+ * ----------------------------
+ *   Determines if a path names a regular file that stays inside the home
+ *   directory once any symbolic links are followed.
+ *
+ *	 Parameters:
+ *   path: The path relative to the home directory
+ *
+ *   Returns: 1 if the file can be served, 0 otherwise
+ */
+static int docroot_servable(const char *path)
+{
+	struct stat fileInfo;
+	char resolved[PATH_MAX];
+	size_t homeLength = strlen(docroot.home);
+
+	if (lstat(path, &fileInfo) != 0)
+	{
+		return 0;
+	}
+	if (S_ISREG(fileInfo.st_mode))
+	{
+		return 1;
+	}
+	if (!S_ISLNK(fileInfo.st_mode))
+	{
+		return 0;
+	}
+
+	// A link is only followed if it ends at a regular file in the home directory
+	if (realpath(path, resolved) == NULL || stat(resolved, &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode))
+	{
+		return 0;
+	}
+	return strncmp(resolved, docroot.home, homeLength) == 0 && resolved[homeLength] == '/';
+}
+
+/*
+ * Function: docroot_find
+ * ----------------------------
+ *   Finds the link to a path's entry in its hash bucket. The lock must
+ *   be held.
+ *
+ *	 Parameters:
+ *   path: The path
+ *   hash: The hash of the path
+ *
+ *   Returns: the link that points to the entry, or to NULL at the end of
+ *   the bucket if the path is not in the index
+ */
+static docroot_entry **docroot_find(const char *path, unsigned long hash)
+{
+	docroot_entry **link = &(docroot.buckets[hash & (docroot.bucketCount - 1)]);
+
+	while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->path, path) != 0))
+	{
+		link = &((*link)->next);
+	}
+
+	return link;
+}
+
+/*
+ * Function: docroot_grow
+ * ----------------------------
+ *   Doubles the number of hash buckets. The write lock must be held.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing; the table keeps its size if memory runs out
+ */
+static void docroot_grow()
+{
+	unsigned long newCount = docroot.bucketCount * 2;
+	docroot_entry **newBuckets = (docroot_entry **) calloc(newCount, sizeof(docroot_entry *));
+	docroot_entry *entry;
+	unsigned long i;
+
+	if (newBuckets == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < docroot.bucketCount; i++)
+	{
+		while ((entry = docroot.buckets[i]) != NULL)
+		{
+			docroot.buckets[i] = entry->next;
+			entry->next = newBuckets[entry->hash & (newCount - 1)];
+			newBuckets[entry->hash & (newCount - 1)] = entry;
+		}
+	}
+
+	free(docroot.buckets);
+	docroot.buckets = newBuckets;
+	docroot.bucketCount = newCount;
+}
+
+/*
+ * Function: docroot_insert
+ * ----------------------------
+ *   Adds a path to the index if it is not already there. The write lock
+ *   must be held.
+ *
+ *	 Parameters:
+ *   path: The path
+ *
+ *   Returns: nothing
+ */
+static void docroot_insert(const char *path)
+{
+	unsigned long hash = hashString(path);
+	docroot_entry **link = docroot_find(path, hash);
+	docroot_entry *entry;
+
+	if (*link != NULL)
+	{
+		return;
+	}
+
+	if (docroot.count >= config_current()->settings.docrootIndexSize)
+	{
+		docroot.overflowed = 1;
+		return;
+	}
+
+	entry = (docroot_entry *) malloc(sizeof(docroot_entry));
+	if (entry == NULL || (entry->path = strdup(path)) == NULL)
+	{
+		free(entry);
+		docroot.overflowed = 1;
+		return;
+	}
+	entry->hash = hash;
+	entry->next = NULL;
+	*link = entry;
+	docroot.count += 1;
+
+	if ((unsigned long) docroot.count > docroot.bucketCount)
+	{
+		docroot_grow();
+	}
+}
+
+/*
+ * Function: docroot_remove
+ * ----------------------------
+ *   Removes a path from the index, or every path below a directory. The
+ *   write lock must be held.
+ *
+ *	 Parameters:
+ *   path: The path of a file, or of a directory
+ *   directory: Nonzero to remove everything below the path
+ *
+ *   Returns: nothing
+ */
+static void docroot_remove(const char *path, int directory)
+{
+	size_t length = strlen(path);
+	docroot_entry **link;
+	docroot_entry *entry;
+	unsigned long i;
+
+	if (!directory)
+	{
+		link = docroot_find(path, hashString(path));
+		if ((entry = *link) != NULL)
+		{
+			*link = entry->next;
+			free(entry->path);
+			free(entry);
+			docroot.count -= 1;
+		}
+		return;
+	}
+
+	for (i = 0; i < docroot.bucketCount; i++)
+	{
+		link = &(docroot.buckets[i]);
+		while ((entry = *link) != NULL)
+		{
+			if (strncmp(entry->path, path, length) == 0 && entry->path[length] == '/')
+			{
+				*link = entry->next;
+				free(entry->path);
+				free(entry);
+				docroot.count -= 1;
+			}
+			else
+			{
+				link = &(entry->next);
+			}
+		}
+	}
+}
+
+/*
+ * Function: docroot_scan
+ * ----------------------------
+ *   Adds every servable file in a directory and the directories below
+ *   it. The write lock must be held.
+ *
+ *	 Parameters:
+ *   path: The directory, relative to the home directory ("" for the
+ *   home directory itself)
+ *
+ *   Returns: nothing
+ */
+static void docroot_scan(const char *path)
+{
+	DIR *directory = opendir(path[0] == '\0' ? "." : path);
+	struct dirent *item;
+	struct stat fileInfo;
+	char child[PATH_MAX];
+
+	if (directory == NULL)
+	{
+		return;
+	}
+
+	while (!docroot.overflowed && (item = readdir(directory)) != NULL)
+	{
+		if (!strcmp(item->d_name, ".") || !strcmp(item->d_name, ".."))
+		{
+			continue;
+		}
+
+		if (path[0] == '\0')
+		{
+			snprintf(child, sizeof(child), "%s", item->d_name);
+		}
+		else
+		{
+			snprintf(child, sizeof(child), "%s/%s", path, item->d_name);
+		}
+
+		// Directories are walked; links to directories are not followed
+		if (item->d_type == DT_DIR ||
+				(item->d_type == DT_UNKNOWN && lstat(child, &fileInfo) == 0 && S_ISDIR(fileInfo.st_mode)))
+		{
+			docroot_scan(child);
+		}
+		else if (docroot_servable(child))
+		{
+			docroot_insert(child);
+		}
+	}
+
+	closedir(directory);
+}
+
+/*
+ * Function: docroot_rebuild
+ * ----------------------------
+ *   Empties the index and scans the home directory again. The index is
+ *   left inactive if the home directory holds too many files. The write
+ *   lock must be held.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+static void docroot_rebuild()
+{
+	char logbuff[BUFSIZE];
+	docroot_entry *entry;
+	unsigned long i;
+
+	for (i = 0; i < docroot.bucketCount; i++)
+	{
+		while ((entry = docroot.buckets[i]) != NULL)
+		{
+			docroot.buckets[i] = entry->next;
+			free(entry->path);
+			free(entry);
+		}
+	}
+	docroot.count = 0;
+	docroot.overflowed = 0;
+
+	docroot_scan("");
+
+	docroot.active = !docroot.overflowed;
+	if (docroot.active)
+	{
+		sprintf(logbuff, "Indexed %ld files in the home directory.", docroot.count);
+	}
+	else
+	{
+		sprintf(logbuff, "The home directory has more than %d files; files will be looked up on disk.",
+				config_current()->settings.docrootIndexSize);
+	}
+	logger(logbuff);
+}
+
+/*
+ * Function: docroot_index_init
+ * ----------------------------
+ *   Subscribes the index to changes in the home directory. Must be called
+ *   before the file watcher starts.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void docroot_index_init()
+{
+	if (config_current()->settings.docrootIndexSize > 0)
+	{
+		file_watcher_subscribe(docroot_changed);
+	}
+}
+
+/*
+ * Function: docroot_index_build
+ * ----------------------------
+ *   Builds the index of the home directory, which must be the current
+ *   directory. Called once the file watcher is running, so no change
+ *   made during the scan is missed.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void docroot_index_build()
+{
+	if (config_current()->settings.docrootIndexSize <= 0 || !file_watcher_active() || realpath(".", docroot.home) == NULL)
+	{
+		return;
+	}
+
+	pthread_rwlock_wrlock(&(docroot.lock));
+	if (docroot.buckets == NULL)
+	{
+		docroot.bucketCount = 1024;
+		docroot.buckets = (docroot_entry **) calloc(docroot.bucketCount, sizeof(docroot_entry *));
+	}
+	if (docroot.buckets != NULL)
+	{
+		docroot_rebuild();
+	}
+	pthread_rwlock_unlock(&(docroot.lock));
+}
+
+/*
+ * Function: docroot_index_lookup
+ * ----------------------------
+ *   Determines if a normalized path names a servable file.
+ *
+ *	 Parameters:
+ *   path: The path relative to the home directory
+ *
+ *   Returns: 1 if the file is in the index, 0 if it is not, or -1 if the
+ *   index is not running and the file must be looked up on disk
+ */
+int docroot_index_lookup(const char *path)
+{
+	int found = -1;
+
+	pthread_rwlock_rdlock(&(docroot.lock));
+	if (docroot.active)
+	{
+		found = *docroot_find(path, hashString(path)) != NULL;
+	}
+	pthread_rwlock_unlock(&(docroot.lock));
+
+	return found;
+}
+
+/*
+ * Function: docroot_changed
+ * ----------------------------
+ *   Called by the file watcher when something in the home directory
+ *   changes. New and moved-in directories are scanned, removed ones are
+ *   dropped with everything below them, and files are checked again
+ *   whenever they are created, written or have their attributes changed.
+ *
+ *	 Parameters:
+ *   path: The changed path, or NULL if anything may have changed
+ *   mask: The inotify event mask
+ *
+ *   Returns: nothing
+ */
+static void docroot_changed(const char *path, unsigned int mask)
+{
+	if (docroot.buckets == NULL)
+	{
+		return;
+	}
+
+	pthread_rwlock_wrlock(&(docroot.lock));
+
+	if (path == NULL)
+	{
+		// Events were lost, so start again
+		docroot_rebuild();
+	}
+	else if (!docroot.active)
+	{
+		// The home directory has too many files to index
+	}
+	else if (mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+	{
+		// The parent directory reports these too
+	}
+	else if (mask & IN_ISDIR)
+	{
+		if (mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			docroot_scan(path);
+		}
+		else if (mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			docroot_remove(path, 1);
+		}
+	}
+	else if (mask & (IN_DELETE | IN_MOVED_FROM))
+	{
+		docroot_remove(path, 0);
+	}
+	else if (mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB))
+	{
+		if (docroot_servable(path))
+		{
+			docroot_insert(path);
+		}
+		else
+		{
+			docroot_remove(path, 0);
+		}
+	}
+
+	// A scan that ran out of room leaves the index incomplete
+	if (docroot.overflowed && docroot.active)
+	{
+		docroot.active = 0;
+		logger("The home directory has grown too large to index; files will be looked up on disk.");
+	}
+
+	pthread_rwlock_unlock(&(docroot.lock));
+}
@@ -8,50 +8,301 @@
 #include "headerfile.h"
 char *getMsg(int);
 
+/*
+ * Error responses, built once at startup. Each is a header with the Date
+ * value left blank and a body, either the built-in page or a custom one
+ * named by an errorpage line in the config file. Sending one copies the
+ * header, fills in the date and writes both parts with one call.
+ */
+static struct error_response {
+	int code;			// the status code
+	char *page;			// custom page file from the config file, or NULL
+	char *header;		// the header with a blank date, or NULL if not built
+	int headerLength;
+	int dateOffset;		// where the Date value starts in the header
+	char *body;			// the page sent after the header
+	int bodyLength;
+} errorResponses[] = { { .code = 400 }, { .code = 403 }, { .code = 404 }, { .code = 405 }, { .code = 411 }, { .code = 413 },
+		{ .code = 415 }, { .code = 417 }, { .code = 429 }, { .code = 500 }, { .code = 502 }, { .code = 503 }, { .code = 504 } };
+
+#define ERROR_RESPONSE_COUNT ((int) (sizeof(errorResponses) / sizeof(errorResponses[0])))
+
+/*
+ * Function: findError
+ * ----------------------------
+ *   Finds the prebuilt response for an error code.
+ *
+ *	 Parameters:
+ *   errorCode: The error code
+ *
+ *   Returns: the response, or NULL if the code has none
+ */
+static struct error_response *findError(int errorCode)
+{
+	int i;
+
+	for (i = 0; i < ERROR_RESPONSE_COUNT; i++)
+	{
+		if (errorResponses[i].code == errorCode)
+		{
+			return &(errorResponses[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: buildHeader
+ * ----------------------------
+ *   Formats the response header for an error.
+ *
+ *	 Parameters:
+ *   header: The buffer to write the header into
+ *   errorCode: The error code
+ *   contentType: The type of the body
+ *   bodyLength: The length of the body
+ *   dateAndTime: The value of the Date header
+ *
+ *   Returns: the length of the header
+ */
+static int buildHeader(char *header, int errorCode, char *contentType, int bodyLength, char *dateAndTime)
+{
+	return sprintf(header,
+			"HTTP/1.1 %s\r\nDate: %s\r\nContent-Type: %s\r\nContent-Length: %i\r\n%sConnection: close\r\n\r\n",
+			getMsg(errorCode), dateAndTime, contentType, bodyLength, errorCode == 429 ? "Retry-After: 1\r\n" : "");
+}
+
+/*
+ * Function: buildBody
+ * ----------------------------
+ *   Formats the built-in html page for an error.
+ *
+ *	 Parameters:
+ *   body: The buffer to write the page into
+ *   errorCode: The error code
+ *
+ *   Returns: the length of the page
+ */
+static int buildBody(char *body, int errorCode)
+{
+	return sprintf(body, "<html><head><title>%i</title></head><body>%s</body></html>\n",
+			errorCode, getMsg(errorCode));
+}
+
+/*
+ * Function: loadPage
+ * ----------------------------
+ *   Reads a custom error page into memory.
+ *
+ *	 Parameters:
+ *   response: The error response whose page is read
+ *
+ *   Returns: 0 if successful, -1 if the page could not be read
+ */
+static int loadPage(struct error_response *response)
+{
+	struct stat fileInfo;
+	ssize_t count;
+	int loaded = 0;
+	int fd = open(response->page, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode) ||
+			fileInfo.st_size > MAX_ERROR_PAGE_SIZE ||
+			(response->body = (char *) malloc(fileInfo.st_size + 1)) == NULL)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+
+	while (loaded < fileInfo.st_size && (count = read(fd, response->body + loaded, fileInfo.st_size - loaded)) > 0)
+	{
+		loaded += count;
+	}
+	close(fd);
+
+	response->bodyLength = loaded;
+	return 0;
+}
+
+/*
+ * Function: error_page_set
+ * ----------------------------
+ *   Sets a custom page for an error code. Called while the config file
+ *   is read; the page is loaded by error_responses_init.
+ *
+ *	 Parameters:
+ *   errorCode: The error code
+ *   page: The page's file, absolute or relative to the home directory
+ *
+ *   Returns: 0 if successful, -1 if the server does not send that code
+ */
+int error_page_set(int errorCode, char *page)
+{
+	struct error_response *response = findError(errorCode);
+
+	if (response == NULL)
+	{
+		return -1;
+	}
+
+	free(response->page);
+	response->page = strdup(page);
+	return 0;
+}
+
+/*
+ * Function: error_responses_init
+ * ----------------------------
+ *   Builds every error response. Custom pages are read from the home
+ *   directory, which must be the current directory; a page that cannot
+ *   be read is logged and the built-in page is used instead.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void error_responses_init()
+{
+	struct error_response *response;
+	char header[500];
+	char blankDate[30];
+	char logbuff[BUFSIZE];
+	char *contentType;
+	int i;
+
+	memset(blankDate, ' ', 29);
+	blankDate[29] = '\0';
+
+	for (i = 0; i < ERROR_RESPONSE_COUNT; i++)
+	{
+		response = &(errorResponses[i]);
+		contentType = "text/html";
+
+		if (response->page != NULL && loadPage(response) == 0)
+		{
+			if (strlen(getContentType(response->page)) > 0)
+			{
+				contentType = getContentType(response->page);
+			}
+		}
+		else
+		{
+			if (response->page != NULL)
+			{
+				sprintf(logbuff, "Error page %s for %i could not be read, using the built-in page.",
+						response->page, response->code);
+				logger(logbuff);
+			}
+			response->body = (char *) malloc(200);
+			if (response->body == NULL)
+			{
+				continue;
+			}
+			response->bodyLength = buildBody(response->body, response->code);
+		}
+
+		response->headerLength = buildHeader(header, response->code, contentType, response->bodyLength, blankDate);
+		response->header = strdup(header);
+		response->dateOffset = strstr(header, "Date: ") + 6 - header;
+	}
+}
+
 /*
  * Function: sendError
  * ----------------------------
  *   Is called when an error has occurred and an html error
- *   message needs to be sent to the requestor. Once processed,
- *   sends error message to the requestor through the socket.
+ *   message needs to be sent to the requestor. The prebuilt
+ *   response is sent through the connection with only the date
+ *   filled in. The socket is closed when the connection is released.
  *
  *	 Parameters:
- *   sockfd: The active connection
+ *   conn: The active connection
  *   errorCode: The specific error code for the error that occurred
  *
  *   Returns: nothing
  */
-void sendError(int sockfd, int errorCode)
+void sendError(connection *conn, int errorCode)
 {
-	// Variables to hold data to be sent back via error message
-	char *httpVersion = "HTTP/1.1";
-	char *contentType = "text/html";
-	char *error_msg = getMsg(errorCode);
-	char response[500];
-	char responseText[500];
-	char dateAndTime[50];
-
-	// Stores messages to be logged
-	char logbuff[BUFSIZE];
+	struct error_response *response = findError(errorCode);
+	struct iovec pieces[2];
+	char header[500];
+	char body[200];
+	char dateAndTime[30];
 
 	// Get the current date and time
-	getTimestamp2(dateAndTime);
-
-	// Create the html to be returned
-	int responseTextSize = sprintf(responseText,
-			"<html><head><title>%i</title></head><body>%s</body></html>",
-			errorCode, error_msg);
-
-	// Create the header reponse for the error message
-	int size = sprintf(response,
-			"%s %s\nDate: %s\nContent-Type: %s\nContent-Length: %i\r\n\r\n%s\n",
-			httpVersion, error_msg, dateAndTime, contentType, responseTextSize + 1, responseText);
-
-	// Log the error, send the error back to the client, close the socket
-	sprintf(logbuff, "Error '%s' sent to socket %i.", error_msg, sockfd);
-	logger(logbuff);
-	send(sockfd, response, size, 0);
-	close(sockfd);
+	getHttpDate(dateAndTime);
+
+	conn->keepAlive = 0;
+	conn->outlen = 0;
+	conn->span.status = errorCode;
+	PROBE2(error, conn->sockfd, errorCode);
+
+	if (response != NULL && response->header != NULL)
+	{
+		memcpy(header, response->header, response->headerLength);
+		memcpy(header + response->dateOffset, dateAndTime, 29);
+		pieces[0].iov_len = response->headerLength;
+		pieces[1].iov_base = response->body;
+		pieces[1].iov_len = response->bodyLength;
+	}
+	else
+	{
+		// A code without a prebuilt response is formatted here
+		pieces[1].iov_base = body;
+		pieces[1].iov_len = buildBody(body, errorCode);
+		pieces[0].iov_len = buildHeader(header, errorCode, "text/html", pieces[1].iov_len, dateAndTime);
+	}
+	pieces[0].iov_base = header;
+
+	// Log the error, send the error back to the client
+	LOG_INFO_SAMPLED("Error '%s' sent to socket %i.", getMsg(errorCode), conn->sockfd);
+	connection_sendv(conn, pieces, 2);
+}
+
+/*
+ * Function: sendRejection
+ * ----------------------------
+ *   Sends a prebuilt error response straight to a socket that has no
+ *   connection context, such as one refused as soon as it is accepted.
+ *   The send never waits; a client whose buffer is full gets nothing.
+ *   The caller closes the socket.
+ *
+ *	 Parameters:
+ *   socketfd: The socket
+ *   errorCode: The error code, one with a prebuilt response
+ *
+ *   Returns: nothing
+ */
+void sendRejection(int socketfd, int errorCode)
+{
+	struct error_response *response = findError(errorCode);
+	struct iovec pieces[2];
+	struct msghdr message;
+	char header[500];
+	char dateAndTime[30];
+
+	if (response == NULL || response->header == NULL)
+	{
+		return;
+	}
+
+	getHttpDate(dateAndTime);
+	memcpy(header, response->header, response->headerLength);
+	memcpy(header + response->dateOffset, dateAndTime, 29);
+	pieces[0].iov_base = header;
+	pieces[0].iov_len = response->headerLength;
+	pieces[1].iov_base = response->body;
+	pieces[1].iov_len = response->bodyLength;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = pieces;
+	message.msg_iovlen = 2;
+	sendmsg(socketfd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
 /*
@@ -83,9 +334,33 @@ char * getMsg(int code)
 		case 405:
 			msg = "405 Method Not Allowed";
 			break;
+		case 411:
+			msg = "411 Length Required";
+			break;
+		case 413:
+			msg = "413 Request Entity Too Large";
+			break;
 		case 415:
 			msg = "415 Unsupported Media Type";
 			break;
+		case 417:
+			msg = "417 Expectation Failed";
+			break;
+		case 429:
+			msg = "429 Too Many Requests";
+			break;
+		case 500:
+			msg = "500 Internal Server Error";
+			break;
+		case 502:
+			msg = "502 Bad Gateway";
+			break;
+		case 503:
+			msg = "503 Service Unavailable";
+			break;
+		case 504:
+			msg = "504 Gateway Timeout";
+			break;
 		default:
 			msg = "An error has occurred";
 			break;
@@ -0,0 +1,286 @@
+/*
+ * fileWatcher.c
+ *
+ * Contains the inotify watcher for the home directory. One thread reads
+ * inotify events for the home directory and every directory below it,
+ * and passes each change to the subscribed caches as a path relative to
+ * the home directory, the same form getResourceName produces. If the
+ * kernel's event queue overflows, subscribers are told with a NULL path
+ * that anything may have changed.
+ */
+
+#include "headerfile.h"
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+ * Struct that holds the inotify descriptor, the directory for each
+ * watch descriptor, and the subscribers.
+ */
+static struct {
+	int fd;					// the inotify descriptor, or -1
+	pthread_t thread;
+	char **paths;			// directory path for each watch descriptor
+	int pathCount;			// slots in paths
+	void (*subscribers[FILE_WATCHER_MAX_SUBSCRIBERS])(const char *, unsigned int);
+	int subscriberCount;
+} watcher = { .fd = -1 };
+
+/*
+ * Function prototypes for the fileWatcher.c file
+ */
+static void file_watcher_add(const char *path);
+static void file_watcher_notify(const char *path, unsigned int mask);
+static void *file_watcher_thread(void *arg);
+
+/*
+ * Function: file_watcher_add
+ * ----------------------------
+ *   Watches a directory and every directory below it.
+ *
+ *	 Parameters:
+ *   path: The directory, relative to the home directory ("" for the
+ *   home directory itself)
+ *
+ *   Returns: nothing
+ */
+static void file_watcher_add(const char *path)
+{
+	DIR *directory;
+	struct dirent *item;
+	char **grown;
+	char child[BUFSIZE];
+	int wd;
+
+	wd = inotify_add_watch(watcher.fd, path[0] == '\0' ? "." : path, WATCH_EVENTS | IN_ONLYDIR);
+	if (wd < 0)
+	{
+		return;
+	}
+
+	// Remember the directory for this watch descriptor
+	if (wd >= watcher.pathCount)
+	{
+		grown = (char **) realloc(watcher.paths, sizeof(char *) * (wd + 64));
+		if (grown == NULL)
+		{
+			return;
+		}
+		memset(grown + watcher.pathCount, 0, sizeof(char *) * (wd + 64 - watcher.pathCount));
+		watcher.paths = grown;
+		watcher.pathCount = wd + 64;
+	}
+	free(watcher.paths[wd]);
+	watcher.paths[wd] = strdup(path);
+
+	// Watch the subdirectories too
+	directory = opendir(path[0] == '\0' ? "." : path);
+	if (directory == NULL)
+	{
+		return;
+	}
+
+	while ((item = readdir(directory)) != NULL)
+	{
+		if (item->d_type != DT_DIR || !strcmp(item->d_name, ".") || !strcmp(item->d_name, ".."))
+		{
+			continue;
+		}
+
+		if (path[0] == '\0')
+		{
+			snprintf(child, sizeof(child), "%s", item->d_name);
+		}
+		else
+		{
+			snprintf(child, sizeof(child), "%s/%s", path, item->d_name);
+		}
+		file_watcher_add(child);
+	}
+
+	closedir(directory);
+}
+
+/*
+ * Function: file_watcher_start
+ * ----------------------------
+ *   Starts watching the home directory, which must be the current
+ *   working directory.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if successful, -1 if inotify is not available, in which
+ *   case the caches rely on their time limits alone
+ */
+int file_watcher_start()
+{
+	watcher.fd = inotify_init1(IN_CLOEXEC);
+	if (watcher.fd < 0)
+	{
+		logger("Unable to watch the home directory for changes");
+		return -1;
+	}
+
+	file_watcher_add("");
+
+	if (pthread_create(&(watcher.thread), NULL, file_watcher_thread, NULL) != 0)
+	{
+		logger("Unable to start the file watcher thread");
+		close(watcher.fd);
+		watcher.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: file_watcher_subscribe
+ * ----------------------------
+ *   Registers a function to be told about changes in the home directory.
+ *   Subscribers must be registered before the watcher starts. They are
+ *   called on the watcher thread.
+ *
+ *	 Parameters:
+ *   callback: The function to call with the changed path and the
+ *   inotify event mask
+ *
+ *   Returns: nothing
+ */
+void file_watcher_subscribe(void (*callback)(const char *, unsigned int))
+{
+	if (watcher.subscriberCount < FILE_WATCHER_MAX_SUBSCRIBERS)
+	{
+		watcher.subscribers[watcher.subscriberCount] = callback;
+		watcher.subscriberCount += 1;
+	}
+}
+
+/*
+ * Function: file_watcher_active
+ * ----------------------------
+ *   Determines if the home directory is being watched.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 1 if the watcher is running, 0 otherwise
+ */
+int file_watcher_active()
+{
+	return watcher.fd >= 0;
+}
+
+/*
+ * Function: file_watcher_notify
+ * ----------------------------
+ *   Passes a change to every subscriber.
+ *
+ *	 Parameters:
+ *   path: The changed path, or NULL if anything may have changed
+ *   mask: The inotify event mask
+ *
+ *   Returns: nothing
+ */
+static void file_watcher_notify(const char *path, unsigned int mask)
+{
+	int i;
+
+	for (i = 0; i < watcher.subscriberCount; i++)
+	{
+		watcher.subscribers[i](path, mask);
+	}
+}
+
+/*
+ * Function: file_watcher_thread
+ * ----------------------------
+ *   Reads inotify events and passes them to the subscribers. New
+ *   directories are watched as they appear.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *
+ *   Returns: nothing, the thread runs until the program ends
+ */
+static void *file_watcher_thread(void *arg)
+{
+	char events[16 * (sizeof(struct inotify_event) + 256)]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[BUFSIZE];
+	const struct inotify_event *event;
+	ssize_t count;
+	char *next;
+
+	config_reader_register();
+
+	for (;;)
+	{
+		// Waiting for events does not hold up a configuration reload
+		config_offline();
+		count = read(watcher.fd, events, sizeof(events));
+		config_quiescent();
+		if (count <= 0)
+		{
+			if (count < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			logger("File watcher stopped");
+			break;
+		}
+
+		for (next = events; next < events + count; next += sizeof(struct inotify_event) + event->len)
+		{
+			event = (const struct inotify_event *) next;
+
+			// The kernel dropped events, so nothing cached can be trusted
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				file_watcher_notify(NULL, event->mask);
+				continue;
+			}
+
+			if (event->wd < 0 || event->wd >= watcher.pathCount || watcher.paths[event->wd] == NULL)
+			{
+				continue;
+			}
+
+			// The directory itself is gone
+			if (event->mask & IN_IGNORED)
+			{
+				free(watcher.paths[event->wd]);
+				watcher.paths[event->wd] = NULL;
+				continue;
+			}
+
+			// Build the path relative to the home directory
+			if (event->len == 0)
+			{
+				snprintf(path, sizeof(path), "%s", watcher.paths[event->wd]);
+			}
+			else if (watcher.paths[event->wd][0] == '\0')
+			{
+				snprintf(path, sizeof(path), "%s", event->name);
+			}
+			else
+			{
+				snprintf(path, sizeof(path), "%s/%s", watcher.paths[event->wd], event->name);
+			}
+
+			// Start watching directories that appear
+			if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+			{
+				file_watcher_add(path);
+			}
+
+			file_watcher_notify(path, event->mask);
+		}
+	}
+
+	return NULL;
+}
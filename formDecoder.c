@@ -0,0 +1,443 @@
+/*
+ * formDecoder.c
+ *
+ * Contains an incremental decoder for application/x-www-form-urlencoded
+ * data. The decoder is fed the body a piece at a time as it arrives and
+ * writes each decoded name and value straight into the request arena,
+ * so a form never has to be buffered whole. Percent escapes and '+' are
+ * decoded even when they are split across pieces.
+ *
+ * Most form data is ordinary characters, so the decoder spends its time
+ * looking for the next '&', '=', '+' or '%'. On x86-64 that scan checks
+ * 16 bytes at a time with SSE2, or 32 at a time with AVX2 when the CPU
+ * supports it; other targets use the scalar loop.
+ */
+
+#include "headerfile.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define FORM_SCAN_SIMD 1
+#endif
+
+/*
+ * Function: hexDigit
+ * ----------------------------
+ *   Converts a hexadecimal digit to its value.
+ *
+ *	 Parameters:
+ *   digit: The character to convert
+ *
+ *   Returns: the value 0-15, or -1 if the character is not a hex digit
+ */
+int hexDigit(char digit)
+{
+	if (digit >= '0' && digit <= '9')
+	{
+		return digit - '0';
+	}
+	if (digit >= 'a' && digit <= 'f')
+	{
+		return digit - 'a' + 10;
+	}
+	if (digit >= 'A' && digit <= 'F')
+	{
+		return digit - 'A' + 10;
+	}
+	return -1;
+}
+
+/*
+ * Function: form_emit
+ * ----------------------------
+ *   Appends decoded bytes to the name or value of the current field,
+ *   starting a new field if there is none.
+ *
+ *	 Parameters:
+ *   parser: The form parser
+ *   data: The decoded bytes
+ *   count: The number of bytes
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int form_emit(form_parser *parser, const char *data, size_t count)
+{
+	form_field *field = parser->current;
+
+	if (field == NULL)
+	{
+		// Begin a new field; the struct is allocated ahead of its strings
+		field = (form_field *) arena_alloc(parser->mem, sizeof(form_field));
+		if (field == NULL)
+		{
+			return -1;
+		}
+		field->name = NULL;
+		field->nameLen = 0;
+		field->value = NULL;
+		field->valueLen = 0;
+		field->next = NULL;
+		parser->current = field;
+		parser->inValue = 0;
+	}
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	if (parser->inValue)
+	{
+		field->value = arena_append(parser->mem, field->value, &(field->valueLen), data, count);
+		return field->value == NULL ? -1 : 0;
+	}
+
+	field->name = arena_append(parser->mem, field->name, &(field->nameLen), data, count);
+	return field->name == NULL ? -1 : 0;
+}
+
+/*
+ * Function: form_end_field
+ * ----------------------------
+ *   Finishes the current field and adds it to the parser's list. Fields
+ *   without a name are dropped; missing values become empty strings.
+ *
+ *	 Parameters:
+ *   parser: The form parser
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int form_end_field(form_parser *parser)
+{
+	form_field *field = parser->current;
+
+	parser->current = NULL;
+	parser->inValue = 0;
+
+	if (field == NULL || field->nameLen == 0)
+	{
+		return 0;
+	}
+
+	if (field->value == NULL)
+	{
+		field->value = arena_append(parser->mem, NULL, &(field->valueLen), "", 0);
+		if (field->value == NULL)
+		{
+			return -1;
+		}
+	}
+
+	if (parser->last == NULL)
+	{
+		parser->first = field;
+	}
+	else
+	{
+		parser->last->next = field;
+	}
+	parser->last = field;
+	parser->count += 1;
+	return 0;
+}
+
+/*
+ * Function: form_parser_init
+ * ----------------------------
+ *   Initializes a form parser that decodes into an arena.
+ *
+ *	 Parameters:
+ *   parser: The form parser
+ *   mem: The arena the decoded fields are written to
+ *
+ *   Returns: nothing
+ */
+void form_parser_init(form_parser *parser, arena *mem)
+{
+	parser->mem = mem;
+	parser->first = NULL;
+	parser->last = NULL;
+	parser->current = NULL;
+	parser->count = 0;
+	parser->inValue = 0;
+	parser->percent = 0;
+	parser->pending[0] = '\0';
+}
+
+/*
+ * Function: form_parser_feed
+ * ----------------------------
+ *   Decodes the next piece of form data. Runs of ordinary characters are
+ *   copied in one step; '&' ends a field, the first '=' separates the
+ *   name from the value, '+' becomes a space and "%XX" becomes the byte
+ *   it encodes. A '%' that is not followed by two hex digits is kept as
+ *   is.
+ *
+ *	 Parameters:
+ *   parser: The form parser
+ *   data: The encoded bytes
+ *   count: The number of bytes
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+int form_parser_feed(form_parser *parser, const char *data, size_t count)
+{
+	size_t i = 0;
+	size_t run;
+	char decoded;
+	int high, low;
+
+	while (i < count)
+	{
+		// Finish a percent escape that may have started in an earlier piece
+		if (parser->percent == 1)
+		{
+			parser->pending[0] = data[i];
+			parser->percent = 2;
+			i++;
+			continue;
+		}
+		if (parser->percent == 2)
+		{
+			high = hexDigit(parser->pending[0]);
+			low = hexDigit(data[i]);
+			parser->percent = 0;
+			if (high >= 0 && low >= 0)
+			{
+				decoded = (char) (high * 16 + low);
+				if (form_emit(parser, &decoded, 1) != 0)
+				{
+					return -1;
+				}
+				i++;
+			}
+			else
+			{
+				// Not an escape; keep the '%' and rescan what followed it
+				if (form_emit(parser, "%", 1) != 0 || form_parser_feed(parser, parser->pending, 1) != 0)
+				{
+					return -1;
+				}
+			}
+			continue;
+		}
+
+		// Copy a run of characters that need no decoding
+		run = form_scan(data + i, count - i);
+		if (run > 0)
+		{
+			if (form_emit(parser, data + i, run) != 0)
+			{
+				return -1;
+			}
+			i += run;
+			continue;
+		}
+
+		switch (data[i])
+		{
+			case '&':
+				if (form_end_field(parser) != 0)
+				{
+					return -1;
+				}
+				break;
+			case '=':
+				if (parser->current == NULL && form_emit(parser, NULL, 0) != 0)
+				{
+					return -1;
+				}
+				if (parser->inValue)
+				{
+					// Only the first '=' separates; later ones are data
+					if (form_emit(parser, "=", 1) != 0)
+					{
+						return -1;
+					}
+				}
+				else
+				{
+					parser->inValue = 1;
+				}
+				break;
+			case '+':
+				if (form_emit(parser, " ", 1) != 0)
+				{
+					return -1;
+				}
+				break;
+			case '%':
+				parser->percent = 1;
+				break;
+		}
+		i++;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: form_parser_finish
+ * ----------------------------
+ *   Ends decoding, keeping any incomplete percent escape as literal
+ *   text, and adds the last field to the list.
+ *
+ *	 Parameters:
+ *   parser: The form parser
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+int form_parser_finish(form_parser *parser)
+{
+	if (parser->percent == 1)
+	{
+		parser->percent = 0;
+		if (form_emit(parser, "%", 1) != 0)
+		{
+			return -1;
+		}
+	}
+	else if (parser->percent == 2)
+	{
+		parser->percent = 0;
+		if (form_emit(parser, "%", 1) != 0 || form_parser_feed(parser, parser->pending, 1) != 0)
+		{
+			return -1;
+		}
+
+		// The rescanned character may itself have been a lone '%'
+		return form_parser_finish(parser);
+	}
+
+	return form_end_field(parser);
+}
+
+#ifdef FORM_SCAN_SIMD
+/*
+ * Function: form_scan_avx2
+ * ----------------------------
+ *   Finds the first form character that needs decoding, 32 bytes at a
+ *   time. Only called when the CPU supports AVX2.
+ *
+ *	 Parameters:
+ *   data: The encoded bytes
+ *   count: The number of bytes
+ *
+ *   Returns: the offset of the first special character, or the offset
+ *   of the unscanned tail if there is none in the full blocks
+ */
+__attribute__((target("avx2")))
+static size_t form_scan_avx2(const char *data, size_t count)
+{
+	const __m256i ampersand = _mm256_set1_epi8('&');
+	const __m256i equals = _mm256_set1_epi8('=');
+	const __m256i plus = _mm256_set1_epi8('+');
+	const __m256i percent = _mm256_set1_epi8('%');
+	__m256i block, hits;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= count; i += 32)
+	{
+		block = _mm256_loadu_si256((const __m256i *) (data + i));
+		hits = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(block, ampersand), _mm256_cmpeq_epi8(block, equals)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(block, plus), _mm256_cmpeq_epi8(block, percent)));
+		mask = (unsigned int) _mm256_movemask_epi8(hits);
+		if (mask != 0)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Function: form_scan_sse2
+ * ----------------------------
+ *   Finds the first form character that needs decoding, 16 bytes at a
+ *   time. SSE2 is part of every x86-64 CPU.
+ *
+ *	 Parameters:
+ *   data: The encoded bytes
+ *   count: The number of bytes
+ *
+ *   Returns: the offset of the first special character, or the offset
+ *   of the unscanned tail if there is none in the full blocks
+ */
+static size_t form_scan_sse2(const char *data, size_t count)
+{
+	const __m128i ampersand = _mm_set1_epi8('&');
+	const __m128i equals = _mm_set1_epi8('=');
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i percent = _mm_set1_epi8('%');
+	__m128i block, hits;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		block = _mm_loadu_si128((const __m128i *) (data + i));
+		hits = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(block, ampersand), _mm_cmpeq_epi8(block, equals)),
+				_mm_or_si128(_mm_cmpeq_epi8(block, plus), _mm_cmpeq_epi8(block, percent)));
+		mask = (unsigned int) _mm_movemask_epi8(hits);
+		if (mask != 0)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i;
+}
+#endif
+
+/*
+ * Function: form_scan
+ * ----------------------------
+ *   Finds the first character in a piece of form data that needs
+ *   decoding: '&', '=', '+' or '%'. Full blocks are checked with the
+ *   widest vector instructions available and the tail byte by byte.
+ *
+ *	 Parameters:
+ *   data: The encoded bytes
+ *   count: The number of bytes
+ *
+ *   Returns: the number of ordinary characters before the first special
+ *   one, or count if there is none
+ */
+size_t form_scan(const char *data, size_t count)
+{
+	size_t i = 0;
+
+#ifdef FORM_SCAN_SIMD
+	static int useAvx2 = -1;	// CPU support for AVX2, checked on first use
+
+	if (useAvx2 < 0)
+	{
+		useAvx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+
+	// Each vector scan returns the position of a special character, or the
+	// end of the full blocks it checked; the remainder falls through
+	if (useAvx2 && count >= 32)
+	{
+		i = form_scan_avx2(data, count);
+	}
+	if ((!useAvx2 || i == (count & ~((size_t) 31))) && count - i >= 16)
+	{
+		i += form_scan_sse2(data + i, count - i);
+	}
+#endif
+
+	for (; i < count; i++)
+	{
+		if (data[i] == '&' || data[i] == '=' || data[i] == '+' || data[i] == '%')
+		{
+			break;
+		}
+	}
+
+	return i;
+}
@@ -0,0 +1,1495 @@
+/*
+ * gateway.c
+ *
+ * Contains the FastCGI and SCGI gateways for dynamic pages. A fastcgi
+ * or scgi line in the config file sends every request whose path starts
+ * with a prefix to a backend listening on a Unix socket. The request is
+ * passed with the usual CGI variables and its body, and the backend's
+ * CGI response is streamed back to the client as it is produced. Each
+ * piece is sent before the next one is read, so a slow client slows
+ * the backend down instead of filling the server's memory.
+ *
+ * FastCGI connections are kept open between requests and shared by the
+ * workers of the server. A backend has a fixed number of connections,
+ * one for each of its worker processes, and a request waits for a free
+ * one rather than queueing behind a worker that is busy. SCGI closes
+ * the connection after each response, so it only shares the limit.
+ *
+ * The server can run the worker processes itself. It creates the
+ * socket, starts the command given for the backend with the listening
+ * socket as its standard input, as FastCGI applications expect, and
+ * starts a worker again whenever one exits. Workers end with the
+ * server. Routes are set up once at startup.
+ */
+
+#include "headerfile.h"
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <ctype.h>
+
+// Results of exchanging a request and response with a backend
+#define GATEWAY_DONE 0 // the response was relayed, or the client went away
+#define GATEWAY_STALE 1 // a pooled connection had closed; nothing was used up
+#define GATEWAY_FAILED 2 // the backend failed before the response started
+#define GATEWAY_BUSY 3 // the backend refused the request as overloaded
+
+// FastCGI record types and values
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_OVERLOADED 2
+#define FCGI_HEADER_SIZE 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_REQUEST_ID 1 // each connection carries one request at a time
+
+// Define type of struct for a gateway path prefix and its backend
+typedef struct gateway_route {
+	char prefix[PROXY_NAME_SIZE];
+	size_t prefixLength;
+	int protocol;					// GATEWAY_FASTCGI or GATEWAY_SCGI
+	struct sockaddr_un address;		// the backend's socket
+	char command[BUFSIZE];			// command the workers run, or empty
+	int workers;					// worker processes the server runs, or 0
+	pid_t pids[GATEWAY_MAX_WORKERS];	// the running workers, 0 for none
+	int listener;					// listening socket the workers share, or -1
+	pthread_mutex_t lock;			// guards the connections
+	pthread_cond_t freed;			// signalled when a connection is given back
+	int idle[GATEWAY_MAX_WORKERS];	// idle FastCGI connections, the newest last
+	int idleCount;
+	int open;						// connections open, idle or in use
+	int limit;						// most connections open at once
+	} gateway_route;
+
+// Define type of struct for a response being read from a backend
+typedef struct gateway_reply {
+	connection *up;			// the backend connection
+	int protocol;			// GATEWAY_FASTCGI or GATEWAY_SCGI
+	int ended;				// nonzero once the backend has ended the response
+	int complete;			// nonzero if FastCGI reported the request complete
+	} gateway_reply;
+
+/*
+ * Struct that holds the routes and the worker supervisor thread.
+ */
+static struct {
+	gateway_route routes[GATEWAY_MAX_ROUTES];
+	int routeCount;
+	pthread_t thread;
+} gateway;
+
+// The calling worker's contexts for backend connections
+static __thread connection_pool contexts;
+
+/*
+ * Function prototypes for the gateway.c file
+ */
+static gateway_route *gateway_find(connection *c);
+static int gateway_listen(gateway_route *route);
+static pid_t gateway_spawn(gateway_route *route, const char *shellCommand, int maxfd);
+static void *gateway_supervisor(void *arg);
+static int gateway_open(gateway_route *route);
+static int gateway_connect(gateway_route *route, int *reused);
+static void gateway_release(gateway_route *route, int fd, int keep);
+static char *gateway_param(connection *c, int protocol, char *params, size_t *length,
+		const char *name, size_t nameLength, const char *value, size_t valueLength);
+static char *gateway_params(connection *c, gateway_route *route, size_t *length);
+static void gateway_record(connection *up, int type, const char *data, size_t length);
+static int gateway_send_request(connection *c, connection *up, int protocol, char *params, size_t paramsLength);
+static int gateway_need(connection *up, size_t count);
+static ssize_t gateway_output(gateway_reply *reply, char **data);
+static char *gateway_header_end(char *header, size_t length);
+static int gateway_send_header(connection *c, char *header, char *end, int head, int *framing);
+static int gateway_relay(connection *c, gateway_reply *reply, int head);
+static int gateway_exchange(connection *c, connection *up, gateway_route *route, char *params,
+		size_t paramsLength, int head, int replayable, int *reusable);
+
+/*
+ * Function: gateway_route_add
+ * ----------------------------
+ *   Sends requests for a path prefix to a FastCGI or SCGI backend.
+ *   Called while the config file is read at startup.
+ *
+ *	 Parameters:
+ *   protocol: GATEWAY_FASTCGI or GATEWAY_SCGI
+ *   prefix: The path prefix, such as /app/
+ *   backend: The backend's Unix socket, optionally followed by
+ *   &workers&command to have the server run that many workers
+ *
+ *   Returns: 0 if successful, -1 if the route cannot be added
+ */
+int gateway_route_add(int protocol, char *prefix, char *backend)
+{
+	gateway_route *route;
+	char logbuff[BUFSIZE];
+	char *workers;
+	char *command = NULL;
+
+	if (gateway.routeCount == GATEWAY_MAX_ROUTES || prefix[0] != '/' || strlen(prefix) >= PROXY_NAME_SIZE)
+	{
+		return -1;
+	}
+
+	route = &(gateway.routes[gateway.routeCount]);
+	memset(route, 0, sizeof(*route));
+
+	// The worker count and command follow the socket
+	workers = strchr(backend, ET_DELIMITER);
+	if (workers != NULL)
+	{
+		*workers++ = '\0';
+		command = strchr(workers, ET_DELIMITER);
+		if (command == NULL || command[1] == '\0')
+		{
+			return -1;
+		}
+		*command++ = '\0';
+		route->workers = atoi(workers);
+		if (route->workers < 1 || route->workers > GATEWAY_MAX_WORKERS || strlen(command) >= sizeof(route->command) - 6)
+		{
+			return -1;
+		}
+		strcpy(route->command, command);
+	}
+
+	if (backend[0] == '\0' || strlen(backend) >= sizeof(route->address.sun_path))
+	{
+		return -1;
+	}
+	route->address.sun_family = AF_UNIX;
+	strcpy(route->address.sun_path, backend);
+
+	strcpy(route->prefix, prefix);
+	route->prefixLength = strlen(prefix);
+	route->protocol = protocol;
+	route->listener = -1;
+	route->limit = route->workers > 0 ? route->workers : GATEWAY_CONNECTIONS;
+	pthread_mutex_init(&(route->lock), NULL);
+	pthread_cond_init(&(route->freed), NULL);
+
+	sprintf(logbuff, "Requests for %.200s are sent to the %s backend on %.200s%s.", prefix,
+			protocol == GATEWAY_FASTCGI ? "FastCGI" : "SCGI", backend, route->workers > 0 ? ", run by the server" : "");
+	logger(logbuff);
+	gateway.routeCount += 1;
+	return 0;
+}
+
+/*
+ * Function: gateway_listen
+ * ----------------------------
+ *   Creates the listening socket a backend's workers will share,
+ *   replacing any socket file left at its path.
+ *
+ *	 Parameters:
+ *   route: The route whose workers the server runs
+ *
+ *   Returns: 0 if successful, -1 if the socket cannot be created
+ */
+static int gateway_listen(gateway_route *route)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	unlink(route->address.sun_path);
+	if (bind(fd, (struct sockaddr *) &(route->address), sizeof(route->address)) != 0 ||
+			listen(fd, LISTENER_QUEUE_SIZE) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	route->listener = fd;
+	return 0;
+}
+
+/*
+ * Function: gateway_start
+ * ----------------------------
+ *   Creates the sockets of the backends the server runs itself and
+ *   starts the thread that runs their workers.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if successful, -1 if a socket or the thread cannot be
+ *   created
+ */
+int gateway_start()
+{
+	char logbuff[BUFSIZE];
+	int result = 0;
+	int spawned = 0;
+	int i;
+
+	for (i = 0; i < gateway.routeCount; i++)
+	{
+		if (gateway.routes[i].workers == 0)
+		{
+			continue;
+		}
+		if (gateway_listen(&(gateway.routes[i])) != 0)
+		{
+			sprintf(logbuff, "Unable to listen on %.200s for the workers of %.200s.",
+					gateway.routes[i].address.sun_path, gateway.routes[i].prefix);
+			logger(logbuff);
+			result = -1;
+			continue;
+		}
+		spawned = 1;
+	}
+
+	if (spawned && pthread_create(&(gateway.thread), NULL, gateway_supervisor, NULL) != 0)
+	{
+		logger("Unable to start the gateway worker thread");
+		return -1;
+	}
+
+	return result;
+}
+
+/*
+ * Function: gateway_spawn
+ * ----------------------------
+ *   Starts one worker of a backend. The worker gets the listening socket
+ *   as its standard input and no other descriptor of the server's, and
+ *   is sent SIGTERM if the thread that started it ends.
+ *
+ *	 Parameters:
+ *   route: The route the worker serves
+ *   shellCommand: The command line for /bin/sh, built before the fork
+ *   maxfd: The highest descriptor the server may have open
+ *
+ *   Returns: the worker's process id, or -1 if it cannot be started
+ */
+static pid_t gateway_spawn(gateway_route *route, const char *shellCommand, int maxfd)
+{
+	sigset_t none;
+	pid_t parent = getpid();
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (pid != 0)
+	{
+		return pid;
+	}
+
+	// Only async-signal-safe calls from here on, since other threads of
+	// the server may have held locks at the fork
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != parent)
+	{
+		_exit(1);
+	}
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+	signal(SIGPIPE, SIG_DFL);
+
+	if (dup2(route->listener, 0) != 0)
+	{
+		_exit(1);
+	}
+	for (fd = 3; fd <= maxfd; fd++)
+	{
+		close(fd);
+	}
+
+	execl("/bin/sh", "sh", "-c", shellCommand, (char *) NULL);
+	_exit(127);
+}
+
+/*
+ * Function: gateway_supervisor
+ * ----------------------------
+ *   Starts the workers of every backend the server runs and starts a
+ *   worker again, after GATEWAY_RESPAWN_DELAY seconds, whenever one
+ *   exits. No workers are started once the server is draining.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *
+ *   Returns: nothing, the thread runs until the program ends
+ */
+static void *gateway_supervisor(void *arg)
+{
+	char commands[GATEWAY_MAX_ROUTES][BUFSIZE];
+	gateway_route *route;
+	pid_t pid;
+	int maxfd = (int) sysconf(_SC_OPEN_MAX);
+	int status;
+	int i;
+	int j;
+
+	// The workers are the server's only children, so any child is one
+	if (maxfd < 0 || maxfd > 65536)
+	{
+		maxfd = 65536;
+	}
+	for (i = 0; i < gateway.routeCount; i++)
+	{
+		snprintf(commands[i], BUFSIZE, "exec %s", gateway.routes[i].command);
+		for (j = 0; j < gateway.routes[i].workers && gateway.routes[i].listener >= 0; j++)
+		{
+			gateway.routes[i].pids[j] = gateway_spawn(&(gateway.routes[i]), commands[i], maxfd);
+		}
+	}
+
+	for (;;)
+	{
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			if (errno == ECHILD)
+			{
+				sleep(GATEWAY_RESPAWN_DELAY);
+			}
+			continue;
+		}
+
+		for (i = 0; i < gateway.routeCount; i++)
+		{
+			route = &(gateway.routes[i]);
+			for (j = 0; j < route->workers && route->pids[j] != pid; j++)
+				;
+			if (j == route->workers)
+			{
+				continue;
+			}
+
+			route->pids[j] = 0;
+			if (server_draining())
+			{
+				break;
+			}
+			if (WIFEXITED(status))
+			{
+				LOG_WARN("Worker %d for %s exited with status %d; starting another.", (int) pid, route->prefix,
+						WEXITSTATUS(status));
+			}
+			else
+			{
+				LOG_WARN("Worker %d for %s ended by signal %d; starting another.", (int) pid, route->prefix,
+						WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+			}
+
+			// A worker that cannot start would otherwise be restarted
+			// as fast as it fails
+			sleep(GATEWAY_RESPAWN_DELAY);
+			route->pids[j] = gateway_spawn(route, commands[i], maxfd);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: gateway_find
+ * ----------------------------
+ *   Finds the route for a request. The longest matching prefix wins.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header
+ *
+ *   Returns: the route, or NULL if the request is not for a gateway path
+ */
+static gateway_route *gateway_find(connection *c)
+{
+	gateway_route *best = NULL;
+	char *path = memchr(c->inbuf, ' ', c->headerlen);
+	size_t length;
+	int i;
+
+	if (path == NULL)
+	{
+		return NULL;
+	}
+	path++;
+	length = strcspn(path, " ?\r\n");
+
+	for (i = 0; i < gateway.routeCount; i++)
+	{
+		if (gateway.routes[i].prefixLength <= length && !memcmp(path, gateway.routes[i].prefix,
+				gateway.routes[i].prefixLength) && (best == NULL || gateway.routes[i].prefixLength > best->prefixLength))
+		{
+			best = &(gateway.routes[i]);
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Function: gateway_requested
+ * ----------------------------
+ *   Determines if a request is for a gateway path.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header
+ *
+ *   Returns: 1 if the request goes to a backend, 0 otherwise
+ */
+int gateway_requested(connection *c)
+{
+	return gateway.routeCount > 0 && gateway_find(c) != NULL;
+}
+
+/*
+ * Function: gateway_open
+ * ----------------------------
+ *   Opens a new connection to a backend. The connect to a Unix socket
+ *   finishes or fails at once; the connection is non-blocking after it.
+ *
+ *	 Parameters:
+ *   route: The route of the backend
+ *
+ *   Returns: the socket, or -1 if the backend cannot be reached
+ */
+static int gateway_open(gateway_route *route)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *) &(route->address), sizeof(route->address)) != 0 ||
+			fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Function: gateway_connect
+ * ----------------------------
+ *   Gets a connection to a backend: an idle one that is still open, a
+ *   new one if the backend has fewer than its limit, or else the next
+ *   one given back, waiting up to the response timeout for it. A request
+ *   in a coroutine cannot sleep on the condition, since the connection
+ *   it waits for may belong to another coroutine on the same worker, so
+ *   it looks again every GATEWAY_RETRY_MS instead.
+ *
+ *	 Parameters:
+ *   route: The route of the backend
+ *   reused: Set to 1 if the connection was idle, 0 if it is new
+ *
+ *   Returns: the socket, -1 if the backend cannot be reached, or -2 if
+ *   no connection was given back in time
+ */
+static int gateway_connect(gateway_route *route, int *reused)
+{
+	struct timespec until;
+	struct timespec now;
+	char peek;
+	int fd;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += config_current()->settings.responseTimeout;
+
+	pthread_mutex_lock(&(route->lock));
+	for (;;)
+	{
+		if (route->idleCount > 0)
+		{
+			fd = route->idle[--route->idleCount];
+			pthread_mutex_unlock(&(route->lock));
+
+			// A worker that exited, or sent something unasked, has made
+			// the connection useless
+			if (recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				*reused = 1;
+				return fd;
+			}
+			close(fd);
+
+			pthread_mutex_lock(&(route->lock));
+			route->open -= 1;
+			continue;
+		}
+
+		if (route->open < route->limit)
+		{
+			route->open += 1;
+			pthread_mutex_unlock(&(route->lock));
+
+			*reused = 0;
+			fd = gateway_open(route);
+			if (fd < 0)
+			{
+				gateway_release(route, -1, 0);
+			}
+			return fd;
+		}
+
+		if (coroutine_active())
+		{
+			pthread_mutex_unlock(&(route->lock));
+			clock_gettime(CLOCK_REALTIME, &now);
+			if (now.tv_sec > until.tv_sec || (now.tv_sec == until.tv_sec && now.tv_nsec >= until.tv_nsec))
+			{
+				return -2;
+			}
+			coroutine_poll(NULL, 0, GATEWAY_RETRY_MS);
+			pthread_mutex_lock(&(route->lock));
+		}
+		else if (pthread_cond_timedwait(&(route->freed), &(route->lock), &until) == ETIMEDOUT)
+		{
+			pthread_mutex_unlock(&(route->lock));
+			return -2;
+		}
+	}
+}
+
+/*
+ * Function: gateway_release
+ * ----------------------------
+ *   Gives a connection back, keeping it for the next request or closing
+ *   it, and wakes a request waiting for one.
+ *
+ *	 Parameters:
+ *   route: The route of the backend
+ *   fd: The connection, or -1 if it could not be opened
+ *   keep: Nonzero if the connection can take another request
+ *
+ *   Returns: nothing
+ */
+static void gateway_release(gateway_route *route, int fd, int keep)
+{
+	pthread_mutex_lock(&(route->lock));
+	if (keep && route->idleCount < GATEWAY_MAX_WORKERS)
+	{
+		route->idle[route->idleCount++] = fd;
+		fd = -1;
+	}
+	else
+	{
+		route->open -= 1;
+	}
+	pthread_cond_signal(&(route->freed));
+	pthread_mutex_unlock(&(route->lock));
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+/*
+ * Function: gateway_param
+ * ----------------------------
+ *   Adds a CGI variable to the parameters being built in the request
+ *   arena, as a FastCGI name-value pair or SCGI's null terminated name
+ *   and value.
+ *
+ *	 Parameters:
+ *   c: The client connection whose arena holds the parameters
+ *   protocol: GATEWAY_FASTCGI or GATEWAY_SCGI
+ *   params: The parameters so far, or NULL to start them
+ *   length: The length of the parameters, updated on return
+ *   name: The variable's name
+ *   nameLength: The length of the name
+ *   value: The variable's value
+ *   valueLength: The length of the value
+ *
+ *   Returns: the parameters, which may have moved, or NULL if memory
+ *   could not be allocated
+ */
+static char *gateway_param(connection *c, int protocol, char *params, size_t *length,
+		const char *name, size_t nameLength, const char *value, size_t valueLength)
+{
+	unsigned char lengths[8];
+	size_t size = 0;
+
+	if (protocol == GATEWAY_SCGI)
+	{
+		params = arena_append(&(c->requestArena), params, length, name, nameLength + 1);
+		if (params != NULL)
+		{
+			params[*length - 1] = '\0';
+			params = arena_append(&(c->requestArena), params, length, value, valueLength);
+		}
+		if (params != NULL)
+		{
+			params = arena_append(&(c->requestArena), params, length, "", 1);
+		}
+		return params;
+	}
+
+	// Lengths below 128 take one byte, others four with the top bit set
+	if (nameLength < 128)
+	{
+		lengths[size++] = (unsigned char) nameLength;
+	}
+	else
+	{
+		lengths[size++] = (unsigned char) ((nameLength >> 24) | 0x80);
+		lengths[size++] = (unsigned char) (nameLength >> 16);
+		lengths[size++] = (unsigned char) (nameLength >> 8);
+		lengths[size++] = (unsigned char) nameLength;
+	}
+	if (valueLength < 128)
+	{
+		lengths[size++] = (unsigned char) valueLength;
+	}
+	else
+	{
+		lengths[size++] = (unsigned char) ((valueLength >> 24) | 0x80);
+		lengths[size++] = (unsigned char) (valueLength >> 16);
+		lengths[size++] = (unsigned char) (valueLength >> 8);
+		lengths[size++] = (unsigned char) valueLength;
+	}
+
+	params = arena_append(&(c->requestArena), params, length, (char *) lengths, size);
+	if (params != NULL)
+	{
+		params = arena_append(&(c->requestArena), params, length, name, nameLength);
+	}
+	if (params != NULL)
+	{
+		params = arena_append(&(c->requestArena), params, length, value, valueLength);
+	}
+	return params;
+}
+
+/*
+ * Function: gateway_params
+ * ----------------------------
+ *   Builds the CGI variables for a request: the request line split into
+ *   its parts, the script and path info under the route's prefix, the
+ *   addresses of both ends, and an HTTP_ variable for each header field.
+ *   The body must have been checked with body_reader_init.
+ *
+ *	 Parameters:
+ *   c: The client connection holding the request header
+ *   route: The route of the request
+ *   length: Set to the length of the parameters
+ *
+ *   Returns: the parameters in the request arena, or NULL if the path
+ *   is invalid or memory could not be allocated
+ */
+static char *gateway_params(connection *c, gateway_route *route, size_t *length)
+{
+	struct sockaddr_storage ends[2];
+	socklen_t endLength;
+	const char *home = config_current()->home;
+	char *params = NULL;
+	char *lineEnd = c->inbuf + strcspn(c->inbuf, "\r\n");
+	char *target = memchr(c->inbuf, ' ', lineEnd - c->inbuf);
+	char *targetEnd;
+	char *query;
+	char *line;
+	char *next;
+	char *colon;
+	char *value;
+	char *normalized;
+	char *filename;
+	char name[256];
+	char address[INET6_ADDRSTRLEN];
+	char port[8];
+	size_t pathLength;
+	size_t scriptLength = route->prefixLength - (route->prefix[route->prefixLength - 1] == '/');
+	size_t normalizedLength;
+	size_t nameLength;
+	size_t valueLength;
+	size_t i;
+	int protocol = route->protocol;
+	int side;
+
+	if (target == NULL)
+	{
+		return NULL;
+	}
+	target++;
+	targetEnd = memchr(target, ' ', lineEnd - target);
+	if (targetEnd == NULL)
+	{
+		return NULL;
+	}
+	pathLength = strcspn(target, "? ");
+	query = target[pathLength] == '?' ? target + pathLength + 1 : targetEnd;
+
+	// The path is decoded and checked the way a file path is, so the
+	// backend sees one name for each script, and must still be under
+	// the prefix once it has been
+	normalized = (char *) arena_alloc(&(c->requestArena), pathLength + 2);
+	if (normalized == NULL || normalizePath(target, pathLength, normalized + 1) != 0)
+	{
+		return NULL;
+	}
+	normalized[0] = '/';
+	normalizedLength = strlen(normalized);
+	if (normalizedLength < scriptLength || memcmp(normalized, route->prefix, scriptLength) != 0 ||
+			(normalizedLength > scriptLength && normalized[scriptLength] != '/'))
+	{
+		return NULL;
+	}
+	filename = (char *) arena_alloc(&(c->requestArena), strlen(home) + normalizedLength + 1);
+	if (filename == NULL)
+	{
+		return NULL;
+	}
+	sprintf(filename, "%s%s", home, normalized);
+
+	// SCGI requires the body's length first, and its own marker
+	i = sprintf(name, "%lld", c->bodyMode == BODY_LENGTH ? c->bodyRemaining : 0LL);
+	params = gateway_param(c, protocol, params, length, "CONTENT_LENGTH", 14, name, i);
+	if (protocol == GATEWAY_SCGI && params != NULL)
+	{
+		params = gateway_param(c, protocol, params, length, "SCGI", 4, "1", 1);
+	}
+
+#define GATEWAY_PARAM(n, v, l) \
+	if (params != NULL) params = gateway_param(c, protocol, params, length, n, sizeof(n) - 1, v, l)
+
+	GATEWAY_PARAM("GATEWAY_INTERFACE", "CGI/1.1", 7);
+	GATEWAY_PARAM("SERVER_SOFTWARE", "WebServer", 9);
+	GATEWAY_PARAM("REQUEST_METHOD", c->inbuf, target - 1 - c->inbuf);
+	GATEWAY_PARAM("REQUEST_URI", target, targetEnd - target);
+	GATEWAY_PARAM("QUERY_STRING", query, query < targetEnd ? targetEnd - query : 0);
+	GATEWAY_PARAM("SERVER_PROTOCOL", targetEnd + 1, lineEnd - targetEnd - 1);
+	GATEWAY_PARAM("SCRIPT_NAME", route->prefix, scriptLength);
+	GATEWAY_PARAM("PATH_INFO", normalized + scriptLength, normalizedLength - scriptLength);
+	GATEWAY_PARAM("SCRIPT_FILENAME", filename, strlen(filename));
+	GATEWAY_PARAM("DOCUMENT_ROOT", home, strlen(home));
+	GATEWAY_PARAM("REDIRECT_STATUS", "200", 3);
+	if (c->secure)
+	{
+		GATEWAY_PARAM("HTTPS", "on", 2);
+	}
+
+	// Both ends of the connection
+	for (side = 0; side < 2 && params != NULL; side++)
+	{
+		endLength = sizeof(ends[side]);
+		if ((side == 0 ? getpeername(c->sockfd, (struct sockaddr *) &(ends[side]), &endLength)
+				: getsockname(c->sockfd, (struct sockaddr *) &(ends[side]), &endLength)) != 0 ||
+				(ends[side].ss_family != AF_INET && ends[side].ss_family != AF_INET6))
+		{
+			continue;
+		}
+		inet_ntop(ends[side].ss_family, ends[side].ss_family == AF_INET ?
+				(void *) &(((struct sockaddr_in *) &(ends[side]))->sin_addr) :
+				(void *) &(((struct sockaddr_in6 *) &(ends[side]))->sin6_addr), address, sizeof(address));
+		i = sprintf(port, "%u", ntohs(ends[side].ss_family == AF_INET ? ((struct sockaddr_in *) &(ends[side]))->sin_port
+				: ((struct sockaddr_in6 *) &(ends[side]))->sin6_port));
+		if (side == 0)
+		{
+			GATEWAY_PARAM("REMOTE_ADDR", address, strlen(address));
+			GATEWAY_PARAM("REMOTE_PORT", port, i);
+		}
+		else
+		{
+			GATEWAY_PARAM("SERVER_ADDR", address, strlen(address));
+			GATEWAY_PARAM("SERVER_PORT", port, i);
+		}
+	}
+
+	// The header fields, with the host's name as the server's
+	for (line = lineEnd + (*lineEnd == '\r' ? 2 : 1); line < c->inbuf + c->headerlen && params != NULL; line = next + 1)
+	{
+		next = memchr(line, '\n', c->inbuf + c->headerlen - line);
+		if (next == NULL || line[0] == '\r' || line[0] == '\n')
+		{
+			break;
+		}
+		colon = memchr(line, ':', next - line);
+		if (colon == NULL || colon - line > (long) sizeof(name) - 6)
+		{
+			continue;
+		}
+		value = colon + 1;
+		while (value < next && (*value == ' ' || *value == '\t'))
+		{
+			value++;
+		}
+		valueLength = next - value - (next[-1] == '\r' && next > value);
+
+		nameLength = colon - line;
+		if (nameLength == 4 && !strncasecmp(line, "Host", 4))
+		{
+			GATEWAY_PARAM("SERVER_NAME", value, strcspn(value, ":\r\n"));
+		}
+		if (nameLength == 12 && !strncasecmp(line, "Content-Type", 12))
+		{
+			GATEWAY_PARAM("CONTENT_TYPE", value, valueLength);
+			continue;
+		}
+
+		// The length is given above, and a Proxy field must not become
+		// HTTP_PROXY, which many programs take as their proxy
+		if ((nameLength == 14 && !strncasecmp(line, "Content-Length", 14)) ||
+				(nameLength == 17 && !strncasecmp(line, "Transfer-Encoding", 17)) ||
+				(nameLength == 5 && !strncasecmp(line, "Proxy", 5)))
+		{
+			continue;
+		}
+
+		memcpy(name, "HTTP_", 5);
+		for (i = 0; i < nameLength; i++)
+		{
+			name[5 + i] = line[i] == '-' ? '_' : toupper((unsigned char) line[i]);
+		}
+		if (params != NULL)
+		{
+			params = gateway_param(c, protocol, params, length, name, nameLength + 5, value, valueLength);
+		}
+	}
+
+#undef GATEWAY_PARAM
+
+	return params;
+}
+
+/*
+ * Function: gateway_record
+ * ----------------------------
+ *   Queues a FastCGI record on a backend connection, split into as many
+ *   records as the data needs. Empty data queues the empty record that
+ *   ends a stream.
+ *
+ *	 Parameters:
+ *   up: The backend connection
+ *   type: The record type
+ *   data: The record content
+ *   length: The length of the content
+ *
+ *   Returns: nothing
+ */
+static void gateway_record(connection *up, int type, const char *data, size_t length)
+{
+	unsigned char header[FCGI_HEADER_SIZE];
+	size_t size;
+
+	do
+	{
+		size = length < FCGI_MAX_CONTENT ? length : FCGI_MAX_CONTENT;
+		header[0] = FCGI_VERSION_1;
+		header[1] = (unsigned char) type;
+		header[2] = 0;
+		header[3] = FCGI_REQUEST_ID;
+		header[4] = (unsigned char) (size >> 8);
+		header[5] = (unsigned char) size;
+		header[6] = 0;
+		header[7] = 0;
+		connection_write(up, header, FCGI_HEADER_SIZE);
+		connection_write(up, data, size);
+		data += size;
+		length -= size;
+	} while (length > 0);
+}
+
+/*
+ * Function: gateway_send_request
+ * ----------------------------
+ *   Sends the request's CGI variables and body to a backend, framed as
+ *   FastCGI records or as an SCGI netstring followed by the body.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   up: The backend connection
+ *   protocol: GATEWAY_FASTCGI or GATEWAY_SCGI
+ *   params: The CGI variables
+ *   paramsLength: The length of the variables
+ *
+ *   Returns: GATEWAY_DONE if the request was sent, GATEWAY_FAILED if the
+ *   backend failed, or -1 if the client's body could not be read
+ */
+static int gateway_send_request(connection *c, connection *up, int protocol, char *params, size_t paramsLength)
+{
+	static const unsigned char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	char netstring[24];
+	char *data;
+	ssize_t count;
+	int size;
+
+	if (protocol == GATEWAY_FASTCGI)
+	{
+		gateway_record(up, FCGI_BEGIN_REQUEST, (const char *) begin, sizeof(begin));
+		gateway_record(up, FCGI_PARAMS, params, paramsLength);
+		gateway_record(up, FCGI_PARAMS, NULL, 0);
+	}
+	else
+	{
+		size = sprintf(netstring, "%zu:", paramsLength);
+		connection_write(up, netstring, size);
+		connection_write(up, params, paramsLength);
+		connection_write(up, ",", 1);
+	}
+
+	// The body follows, gathered into larger sends
+	while ((count = body_next(c, &data)) > 0)
+	{
+		if (protocol == GATEWAY_FASTCGI)
+		{
+			gateway_record(up, FCGI_STDIN, data, count);
+		}
+		else
+		{
+			connection_write(up, data, count);
+		}
+
+		if (up->outlen >= STREAM_CHUNK_SIZE && connection_flush(up) != 0)
+		{
+			c->keepAlive = 0;
+			return GATEWAY_FAILED;
+		}
+	}
+	if (count < 0)
+	{
+		c->keepAlive = 0;
+		return -1;
+	}
+	if (protocol == GATEWAY_FASTCGI)
+	{
+		gateway_record(up, FCGI_STDIN, NULL, 0);
+	}
+	if (connection_flush(up) != 0)
+	{
+		return GATEWAY_FAILED;
+	}
+
+	return GATEWAY_DONE;
+}
+
+/*
+ * Function: gateway_need
+ * ----------------------------
+ *   Receives from a backend until a number of unread bytes are in the
+ *   input buffer, moving unread bytes to the front first so the buffer
+ *   only grows to fit one record.
+ *
+ *	 Parameters:
+ *   up: The backend connection
+ *   count: The number of unread bytes needed
+ *
+ *   Returns: 0 if successful, -1 if the backend closed the connection,
+ *   failed or timed out first
+ */
+static int gateway_need(connection *up, size_t count)
+{
+	while (up->inlen - up->inpos < count)
+	{
+		if (up->inpos > 0 && up->inpos < up->inlen)
+		{
+			up->inlen -= up->inpos;
+			memmove(up->inbuf, up->inbuf + up->inpos, up->inlen);
+			up->inpos = 0;
+		}
+		if (connection_fill(up) <= 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: gateway_output
+ * ----------------------------
+ *   Returns the next piece of a backend's CGI response. A FastCGI
+ *   backend's error stream is logged along the way.
+ *
+ *	 Parameters:
+ *   reply: The response being read
+ *   data: Set to the start of the piece, valid until the next call
+ *
+ *   Returns: the length of the piece, 0 at the end of the response, or
+ *   -1 if the backend closed the connection early, failed or timed out
+ */
+static ssize_t gateway_output(gateway_reply *reply, char **data)
+{
+	connection *up = reply->up;
+	unsigned char *header;
+	size_t contentLength;
+	size_t paddingLength;
+	ssize_t received;
+
+	if (reply->ended)
+	{
+		return 0;
+	}
+
+	// An SCGI response runs until the backend closes the connection
+	if (reply->protocol == GATEWAY_SCGI)
+	{
+		if (up->inpos == up->inlen)
+		{
+			received = connection_fill(up);
+			if (received == 0 && !up->timedOut)
+			{
+				reply->ended = 1;
+				return 0;
+			}
+			if (received <= 0)
+			{
+				return -1;
+			}
+		}
+		*data = up->inbuf + up->inpos;
+		received = up->inlen - up->inpos;
+		up->inpos = up->inlen;
+		return received;
+	}
+
+	for (;;)
+	{
+		if (gateway_need(up, FCGI_HEADER_SIZE) != 0)
+		{
+			return -1;
+		}
+		header = (unsigned char *) up->inbuf + up->inpos;
+		contentLength = (header[4] << 8) | header[5];
+		paddingLength = header[6];
+		if (header[0] != FCGI_VERSION_1 || gateway_need(up, FCGI_HEADER_SIZE + contentLength + paddingLength) != 0)
+		{
+			return -1;
+		}
+
+		// The buffer may have moved
+		header = (unsigned char *) up->inbuf + up->inpos;
+		up->inpos += FCGI_HEADER_SIZE + contentLength + paddingLength;
+		*data = (char *) header + FCGI_HEADER_SIZE;
+
+		switch (header[1])
+		{
+			case FCGI_STDOUT:
+				if (contentLength > 0)
+				{
+					return contentLength;
+				}
+				break;
+			case FCGI_STDERR:
+				while (contentLength > 0 && ((*data)[contentLength - 1] == '\n' || (*data)[contentLength - 1] == '\r'))
+				{
+					contentLength--;
+				}
+				if (contentLength > 0)
+				{
+					LOG_WARN("Thread %u: Backend: %.*s", (unsigned int) pthread_self(),
+							(int) (contentLength < 500 ? contentLength : 500), *data);
+				}
+				break;
+			case FCGI_END_REQUEST:
+				reply->ended = 1;
+				reply->complete = contentLength >= 5 && header[FCGI_HEADER_SIZE + 4] == FCGI_REQUEST_COMPLETE;
+				if (contentLength >= 5 && header[FCGI_HEADER_SIZE + 4] == FCGI_OVERLOADED)
+				{
+					return -1;
+				}
+				return 0;
+			default:
+				// Management records are not asked for, so there are none to answer
+				break;
+		}
+	}
+}
+
+/*
+ * Function: gateway_header_end
+ * ----------------------------
+ *   Finds the blank line that ends a CGI response header.
+ *
+ *	 Parameters:
+ *   header: The response so far
+ *   length: The length of the response so far
+ *
+ *   Returns: the first byte after the blank line, or NULL if the header
+ *   is not complete
+ */
+static char *gateway_header_end(char *header, size_t length)
+{
+	char *newline = header;
+
+	while ((newline = memchr(newline, '\n', header + length - newline)) != NULL)
+	{
+		newline++;
+		if (newline < header + length && *newline == '\n')
+		{
+			return newline + 1;
+		}
+		if (newline + 1 < header + length && newline[0] == '\r' && newline[1] == '\n')
+		{
+			return newline + 2;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: gateway_send_header
+ * ----------------------------
+ *   Turns a CGI response header into the HTTP one. The status comes from
+ *   the Status field, or is 302 for a Location alone and 200 otherwise.
+ *   A body without a Content-Length is chunked for an HTTP/1.1 client
+ *   and ends the connection of an HTTP/1.0 one.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   header: The CGI response header
+ *   end: The first byte after the header
+ *   head: Nonzero if the request was HEAD
+ *   framing: Set to BODY_NONE if no body is sent, BODY_CHUNKED if it is
+ *   chunked, or BODY_LENGTH if it is sent as it comes
+ *
+ *   Returns: 0 if successful, -1 if the client went away
+ */
+static int gateway_send_header(connection *c, char *header, char *end, int head, int *framing)
+{
+	char *line;
+	char *next;
+	char *status = NULL;
+	char *requestLine = memchr(c->inbuf, '\n', c->headerlen);
+	size_t statusLength = 0;
+	int hasLength = 0;
+	int hasLocation = 0;
+	int code;
+
+	// The status depends on fields that may come in any order
+	for (line = header; line < end && *line != '\r' && *line != '\n'; line = next + 1)
+	{
+		next = memchr(line, '\n', end - line);
+		if (!strncasecmp(line, "Status:", 7))
+		{
+			for (status = line + 7; *status == ' ' || *status == '\t'; status++)
+				;
+			statusLength = next - status - (next[-1] == '\r');
+		}
+		hasLength |= !strncasecmp(line, "Content-Length:", 15);
+		hasLocation |= !strncasecmp(line, "Location:", 9);
+	}
+
+	c->outlen = 0;
+	code = status != NULL ? atoi(status) : hasLocation ? 302 : 200;
+	if (code < 100 || code > 999 || (status != NULL && statusLength < 3))
+	{
+		code = 502;
+		status = NULL;
+	}
+	c->span.status = code;
+	connection_write(c, "HTTP/1.1 ", 9);
+	if (status != NULL)
+	{
+		connection_write(c, status, statusLength);
+		connection_write(c, statusLength == 3 ? " \r\n" : "\r\n", statusLength == 3 ? 3 : 2);
+	}
+	else
+	{
+		connection_write(c, code == 302 ? "302 Found\r\n" : code == 200 ? "200 OK\r\n" : "502 Bad Gateway\r\n",
+				code == 302 ? 11 : code == 200 ? 8 : 17);
+	}
+
+	// The fields the server frames the response with are its own
+	for (line = header; line < end && *line != '\r' && *line != '\n'; line = next + 1)
+	{
+		next = memchr(line, '\n', end - line);
+		if (!strncasecmp(line, "Status:", 7) || !strncasecmp(line, "Connection:", 11) ||
+				!strncasecmp(line, "Keep-Alive:", 11) || !strncasecmp(line, "Transfer-Encoding:", 18))
+		{
+			continue;
+		}
+		connection_write(c, line, next - line - (next[-1] == '\r'));
+		connection_write(c, "\r\n", 2);
+	}
+
+	if (head || code == 204 || code == 304 || code < 200)
+	{
+		*framing = BODY_NONE;
+	}
+	else if (hasLength || c->http2)
+	{
+		*framing = BODY_LENGTH;
+	}
+	else if (requestLine != NULL && memmem(c->inbuf, requestLine - c->inbuf, " HTTP/1.0", 9) != NULL)
+	{
+		// An HTTP/1.0 client cannot read chunks; the close ends the body
+		*framing = BODY_LENGTH;
+		c->keepAlive = 0;
+	}
+	else
+	{
+		*framing = BODY_CHUNKED;
+		connection_write(c, "Transfer-Encoding: chunked\r\n", 28);
+	}
+
+	if (connection_write(c, c->keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n",
+			c->keepAlive ? 26 : 21) != 0 || connection_flush(c) != 0)
+	{
+		c->keepAlive = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: gateway_relay
+ * ----------------------------
+ *   Reads a backend's CGI response and relays it to the client, each
+ *   piece sent as soon as it arrives.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   reply: The response being read
+ *   head: Nonzero if the request was HEAD
+ *
+ *   Returns: GATEWAY_DONE if the response was relayed or the client went
+ *   away, GATEWAY_FAILED if the backend failed before the header was
+ *   complete, or GATEWAY_BUSY if it refused the request
+ */
+static int gateway_relay(connection *c, gateway_reply *reply, int head)
+{
+	char *header = NULL;
+	char *end = NULL;
+	char *data;
+	char chunk[20];
+	size_t headerLength = 0;
+	ssize_t count;
+	int framing;
+	int size;
+
+	// The header may come in several pieces
+	while (end == NULL)
+	{
+		count = gateway_output(reply, &data);
+		if (count <= 0)
+		{
+			return reply->ended && !reply->complete ? GATEWAY_BUSY : GATEWAY_FAILED;
+		}
+		header = arena_append(&(c->requestArena), header, &headerLength, data, count);
+		if (header == NULL || headerLength > MAX_HEADER_SIZE)
+		{
+			return GATEWAY_FAILED;
+		}
+		end = gateway_header_end(header, headerLength);
+	}
+
+	// The wait for the header was the backend's; the client's deadline
+	// applies to the rest
+	connection_set_deadline(c, CONN_TIMER_RESPONSE);
+	if (gateway_send_header(c, header, end, head, &framing) != 0)
+	{
+		return GATEWAY_DONE;
+	}
+	LOG_DEBUG("Thread %u: Backend answered with %d", (unsigned int) pthread_self(), c->span.status);
+
+	// Whatever followed the header is the start of the body
+	data = end;
+	count = header + headerLength - end;
+	do
+	{
+		if (count > 0 && framing != BODY_NONE)
+		{
+			if (framing == BODY_CHUNKED)
+			{
+				size = sprintf(chunk, "%zx\r\n", (size_t) count);
+				connection_write(c, chunk, size);
+			}
+			connection_write(c, data, count);
+			if (framing == BODY_CHUNKED)
+			{
+				connection_write(c, "\r\n", 2);
+			}
+
+			// The backend is not read again until the client has this
+			if (connection_flush(c) != 0)
+			{
+				c->keepAlive = 0;
+				return GATEWAY_DONE;
+			}
+		}
+	} while ((count = gateway_output(reply, &data)) > 0);
+
+	// The client cannot be told the body is short, so its connection ends
+	if (count < 0)
+	{
+		c->keepAlive = 0;
+		return GATEWAY_DONE;
+	}
+	// The end of the response is sent by the worker once this returns
+	if (framing == BODY_CHUNKED)
+	{
+		connection_write(c, "0\r\n\r\n", 5);
+	}
+
+	return GATEWAY_DONE;
+}
+
+/*
+ * Function: gateway_exchange
+ * ----------------------------
+ *   Sends the client's request over a backend connection and relays the
+ *   response.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   up: The backend connection
+ *   route: The route of the backend
+ *   params: The CGI variables
+ *   paramsLength: The length of the variables
+ *   head: Nonzero if the request is HEAD
+ *   replayable: Nonzero if the request has no body, so it can be sent
+ *   again on another connection
+ *   reusable: Set to 1 if the connection can take another request
+ *
+ *   Returns: GATEWAY_DONE, GATEWAY_STALE if the connection turned out to
+ *   be closed before anything was received, GATEWAY_FAILED if the
+ *   backend failed before the response started, or GATEWAY_BUSY if it
+ *   refused the request; the client has been sent nothing in the last
+ *   three cases
+ */
+static int gateway_exchange(connection *c, connection *up, gateway_route *route, char *params,
+		size_t paramsLength, int head, int replayable, int *reusable)
+{
+	gateway_reply reply;
+	int result;
+
+	*reusable = 0;
+	memset(&reply, 0, sizeof(reply));
+	reply.up = up;
+	reply.protocol = route->protocol;
+
+	// The whole exchange is held to the response deadline
+	connection_set_deadline(up, CONN_TIMER_RESPONSE);
+	result = gateway_send_request(c, up, route->protocol, params, paramsLength);
+	if (result < 0)
+	{
+		LOG_INFO("Thread %u: Request body incomplete or invalid.", (unsigned int) pthread_self());
+		sendError(c, 400);
+		return GATEWAY_DONE;
+	}
+	if (result == GATEWAY_FAILED)
+	{
+		return replayable ? GATEWAY_STALE : GATEWAY_FAILED;
+	}
+
+	// The wait is bounded by the backend's deadline alone, so the client
+	// is still there to be told if the backend runs out of time
+	timer_cancel(&(c->timer));
+	result = gateway_relay(c, &reply, head);
+	connection_set_deadline(c, CONN_TIMER_RESPONSE);
+	if (result == GATEWAY_FAILED && replayable && up->bytesIn == 0 && !up->timedOut)
+	{
+		return GATEWAY_STALE;
+	}
+
+	*reusable = route->protocol == GATEWAY_FASTCGI && reply.ended && reply.complete && up->inpos == up->inlen;
+	return result;
+}
+
+/*
+ * Function: processGateway
+ * ----------------------------
+ *   Sends a request for a gateway path to its backend and relays the
+ *   response. An idle connection that turns out to have been closed is
+ *   replaced by a new one. The client is sent 502 if the backend cannot
+ *   be reached or fails, 503 if it is busy, and 504 if it does not
+ *   answer in time.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header
+ *
+ *   Returns: nothing
+ */
+void processGateway(connection *c)
+{
+	gateway_route *route = gateway_find(c);
+	connection *up;
+	char *params;
+	size_t paramsLength;
+	int head = !strncmp(c->inbuf, "HEAD ", 5);
+	int replayable;
+	int reused;
+	int reusable;
+	int retried = 0;
+	int result;
+	int status;
+	int fd;
+
+	// Only a request that says it has a body has one, and the backend
+	// must be told its length up front
+	c->bodyMode = BODY_NONE;
+	if (connection_header(c, "Transfer-Encoding") != NULL || connection_header(c, "Content-Length") != NULL)
+	{
+		status = body_reader_init(c);
+		if (status == 0 && c->bodyMode == BODY_CHUNKED)
+		{
+			status = 411;
+		}
+		if (status != 0)
+		{
+			LOG_INFO("Thread %u: Request body refused with status %i.", (unsigned int) pthread_self(), status);
+			c->keepAlive = 0;
+			sendError(c, status);
+			return;
+		}
+	}
+
+	replayable = c->bodyMode == BODY_NONE || c->bodyRemaining == 0;
+
+	params = gateway_params(c, route, &paramsLength);
+	if (params == NULL)
+	{
+		LOG_INFO("Thread %u: Invalid path for the backend.", (unsigned int) pthread_self());
+		sendError(c, 400);
+		return;
+	}
+
+	// An idle connection the backend had already closed is replaced, but
+	// only once, since a request that ends its worker would end the next
+	do
+	{
+		fd = gateway_connect(route, &reused);
+		if (fd < 0)
+		{
+			LOG_WARN("Thread %u: %s backend on %s %s.", (unsigned int) pthread_self(),
+					route->protocol == GATEWAY_FASTCGI ? "FastCGI" : "SCGI", route->address.sun_path,
+					fd == -1 ? "cannot be reached" : "had no free connection in time");
+			sendError(c, fd == -1 ? 502 : 503);
+			return;
+		}
+
+		up = connection_acquire(&contexts, fd);
+		if (up == NULL)
+		{
+			gateway_release(route, fd, 0);
+			sendError(c, 500);
+			return;
+		}
+		PROBE2(gateway, c->sockfd, fd);
+
+		result = gateway_exchange(c, up, route, params, paramsLength, head, replayable, &reusable);
+		status = up->timedOut ? 504 : result == GATEWAY_BUSY ? 503 : 502;
+
+		// The deadline must be off before the socket is kept or closed
+		timer_cancel(&(up->timer));
+		up->sockfd = -1;
+		connection_release(&contexts, up);
+		gateway_release(route, fd, result == GATEWAY_DONE && reusable);
+	} while (result == GATEWAY_STALE && reused && !retried++);
+
+	if (result != GATEWAY_DONE)
+	{
+		LOG_WARN("Thread %u: No response from the backend%s.", (unsigned int) pthread_self(),
+				status == 504 ? " in time" : status == 503 ? "; it is overloaded" : "");
+		sendError(c, status);
+	}
+}
@@ -43,3 +43,26 @@ void getTimestamp2(char *timestamp)
 	strncpy(timestamp, timebuff, sizeof(timebuff));
 
 }
+
+/*
+ * Returns the current time for a Date header, in the same format as
+ * getTimestamp2. The string only changes once a second, so each thread
+ * keeps the last one it made and reuses it until the second changes.
+ * The buffer must hold at least 30 characters.
+ */
+void getHttpDate(char *timestamp)
+{
+	static __thread time_t cachedSecond = 0;
+	static __thread char cachedDate[30];
+	struct tm parts;
+	time_t now;
+
+	now = time((time_t*) 0);
+	if (now != cachedSecond)
+	{
+		strftime(cachedDate, sizeof(cachedDate), RFC1123FMT, gmtime_r(&now, &parts));
+		cachedSecond = now;
+	}
+
+	memcpy(timestamp, cachedDate, sizeof(cachedDate));
+}
@@ -12,6 +12,100 @@
 
 #include "headerfile.h"
 
+/*
+ * Function: isKeepAlive
+ * ----------------------------
+ *   Determines if the client wants the connection kept open after the
+ *   response. HTTP/1.1 connections persist unless the client sends
+ *   "Connection: close"; HTTP/1.0 connections persist only if the client
+ *   sends "Connection: keep-alive".
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header.
+ *
+ *   Returns: 1 if the connection should be kept open, 0 otherwise
+ */
+static int isKeepAlive(connection *conn)
+{
+	char *line = memchr(conn->inbuf, '\n', conn->headerlen);	// end of the request line
+	char *connectionHeader;
+	int result;
+
+	result = (line != NULL && memmem(conn->inbuf, line - conn->inbuf, " HTTP/1.1", 9) != NULL);
+
+	connectionHeader = connection_header(conn, "Connection");
+	if (connectionHeader != NULL)
+	{
+		if (!strncasecmp(connectionHeader, "close", 5))
+		{
+			result = 0;
+		}
+		else if (!strncasecmp(connectionHeader, "keep-alive", 10))
+		{
+			result = 1;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Function: dispatchRequest
+ * ----------------------------
+ *   Passes a parsed request to the handler for its method, or answers it
+ *   with an error if the method is not supported.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header.
+ *
+ *   Returns: nothing
+ */
+void dispatchRequest(connection *c)
+{
+	// Check for a valid request method is being used
+	if (trace_requested(c))
+	{
+		LOG_DEBUG("Thread %u: Sending the request trace", (unsigned int) pthread_self());
+		trace_send(c);
+	}
+	else if (proxy_requested(c))
+	{
+		// Paths served by upstream servers take any method
+		LOG_DEBUG("Thread %u: Processing proxied request", (unsigned int) pthread_self());
+		processProxy(c);
+	}
+	else if (gateway_requested(c))
+	{
+		// Paths served by FastCGI and SCGI backends take any method
+		LOG_DEBUG("Thread %u: Processing gateway request", (unsigned int) pthread_self());
+		processGateway(c);
+	}
+	else if (!strncmp(c->inbuf, "GET ", 4))
+	{
+		// Log GET request, check formatting of request, call process method
+		LOG_DEBUG("Thread %u: Processing GET request", (unsigned int) pthread_self());
+		processGet(c);
+	}
+	else if (!strncmp(c->inbuf, "HEAD ", 5))
+	{
+		// Log HEAD request, check formatting of request, call process method
+		LOG_DEBUG("Thread %u: Processing HEAD request", (unsigned int) pthread_self());
+		processHead(c);
+	}
+	else if (!strncmp(c->inbuf, "POST ", 5))
+	{
+		// Log POST request, check formatting of request, call process method
+		LOG_DEBUG("Thread %u: Processing POST request", (unsigned int) pthread_self());
+		processPost(c);
+	}
+	else
+	{
+		// Log invalid HTTP request, send error
+		LOG_WARN("Invalid HTTP request method submitted");
+		sendError(c, 405);
+	}
+}
+
 /*
  * Function: router
  * ----------------------------
@@ -20,77 +114,112 @@
  *   based on the method being used in the request.
  *
  *	 Parameters:
- *   sockfd: The socket identifier of the active connection.
+ *   conn: The connection context of the active connection.
  *
  *   Returns: nothing
  */
-void *router(void *socket)
+void *router(void *conn)
 {
-	char logbuff[300];
-	int sockfd = (int) socket;
+	connection *c = (connection *) conn;
+	int result;		// Result of reading the request header
+
+	c->keepAlive = 0;
 
-	// Variables
-	long buffer_bytes;	// Number of bytes in the buffer
-	static char buffer[BUFSIZE + 1];	// Buffer to hold request string
+	// Receive the request header into the connection's input buffer
+	result = connection_read_header(c);
 
-	// Receive the request information, place into buffer
+	// An idle keep-alive connection closing or timing out is not an error
+	if (result != CONN_OK && c->requests > 0 && c->inlen == 0)
+	{
+		return 0;
+	}
 
-	buffer_bytes = recv(sockfd, buffer, BUFSIZE, 0);
+	// A client that ran out its deadline has had its socket shut down
+	if (result == CONN_ERR_TIMEOUT)
+	{
+		LOG_INFO("Thread %u: Connection timed out reading the request", (unsigned int) pthread_self());
+		c->state = CONN_DONE;
+		return 0;
+	}
 
+	// Nothing can be sent to a client that failed the TLS handshake or
+	// closed its end of the connection
+	if (result == CONN_ERR_TLS || result == CONN_ERR_CLOSED)
+	{
+		c->state = CONN_DONE;
+		return 0;
+	}
 
-	// Check that the request is not empty and that the BUFSIZE has not been exceeded
-	if (buffer_bytes <= 0 || buffer_bytes > BUFSIZE)
+	// Check that the header size has not been exceeded
+	if (result != CONN_OK)
 	{
 		// Log error, send error
-		if (buffer_bytes <= 0)
-		{
-			logger("Buffer size is <= 0");
-		}
+		LOG_WARN("Buffer is larger than allowed buffer size");
+		sendError(c, 400);
+		c->state = CONN_DONE;
+		return 0;
+	}
 
-		if (buffer_bytes > BUFSIZE)
+	// A request over the Unix socket is logged with the process that sent it
+	if (c->local)
+	{
+		if (c->requests == 1)
 		{
-			logger("Buffer is larger than allowed buffer size");
+			struct ucred peer;
+			socklen_t peerLength = sizeof(peer);
+			if (getsockopt(c->sockfd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) != 0)
+			{
+				peer.pid = -1;
+				peer.uid = (uid_t) -1;
+				peer.gid = (gid_t) -1;
+			}
+			c->peerPid = peer.pid;
+			c->peerUid = peer.uid;
+			c->peerGid = peer.gid;
 		}
-		sendError(sockfd, 400);
-		pthread_exit(NULL);
-		return 0;
+		LOG_INFO_SAMPLED("Thread %u: Request on Unix socket %i from pid %d, uid %d, gid %d", (unsigned int) pthread_self(),
+				c->sockfd, (int) c->peerPid, (int) c->peerUid, (int) c->peerGid);
 	}
 
-	// Check for a valid request method is being used
-	if (!strncmp(buffer, "GET ", 4))
+	// An HTTP/2 connection is served by its session until it closes
+	if (http2_start(c))
 	{
-		// Log GET request, check formatting of request, call process method
-		sprintf(logbuff, "Thread %u: Processing GET request", (unsigned int) pthread_self());
-		logger(logbuff);
-		processGet(sockfd, buffer);
-		bzero(buffer, BUFSIZE);
+		c->state = CONN_DONE;
 		return 0;
 	}
-	else if (!strncmp(buffer, "HEAD ", 5))
+
+	// The first request was charged when the connection was accepted
+	if (c->requests > 1 && rate_limit_request(&(c->limits)) != 0)
 	{
-		// Log HEAD request, check formatting of request, call process method
-		sprintf(logbuff, "Thread %u: Processing HEAD request", (unsigned int) pthread_self());
-		logger(logbuff);
-		processGet(sockfd, buffer);
-		bzero(buffer, BUFSIZE);
+		PROBE2(ratelimit, c->sockfd, 0);
+		sendError(c, 429);
+		c->state = CONN_DONE;
 		return 0;
 	}
-	else if (!strncmp(buffer, "POST ", 5))
+
+	trace_request(c);
+	PROBE2(request, c->sockfd, c->span.request);
+
+	// GET, HEAD and POST requests can be kept alive. Proxied and gateway
+	// requests frame their responses themselves. A draining server
+	// closes each connection after its response.
+	c->keepAlive = (!strncmp(c->inbuf, "GET ", 4) || !strncmp(c->inbuf, "HEAD ", 5) || !strncmp(c->inbuf, "POST ", 5)
+			|| proxy_requested(c) || gateway_requested(c)) && isKeepAlive(c) && !server_draining();
+
+	// The GET and HEAD handlers never read a body, so one sent with them
+	// would be parsed as the next request; the connection closes instead
+	if ((!strncmp(c->inbuf, "GET ", 4) || !strncmp(c->inbuf, "HEAD ", 5)) && !proxy_requested(c) && !gateway_requested(c)
+			&& (connection_header(c, "Content-Length") != NULL || connection_header(c, "Transfer-Encoding") != NULL))
 	{
-		// Log POST request, check formatting of request, call process method
-		sprintf(logbuff, "Thread %u: Processing POST request", (unsigned int) pthread_self());
-		logger(logbuff);
-		logger("Processing POST request");
-		processPost(sockfd, buffer);
-		bzero(buffer, BUFSIZE);
-		return 0;
+		c->keepAlive = 0;
 	}
-	else
+
+	dispatchRequest(c);
+
+	// A file still streaming is finished by the worker
+	if (c->state != CONN_SENDING)
 	{
-		// Log invalid HTTP request, send error
-		logger("Invalid HTTP request method submitted");
-		sendError(sockfd, 405);
-		pthread_exit(NULL);
-		return 0;
+		c->state = CONN_DONE;
 	}
+	return 0;
 }
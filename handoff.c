@@ -0,0 +1,290 @@
+/*
+ * handoff.c
+ *
+ * Contains the listening socket handoff used to upgrade the server
+ * without dropping connections. A server with a handoff socket
+ * configured listens on that Unix socket. A new server started with the
+ * same configuration connects to it first, and the running server passes
+ * its listening socket across with SCM_RIGHTS and then drains. The
+ * listening socket stays open throughout, so connections waiting in its
+ * backlog are accepted by the new server instead of being refused.
+ *
+ * Only a process running as the same user is given the socket.
+ */
+
+#include "headerfile.h"
+#include <sys/un.h>
+
+#define HANDOFF_TIMEOUT 5 // seconds a new server waits for the socket
+
+/*
+ * Struct that holds the handoff socket and the listening socket it
+ * passes on.
+ */
+static struct {
+	int fd;					// the handoff socket, or -1
+	int listenersocket;		// the socket passed to a new server
+	int handedOff;			// set once a new server has taken the socket
+	struct sockaddr_un address;
+	pthread_t thread;
+} handoff = { .fd = -1, .listenersocket = -1 };
+
+/*
+ * Function prototypes for the handoff.c file
+ */
+static int handoff_address(const char *path, struct sockaddr_un *address);
+static void *handoff_thread(void *arg);
+
+/*
+ * Function: handoff_address
+ * ----------------------------
+ *   Fills in the address of a handoff socket.
+ *
+ *	 Parameters:
+ *   path: The handoff socket's path
+ *   address: The address to fill in
+ *
+ *   Returns: 0 if successful, -1 if the path is too long
+ */
+static int handoff_address(const char *path, struct sockaddr_un *address)
+{
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path))
+	{
+		logger("The handoff socket path is too long.");
+		return -1;
+	}
+	strcpy(address->sun_path, path);
+	return 0;
+}
+
+/*
+ * Function: handoff_receive
+ * ----------------------------
+ *   Asks a running server for its listening socket.
+ *
+ *	 Parameters:
+ *   path: The handoff socket's path
+ *
+ *   Returns: the listening socket, or -1 if no server handed one over
+ */
+int handoff_receive(const char *path)
+{
+	struct sockaddr_un address;
+	struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr message;
+	struct cmsghdr *header;
+	struct iovec part;
+	char byte;
+	int listening = 0;
+	int listenersocket = -1;
+	int fd;
+	socklen_t length = sizeof(listening);
+
+	if (handoff_address(path, &address) != 0)
+	{
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	// No server is running if nothing answers
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	part.iov_base = &byte;
+	part.iov_len = 1;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &part;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) == 1)
+	{
+		header = CMSG_FIRSTHDR(&message);
+		if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+				header->cmsg_len == CMSG_LEN(sizeof(int)))
+		{
+			memcpy(&listenersocket, CMSG_DATA(header), sizeof(int));
+		}
+	}
+	close(fd);
+
+	// Anything but a listening socket is of no use
+	if (listenersocket >= 0 && (getsockopt(listenersocket, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) != 0 || !listening))
+	{
+		close(listenersocket);
+		listenersocket = -1;
+	}
+
+	if (listenersocket < 0)
+	{
+		logger("A server answered on the handoff socket but passed no listening socket.");
+	}
+
+	return listenersocket;
+}
+
+/*
+ * Function: handoff_start
+ * ----------------------------
+ *   Listens on the handoff socket, replacing any socket left at its path
+ *   by the server this one took over from.
+ *
+ *	 Parameters:
+ *   path: The handoff socket's path
+ *   listenersocket: The listening socket to pass on
+ *
+ *   Returns: 0 if successful, -1 otherwise
+ */
+int handoff_start(const char *path, int listenersocket)
+{
+	if (handoff_address(path, &(handoff.address)) != 0)
+	{
+		return -1;
+	}
+
+	handoff.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (handoff.fd < 0)
+	{
+		logger("Unable to create the handoff socket.");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(handoff.fd, (struct sockaddr *) &(handoff.address), sizeof(handoff.address)) != 0 ||
+			chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(handoff.fd, 1) != 0)
+	{
+		logger("Unable to listen on the handoff socket.");
+		close(handoff.fd);
+		handoff.fd = -1;
+		return -1;
+	}
+
+	handoff.listenersocket = listenersocket;
+	if (pthread_create(&(handoff.thread), NULL, handoff_thread, NULL) != 0)
+	{
+		logger("Unable to start the handoff thread.");
+		close(handoff.fd);
+		handoff.fd = -1;
+		unlink(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: handoff_stop
+ * ----------------------------
+ *   Stops listening on the handoff socket. Its path is removed unless a
+ *   new server has already taken it over.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void handoff_stop()
+{
+	if (handoff.fd < 0)
+	{
+		return;
+	}
+
+	// Wakes the handoff thread from accept()
+	shutdown(handoff.fd, SHUT_RDWR);
+	pthread_join(handoff.thread, NULL);
+
+	if (!handoff.handedOff)
+	{
+		unlink(handoff.address.sun_path);
+	}
+	close(handoff.fd);
+	handoff.fd = -1;
+}
+
+/*
+ * Function: handoff_thread
+ * ----------------------------
+ *   Waits for a new server on the handoff socket, passes it the
+ *   listening socket, and starts the drain.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *
+ *   Returns: nothing
+ */
+static void *handoff_thread(void *arg)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr message;
+	struct cmsghdr *header;
+	struct iovec part;
+	struct ucred peer;
+	socklen_t length;
+	char byte = 'L';
+	char logbuff[BUFSIZE];
+	int client;
+
+	for (;;)
+	{
+		client = accept4(handoff.fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			break;
+		}
+
+		length = sizeof(peer);
+		if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 || peer.uid != getuid())
+		{
+			logger("Refused a handoff to a process running as another user.");
+			close(client);
+			continue;
+		}
+
+		part.iov_base = &byte;
+		part.iov_len = 1;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &part;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(header), &(handoff.listenersocket), sizeof(int));
+
+		if (sendmsg(client, &message, MSG_NOSIGNAL) != 1)
+		{
+			logger("Unable to pass the listening socket to the new server.");
+			close(client);
+			continue;
+		}
+		close(client);
+
+		sprintf(logbuff, "Listening socket passed to the new server (pid %d); draining.", (int) peer.pid);
+		logger(logbuff);
+		handoff.handedOff = 1;
+		server_drain();
+		break;
+	}
+
+	return NULL;
+}
@@ -7,6 +7,8 @@
 #ifndef HEADERFILE_H_
 #define HEADERFILE_H_
 
+#define _GNU_SOURCE // for get_current_dir_name() and memmem()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -16,20 +18,40 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <time.h>
 
 #define BUFSIZE 8096 /* default buffer size */
-#define LISTENER_QUEUE_SIZE 64 /* default listener queue size */
+#define LISTENER_QUEUE_SIZE 64 /* listener queue size of the gateway sockets */
+#define DEFAULT_LISTEN_BACKLOG 4096 /* default listener queue size, capped by net.core.somaxconn */
+#define ACCEPT_BATCH 64 /* connections accepted per wakeup before checking for a drain */
+#define ACCEPT_RETRY_DELAY 10 /* milliseconds the listener waits for room in a full queue */
 #define DEFAULT_CONFIG_FILE "config.txt" // default config file name
 #define DEFAULT_PORT 5555 /* default port */
 #define DEFAULT_DIR "c:/webserver/home" /* default directory */
 #define CMD_LINE_ARG_MAX 4 /* maximum number of command line arguments */
+#define PACK_OPTION "-pack" /* first argument to pack the home directory into a bundle */
 #define CMD_LINE_ERR 2 /* command line error code */
 #define DIR_ERR 3 // home directory error
 #define SOCKET_ERR 3 /* socket error code */
-#define MAX_GET_REQUEST_SIZE 10000000 /* max size of a file that can be returned from a GET */
+#define MAX_GET_REQUEST_SIZE 10000000 /* max size of a form template that can be returned from a GET */
+#define STREAM_CHUNK_SIZE (256 * 1024) /* bytes handed to sendfile() per call when streaming a file */
+#define STREAM_SLICE_SIZE (8 * 1024 * 1024) /* bytes streamed before a transfer yields to waiting connections */
+#define SCHED_BULK_SHARE 4 /* turns in which the bulk lane is served once while both lanes wait */
+#define LANE_INTERACTIVE 0 // queue lane of new connections and those back for another request
+#define LANE_BULK 1 // queue lane of file transfers put back between slices
+#define SENDER_MAX_EVENTS 64 /* sockets the sender handles per wakeup */
+#define COROUTINE_STACK_SIZE (256 * 1024) /* stack of each connection's coroutine, guard page included */
+#define COROUTINE_MAX 1024 /* connections a worker serves at once before it leaves the queue to others */
+#define COROUTINE_POOL_MAX 64 /* finished coroutines' stacks a worker keeps for reuse */
+#define COROUTINE_MAX_EVENTS 64 /* socket events a worker handles per wakeup */
+#define COROUTINE_MAX_WAIT 4 /* descriptors one coroutine can wait on at once */
 #define NV_DELIMITER '=' // name/value pair delimiter
 #define ET_DELIMITER '&' // extension/type delimiter
 #define FILETYPES_ARRAY_SIZE 100 // max elements in filetypes array
@@ -40,8 +62,337 @@
 #define DEFAULT_START "index.html"	//default page to open if none provided
 #define MAX_THREADS 5	// number of threads to start in thread pool
 #define QUEUE_SIZE  20  //number of waiting connections allowed in the queue
+#define CONN_BUF_INITIAL 1024 // starting size of a connection's input and output buffers
+#define MAX_HEADER_SIZE 65536 // largest request header a connection will buffer
+#define CONN_POOL_MAX 64 // idle connection objects kept on each worker's free list
+
+#define TIMER_TICK_MS 100 // resolution of the timer wheel
+#define TIMER_WHEEL_BITS 6 // log2 of the slots per wheel level
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS) // slots per wheel level
+#define TIMER_WHEEL_LEVELS 4 // wheel levels, covering about 19 days at 100ms ticks
+#define DEFAULT_HEADER_TIMEOUT 10 // seconds allowed to receive a request header
+#define DEFAULT_BODY_TIMEOUT 30 // seconds allowed between pieces of a request body
+#define DEFAULT_KEEPALIVE_TIMEOUT 5 // seconds an idle keep-alive connection is held
+#define DEFAULT_RESPONSE_TIMEOUT 300 // seconds allowed to produce and send a response
+#define DEFAULT_MAX_BODY_SIZE 1048576 // largest request body accepted, in bytes
+#define ARENA_BLOCK_SIZE 2048 // size of each block in a request arena
+#define ARENA_ALIGN 16 // alignment of arena allocations
+#define FILE_CACHE_BUCKETS 1024 // hash buckets in the open file cache, a power of two
+#define DEFAULT_FILE_CACHE_SIZE 1000 // open files kept in the cache
+#define DEFAULT_FILE_CACHE_VALID 60 // seconds a cached file is trusted before it is checked again
+#define MAX_ERROR_PAGE_SIZE 65536 // largest custom error page loaded from the config file
+#define DEFAULT_NEGATIVE_CACHE_SIZE 4096 // slots for missing paths and extensions without a type
+#define DEFAULT_DOCROOT_INDEX_SIZE 100000 // most files the home directory index will hold
+#define DEFAULT_DRAIN_TIMEOUT 30 // seconds in-flight requests are given to finish on SIGTERM or SIGQUIT
+#define DEFAULT_TRACE_RING_SIZE 1024 // recent requests kept in the request trace
+#define DEFAULT_SLOW_REQUEST 1000 // milliseconds after which a request is kept as a slow one
+#define DEFAULT_TLS_SESSION_CACHE 20480 // TLS sessions kept for resumption
+#define DEFAULT_HTTP2 1 // HTTP/2 is offered unless the config file turns it off
+#define DEFAULT_TCP_NODELAY 1 // responses are sent without waiting for Nagle's algorithm
+#define DEFAULT_TCP_NOPUSH 1 // a header is held back to share a packet with the file after it
+#define DEFAULT_UNIX_SOCKET_MODE 0660 // permissions of the Unix socket file
+#define DEFAULT_LARGE_RESPONSE (1024 * 1024) // bytes from which a file is streamed by the sender
+#define H2_MAX_STREAMS 100 // streams an HTTP/2 client may have open at once
+#define H2_FRAME_SIZE 16384 // largest HTTP/2 frame payload received (the protocol default)
+#define H2_WINDOW 65535 // HTTP/2 flow control window given to clients (the protocol default)
+#define HPACK_TABLE_SIZE 4096 // HPACK dynamic table size in each direction (the protocol default)
+#define PROXY_MAX_ROUTES 16 // path prefixes that can be sent to upstream servers
+#define PROXY_MAX_UPSTREAMS 32 // upstream servers across every route
+#define PROXY_NAME_SIZE 256 // longest path prefix or upstream host:port
+#define PROXY_POOL_SIZE 16 // idle keep-alive connections kept to each upstream server
+#define PROXY_CONNECT_TIMEOUT 5 // seconds allowed to connect to an upstream server
+#define PROXY_HEALTH_INTERVAL 5 // seconds between health checks of the upstream servers
+#define PROXY_SPARE_PIPES 8 // empty splice() pipes each worker keeps for reuse
+#define GATEWAY_MAX_ROUTES 16 // path prefixes that can be sent to FastCGI or SCGI backends
+#define GATEWAY_MAX_WORKERS 64 // worker processes spawned for one backend
+#define GATEWAY_CONNECTIONS 16 // connections kept to a backend whose workers run elsewhere
+#define GATEWAY_RESPAWN_DELAY 1 // seconds before a worker that exited is started again
+#define GATEWAY_RETRY_MS 10 // milliseconds a coroutine waits before looking for a free backend connection again
+#define RATE_SHARDS 64 // lock stripes in the rate limiter's table, a power of two
+#define RATE_SHARD_SIZE 512 // client and network buckets in each stripe, a power of two
+#define RATE_PROBE 8 // slots searched for a bucket before the table counts as full
+#define RATE_MAX_RULES 32 // networks that can be given limits of their own
+
+// Gateway protocols spoken to dynamic page backends
+#define GATEWAY_FASTCGI 1
+#define GATEWAY_SCGI 2
+
+// Request phases timed by the request trace
+#define SPAN_ACCEPT 0 // accepted by the listener
+#define SPAN_ENQUEUE 1 // put on the thread pool queue
+#define SPAN_DEQUEUE 2 // taken from the queue by a worker
+#define SPAN_PARSED 3 // request header received and parsed
+#define SPAN_OPENED 4 // file opened and sized
+#define SPAN_HEADERS 5 // response header sent
+#define SPAN_DONE 6 // response complete
+#define SPAN_PHASES 7
+#define SPAN_REQUEST_SIZE 80 // bytes of the request line kept in a span
+
+// Log levels, from the most to the least severe
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5
+#define DEFAULT_LOG_LEVEL LOG_LEVEL_INFO // level logged unless the config file sets one
+#define DEFAULT_LOG_SAMPLE 1 // sampled info lines logged one in this many times
+
+// Most verbose level compiled in. Build with -DLOG_COMPILE_LEVEL=3 to
+// leave out every debug and trace call, arguments and all.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+#define FILE_WATCHER_MAX_SUBSCRIBERS 8 // caches that can be told about changes in the home directory
+#define CONFIG_MAX_READERS (MAX_THREADS * (COROUTINE_MAX + 1) + 8) // threads and coroutines that can read a reloadable configuration
+#define CONFIG_REAP_INTERVAL 1 // seconds between tries to free a replaced configuration still in use
+
+// Negative cache entry kinds
+#define NEGATIVE_MISSING 1 // a resource path that was not found
+#define NEGATIVE_TYPE 2 // a file extension with no MIME type
+
+// Request body framing
+#define BODY_NONE 0 // no body, or the body has been read
+#define BODY_LENGTH 1 // body length given by Content-Length
+#define BODY_CHUNKED 2 // body sent with Transfer-Encoding: chunked
+#define BODY_CLOSE 3 // response body that ends when the peer closes the connection
+
+// Chunked body parser states
+#define CHUNK_SIZE 0 // reading the hex chunk size
+#define CHUNK_EXTENSION 1 // skipping chunk extensions to the end of the line
+#define CHUNK_DATA 2 // reading chunk data
+#define CHUNK_DATA_END 3 // reading the CRLF after chunk data
+#define CHUNK_TRAILER 4 // skipping trailer fields after the last chunk
+#define CHUNK_DONE 5 // the body is complete
+#define CHUNK_SIZE_START 6 // reading the first digit of the hex chunk size
+
+// Connection deadlines
+#define CONN_TIMER_HEADER 0 // header-read deadline
+#define CONN_TIMER_BODY 1 // body-read deadline
+#define CONN_TIMER_KEEPALIVE 2 // keep-alive idle deadline
+#define CONN_TIMER_RESPONSE 3 // total-response deadline
+
+// Connection parser states
+#define CONN_IDLE 0 // on a free list, not attached to a socket
+#define CONN_READING_HEADER 1 // receiving the request header
+#define CONN_PROCESSING 2 // header received, request being handled
+#define CONN_DONE 3 // response sent, ready to be released
+#define CONN_SENDING 4 // sending queued output and any file, may be requeued between slices
+
+// Return codes from connection_read_header
+#define CONN_OK 0
+#define CONN_ERR_CLOSED -1 // peer closed the connection or a socket error occurred
+#define CONN_ERR_TOO_LARGE -2 // header did not fit in MAX_HEADER_SIZE
+#define CONN_ERR_TIMEOUT -3 // a connection deadline passed
+#define CONN_ERR_TLS -4 // the TLS handshake failed
+
+// Results of connection_send_file, a turn at sending a response
+#define SEND_DONE 0 // the whole response was sent
+#define SEND_BLOCKED 1 // the socket is full; wait until it can take more
+#define SEND_YIELDED 2 // a slice was sent; other transfers go next
+#define SEND_FAILED -1 // the client went away or the file could not be read
 
 typedef struct threadpool threadpool;
+typedef struct bundle_entry bundle_entry;
+typedef struct server_config server_config;
+
+// Define type of struct for a timer wheel entry
+typedef struct timer_node {
+	struct timer_node *next;	// slot list links, NULL when not armed
+	struct timer_node *prev;
+	unsigned long long expires;	// tick at which the timer fires
+	void (*callback)(void *);	// called on the timer thread when it fires
+	void *arg;					// argument for the callback
+	} timer_node;
+
+// Define type of struct for the phase times of one request
+typedef struct request_span {
+	unsigned long long at[SPAN_PHASES];	// monotonic nanoseconds at each phase, 0 if not reached
+	unsigned int thread;				// the worker that finished the request
+	int status;							// the response status
+	char request[SPAN_REQUEST_SIZE];	// method and path
+	} request_span;
+
+// Define type of struct for the limits given to a network by the config file
+typedef struct rate_rule {
+	unsigned int network;	// the network's address, host order
+	unsigned int mask;		// the network's mask, host order
+	int prefixLength;		// the length of the mask
+	int rate;				// requests per second from the whole network, 0 for no limit
+	int burst;				// requests the network may make at once
+	int connections;		// connections the network may hold open, 0 for no limit
+	} rate_rule;
+
+// Define type of struct for the server settings read from the config file
+typedef struct server_settings {
+	int headerTimeout;		// seconds to receive a request header
+	int bodyTimeout;		// seconds between pieces of a request body
+	int keepaliveTimeout;	// seconds an idle keep-alive connection is held
+	int responseTimeout;	// seconds to produce and send a response
+	long long maxBodySize;	// largest request body accepted
+	int fileCacheSize;		// open files kept in the cache, 0 to disable it
+	int fileCacheValid;		// seconds a cached file is trusted before it is checked again
+	int negativeCacheSize;	// slots in the negative lookup cache, 0 to disable it
+	int docrootIndexSize;	// most files in the home directory index, 0 to disable it
+	char bundle[BUFSIZE];	// bundle to serve files from, or empty to serve the home directory
+	int drainTimeout;		// seconds in-flight requests are given to finish when stopping
+	char handoff[BUFSIZE];	// Unix socket the listening socket is passed over, or empty
+	int logLevel;			// most verbose level logged, LOG_LEVEL_ERROR to LOG_LEVEL_TRACE
+	int logSample;			// sampled info lines are logged one in this many times
+	int traceRingSize;		// recent requests kept in the request trace, 0 to disable it
+	int slowRequest;		// milliseconds after which a request is kept as a slow one
+	char traceEndpoint[BUFSIZE];	// path local clients get the request trace from, or empty
+	char tlsCertificate[BUFSIZE];	// PEM certificate chain to serve TLS with, or empty for plaintext
+	char tlsKey[BUFSIZE];	// PEM private key, or empty if it is in the certificate file
+	int tlsSessionCache;	// TLS sessions kept for resumption
+	int http2;				// nonzero to offer HTTP/2 through ALPN, the preface or h2c upgrades
+	char proxyHealth[BUFSIZE];	// path upstream servers are checked at, or empty to only connect
+	int rateLimit;			// requests per second from one client, 0 for no limit
+	int rateBurst;			// requests one client may make at once
+	int connLimit;			// connections one client may hold open, 0 for no limit
+	rate_rule rateRules[RATE_MAX_RULES];	// networks with limits of their own
+	int rateRuleCount;
+	int listenBacklog;		// connections the kernel queues before they are accepted
+	int deferAccept;		// seconds a connection may wait for its first data before it is accepted, 0 to accept at once
+	int fastOpen;			// TCP Fast Open requests queued, 0 to turn it off
+	int tcpNoDelay;			// nonzero to turn off Nagle's algorithm on client sockets
+	int tcpNoPush;			// nonzero to send a file's header in the same packet as its first bytes
+	int busyPoll;			// microseconds a read busy polls the device queue, 0 to turn it off
+	int tcpListen;			// nonzero to listen on the TCP port
+	char unixSocket[BUFSIZE];	// Unix socket to listen on, @name for the abstract namespace, or empty
+	int unixSocketMode;		// permissions of the Unix socket file
+	long long largeResponse;	// bytes from which a file goes straight to the sender, 0 to start every file on its worker
+	} server_settings;
+
+// Define type of struct for an HPACK dynamic table entry
+typedef struct hpack_field {
+	char *name;				// the name followed by the value, in one allocation
+	size_t nameLength;
+	size_t valueLength;
+	} hpack_field;
+
+// Define type of struct for an HPACK dynamic table
+typedef struct hpack_table {
+	hpack_field *fields;	// ring of entries
+	int capacity;			// slots in the ring, enough for the largest table
+	int newest;				// slot of the most recent entry
+	int count;				// entries held
+	size_t size;			// size of the entries as HPACK counts it
+	size_t maxSize;			// size the table is held to
+	size_t limit;			// largest size the table may be given
+	size_t lowest;			// smallest size since the last header block
+	int resized;			// set when a size change must be announced
+	} hpack_table;
+
+// Function given each decoded header field
+typedef void (*hpack_emit)(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength);
+
+// Define type of struct for an open file cache entry
+typedef struct file_cache_entry {
+	char *path;				// the resource path
+	unsigned long hash;		// hash of the path
+	int fd;					// the open file, shared by every request using it
+	off_t size;				// file size from fstat()
+	time_t mtime;			// modification time from fstat()
+	ino_t ino;				// inode from fstat()
+	dev_t dev;				// device from fstat()
+	time_t validUntil;		// monotonic time after which the file is checked again
+	int refs;				// requests holding the entry
+	int cached;				// nonzero while the entry is in the cache
+	struct file_cache_entry *hashNext;	// hash bucket link
+	struct file_cache_entry *lruPrev;	// least recently used list links
+	struct file_cache_entry *lruNext;
+	} file_cache_entry;
+
+// Define type of struct for a block of arena memory
+typedef struct arena_block {
+	struct arena_block *next;	// the previously allocated block
+	size_t size;				// bytes available in data
+	size_t used;				// bytes handed out from data
+	char data[];
+	} arena_block;
+
+// Define type of struct for a per-request bump allocator
+typedef struct arena {
+	arena_block *head;		// the block allocations come from
+	char *last;				// the most recent allocation
+	} arena;
+
+// Define type of struct for a decoded form field
+typedef struct form_field {
+	char *name;				// decoded, null terminated name
+	size_t nameLen;
+	char *value;			// decoded, null terminated value
+	size_t valueLen;
+	struct form_field *next;
+	} form_field;
+
+// Define type of struct for an incremental form decoder
+typedef struct form_parser {
+	arena *mem;				// where decoded fields are written
+	form_field *first;		// completed fields in order
+	form_field *last;
+	form_field *current;	// field being decoded, or NULL
+	int count;				// number of completed fields
+	int inValue;			// nonzero once the field's '=' has been seen
+	int percent;			// 1 after '%', 2 after '%' and one more character
+	char pending[1];		// the character following a pending '%'
+	} form_parser;
+
+// Define type of struct for the rate limiter buckets a connection is counted in
+typedef struct rate_keys {
+	unsigned long long client;	// the client's own bucket, or 0 if it is not counted
+	unsigned long long network;	// the bucket of the client's network, or 0 if none
+	} rate_keys;
+
+// Define type of struct for a connection context
+typedef struct connection {
+	int sockfd;				// the socket for the connection
+	int state;				// the parser state
+	char *inbuf;			// request input buffer
+	size_t insize;			// allocated size of inbuf
+	size_t inlen;			// bytes held in inbuf
+	size_t headerlen;		// length of the request header including the blank line
+	size_t inpos;			// first byte of inbuf not yet consumed
+	char *outbuf;			// response output buffer
+	size_t outsize;			// allocated size of outbuf
+	size_t outlen;			// bytes held in outbuf
+	size_t outpos;			// first byte of outbuf not yet sent
+	int bodyMode;			// BODY_NONE, BODY_LENGTH or BODY_CHUNKED
+	int chunkState;			// chunked body parser state
+	long long bodyRemaining;	// bytes left in the body or current chunk
+	long long bodyTotal;		// body bytes read so far
+	long long bodyLimit;		// largest body accepted
+	size_t trailerLineLen;	// length of the current chunked trailer line
+	arena requestArena;		// per-request allocations
+	file_cache_entry *file;	// file being sized or streamed, or NULL
+	off_t fileOffset;		// next byte of the file to send
+	off_t fileRemaining;	// bytes of the file left to send
+	struct timespec accepted;	// when a worker took the connection
+	struct timespec lastActive;	// when data was last received
+	unsigned long requests;		// requests handled on this connection
+	unsigned long long bytesIn;	// bytes received
+	unsigned long long bytesOut;	// bytes sent
+	int keepAlive;				// nonzero if the connection stays open after the response
+	volatile int timedOut;		// set by the timer thread when a deadline passes
+	timer_node timer;			// the connection's current deadline
+	request_span span;			// phase times of the current request
+	struct ssl_st *tls;			// the connection's TLS state, or NULL for plaintext
+	int ktls;					// nonzero if the kernel encrypts what is sent
+	int secure;					// nonzero if the client connected over TLS
+	int local;					// nonzero if the client connected over the Unix socket
+	pid_t peerPid;				// the local client's process, once its first request is read
+	uid_t peerUid;				// the local client's user
+	gid_t peerGid;				// the local client's group
+	int http2;					// nonzero for an HTTP/2 stream, whose output its session frames
+	rate_keys limits;			// rate limiter buckets the connection is counted in
+	struct connection *next;	// free list link
+	} connection;
+
+// Define type of struct for a worker's pool of idle connections
+typedef struct connection_pool {
+	connection *free_list;	// idle connection objects
+	int free_count;			// number of objects on the free list
+	} connection_pool;
 
 // Function prototypes
 // Listens for connections
@@ -50,35 +401,334 @@ int listener(int);
 // Routes requests to appropriate handlers
 void *router(void *);
 
+// Passes a parsed request to the handler for its method
+void dispatchRequest(connection *);
+
 // Processes GET requests
-void processGet(int, char *);
+void processGet(connection *);
 
 // Processes HEAD requests
-void processHead(int, char *);
+void processHead(connection *);
 
 // Processes POST requests
-void processPost(int, char *);
+void processPost(connection *);
 
 // Gets the current date and time
 void getTimestamp2(char *);
 
+// Gets the current date and time for a Date header
+void getHttpDate(char *);
+
+// Turns a URL path into a file path below the home directory
+int normalizePath(const char *, size_t, char *);
+
+// Translates a file's extension into a MIME type
+char *getContentType(char *);
+
 // Processes HTTP error codes
-void sendError(int, int);
+void sendError(connection *, int);
+
+// Send a prebuilt error response straight to a socket with no connection context
+void sendRejection(int, int);
+
+// Initialize a worker's connection pool
+void connection_pool_init(connection_pool *);
+
+// Take a connection context from the pool for a socket
+connection *connection_acquire(connection_pool *, int);
+
+// Close the socket and return the connection context to the pool
+void connection_release(connection_pool *, connection *);
+
+// Close the socket and free the connection context
+void connection_discard(connection *);
+
+// Free every idle connection context in the pool
+void connection_pool_destroy(connection_pool *);
+
+// Receive a complete request header into the connection
+int connection_read_header(connection *);
+
+// Arm one of the connection's deadlines
+void connection_set_deadline(connection *, int);
+
+// Find a request header field's value
+char *connection_header(connection *, const char *);
+
+// Receive more data after the consumed part of the input buffer
+ssize_t connection_fill(connection *);
+
+// Prepare a keep-alive connection for its next request
+void connection_next_request(connection *);
+
+// Add data to the input buffer as if it had been received
+int connection_feed(connection *, const void *, size_t);
+
+// Queue data in the connection's output buffer
+int connection_write(connection *, const void *, size_t);
+
+// Send everything queued in the connection's output buffer
+int connection_flush(connection *);
+
+// Send several pieces of data without waiting, queueing what the socket does not take
+int connection_sendv(connection *, struct iovec *, int);
+
+// Wait until the connection's socket can be read or can take more
+int connection_wait(connection *, short);
+
+// Give the connection's file back to the open file cache
+void connection_close_file(connection *);
+
+// Stream the connection's open file
+void connection_attach_file(connection *, off_t, off_t);
+
+// Send the queued output and the next slice of the attached file
+int connection_send_file(connection *);
+
+// Send part of a file to the connection's socket
+ssize_t connection_sendfile(connection *, int, off_t *, size_t);
 
 // Logs the transactions
 void logger(char *);
 
+// Format and log a message; called through the LOG_ macros
+void log_write(const char *, ...) __attribute__ ((format(printf, 1, 2)));
+
+// Determine if this sampled line is the one in logsample to log
+int log_sample();
+
+// Set the level logged and the info sampling rate
+void log_set_level(int, int);
+
+// Translate a level name or number into a level
+int log_level_parse(const char *);
+
+// The level currently logged
+extern int logLevel;
+
+// The LOG_ macros format nothing unless the level is being logged
+#define LOG_ENABLED(level) ((level) <= __atomic_load_n(&logLevel, __ATOMIC_RELAXED))
+#define LOG_AT(level, ...) do { if (LOG_ENABLED(level)) log_write(__VA_ARGS__); } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+
+// Per-request info lines, logged one in logsample times
+#define LOG_INFO_SAMPLED(...) do { if (LOG_ENABLED(LOG_LEVEL_INFO) && log_sample()) log_write(__VA_ARGS__); } while (0)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void) 0)
+#endif
+
+// USDT probes for SystemTap and bpftrace, provider "webserver". Each is a
+// single nop until a tracer attaches; without <sys/sdt.h>, or built with
+// -DNO_USDT, they compile to nothing. Probe arguments must be cheap to
+// evaluate and have no side effects.
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT_ENABLED 1
+#endif
+#endif
+
+#ifdef USDT_ENABLED
+#define PROBE1(name, a) DTRACE_PROBE1(webserver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(webserver, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void) 0)
+#define PROBE2(name, a, b) ((void) 0)
+#define PROBE3(name, a, b, c) ((void) 0)
+#endif
+
 // Read and process the configuration file
-int readConfigFile(char *, char *, char *);
+int readConfigFile(char *, char *, char *, server_config *);
 
 // Build a threadpool
 threadpool *threadpool_build();
 
 // Add a connection to the threadpool
-int add_connection(threadpool *, int);
+int add_connection(threadpool *, int, unsigned long long, rate_keys *, int);
+
+// Destroy the threadpool upon program exit, waiting for workers to finish
+int threadpool_eliminate(threadpool *, int);
+
+// Prepare to read a request body
+int body_reader_init(connection *);
+
+// Prepare to read a response body
+int body_reader_response(connection *, int);
+
+// Get the next piece of a request body
+ssize_t body_next(connection *, char **);
+
+// Read and discard the rest of a request body
+int body_discard(connection *);
+
+// Initialize an arena
+void arena_init(arena *);
+
+// Allocate memory from an arena
+void *arena_alloc(arena *, size_t);
+
+// Append to a string at the top of an arena
+char *arena_append(arena *, char *, size_t *, const char *, size_t);
+
+// Release every allocation in an arena
+void arena_reset(arena *);
+
+// Free an arena's memory
+void arena_destroy(arena *);
+
+// Convert a hexadecimal digit to its value, or -1
+int hexDigit(char);
+
+// Initialize an incremental form decoder
+void form_parser_init(form_parser *, arena *);
+
+// Decode the next piece of form data
+int form_parser_feed(form_parser *, const char *, size_t);
+
+// Finish decoding form data
+int form_parser_finish(form_parser *);
+
+// Find the next form character that needs decoding
+size_t form_scan(const char *, size_t);
+
+// Start the timer wheel thread
+int timer_wheel_start();
+
+// Arm a timer
+void timer_set(timer_node *, unsigned int, void (*)(void *), void *);
+
+// Disarm a timer
+void timer_cancel(timer_node *);
+
+// Returns the number of connections waiting in the threadpool's interactive lane
+int threadpool_waiting(threadpool *);
+
+// Put a connection with a transfer in progress, or back from the sender, on the queue
+int threadpool_requeue(threadpool *, connection *);
+
+// Start the sender that finishes large files and slow responses without holding a worker
+int sender_start(threadpool *);
+
+// Stop the sender once its transfers finish, waiting at most the given seconds
+int sender_stop(int);
+
+// Determine if a connection's file transfer is large enough to go to the sender at once
+int sender_wanted(connection *);
+
+// Hand the rest of a connection's response to the sender
+int sender_submit(connection *);
 
-// Destroy the threadpool upon program exit
-void threadpool_eliminate();
+// Make the calling worker a scheduler of coroutines, woken by the given eventfd
+int coroutine_scheduler_init(int);
+
+// Free the calling worker's scheduler
+void coroutine_scheduler_destroy();
+
+// Start a coroutine on the calling worker
+int coroutine_start(void (*)(void *), void *);
+
+// Run the worker's coroutines that can go on, then wait for more to
+void coroutine_schedule(int);
+
+// Wait like poll(), letting the worker's other coroutines run meanwhile
+int coroutine_poll(struct pollfd *, int, int);
+
+// Let the worker's other coroutines have a turn
+void coroutine_yield();
+
+// Determine if the caller runs in a coroutine
+int coroutine_active();
+
+// Get the number of coroutines the calling worker is running
+int coroutine_count();
+
+// Start watching the home directory for changes
+int file_watcher_start();
+
+// Be told about changes in the home directory
+void file_watcher_subscribe(void (*)(const char *, unsigned int));
+
+// Determine if the home directory is being watched
+int file_watcher_active();
+
+// Hash a string
+unsigned long hashString(const char *);
+
+// Connect the open file cache to the file watcher
+void file_cache_init();
+
+// Get an open file from the cache
+file_cache_entry *file_cache_open(const char *);
+
+// Take another reference to a cached file
+void file_cache_retain(file_cache_entry *);
+
+// Release a file taken from the cache
+void file_cache_release(file_cache_entry *);
+
+// Drop a path, or everything, from the open file cache
+void file_cache_invalidate(const char *);
+
+// Allocate the negative lookup cache
+void negative_cache_init();
+
+// Determine if a path is known to be missing or an extension to have no type
+int negative_cache_lookup(int, const char *);
+
+// Remember a missing path or an extension with no type
+void negative_cache_add(int, const char *);
+
+// Drop a path, or every entry of a kind, from the negative lookup cache
+void negative_cache_invalidate(int, const char *);
+
+// Subscribe the home directory index to changes
+void docroot_index_init();
+
+// Build the home directory index
+void docroot_index_build();
+
+// Determine if a path names a servable file
+int docroot_index_lookup(const char *);
+
+// Pack the home directory into a bundle
+int bundle_pack(const char *);
+
+// Serve files from a bundle
+int bundle_open(const char *);
+
+// Determine if files are served from a bundle
+int bundle_active();
+
+// Find a file in the bundle
+const bundle_entry *bundle_lookup(const char *);
+
+// Get a bundled file's contents
+const char *bundle_body(const bundle_entry *, size_t *);
+
+// Get a bundled file's MIME type
+const char *bundle_type(const bundle_entry *);
+
+// Send a file from the bundle
+void bundle_send(connection *, const bundle_entry *);
+
+// Set a custom page for an error code
+int error_page_set(int, char *);
+
+// Build the error responses sent from memory
+void error_responses_init();
 
 // Define type of struct for file types
 typedef struct filetypes_template {
@@ -87,8 +737,178 @@ typedef struct filetypes_template {
     char type[80];
 	} filetypes_template;
 
-// Declare global array for file types
-extern filetypes_template filetypes[];
+// Define type of struct for a loaded configuration. It is never changed
+// once published; a reload publishes a new one.
+struct server_config {
+	server_settings settings;	// limits and cache sizes
+	filetypes_template filetypes[FILETYPES_ARRAY_SIZE];	// the MIME table
+	char home[BUFSIZE];			// absolute path of the home directory
+	};
+
+// Allocate a configuration holding the defaults
+server_config *config_create();
+
+// Get the configuration in effect
+const server_config *config_current();
+
+// Put a configuration into effect, returning the old one
+server_config *config_publish(server_config *);
+
+// Give the calling thread a configuration reader slot
+void config_reader_register();
+
+// Mark that the calling thread holds nothing from the configuration
+void config_quiescent();
+
+// Mark the calling thread idle until its next quiescent point
+void config_offline();
+
+// Switch the calling thread to another reader slot, returning the one it had
+void *config_reader_swap(void *);
+
+// Remember the config file for reloads
+void config_reload_init(char *);
+
+// Read the config file again and put it into effect
+void config_reload();
+
+// Free replaced configurations no request can still use, returning how many are left
+int config_reclaim();
+
+// Block the signals taken by the signal thread before threads start
+void signal_handler_init();
+
+// Start the thread that handles the reload, log level and stop signals
+int signal_handler_start();
+
+// Start a graceful drain
+void server_drain();
+
+// Determine if a drain has started
+int server_draining();
+
+// Get the descriptor that becomes readable when a drain starts
+int server_drain_fd();
+
+// Get the monotonic time in nanoseconds
+unsigned long long trace_now();
+
+// Allocate the request trace rings
+void trace_init();
+
+// Record the time a request reached a phase
+void trace_mark(connection *, int);
+
+// Record that a request header has been parsed
+void trace_request(connection *);
+
+// Record that a response is complete and keep its span
+void trace_finish(connection *);
+
+// Write the request trace as Chrome trace JSON
+void trace_write(FILE *);
+
+// Write the request trace to trace.json
+void trace_dump();
+
+// Determine if a request is for the trace endpoint from a local client
+int trace_requested(connection *);
+
+// Send the request trace as a response
+void trace_send(connection *);
+
+// Ask a running server for its listening socket
+int handoff_receive(const char *);
+
+// Offer the listening socket to a new server on the handoff socket
+int handoff_start(const char *, int);
+
+// Stop offering the listening socket
+void handoff_stop();
+
+// Load the TLS certificate and key if TLS is configured
+int tls_init();
+
+// Determine if connections start with a TLS handshake
+int tls_active();
+
+// Perform the TLS handshake on a new connection
+int tls_handshake(connection *);
+
+// Receive decrypted data from a TLS connection
+ssize_t tls_recv(connection *, void *, size_t);
+
+// Send data over a TLS connection
+ssize_t tls_send(connection *, const void *, size_t);
+
+// Send part of a file over a TLS connection
+ssize_t tls_sendfile(connection *, int, off_t *, size_t);
+
+// Close and free a connection's TLS state
+void tls_close(connection *);
+
+// Determine if received data is waiting inside the TLS layer
+int tls_pending(connection *);
+
+// Build the HPACK Huffman decoding tree
+void hpack_init();
+
+// Create an empty HPACK dynamic table
+int hpack_table_init(hpack_table *, size_t);
+
+// Free an HPACK dynamic table
+void hpack_table_destroy(hpack_table *);
+
+// Apply the peer's size for the table used to encode
+void hpack_table_limit(hpack_table *, size_t);
+
+// Decode an HPACK header block
+int hpack_decode(hpack_table *, const unsigned char *, size_t, hpack_emit, void *);
+
+// Add a header field to an HPACK header block
+size_t hpack_encode(hpack_table *, unsigned char *, size_t, const char *, size_t, const char *, size_t, int);
+
+// Add the :status field to an HPACK header block
+size_t hpack_encode_status(hpack_table *, unsigned char *, size_t, int);
+
+// Serve a connection over HTTP/2 if the client asked for it
+int http2_start(connection *);
+
+// Send requests for a path prefix to upstream servers
+int proxy_route_add(char *, char *);
+
+// Start checking the health of the upstream servers
+int proxy_start();
+
+// Determine if a request is for a proxied path
+int proxy_requested(connection *);
+
+// Processes requests for proxied paths
+void processProxy(connection *);
+
+// Send requests for a path prefix to a FastCGI or SCGI backend
+int gateway_route_add(int, char *, char *);
+
+// Start the workers of the gateway backends the server runs itself
+int gateway_start();
+
+// Determine if a request is for a gateway path
+int gateway_requested(connection *);
+
+// Processes requests for gateway paths
+void processGateway(connection *);
+
+// Read the limits of a network from a ratelimitnet line
+int rate_rule_parse(char *, char *, rate_rule *);
+
+// Decide whether a new connection from an IPv4 client is admitted
+int rate_limit_admit(unsigned int, rate_keys *);
+
+// Charge another request on a kept-alive connection to its buckets
+int rate_limit_request(rate_keys *);
+
+// Stop counting a closed connection against its buckets
+void rate_limit_release(rate_keys *);
 
 // Global variable for log file path and name
 extern char logfilePathAndName[];
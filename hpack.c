@@ -0,0 +1,958 @@
+/*
+ * hpack.c
+ *
+ * Contains HPACK, the HTTP/2 header compression (RFC 7541). Each
+ * direction of a connection keeps a dynamic table of recent header
+ * fields that both ends update in step, so a repeated field costs one
+ * byte. The static table of common fields is a fixed array, so looking
+ * up one of its entries is a plain index with no search.
+ *
+ * Request headers are decoded in full, Huffman-coded strings included.
+ * Response headers are encoded with static table entries where they
+ * match, Huffman coding where it is shorter, and the dynamic table for
+ * the fields that repeat from one response to the next.
+ */
+
+#include "headerfile.h"
+
+#define HPACK_STATIC_ENTRIES 61 // entries in the static table
+#define HPACK_ENTRY_OVERHEAD 32 // bytes each entry adds to a table's size
+#define HUFFMAN_NODES 256 // internal nodes in the Huffman decoding tree
+
+// Define type of struct for a static table entry
+typedef struct hpack_static_entry {
+	const char *name;
+	const char *value;
+	} hpack_static_entry;
+
+// The static table from RFC 7541 Appendix A; index 1 is its first entry
+static const hpack_static_entry staticTable[HPACK_STATIC_ENTRIES] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+// Huffman codes from RFC 7541 Appendix B, right-aligned, and their lengths in bits
+static const uint32_t huffmanCodes[256] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+
+static const unsigned char huffmanLengths[256] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+/*
+ * Struct that holds the Huffman decoding tree. A positive child is
+ * another node, a negative child is a leaf holding -(symbol + 1), and 0
+ * marks a code that does not exist (the root is never a child).
+ */
+static struct {
+	short children[HUFFMAN_NODES][2];
+	int nodes;
+} huffman;
+
+/*
+ * Function prototypes for the hpack.c file
+ */
+static ssize_t huffman_decode(const unsigned char *in, size_t length, char *out);
+static int hpack_get_integer(const unsigned char **in, const unsigned char *end, int prefix, size_t *value);
+static ssize_t hpack_get_string(const unsigned char **in, const unsigned char *end, char *out, const char **string);
+static int hpack_table_get(const hpack_table *table, size_t index, const char **name, size_t *nameLength,
+		const char **value, size_t *valueLength);
+static void hpack_table_evict(hpack_table *table, size_t limit);
+static char *hpack_field_copy(const char *name, size_t nameLength, const char *value, size_t valueLength);
+static void hpack_table_add(hpack_table *table, char *field, size_t nameLength, size_t valueLength);
+static size_t hpack_put_integer(unsigned char *out, size_t space, int prefix, unsigned char flags, size_t value);
+static size_t hpack_put_string(unsigned char *out, size_t space, const char *string, size_t length);
+static size_t hpack_put_resize(hpack_table *table, unsigned char *out, size_t space);
+
+/*
+ * Function: hpack_init
+ * ----------------------------
+ *   Builds the Huffman decoding tree from the code table.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void hpack_init()
+{
+	uint32_t code;
+	int symbol;
+	int bit;
+	int node;
+	int next;
+
+	huffman.nodes = 1;
+	for (symbol = 0; symbol < 256; symbol++)
+	{
+		code = huffmanCodes[symbol];
+		node = 0;
+		for (bit = huffmanLengths[symbol] - 1; bit > 0; bit--)
+		{
+			next = huffman.children[node][(code >> bit) & 1];
+			if (next == 0)
+			{
+				next = huffman.nodes++;
+				huffman.children[node][(code >> bit) & 1] = next;
+			}
+			node = next;
+		}
+		huffman.children[node][code & 1] = -(symbol + 1);
+	}
+}
+
+/*
+ * Function: huffman_decode
+ * ----------------------------
+ *   Decodes a Huffman-coded string.
+ *
+ *	 Parameters:
+ *   in: The coded string
+ *   length: The length of the coded string
+ *   out: Where to put the decoded string, at least 8/5 of length
+ *
+ *   Returns: the length of the decoded string, or -1 if it is not valid
+ */
+static ssize_t huffman_decode(const unsigned char *in, size_t length, char *out)
+{
+	size_t produced = 0;
+	size_t i;
+	int node = 0;
+	int depth = 0;		// bits read since the last symbol
+	int ones = 1;		// set while every one of those bits was a 1
+	int bit;
+	int value;
+	int next;
+
+	for (i = 0; i < length; i++)
+	{
+		for (bit = 7; bit >= 0; bit--)
+		{
+			value = (in[i] >> bit) & 1;
+			next = huffman.children[node][value];
+			if (next == 0)
+			{
+				return -1;
+			}
+			if (next < 0)
+			{
+				out[produced++] = (char) (-next - 1);
+				node = 0;
+				depth = 0;
+				ones = 1;
+			}
+			else
+			{
+				node = next;
+				depth++;
+				ones &= value;
+			}
+		}
+	}
+
+	// The padding must be a prefix of the end-of-string code: up to seven 1s
+	if (depth > 7 || !ones)
+	{
+		return -1;
+	}
+
+	return produced;
+}
+
+/*
+ * Function: hpack_get_integer
+ * ----------------------------
+ *   Reads an integer with an N-bit prefix.
+ *
+ *	 Parameters:
+ *   in: The position in the header block, advanced past the integer
+ *   end: The end of the header block
+ *   prefix: The number of bits of the first byte the integer starts in
+ *   value: Set to the integer
+ *
+ *   Returns: 0 if successful, -1 if the integer is truncated or too large
+ */
+static int hpack_get_integer(const unsigned char **in, const unsigned char *end, int prefix, size_t *value)
+{
+	size_t max = (1u << prefix) - 1;
+	int shift = 0;
+
+	if (*in >= end)
+	{
+		return -1;
+	}
+
+	*value = **in & max;
+	(*in)++;
+	if (*value < max)
+	{
+		return 0;
+	}
+
+	do
+	{
+		if (*in >= end || shift > 28)
+		{
+			return -1;
+		}
+		*value += (size_t) (**in & 0x7f) << shift;
+		shift += 7;
+	} while (*((*in)++) & 0x80);
+
+	return 0;
+}
+
+/*
+ * Function: hpack_get_string
+ * ----------------------------
+ *   Reads a string literal, decoding it if it is Huffman coded.
+ *
+ *	 Parameters:
+ *   in: The position in the header block, advanced past the string
+ *   end: The end of the header block
+ *   out: Where to put a decoded string, at least twice the block's length
+ *   string: Set to the string, in the block or in out
+ *
+ *   Returns: the length of the string, or -1 if it is not valid
+ */
+static ssize_t hpack_get_string(const unsigned char **in, const unsigned char *end, char *out, const char **string)
+{
+	int coded;
+	size_t length;
+	ssize_t decoded;
+
+	if (*in >= end)
+	{
+		return -1;
+	}
+
+	coded = **in & 0x80;
+	if (hpack_get_integer(in, end, 7, &length) != 0 || length > (size_t) (end - *in))
+	{
+		return -1;
+	}
+
+	if (!coded)
+	{
+		*string = (const char *) *in;
+		*in += length;
+		return length;
+	}
+
+	decoded = huffman_decode(*in, length, out);
+	*string = out;
+	*in += length;
+	return decoded;
+}
+
+/*
+ * Function: hpack_table_init
+ * ----------------------------
+ *   Creates an empty dynamic table.
+ *
+ *	 Parameters:
+ *   table: The table
+ *   limit: The largest size the table may be given
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+int hpack_table_init(hpack_table *table, size_t limit)
+{
+	table->capacity = limit / HPACK_ENTRY_OVERHEAD + 1;
+	table->fields = (hpack_field *) calloc(table->capacity, sizeof(hpack_field));
+	table->newest = 0;
+	table->count = 0;
+	table->size = 0;
+	table->maxSize = limit;
+	table->limit = limit;
+	table->lowest = limit;
+	table->resized = 0;
+
+	return table->fields == NULL ? -1 : 0;
+}
+
+/*
+ * Function: hpack_table_destroy
+ * ----------------------------
+ *   Frees a dynamic table's entries.
+ *
+ *	 Parameters:
+ *   table: The table
+ *
+ *   Returns: nothing
+ */
+void hpack_table_destroy(hpack_table *table)
+{
+	if (table->fields != NULL)
+	{
+		hpack_table_evict(table, 0);
+		free(table->fields);
+		table->fields = NULL;
+	}
+}
+
+/*
+ * Function: hpack_table_get
+ * ----------------------------
+ *   Looks up an index in the static table, then the dynamic table.
+ *
+ *	 Parameters:
+ *   table: The dynamic table
+ *   index: The index, from 1
+ *   name: Set to the field's name
+ *   nameLength: Set to the length of the name
+ *   value: Set to the field's value
+ *   valueLength: Set to the length of the value
+ *
+ *   Returns: 0 if successful, -1 if there is no such index
+ */
+static int hpack_table_get(const hpack_table *table, size_t index, const char **name, size_t *nameLength,
+		const char **value, size_t *valueLength)
+{
+	const hpack_field *field;
+
+	if (index == 0)
+	{
+		return -1;
+	}
+
+	if (index <= HPACK_STATIC_ENTRIES)
+	{
+		*name = staticTable[index - 1].name;
+		*nameLength = strlen(*name);
+		*value = staticTable[index - 1].value;
+		*valueLength = strlen(*value);
+		return 0;
+	}
+
+	index -= HPACK_STATIC_ENTRIES + 1;
+	if (index >= (size_t) table->count)
+	{
+		return -1;
+	}
+
+	field = &(table->fields[(table->newest + table->capacity - index) % table->capacity]);
+	*name = field->name;
+	*nameLength = field->nameLength;
+	*value = field->name + field->nameLength;
+	*valueLength = field->valueLength;
+	return 0;
+}
+
+/*
+ * Function: hpack_table_evict
+ * ----------------------------
+ *   Drops the oldest entries until the table fits a size.
+ *
+ *	 Parameters:
+ *   table: The table
+ *   limit: The size to fit
+ *
+ *   Returns: nothing
+ */
+static void hpack_table_evict(hpack_table *table, size_t limit)
+{
+	hpack_field *oldest;
+
+	while (table->count > 0 && table->size > limit)
+	{
+		oldest = &(table->fields[(table->newest + table->capacity - (table->count - 1)) % table->capacity]);
+		table->size -= oldest->nameLength + oldest->valueLength + HPACK_ENTRY_OVERHEAD;
+		free(oldest->name);
+		oldest->name = NULL;
+		table->count -= 1;
+	}
+}
+
+/*
+ * Function: hpack_field_copy
+ * ----------------------------
+ *   Copies a field's name and value into one allocation for the dynamic
+ *   table. Copied before anything is evicted, since the name may belong
+ *   to an entry about to go.
+ *
+ *	 Parameters:
+ *   name: The field's name
+ *   nameLength: The length of the name
+ *   value: The field's value
+ *   valueLength: The length of the value
+ *
+ *   Returns: the copy, or NULL if memory could not be allocated
+ */
+static char *hpack_field_copy(const char *name, size_t nameLength, const char *value, size_t valueLength)
+{
+	char *copy = (char *) malloc(nameLength + valueLength + 1);
+
+	if (copy != NULL)
+	{
+		memcpy(copy, name, nameLength);
+		memcpy(copy + nameLength, value, valueLength);
+		copy[nameLength + valueLength] = '\0';
+	}
+	return copy;
+}
+
+/*
+ * Function: hpack_table_add
+ * ----------------------------
+ *   Adds a field to the dynamic table, evicting old entries to make room.
+ *   A field larger than the whole table empties it.
+ *
+ *	 Parameters:
+ *   table: The table
+ *   field: The field from hpack_field_copy, which the table takes over
+ *   nameLength: The length of the name
+ *   valueLength: The length of the value
+ *
+ *   Returns: nothing
+ */
+static void hpack_table_add(hpack_table *table, char *field, size_t nameLength, size_t valueLength)
+{
+	size_t entrySize = nameLength + valueLength + HPACK_ENTRY_OVERHEAD;
+
+	if (entrySize > table->maxSize)
+	{
+		hpack_table_evict(table, 0);
+		free(field);
+		return;
+	}
+
+	hpack_table_evict(table, table->maxSize - entrySize);
+
+	table->newest = (table->newest + 1) % table->capacity;
+	table->fields[table->newest].name = field;
+	table->fields[table->newest].nameLength = nameLength;
+	table->fields[table->newest].valueLength = valueLength;
+	table->count += 1;
+	table->size += entrySize;
+}
+
+/*
+ * Function: hpack_table_limit
+ * ----------------------------
+ *   Applies the size the peer allows for the table this end encodes
+ *   with. The change is announced at the start of the next header block.
+ *
+ *	 Parameters:
+ *   table: The encoding table
+ *   size: The peer's SETTINGS_HEADER_TABLE_SIZE
+ *
+ *   Returns: nothing
+ */
+void hpack_table_limit(hpack_table *table, size_t size)
+{
+	if (size > table->limit)
+	{
+		size = table->limit;
+	}
+	if (size == table->maxSize)
+	{
+		return;
+	}
+
+	table->maxSize = size;
+	hpack_table_evict(table, size);
+	if (!table->resized || size < table->lowest)
+	{
+		table->lowest = size;
+	}
+	table->resized = 1;
+}
+
+/*
+ * Function: hpack_decode
+ * ----------------------------
+ *   Decodes a header block, passing each field to a function in order.
+ *   The name and value passed are only valid during the call.
+ *
+ *	 Parameters:
+ *   table: The decoding table
+ *   block: The header block
+ *   length: The length of the header block
+ *   emit: The function to pass each field to
+ *   arg: Passed to emit
+ *
+ *   Returns: 0 if successful, -1 if the block is not valid, which is a
+ *   connection error since the tables are no longer in step
+ */
+int hpack_decode(hpack_table *table, const unsigned char *block, size_t length, hpack_emit emit, void *arg)
+{
+	const unsigned char *in = block;
+	const unsigned char *end = block + length;
+	const char *name;
+	const char *value;
+	size_t nameLength;
+	size_t valueLength;
+	size_t index;
+	ssize_t decoded;
+	char *scratch;
+	char *field;
+	int indexing;
+	int result = -1;
+
+	// Names are decoded at the start and values halfway along
+	scratch = (char *) malloc(length * 4 + 16);
+	if (scratch == NULL)
+	{
+		return -1;
+	}
+
+	while (in < end)
+	{
+		if (*in & 0x80)
+		{
+			// Indexed field
+			if (hpack_get_integer(&in, end, 7, &index) != 0 ||
+					hpack_table_get(table, index, &name, &nameLength, &value, &valueLength) != 0)
+			{
+				goto done;
+			}
+			(*emit)(arg, name, nameLength, value, valueLength);
+			continue;
+		}
+
+		if ((*in & 0xe0) == 0x20)
+		{
+			// Dynamic table size update
+			if (hpack_get_integer(&in, end, 5, &index) != 0 || index > table->limit)
+			{
+				goto done;
+			}
+			table->maxSize = index;
+			hpack_table_evict(table, index);
+			continue;
+		}
+
+		// Literal field, with incremental indexing or without
+		indexing = (*in & 0xc0) == 0x40;
+		if (hpack_get_integer(&in, end, indexing ? 6 : 4, &index) != 0)
+		{
+			goto done;
+		}
+		if (index == 0)
+		{
+			decoded = hpack_get_string(&in, end, scratch, &name);
+			if (decoded < 0)
+			{
+				goto done;
+			}
+			nameLength = decoded;
+		}
+		else if (hpack_table_get(table, index, &name, &nameLength, &value, &valueLength) != 0)
+		{
+			goto done;
+		}
+
+		decoded = hpack_get_string(&in, end, scratch + length * 2 + 8, &value);
+		if (decoded < 0)
+		{
+			goto done;
+		}
+		valueLength = decoded;
+
+		(*emit)(arg, name, nameLength, value, valueLength);
+		if (indexing)
+		{
+			field = hpack_field_copy(name, nameLength, value, valueLength);
+			if (field == NULL)
+			{
+				goto done;
+			}
+			hpack_table_add(table, field, nameLength, valueLength);
+		}
+	}
+	result = 0;
+
+done:
+	free(scratch);
+	return result;
+}
+
+/*
+ * Function: hpack_put_integer
+ * ----------------------------
+ *   Writes an integer with an N-bit prefix.
+ *
+ *	 Parameters:
+ *   out: Where to write
+ *   space: The bytes available at out
+ *   prefix: The number of bits of the first byte the integer starts in
+ *   flags: The bits above the prefix in the first byte
+ *   value: The integer
+ *
+ *   Returns: the bytes written, or 0 if there was not enough space
+ */
+static size_t hpack_put_integer(unsigned char *out, size_t space, int prefix, unsigned char flags, size_t value)
+{
+	size_t max = (1u << prefix) - 1;
+	size_t used = 0;
+
+	if (space == 0)
+	{
+		return 0;
+	}
+
+	if (value < max)
+	{
+		out[0] = flags | value;
+		return 1;
+	}
+
+	out[used++] = flags | max;
+	value -= max;
+	while (value >= 0x80)
+	{
+		if (used >= space)
+		{
+			return 0;
+		}
+		out[used++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	if (used >= space)
+	{
+		return 0;
+	}
+	out[used++] = value;
+	return used;
+}
+
+/*
+ * Function: hpack_put_string
+ * ----------------------------
+ *   Writes a string literal, Huffman coded if that is shorter.
+ *
+ *	 Parameters:
+ *   out: Where to write
+ *   space: The bytes available at out
+ *   string: The string
+ *   length: The length of the string
+ *
+ *   Returns: the bytes written, or 0 if there was not enough space
+ */
+static size_t hpack_put_string(unsigned char *out, size_t space, const char *string, size_t length)
+{
+	uint64_t bits = 0;
+	size_t coded;
+	size_t used;
+	size_t i;
+	int pending = 0;
+	unsigned char symbol;
+	unsigned char *next;
+
+	for (i = 0; i < length; i++)
+	{
+		bits += huffmanLengths[(unsigned char) string[i]];
+	}
+	coded = (bits + 7) / 8;
+
+	if (coded >= length)
+	{
+		used = hpack_put_integer(out, space, 7, 0x00, length);
+		if (used == 0 || space - used < length)
+		{
+			return 0;
+		}
+		memcpy(out + used, string, length);
+		return used + length;
+	}
+
+	used = hpack_put_integer(out, space, 7, 0x80, coded);
+	if (used == 0 || space - used < coded)
+	{
+		return 0;
+	}
+
+	// Only the low bits of the accumulator are ever written out
+	bits = 0;
+	next = out + used;
+	for (i = 0; i < length; i++)
+	{
+		symbol = (unsigned char) string[i];
+		bits = (bits << huffmanLengths[symbol]) | huffmanCodes[symbol];
+		pending += huffmanLengths[symbol];
+		while (pending >= 8)
+		{
+			pending -= 8;
+			*next++ = (unsigned char) (bits >> pending);
+		}
+	}
+	if (pending > 0)
+	{
+		// Pad with the start of the end-of-string code
+		*next++ = (unsigned char) ((bits << (8 - pending)) | (0xff >> pending));
+	}
+
+	return used + coded;
+}
+
+/*
+ * Function: hpack_put_resize
+ * ----------------------------
+ *   Announces a change to the encoding table's size, if there has been
+ *   one since the last header block. Called before a block's first field.
+ *
+ *	 Parameters:
+ *   table: The encoding table
+ *   out: Where to write
+ *   space: The bytes available at out
+ *
+ *   Returns: the bytes written
+ */
+static size_t hpack_put_resize(hpack_table *table, unsigned char *out, size_t space)
+{
+	size_t used = 0;
+
+	if (!table->resized)
+	{
+		return 0;
+	}
+
+	// The smallest size since the last block comes first, so the peer
+	// evicts everything this end did
+	if (table->lowest < table->maxSize)
+	{
+		used = hpack_put_integer(out, space, 5, 0x20, table->lowest);
+	}
+	used += hpack_put_integer(out + used, space - used, 5, 0x20, table->maxSize);
+	table->resized = 0;
+	return used;
+}
+
+/*
+ * Function: hpack_encode
+ * ----------------------------
+ *   Adds a field to a header block: as an index if the static or dynamic
+ *   table holds it, otherwise as a literal that refers to an indexed name
+ *   where it can.
+ *
+ *	 Parameters:
+ *   table: The encoding table
+ *   out: Where to write
+ *   space: The bytes available at out
+ *   name: The field's name, in lower case
+ *   nameLength: The length of the name
+ *   value: The field's value
+ *   valueLength: The length of the value
+ *   indexing: Nonzero to add the field to the dynamic table, for fields
+ *   likely to be sent again with the same value
+ *
+ *   Returns: the bytes written, or 0 if there was not enough space
+ */
+size_t hpack_encode(hpack_table *table, unsigned char *out, size_t space, const char *name, size_t nameLength,
+		const char *value, size_t valueLength, int indexing)
+{
+	const char *entryName;
+	const char *entryValue;
+	size_t entryNameLength;
+	size_t entryValueLength;
+	size_t nameIndex = 0;
+	size_t index;
+	size_t used;
+	size_t more;
+	char *field = NULL;
+
+	used = hpack_put_resize(table, out, space);
+
+	// The static table first, then the dynamic table, newest entry first
+	for (index = 1; index <= HPACK_STATIC_ENTRIES + (size_t) table->count; index++)
+	{
+		hpack_table_get(table, index, &entryName, &entryNameLength, &entryValue, &entryValueLength);
+		if (entryNameLength != nameLength || memcmp(entryName, name, nameLength) != 0)
+		{
+			continue;
+		}
+		if (entryValueLength == valueLength && memcmp(entryValue, value, valueLength) == 0)
+		{
+			more = hpack_put_integer(out + used, space - used, 7, 0x80, index);
+			return more == 0 ? 0 : used + more;
+		}
+		if (nameIndex == 0)
+		{
+			nameIndex = index;
+		}
+	}
+
+	// A field that cannot be kept is sent without indexing
+	if (indexing)
+	{
+		field = hpack_field_copy(name, nameLength, value, valueLength);
+	}
+
+	more = hpack_put_integer(out + used, space - used, field != NULL ? 6 : 4, field != NULL ? 0x40 : 0x00, nameIndex);
+	if (more > 0 && nameIndex == 0)
+	{
+		used += more;
+		more = hpack_put_string(out + used, space - used, name, nameLength);
+	}
+	if (more > 0)
+	{
+		used += more;
+		more = hpack_put_string(out + used, space - used, value, valueLength);
+	}
+	if (more == 0)
+	{
+		free(field);
+		return 0;
+	}
+	used += more;
+
+	if (field != NULL)
+	{
+		hpack_table_add(table, field, nameLength, valueLength);
+	}
+	return used;
+}
+
+/*
+ * Function: hpack_encode_status
+ * ----------------------------
+ *   Adds the :status field to a header block. The common statuses are
+ *   single-byte static table entries.
+ *
+ *	 Parameters:
+ *   table: The encoding table
+ *   out: Where to write
+ *   space: The bytes available at out
+ *   status: The HTTP status code
+ *
+ *   Returns: the bytes written, or 0 if there was not enough space
+ */
+size_t hpack_encode_status(hpack_table *table, unsigned char *out, size_t space, int status)
+{
+	char digits[8];
+	size_t used;
+	int index;
+
+	switch (status)
+	{
+		case 200: index = 8; break;
+		case 204: index = 9; break;
+		case 206: index = 10; break;
+		case 304: index = 11; break;
+		case 400: index = 12; break;
+		case 404: index = 13; break;
+		case 500: index = 14; break;
+		default: index = 0; break;
+	}
+
+	if (index == 0)
+	{
+		snprintf(digits, sizeof(digits), "%03d", status % 1000);
+		return hpack_encode(table, out, space, ":status", 7, digits, 3, 1);
+	}
+
+	used = hpack_put_resize(table, out, space);
+	if (used >= space)
+	{
+		return 0;
+	}
+	out[used] = 0x80 | index;
+	return used + 1;
+}
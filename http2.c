@@ -0,0 +1,2057 @@
+/*
+ * http2.c
+ *
+ * Contains HTTP/2 (RFC 9113). A connection becomes an HTTP/2 session
+ * when TLS negotiates h2 through ALPN, when a cleartext client starts
+ * with the connection preface (prior knowledge), or when a cleartext
+ * GET or HEAD asks to upgrade to h2c. The session then runs in the
+ * connection's coroutine until the connection closes, and its worker
+ * serves other connections whenever it waits for the client.
+ *
+ * Each stream gets a connection context of its own with the HTTP2 flag
+ * set. Its request is written into the context's input buffer as an
+ * HTTP/1.1 request, the usual handlers answer it into the output buffer,
+ * and the session turns that response back into HEADERS and DATA
+ * frames. A file body stays attached to the context and goes out in
+ * DATA frames with sendfile(), so large files are not copied.
+ *
+ * Response bodies are sent as flow control allows, one frame at a time,
+ * from the stream with the lowest urgency (RFC 9218). Incremental
+ * streams of the same urgency take turns; the others are finished in the
+ * order they were opened. The urgency comes from the priority header or
+ * PRIORITY_UPDATE frames, or failing those from the RFC 7540 weight.
+ */
+
+#include "headerfile.h"
+#include <poll.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24 // length of the client connection preface
+#define H2_PREFACE_HEADER 18 // part of the preface that reads as a request header
+#define H2_HEADER_SIZE 9 // length of a frame header
+#define H2_WINDOW_MAX 0x7fffffff // largest flow control window
+#define H2_SEND_BUDGET (H2_FRAME_SIZE * 4) // DATA bytes sent between checks for incoming frames
+#define H2_URGENCY_DEFAULT 3 // urgency of a stream that gives none
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+#define H2_PRIORITY_UPDATE 0x10
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// Error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// Define type of struct for a stream
+typedef struct h2_stream {
+	unsigned int id;
+	connection *conn;		// the context the request is handled in
+	char method[16];
+	char *path;				// the :path pseudo-header, or NULL
+	char *authority;		// the :authority pseudo-header, or NULL
+	int fieldsStarted;		// set once the request line has been written
+	int malformed;			// set if the request breaks the HTTP/2 rules
+	int reject;				// status to answer with instead of handling the request, or 0
+	int headersDone;		// set once the request header block is complete
+	int remoteClosed;		// set once the client has ended the stream
+	int dispatched;			// set once the request has been handled
+	int headOnly;			// set for HEAD, whose body is dropped
+	long long window;		// bytes the client will accept on the stream
+	long long recvWindow;	// bytes the client may still send on the stream
+	long long unacknowledged;	// bytes received but not yet given back
+	int urgency;			// 0 (most urgent) to 7
+	int incremental;		// nonzero if the body is useful as it arrives
+	int prioritized;		// set once a priority field has been seen
+	unsigned long turn;		// when the stream last sent, for round robin
+	size_t bodyNext;		// next byte of the body in the context's output buffer
+	size_t bodyEnd;			// end of the body in the output buffer
+	struct h2_stream *next;
+	} h2_stream;
+
+// Define type of struct for a session
+typedef struct h2_session {
+	connection *conn;		// the client connection
+	hpack_table decoder;	// table for request headers
+	hpack_table encoder;	// table for response headers
+	connection_pool pool;	// the stream contexts
+	h2_stream *streams;		// open streams
+	int streamCount;
+	unsigned int lastStream;	// highest stream the client has opened
+	long long window;		// bytes the client will accept on the connection
+	long long recvWindow;	// bytes the client may still send on the connection
+	long long unacknowledged;	// bytes received but not yet given back
+	long long initialWindow;	// the client's initial stream window
+	size_t maxFrame;		// largest frame payload to send
+	unsigned char *block;	// header block waiting for CONTINUATION frames
+	size_t blockLength;
+	size_t blockSize;
+	unsigned int blockStream;	// stream of the waiting header block, or 0
+	int blockFlags;			// flags of the HEADERS frame that started it
+	int blockWeight;		// its RFC 7540 weight, or -1 if it had none
+	int goawaySent;
+	int goawayReceived;
+	unsigned long turn;		// bumped each time a stream sends
+	} h2_session;
+
+/*
+ * Function prototypes for the http2.c file
+ */
+static unsigned int h2_get32(const unsigned char *in);
+
+static void h2_put32(unsigned char *out, unsigned int value);
+
+static int h2_frame(h2_session *session, int type, int flags, unsigned int id, const void *payload, size_t length);
+
+static int h2_reset(h2_session *session, unsigned int id, unsigned int error);
+
+static int h2_goaway(h2_session *session, unsigned int error);
+
+static int h2_window_update(h2_session *session, unsigned int id, long long increment);
+
+static ssize_t h2_fill(h2_session *session);
+
+static h2_stream *h2_stream_find(h2_session *session, unsigned int id);
+
+static h2_stream *h2_stream_open(h2_session *session, unsigned int id);
+
+static void h2_stream_free(h2_session *session, h2_stream *stream);
+
+static int h2_stream_close(h2_session *session, h2_stream *stream);
+
+static void h2_weight(h2_stream *stream, int weight);
+
+static void h2_priority(h2_stream *stream, const char *value, size_t length);
+
+static int h2_request_line(h2_stream *stream);
+
+static void h2_field(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength);
+
+static void h2_field_discard(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength);
+
+static int h2_dispatch(h2_session *session, h2_stream *stream);
+
+static int h2_respond(h2_session *session, h2_stream *stream);
+
+static int h2_header_block(h2_session *session, unsigned int id, int flags, int weight, const unsigned char *block,
+		size_t length);
+
+static int h2_settings(h2_session *session, const unsigned char *payload, size_t length);
+
+static int h2_on_data(h2_session *session, int flags, unsigned int id, const unsigned char *payload, size_t length);
+
+static int h2_on_headers(h2_session *session, int flags, unsigned int id, const unsigned char *payload, size_t length);
+
+static int h2_on_continuation(h2_session *session, int flags, unsigned int id, const unsigned char *payload,
+		size_t length);
+
+static int h2_on_window_update(h2_session *session, unsigned int id, const unsigned char *payload, size_t length);
+
+static int h2_on_frame(h2_session *session, int type, int flags, unsigned int id, const unsigned char *payload,
+		size_t length);
+
+static int h2_read_frames(h2_session *session);
+
+static ssize_t h2_send_data(h2_session *session);
+
+static int h2_upgrade_requested(connection *conn);
+
+static ssize_t h2_base64url_decode(const char *in, unsigned char *out, size_t space);
+
+static int h2_upgrade(h2_session *session);
+
+static void h2_run(connection *conn, int upgrade);
+
+/*
+ * Function: h2_get32
+ * ----------------------------
+ *   Reads a 32-bit big-endian number.
+ *
+ *	 Parameters:
+ *   in: The first byte
+ *
+ *   Returns: the number
+ */
+static unsigned int h2_get32(const unsigned char *in)
+{
+	return ((unsigned int) in[0] << 24) | ((unsigned int) in[1] << 16) | ((unsigned int) in[2] << 8) | in[3];
+}
+
+/*
+ * Function: h2_put32
+ * ----------------------------
+ *   Writes a 32-bit big-endian number.
+ *
+ *	 Parameters:
+ *   out: Where to write
+ *   value: The number
+ *
+ *   Returns: nothing
+ */
+static void h2_put32(unsigned char *out, unsigned int value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+/*
+ * Function: h2_frame
+ * ----------------------------
+ *   Queues a frame on the client connection. Nothing is sent until the
+ *   connection is flushed.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   type: The frame type
+ *   flags: The frame flags
+ *   id: The stream, or 0 for the connection
+ *   payload: The payload, or NULL if the caller sends it
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int h2_frame(h2_session *session, int type, int flags, unsigned int id, const void *payload, size_t length)
+{
+	unsigned char header[H2_HEADER_SIZE];
+
+	header[0] = length >> 16;
+	header[1] = length >> 8;
+	header[2] = length;
+	header[3] = type;
+	header[4] = flags;
+	h2_put32(header + 5, id & H2_WINDOW_MAX);
+
+	if (connection_write(session->conn, header, sizeof(header)) != 0 ||
+			(payload != NULL && length > 0 && connection_write(session->conn, payload, length) != 0))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function: h2_reset
+ * ----------------------------
+ *   Queues a RST_STREAM frame.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   id: The stream
+ *   error: The error code
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int h2_reset(h2_session *session, unsigned int id, unsigned int error)
+{
+	unsigned char payload[4];
+
+	h2_put32(payload, error);
+	return h2_frame(session, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+/*
+ * Function: h2_goaway
+ * ----------------------------
+ *   Queues a GOAWAY frame naming the last stream the session will handle.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   error: The error code, H2_NO_ERROR for a graceful close
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int h2_goaway(h2_session *session, unsigned int error)
+{
+	unsigned char payload[8];
+
+	h2_put32(payload, session->lastStream);
+	h2_put32(payload + 4, error);
+	session->goawaySent = 1;
+	return h2_frame(session, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+/*
+ * Function: h2_window_update
+ * ----------------------------
+ *   Queues a WINDOW_UPDATE frame.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   id: The stream, or 0 for the connection
+ *   increment: The bytes given back
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int h2_window_update(h2_session *session, unsigned int id, long long increment)
+{
+	unsigned char payload[4];
+
+	h2_put32(payload, (unsigned int) increment);
+	return h2_frame(session, H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/*
+ * Function: h2_fill
+ * ----------------------------
+ *   Moves unread frames to the front of the client connection's input
+ *   buffer and receives more data after them.
+ *
+ *	 Parameters:
+ *   session: The session
+ *
+ *   Returns: the number of bytes received, 0 if the client closed the
+ *   connection, or -1 on error or timeout
+ */
+static ssize_t h2_fill(h2_session *session)
+{
+	connection *conn = session->conn;
+
+	if (conn->inpos > 0)
+	{
+		conn->inlen -= conn->inpos;
+		memmove(conn->inbuf, conn->inbuf + conn->inpos, conn->inlen);
+		conn->inpos = 0;
+	}
+
+	return connection_fill(conn);
+}
+
+/*
+ * Function: h2_stream_find
+ * ----------------------------
+ *   Finds an open stream.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   id: The stream
+ *
+ *   Returns: the stream, or NULL if it is not open
+ */
+static h2_stream *h2_stream_find(h2_session *session, unsigned int id)
+{
+	h2_stream *stream;
+
+	for (stream = session->streams; stream != NULL; stream = stream->next)
+	{
+		if (stream->id == id)
+		{
+			return stream;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Function: h2_stream_open
+ * ----------------------------
+ *   Opens a stream with a connection context to handle its request in.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   id: The stream
+ *
+ *   Returns: the stream, or NULL if memory could not be allocated
+ */
+static h2_stream *h2_stream_open(h2_session *session, unsigned int id)
+{
+	h2_stream *stream = (h2_stream *) calloc(1, sizeof(h2_stream));
+
+	if (stream == NULL)
+	{
+		return NULL;
+	}
+
+	// The context shares the client's socket so logs and traces name it
+	stream->conn = connection_acquire(&(session->pool), session->conn->sockfd);
+	if (stream->conn == NULL)
+	{
+		free(stream);
+		return NULL;
+	}
+	stream->conn->http2 = 1;
+	stream->conn->secure = session->conn->secure;
+	stream->conn->local = session->conn->local;
+	stream->conn->peerPid = session->conn->peerPid;
+	stream->conn->peerUid = session->conn->peerUid;
+	stream->conn->peerGid = session->conn->peerGid;
+	stream->conn->state = CONN_READING_HEADER;
+
+	stream->id = id;
+	stream->window = session->initialWindow;
+	stream->recvWindow = H2_WINDOW;
+	stream->urgency = H2_URGENCY_DEFAULT;
+	stream->next = session->streams;
+	session->streams = stream;
+	session->streamCount += 1;
+	return stream;
+}
+
+/*
+ * Function: h2_stream_free
+ * ----------------------------
+ *   Removes a stream from the session and returns its context to the
+ *   session's pool.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   stream: The stream
+ *
+ *   Returns: nothing
+ */
+static void h2_stream_free(h2_session *session, h2_stream *stream)
+{
+	h2_stream **link = &(session->streams);
+
+	while (*link != stream)
+	{
+		link = &((*link)->next);
+	}
+	*link = stream->next;
+	session->streamCount -= 1;
+
+	// The socket belongs to the client connection
+	stream->conn->sockfd = -1;
+	connection_release(&(session->pool), stream->conn);
+	free(stream->path);
+	free(stream->authority);
+	free(stream);
+}
+
+/*
+ * Function: h2_stream_close
+ * ----------------------------
+ *   Finishes a stream whose response has been sent. A client still
+ *   sending is told to stop, as the response did not need the rest.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   stream: The stream
+ *
+ *   Returns: 0 if successful, -1 if memory could not be allocated
+ */
+static int h2_stream_close(h2_session *session, h2_stream *stream)
+{
+	int result = 0;
+
+	if (!stream->remoteClosed)
+	{
+		result = h2_reset(session, stream->id, H2_NO_ERROR);
+	}
+
+	trace_finish(stream->conn);
+	h2_stream_free(session, stream);
+	return result;
+}
+
+/*
+ * Function: h2_weight
+ * ----------------------------
+ *   Sets a stream's urgency from an RFC 7540 weight, for clients that
+ *   send no priority header. The default weight of 16 is the default
+ *   urgency.
+ *
+ *	 Parameters:
+ *   stream: The stream
+ *   weight: The weight, 1 to 256
+ *
+ *   Returns: nothing
+ */
+static void h2_weight(h2_stream *stream, int weight)
+{
+	if (weight >= 128)
+	{
+		stream->urgency = H2_URGENCY_DEFAULT - 1;
+	}
+	else if (weight >= 16)
+	{
+		stream->urgency = H2_URGENCY_DEFAULT;
+	}
+	else
+	{
+		stream->urgency = H2_URGENCY_DEFAULT + 1;
+	}
+}
+
+/*
+ * Function: h2_priority
+ * ----------------------------
+ *   Applies an RFC 9218 priority field value, such as "u=1, i", to a
+ *   stream. Parameters that are not understood are ignored.
+ *
+ *	 Parameters:
+ *   stream: The stream
+ *   value: The field value
+ *   length: The length of the value
+ *
+ *   Returns: nothing
+ */
+static void h2_priority(h2_stream *stream, const char *value, size_t length)
+{
+	const char *end = value + length;
+	const char *item;
+
+	stream->prioritized = 1;
+	while (value < end)
+	{
+		while (value < end && (*value == ' ' || *value == '\t' || *value == ','))
+		{
+			value++;
+		}
+		item = value;
+		while (value < end && *value != ',')
+		{
+			value++;
+		}
+
+		if (value - item >= 3 && item[0] == 'u' && item[1] == '=' && item[2] >= '0' && item[2] <= '7')
+		{
+			stream->urgency = item[2] - '0';
+		}
+		else if (item < value && item[0] == 'i' && (value - item == 1 || item[1] == ' ' || item[1] == ';'))
+		{
+			stream->incremental = 1;
+		}
+		else if (value - item >= 4 && !strncmp(item, "i=?", 3))
+		{
+			stream->incremental = item[3] == '1';
+		}
+	}
+}
+
+/*
+ * Function: h2_request_line
+ * ----------------------------
+ *   Writes the HTTP/1.1 request line and Host field from the stream's
+ *   pseudo-headers, once they have all been seen.
+ *
+ *	 Parameters:
+ *   stream: The stream
+ *
+ *   Returns: 0 if successful, -1 if the request is malformed
+ */
+static int h2_request_line(h2_stream *stream)
+{
+	connection *conn = stream->conn;
+
+	stream->fieldsStarted = 1;
+	if (stream->method[0] == '\0' || stream->path == NULL)
+	{
+		stream->malformed = 1;
+		return -1;
+	}
+
+	if (connection_feed(conn, stream->method, strlen(stream->method)) != 0 ||
+			connection_feed(conn, " ", 1) != 0 ||
+			connection_feed(conn, stream->path, strlen(stream->path)) != 0 ||
+			connection_feed(conn, " HTTP/1.1\r\n", 11) != 0 ||
+			(stream->authority != NULL && (connection_feed(conn, "Host: ", 6) != 0 ||
+			connection_feed(conn, stream->authority, strlen(stream->authority)) != 0 ||
+			connection_feed(conn, "\r\n", 2) != 0)))
+	{
+		stream->reject = 500;
+		return -1;
+	}
+
+	stream->headOnly = !strcmp(stream->method, "HEAD");
+	return 0;
+}
+
+/*
+ * Function: h2_field
+ * ----------------------------
+ *   Takes one decoded request header field. Pseudo-headers are kept
+ *   until the request line can be written; other fields are written as
+ *   HTTP/1.1 header lines, except those HTTP/2 does the work of.
+ *
+ *	 Parameters:
+ *   arg: The stream
+ *   name: The field's name
+ *   nameLength: The length of the name
+ *   value: The field's value
+ *   valueLength: The length of the value
+ *
+ *   Returns: nothing
+ */
+static void h2_field(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength)
+{
+	h2_stream *stream = (h2_stream *) arg;
+	connection *conn = stream->conn;
+	char **pseudo = NULL;
+	size_t i;
+
+	if (stream->malformed || stream->reject)
+	{
+		return;
+	}
+
+	// Nothing may smuggle a line break into the HTTP/1.1 request
+	if (nameLength == 0 || memchr(value, '\r', valueLength) != NULL || memchr(value, '\n', valueLength) != NULL
+			|| memchr(value, '\0', valueLength) != NULL)
+	{
+		stream->malformed = 1;
+		return;
+	}
+
+	if (name[0] == ':')
+	{
+		if (stream->fieldsStarted)
+		{
+			stream->malformed = 1;
+		}
+		else if (nameLength == 7 && !memcmp(name, ":method", 7))
+		{
+			if (stream->method[0] != '\0' || valueLength == 0 || valueLength >= sizeof(stream->method))
+			{
+				stream->malformed = 1;
+				return;
+			}
+			memcpy(stream->method, value, valueLength);
+			stream->method[valueLength] = '\0';
+		}
+		else if (nameLength == 5 && !memcmp(name, ":path", 5))
+		{
+			pseudo = &(stream->path);
+		}
+		else if (nameLength == 10 && !memcmp(name, ":authority", 10))
+		{
+			pseudo = &(stream->authority);
+		}
+		else if (nameLength != 7 || memcmp(name, ":scheme", 7) != 0)
+		{
+			stream->malformed = 1;
+		}
+
+		if (pseudo != NULL)
+		{
+			if (*pseudo != NULL || valueLength == 0 || (*pseudo = strndup(value, valueLength)) == NULL)
+			{
+				stream->malformed = 1;
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < nameLength; i++)
+	{
+		if ((name[i] >= 'A' && name[i] <= 'Z') || name[i] == ':' || name[i] == ' ' || name[i] == '\r'
+				|| name[i] == '\n' || name[i] == '\0')
+		{
+			stream->malformed = 1;
+			return;
+		}
+	}
+
+	if (!stream->fieldsStarted && h2_request_line(stream) != 0)
+	{
+		return;
+	}
+
+	// Connection-specific fields have no meaning in HTTP/2
+	if ((nameLength == 10 && !memcmp(name, "connection", 10)) ||
+			(nameLength == 10 && !memcmp(name, "keep-alive", 10)) ||
+			(nameLength == 16 && !memcmp(name, "proxy-connection", 16)) ||
+			(nameLength == 17 && !memcmp(name, "transfer-encoding", 17)) ||
+			(nameLength == 7 && !memcmp(name, "upgrade", 7)) ||
+			(nameLength == 2 && !memcmp(name, "te", 2) && (valueLength != 8 || memcmp(value, "trailers", 8) != 0)))
+	{
+		stream->malformed = 1;
+		return;
+	}
+
+	// The body's length is known from its frames and there is no 100 Continue
+	if ((nameLength == 14 && !memcmp(name, "content-length", 14)) ||
+			(nameLength == 6 && !memcmp(name, "expect", 6)) ||
+			(nameLength == 4 && !memcmp(name, "host", 4) && stream->authority != NULL))
+	{
+		return;
+	}
+
+	if (nameLength == 8 && !memcmp(name, "priority", 8))
+	{
+		h2_priority(stream, value, valueLength);
+	}
+
+	if (conn->inlen + nameLength + valueLength + 4 > MAX_HEADER_SIZE)
+	{
+		stream->reject = 400;
+		return;
+	}
+
+	if (connection_feed(conn, name, nameLength) != 0 || connection_feed(conn, ": ", 2) != 0 ||
+			connection_feed(conn, value, valueLength) != 0 || connection_feed(conn, "\r\n", 2) != 0)
+	{
+		stream->reject = 500;
+	}
+}
+
+/*
+ * Function: h2_field_discard
+ * ----------------------------
+ *   Takes a decoded field that is not wanted, such as one from a trailer
+ *   or a refused stream. The block must still be decoded to keep the
+ *   tables in step.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *   name: not used
+ *   nameLength: not used
+ *   value: not used
+ *   valueLength: not used
+ *
+ *   Returns: nothing
+ */
+static void h2_field_discard(void *arg, const char *name, size_t nameLength, const char *value, size_t valueLength)
+{
+}
+
+/*
+ * Function: h2_dispatch
+ * ----------------------------
+ *   Completes a stream's HTTP/1.1 request with its body, passes it to
+ *   the handler for its method, and frames the response.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   stream: The stream, whose request is complete or rejected
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_dispatch(h2_session *session, h2_stream *stream)
+{
+	connection *conn = stream->conn;
+	char length[40];
+	int size;
+
+	stream->dispatched = 1;
+
+	// The body was gathered in the output buffer
+	if (stream->reject == 0)
+	{
+		size = sprintf(length, "Content-Length: %lu\r\n\r\n", (unsigned long) conn->outlen);
+		if (connection_feed(conn, length, size) != 0)
+		{
+			stream->reject = 500;
+		}
+		else
+		{
+			conn->headerlen = conn->inlen;
+			if (connection_feed(conn, conn->outbuf, conn->outlen) != 0)
+			{
+				stream->reject = 500;
+			}
+		}
+	}
+	if (stream->reject != 0)
+	{
+		connection_feed(conn, "\r\n", 2);
+		conn->headerlen = conn->inlen;
+	}
+
+	conn->outlen = 0;
+	conn->inpos = conn->headerlen;
+	conn->state = CONN_PROCESSING;
+	conn->requests = 1;
+	conn->keepAlive = 0;
+
+	trace_request(conn);
+	PROBE2(request, conn->sockfd, conn->span.request);
+
+	if (stream->reject != 0)
+	{
+		sendError(conn, stream->reject);
+	}
+	else
+	{
+		dispatchRequest(conn);
+	}
+
+	return h2_respond(session, stream);
+}
+
+/*
+ * Function: h2_respond
+ * ----------------------------
+ *   Turns the HTTP/1.1 response a handler wrote into a HEADERS frame,
+ *   with CONTINUATION frames if it is large, and leaves the body in the
+ *   output buffer, or the attached file, for the scheduler to send.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   stream: The stream
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_respond(h2_session *session, h2_stream *stream)
+{
+	connection *conn = stream->conn;
+	char *header = conn->outbuf;
+	char *end = NULL;
+	char *other;
+	char *line;
+	char *next;
+	char *colon;
+	char *value;
+	char *c;
+	unsigned char *block;
+	size_t blockSize;
+	size_t used;
+	size_t more;
+	size_t nameLength;
+	size_t valueLength;
+	size_t offset;
+	size_t piece;
+	int status;
+	int hasBody;
+	int type;
+	int result = 0;
+
+	// The header ends at the first blank line, whichever line ending it uses
+	if (conn->outlen > 0)
+	{
+		end = memmem(header, conn->outlen, "\r\n\r\n", 4);
+		other = memmem(header, conn->outlen, "\n\n", 2);
+		if (other != NULL && (end == NULL || other < end))
+		{
+			end = other;
+		}
+	}
+	if (end == NULL || conn->outlen < 12 || strncmp(header, "HTTP/1.", 7) != 0)
+	{
+		LOG_WARN("Thread %u: No response to frame for HTTP/2 stream %u", (unsigned int) pthread_self(), stream->id);
+		if (h2_reset(session, stream->id, H2_INTERNAL_ERROR) != 0)
+		{
+			return H2_INTERNAL_ERROR;
+		}
+		h2_stream_free(session, stream);
+		return 0;
+	}
+	status = atoi(header + 9);
+	stream->bodyNext = end - header + (*end == '\r' ? 4 : 2);
+	stream->bodyEnd = conn->outlen;
+	if (stream->headOnly)
+	{
+		stream->bodyNext = stream->bodyEnd;
+		connection_close_file(conn);
+	}
+	hasBody = stream->bodyNext < stream->bodyEnd || conn->fileRemaining > 0;
+
+	blockSize = (end - header) * 2 + 64;
+	block = (unsigned char *) malloc(blockSize);
+	if (block == NULL)
+	{
+		return H2_INTERNAL_ERROR;
+	}
+
+	used = hpack_encode_status(&(session->encoder), block, blockSize, status);
+	for (line = memchr(header, '\n', end - header); used > 0 && line != NULL && line < end; line = next)
+	{
+		line++;
+		next = memchr(line, '\n', end - line);
+		if (next == NULL)
+		{
+			next = end;
+		}
+
+		colon = memchr(line, ':', next - line);
+		if (colon == NULL || colon == line)
+		{
+			continue;
+		}
+		nameLength = colon - line;
+		for (c = line; c < colon; c++)
+		{
+			if (*c >= 'A' && *c <= 'Z')
+			{
+				*c += 'a' - 'A';
+			}
+		}
+
+		value = colon + 1;
+		while (value < next && (*value == ' ' || *value == '\t'))
+		{
+			value++;
+		}
+		valueLength = next - value;
+		while (valueLength > 0 && (value[valueLength - 1] == '\r' || value[valueLength - 1] == ' '))
+		{
+			valueLength--;
+		}
+
+		// HTTP/2 has no connection-specific fields
+		if ((nameLength == 10 && !memcmp(line, "connection", 10)) ||
+				(nameLength == 10 && !memcmp(line, "keep-alive", 10)) ||
+				(nameLength == 16 && !memcmp(line, "proxy-connection", 16)) ||
+				(nameLength == 17 && !memcmp(line, "transfer-encoding", 17)) ||
+				(nameLength == 7 && !memcmp(line, "upgrade", 7)))
+		{
+			continue;
+		}
+
+		// Fields that change with every response are not worth indexing
+		more = hpack_encode(&(session->encoder), block + used, blockSize - used, line, nameLength, value,
+				valueLength, !((nameLength == 4 && !memcmp(line, "date", 4)) ||
+				(nameLength == 14 && !memcmp(line, "content-length", 14)) ||
+				(nameLength == 4 && !memcmp(line, "etag", 4)) ||
+				(nameLength == 13 && !memcmp(line, "last-modified", 13))));
+		used = more == 0 ? 0 : used + more;
+	}
+
+	// A half-written block has changed the table, so the session is lost
+	if (used == 0)
+	{
+		free(block);
+		return H2_INTERNAL_ERROR;
+	}
+
+	for (offset = 0, type = H2_HEADERS; offset < used; offset += piece, type = H2_CONTINUATION)
+	{
+		piece = used - offset < session->maxFrame ? used - offset : session->maxFrame;
+		if (h2_frame(session, type, (offset + piece == used ? H2_FLAG_END_HEADERS : 0) |
+				(type == H2_HEADERS && !hasBody ? H2_FLAG_END_STREAM : 0), stream->id, block + offset, piece) != 0)
+		{
+			result = H2_INTERNAL_ERROR;
+			break;
+		}
+	}
+	free(block);
+
+	conn->span.status = status;
+	LOG_TRACE("Thread %u: Sent header information for HTTP/2 stream %u", (unsigned int) pthread_self(), stream->id);
+
+	if (result == 0 && !hasBody && h2_stream_close(session, stream) != 0)
+	{
+		result = H2_INTERNAL_ERROR;
+	}
+	return result;
+}
+
+/*
+ * Function: h2_header_block
+ * ----------------------------
+ *   Handles a complete header block: a new request, a trailer, or a block
+ *   for a stream the session will not take, which is decoded and dropped.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   id: The stream
+ *   flags: The flags of the HEADERS frame
+ *   weight: The RFC 7540 weight from the HEADERS frame, or -1
+ *   block: The header block
+ *   length: The length of the block
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_header_block(h2_session *session, unsigned int id, int flags, int weight, const unsigned char *block,
+		size_t length)
+{
+	h2_stream *stream = h2_stream_find(session, id);
+
+	// A second block on an open stream is a trailer, which must end it
+	if (stream != NULL)
+	{
+		if (stream->remoteClosed || !(flags & H2_FLAG_END_STREAM))
+		{
+			return H2_PROTOCOL_ERROR;
+		}
+		if (hpack_decode(&(session->decoder), block, length, h2_field_discard, NULL) != 0)
+		{
+			return H2_COMPRESSION_ERROR;
+		}
+		stream->remoteClosed = 1;
+		return stream->dispatched ? 0 : h2_dispatch(session, stream);
+	}
+
+	if (id <= session->lastStream || (id & 1) == 0)
+	{
+		// A stream that has been reset may still have frames on the way
+		if ((id & 1) == 0)
+		{
+			return H2_PROTOCOL_ERROR;
+		}
+		return hpack_decode(&(session->decoder), block, length, h2_field_discard, NULL) != 0 ? H2_COMPRESSION_ERROR : 0;
+	}
+	session->lastStream = id;
+
+	if (session->goawaySent || session->streamCount >= H2_MAX_STREAMS ||
+			(stream = h2_stream_open(session, id)) == NULL)
+	{
+		if (hpack_decode(&(session->decoder), block, length, h2_field_discard, NULL) != 0)
+		{
+			return H2_COMPRESSION_ERROR;
+		}
+		return h2_reset(session, id, H2_REFUSED_STREAM) != 0 ? H2_INTERNAL_ERROR : 0;
+	}
+
+	if (hpack_decode(&(session->decoder), block, length, h2_field, stream) != 0)
+	{
+		return H2_COMPRESSION_ERROR;
+	}
+	if (!stream->fieldsStarted && !stream->reject)
+	{
+		h2_request_line(stream);
+	}
+	stream->headersDone = 1;
+	if (weight >= 0 && !stream->prioritized)
+	{
+		h2_weight(stream, weight);
+	}
+
+	if (stream->malformed)
+	{
+		LOG_WARN("Malformed request on HTTP/2 stream %u", id);
+		h2_stream_free(session, stream);
+		return h2_reset(session, id, H2_PROTOCOL_ERROR) != 0 ? H2_INTERNAL_ERROR : 0;
+	}
+
+	if (flags & H2_FLAG_END_STREAM)
+	{
+		stream->remoteClosed = 1;
+		return h2_dispatch(session, stream);
+	}
+
+	// A request whose header was refused is answered without its body
+	return stream->reject ? h2_dispatch(session, stream) : 0;
+}
+
+/*
+ * Function: h2_settings
+ * ----------------------------
+ *   Applies the client's settings.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   payload: The settings, six bytes each
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_settings(h2_session *session, const unsigned char *payload, size_t length)
+{
+	h2_stream *stream;
+	unsigned int value;
+	long long delta;
+	size_t i;
+
+	if (length % 6 != 0)
+	{
+		return H2_FRAME_SIZE_ERROR;
+	}
+
+	for (i = 0; i < length; i += 6)
+	{
+		value = h2_get32(payload + i + 2);
+		switch ((payload[i] << 8) | payload[i + 1])
+		{
+			case H2_SETTINGS_HEADER_TABLE_SIZE:
+				hpack_table_limit(&(session->encoder), value);
+				break;
+			case H2_SETTINGS_ENABLE_PUSH:
+				if (value > 1)
+				{
+					return H2_PROTOCOL_ERROR;
+				}
+				break;
+			case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+				if (value > H2_WINDOW_MAX)
+				{
+					return H2_FLOW_CONTROL_ERROR;
+				}
+
+				// Open streams' windows move by the change
+				delta = (long long) value - session->initialWindow;
+				session->initialWindow = value;
+				for (stream = session->streams; stream != NULL; stream = stream->next)
+				{
+					stream->window += delta;
+					if (stream->window > H2_WINDOW_MAX)
+					{
+						return H2_FLOW_CONTROL_ERROR;
+					}
+				}
+				break;
+			case H2_SETTINGS_MAX_FRAME_SIZE:
+				if (value < H2_FRAME_SIZE || value > 0xffffff)
+				{
+					return H2_PROTOCOL_ERROR;
+				}
+				session->maxFrame = value < H2_SEND_BUDGET ? value : H2_SEND_BUDGET;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: h2_on_data
+ * ----------------------------
+ *   Handles a DATA frame: the body is gathered in the stream's output
+ *   buffer, and the client's windows are given back as it arrives.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   flags: The frame flags
+ *   id: The stream
+ *   payload: The payload
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_on_data(h2_session *session, int flags, unsigned int id, const unsigned char *payload, size_t length)
+{
+	h2_stream *stream;
+	size_t data = length;
+
+	if (id == 0 || id > session->lastStream)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+	if (flags & H2_FLAG_PADDED)
+	{
+		if (length == 0 || payload[0] >= length)
+		{
+			return H2_PROTOCOL_ERROR;
+		}
+		data = length - 1 - payload[0];
+		payload++;
+	}
+
+	// Padding counts against the windows too
+	session->recvWindow -= length;
+	if (session->recvWindow < 0)
+	{
+		return H2_FLOW_CONTROL_ERROR;
+	}
+	session->unacknowledged += length;
+	if (session->unacknowledged >= H2_WINDOW / 2)
+	{
+		if (h2_window_update(session, 0, session->unacknowledged) != 0)
+		{
+			return H2_INTERNAL_ERROR;
+		}
+		session->recvWindow += session->unacknowledged;
+		session->unacknowledged = 0;
+	}
+
+	// Frames still arriving for a stream that was reset are dropped
+	stream = h2_stream_find(session, id);
+	if (stream == NULL)
+	{
+		return 0;
+	}
+	if (stream->remoteClosed)
+	{
+		h2_stream_free(session, stream);
+		return h2_reset(session, id, H2_STREAM_CLOSED) != 0 ? H2_INTERNAL_ERROR : 0;
+	}
+
+	stream->recvWindow -= length;
+	if (stream->recvWindow < 0)
+	{
+		h2_stream_free(session, stream);
+		return h2_reset(session, id, H2_FLOW_CONTROL_ERROR) != 0 ? H2_INTERNAL_ERROR : 0;
+	}
+	if (flags & H2_FLAG_END_STREAM)
+	{
+		stream->remoteClosed = 1;
+	}
+	else
+	{
+		stream->unacknowledged += length;
+		if (stream->unacknowledged >= H2_WINDOW / 2)
+		{
+			if (h2_window_update(session, id, stream->unacknowledged) != 0)
+			{
+				return H2_INTERNAL_ERROR;
+			}
+			stream->recvWindow += stream->unacknowledged;
+			stream->unacknowledged = 0;
+		}
+	}
+
+	// A stream already answered only needs the rest of its body drained
+	if (stream->dispatched)
+	{
+		return 0;
+	}
+
+	if (stream->conn->outlen + data > (unsigned long long) config_current()->settings.maxBodySize)
+	{
+		stream->reject = 413;
+		stream->conn->outlen = 0;
+		return h2_dispatch(session, stream);
+	}
+	if (connection_write(stream->conn, payload, data) != 0)
+	{
+		stream->reject = 500;
+		stream->conn->outlen = 0;
+		return h2_dispatch(session, stream);
+	}
+
+	return stream->remoteClosed ? h2_dispatch(session, stream) : 0;
+}
+
+/*
+ * Function: h2_on_headers
+ * ----------------------------
+ *   Handles a HEADERS frame. A block that does not fit in one frame is
+ *   kept until its CONTINUATION frames arrive.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   flags: The frame flags
+ *   id: The stream
+ *   payload: The payload
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_on_headers(h2_session *session, int flags, unsigned int id, const unsigned char *payload,
+		size_t length)
+{
+	size_t padding = 0;
+	int weight = -1;
+
+	if (id == 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+	if (flags & H2_FLAG_PADDED)
+	{
+		if (length == 0)
+		{
+			return H2_FRAME_SIZE_ERROR;
+		}
+		padding = payload[0];
+		payload++;
+		length--;
+	}
+	if (flags & H2_FLAG_PRIORITY)
+	{
+		if (length < 5)
+		{
+			return H2_FRAME_SIZE_ERROR;
+		}
+		if ((h2_get32(payload) & H2_WINDOW_MAX) == id)
+		{
+			return H2_PROTOCOL_ERROR;
+		}
+		weight = payload[4] + 1;
+		payload += 5;
+		length -= 5;
+	}
+	if (padding > length)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+	length -= padding;
+
+	if (!(flags & H2_FLAG_END_HEADERS))
+	{
+		if (length > MAX_HEADER_SIZE)
+		{
+			return H2_ENHANCE_YOUR_CALM;
+		}
+		session->block = (unsigned char *) malloc(MAX_HEADER_SIZE);
+		if (session->block == NULL)
+		{
+			return H2_INTERNAL_ERROR;
+		}
+		memcpy(session->block, payload, length);
+		session->blockLength = length;
+		session->blockSize = MAX_HEADER_SIZE;
+		session->blockStream = id;
+		session->blockFlags = flags;
+		session->blockWeight = weight;
+		return 0;
+	}
+
+	return h2_header_block(session, id, flags, weight, payload, length);
+}
+
+/*
+ * Function: h2_on_continuation
+ * ----------------------------
+ *   Handles a CONTINUATION frame, adding to the header block that is
+ *   waiting and handling the block once it is complete.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   flags: The frame flags
+ *   id: The stream
+ *   payload: The payload
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_on_continuation(h2_session *session, int flags, unsigned int id, const unsigned char *payload,
+		size_t length)
+{
+	int result;
+
+	if (session->blockStream == 0 || id != session->blockStream)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+	if (length > session->blockSize - session->blockLength)
+	{
+		return H2_ENHANCE_YOUR_CALM;
+	}
+	memcpy(session->block + session->blockLength, payload, length);
+	session->blockLength += length;
+
+	if (!(flags & H2_FLAG_END_HEADERS))
+	{
+		return 0;
+	}
+
+	result = h2_header_block(session, id, session->blockFlags, session->blockWeight, session->block,
+			session->blockLength);
+	free(session->block);
+	session->block = NULL;
+	session->blockStream = 0;
+	return result;
+}
+
+/*
+ * Function: h2_on_window_update
+ * ----------------------------
+ *   Handles a WINDOW_UPDATE frame, widening the connection's or a
+ *   stream's send window.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   id: The stream, or 0 for the connection
+ *   payload: The payload
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_on_window_update(h2_session *session, unsigned int id, const unsigned char *payload, size_t length)
+{
+	h2_stream *stream;
+	unsigned int increment;
+
+	if (length != 4)
+	{
+		return H2_FRAME_SIZE_ERROR;
+	}
+	increment = h2_get32(payload) & H2_WINDOW_MAX;
+
+	if (id == 0)
+	{
+		session->window += increment;
+		return increment == 0 ? H2_PROTOCOL_ERROR : session->window > H2_WINDOW_MAX ? H2_FLOW_CONTROL_ERROR : 0;
+	}
+	if (id > session->lastStream)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	stream = h2_stream_find(session, id);
+	if (stream == NULL)
+	{
+		return 0;
+	}
+	stream->window += increment;
+	if (increment == 0 || stream->window > H2_WINDOW_MAX)
+	{
+		h2_stream_free(session, stream);
+		return h2_reset(session, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR) != 0
+				? H2_INTERNAL_ERROR : 0;
+	}
+	return 0;
+}
+
+/*
+ * Function: h2_on_frame
+ * ----------------------------
+ *   Handles one frame from the client.
+ *
+ *	 Parameters:
+ *   session: The session
+ *   type: The frame type
+ *   flags: The frame flags
+ *   id: The stream, or 0 for the connection
+ *   payload: The payload
+ *   length: The length of the payload
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_on_frame(h2_session *session, int type, int flags, unsigned int id, const unsigned char *payload,
+		size_t length)
+{
+	h2_stream *stream;
+	int result;
+
+	// Nothing may come between a header block's frames
+	if (session->blockStream != 0 && type != H2_CONTINUATION)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	switch (type)
+	{
+		case H2_DATA:
+			return h2_on_data(session, flags, id, payload, length);
+		case H2_HEADERS:
+			return h2_on_headers(session, flags, id, payload, length);
+		case H2_CONTINUATION:
+			return h2_on_continuation(session, flags, id, payload, length);
+		case H2_PRIORITY:
+			if (id == 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+			if (length != 5)
+			{
+				return H2_FRAME_SIZE_ERROR;
+			}
+			stream = h2_stream_find(session, id);
+			if ((h2_get32(payload) & H2_WINDOW_MAX) == id)
+			{
+				if (stream != NULL)
+				{
+					h2_stream_free(session, stream);
+				}
+				return h2_reset(session, id, H2_PROTOCOL_ERROR) != 0 ? H2_INTERNAL_ERROR : 0;
+			}
+			if (stream != NULL && !stream->prioritized)
+			{
+				h2_weight(stream, payload[4] + 1);
+			}
+			return 0;
+		case H2_RST_STREAM:
+			if (length != 4)
+			{
+				return H2_FRAME_SIZE_ERROR;
+			}
+			if (id == 0 || id > session->lastStream)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+			stream = h2_stream_find(session, id);
+			if (stream != NULL)
+			{
+				LOG_DEBUG("Thread %u: HTTP/2 stream %u reset by the client", (unsigned int) pthread_self(), id);
+				h2_stream_free(session, stream);
+			}
+			return 0;
+		case H2_SETTINGS:
+			if (id != 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+			if (flags & H2_FLAG_ACK)
+			{
+				return length != 0 ? H2_FRAME_SIZE_ERROR : 0;
+			}
+			result = h2_settings(session, payload, length);
+			if (result == 0 && h2_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0) != 0)
+			{
+				result = H2_INTERNAL_ERROR;
+			}
+			return result;
+		case H2_PUSH_PROMISE:
+			return H2_PROTOCOL_ERROR;
+		case H2_PING:
+			if (id != 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+			if (length != 8)
+			{
+				return H2_FRAME_SIZE_ERROR;
+			}
+			if (!(flags & H2_FLAG_ACK) && h2_frame(session, H2_PING, H2_FLAG_ACK, 0, payload, length) != 0)
+			{
+				return H2_INTERNAL_ERROR;
+			}
+			return 0;
+		case H2_GOAWAY:
+			if (id != 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+			if (length < 8)
+			{
+				return H2_FRAME_SIZE_ERROR;
+			}
+			session->goawayReceived = 1;
+			return 0;
+		case H2_WINDOW_UPDATE:
+			return h2_on_window_update(session, id, payload, length);
+		case H2_PRIORITY_UPDATE:
+			if (id != 0)
+			{
+				return H2_PROTOCOL_ERROR;
+			}
+			if (length < 4)
+			{
+				return H2_FRAME_SIZE_ERROR;
+			}
+			stream = h2_stream_find(session, h2_get32(payload) & H2_WINDOW_MAX);
+			if (stream != NULL)
+			{
+				h2_priority(stream, (const char *) payload + 4, length - 4);
+			}
+			return 0;
+		default:
+			// Frames of unknown types are ignored
+			return 0;
+	}
+}
+
+/*
+ * Function: h2_read_frames
+ * ----------------------------
+ *   Handles every complete frame in the client connection's input
+ *   buffer.
+ *
+ *	 Parameters:
+ *   session: The session
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_read_frames(h2_session *session)
+{
+	connection *conn = session->conn;
+	unsigned char *frame;
+	size_t length;
+	int result;
+
+	while (conn->inlen - conn->inpos >= H2_HEADER_SIZE)
+	{
+		frame = (unsigned char *) conn->inbuf + conn->inpos;
+		length = ((size_t) frame[0] << 16) | ((size_t) frame[1] << 8) | frame[2];
+		if (length > H2_FRAME_SIZE)
+		{
+			return H2_FRAME_SIZE_ERROR;
+		}
+		if (conn->inlen - conn->inpos < H2_HEADER_SIZE + length)
+		{
+			break;
+		}
+		conn->inpos += H2_HEADER_SIZE + length;
+
+		result = h2_on_frame(session, frame[3], frame[4], h2_get32(frame + 5) & H2_WINDOW_MAX,
+				frame + H2_HEADER_SIZE, length);
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: h2_send_data
+ * ----------------------------
+ *   Sends one DATA frame from the stream that should go next: the
+ *   lowest urgency first, incremental streams of the same urgency in
+ *   turn, and otherwise the oldest stream. A file body is sent from the
+ *   file with sendfile() after the frame header.
+ *
+ *	 Parameters:
+ *   session: The session
+ *
+ *   Returns: the bytes of body sent, 0 if no stream can send, or -1 if
+ *   the connection failed
+ */
+static ssize_t h2_send_data(h2_session *session)
+{
+	h2_stream *stream;
+	h2_stream *best = NULL;
+	connection *conn;
+	unsigned long turn;
+	unsigned long bestTurn = 0;
+	size_t memory;
+	size_t length;
+	size_t left;
+	ssize_t sent;
+	int last;
+
+	if (session->window <= 0)
+	{
+		return 0;
+	}
+
+	for (stream = session->streams; stream != NULL; stream = stream->next)
+	{
+		if (!stream->dispatched || stream->window <= 0)
+		{
+			continue;
+		}
+		turn = stream->incremental ? stream->turn : 0;
+		if (best == NULL || stream->urgency < best->urgency || (stream->urgency == best->urgency &&
+				(turn < bestTurn || (turn == bestTurn && stream->id < best->id))))
+		{
+			best = stream;
+			bestTurn = turn;
+		}
+	}
+	if (best == NULL)
+	{
+		return 0;
+	}
+
+	// The body in memory goes first, then the attached file
+	conn = best->conn;
+	memory = best->bodyEnd - best->bodyNext;
+	length = memory > 0 ? memory : (size_t) conn->fileRemaining;
+	if (length > session->maxFrame)
+	{
+		length = session->maxFrame;
+	}
+	if ((long long) length > session->window)
+	{
+		length = session->window;
+	}
+	if ((long long) length > best->window)
+	{
+		length = best->window;
+	}
+	last = (long long) length == (long long) memory + conn->fileRemaining;
+
+	if (memory > 0)
+	{
+		if (h2_frame(session, H2_DATA, last ? H2_FLAG_END_STREAM : 0, best->id, conn->outbuf + best->bodyNext,
+				length) != 0)
+		{
+			return -1;
+		}
+		best->bodyNext += length;
+	}
+	else
+	{
+		if (h2_frame(session, H2_DATA, last ? H2_FLAG_END_STREAM : 0, best->id, NULL, length) != 0 ||
+				connection_flush(session->conn) != 0)
+		{
+			return -1;
+		}
+
+		// The frame header promised the bytes, so a short file is fatal
+		for (left = length; left > 0; left -= sent)
+		{
+			sent = connection_sendfile(session->conn, conn->file->fd, &(conn->fileOffset), left);
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && connection_wait(session->conn, POLLOUT) == 0)
+			{
+				sent = 0;
+				continue;
+			}
+			if (sent <= 0)
+			{
+				return -1;
+			}
+			session->conn->bytesOut += sent;
+		}
+		conn->fileRemaining -= length;
+	}
+
+	session->window -= length;
+	best->window -= length;
+	best->turn = ++(session->turn);
+	conn->bytesOut += length;
+
+	if (last)
+	{
+		connection_close_file(conn);
+		if (h2_stream_close(session, best) != 0)
+		{
+			return -1;
+		}
+	}
+	return length;
+}
+
+/*
+ * Function: h2_upgrade_requested
+ * ----------------------------
+ *   Determines if a cleartext request asks to upgrade to h2c. Only GET
+ *   and HEAD are upgraded, so no request body is read as HTTP/1.1.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header
+ *
+ *   Returns: 1 if the connection should upgrade, 0 otherwise
+ */
+static int h2_upgrade_requested(connection *conn)
+{
+	char *upgrade;
+
+	if (conn->tls != NULL || (strncmp(conn->inbuf, "GET ", 4) != 0 && strncmp(conn->inbuf, "HEAD ", 5) != 0))
+	{
+		return 0;
+	}
+
+	upgrade = connection_header(conn, "Upgrade");
+	if (upgrade == NULL || strncasecmp(upgrade, "h2c", 3) != 0 ||
+			(upgrade[3] != '\r' && upgrade[3] != '\n' && upgrade[3] != ',' && upgrade[3] != ' '))
+	{
+		return 0;
+	}
+
+	return connection_header(conn, "HTTP2-Settings") != NULL;
+}
+
+/*
+ * Function: h2_base64url_decode
+ * ----------------------------
+ *   Decodes a base64url value, such as the HTTP2-Settings field, up to
+ *   the end of its line. Padding is ignored.
+ *
+ *	 Parameters:
+ *   in: The value
+ *   out: Where to put the decoded bytes
+ *   space: The bytes available at out
+ *
+ *   Returns: the number of bytes decoded, or -1 if the value is not
+ *   valid or does not fit
+ */
+static ssize_t h2_base64url_decode(const char *in, unsigned char *out, size_t space)
+{
+	unsigned int bits = 0;
+	size_t used = 0;
+	int count = 0;
+	int digit;
+
+	for (; *in != '\0' && *in != '\r' && *in != '\n' && *in != ' ' && *in != '='; in++)
+	{
+		if (*in >= 'A' && *in <= 'Z')
+		{
+			digit = *in - 'A';
+		}
+		else if (*in >= 'a' && *in <= 'z')
+		{
+			digit = *in - 'a' + 26;
+		}
+		else if (*in >= '0' && *in <= '9')
+		{
+			digit = *in - '0' + 52;
+		}
+		else if (*in == '-' || *in == '+')
+		{
+			digit = 62;
+		}
+		else if (*in == '_' || *in == '/')
+		{
+			digit = 63;
+		}
+		else
+		{
+			return -1;
+		}
+
+		bits = (bits << 6) | digit;
+		count += 6;
+		if (count >= 8)
+		{
+			count -= 8;
+			if (used >= space)
+			{
+				return -1;
+			}
+			out[used++] = (unsigned char) (bits >> count);
+		}
+	}
+
+	return used;
+}
+
+/*
+ * Function: h2_upgrade
+ * ----------------------------
+ *   Switches a cleartext connection to h2c. The client's settings come
+ *   from the HTTP2-Settings field, and the request that asked for the
+ *   upgrade becomes stream 1.
+ *
+ *	 Parameters:
+ *   session: The session
+ *
+ *   Returns: 0 if successful, or an HTTP/2 error code for the connection
+ */
+static int h2_upgrade(h2_session *session)
+{
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	connection *conn = session->conn;
+	unsigned char settings[H2_MAX_STREAMS * 6];
+	h2_stream *stream;
+	ssize_t length;
+	size_t header;
+
+	if (connection_write(conn, switching, sizeof(switching) - 1) != 0)
+	{
+		return H2_INTERNAL_ERROR;
+	}
+
+	length = h2_base64url_decode(connection_header(conn, "HTTP2-Settings"), settings, sizeof(settings));
+	if (length < 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+	if (h2_settings(session, settings, length) != 0)
+	{
+		return H2_PROTOCOL_ERROR;
+	}
+
+	// The request's header, less its blank line, starts stream 1
+	session->lastStream = 1;
+	stream = h2_stream_open(session, 1);
+	if (stream == NULL)
+	{
+		return H2_INTERNAL_ERROR;
+	}
+	header = conn->headerlen - (conn->headerlen >= 4 && conn->inbuf[conn->headerlen - 2] == '\r' ? 2 : 1);
+	if (connection_feed(stream->conn, conn->inbuf, header) != 0)
+	{
+		stream->reject = 500;
+	}
+	stream->fieldsStarted = 1;
+	stream->headersDone = 1;
+	stream->remoteClosed = 1;
+	stream->headOnly = !strncmp(conn->inbuf, "HEAD ", 5);
+	return 0;
+}
+
+/*
+ * Function: h2_run
+ * ----------------------------
+ *   Serves a connection as an HTTP/2 session until it closes. Frames are
+ *   read and handled as they arrive, and response bodies are sent between
+ *   reads. The client gets the keep-alive deadline while no stream is
+ *   open and the response deadline while one is.
+ *
+ *	 Parameters:
+ *   conn: The client connection, holding the start of the preface or
+ *   the request asking to upgrade
+ *   upgrade: Nonzero for an h2c upgrade
+ *
+ *   Returns: nothing
+ */
+static void h2_run(connection *conn, int upgrade)
+{
+	static const unsigned char serverSettings[] = {
+		0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+		0, H2_SETTINGS_ENABLE_PUSH, 0, 0, 0, 0
+	};
+	h2_session session;
+	struct pollfd waitfds[2];
+	size_t preface;
+	ssize_t sent = 0;
+	size_t round;
+	int error = 0;
+	int count;
+
+	memset(&session, 0, sizeof(session));
+	session.conn = conn;
+	session.window = H2_WINDOW;
+	session.recvWindow = H2_WINDOW;
+	session.initialWindow = H2_WINDOW;
+	session.maxFrame = H2_FRAME_SIZE;
+	session.blockWeight = -1;
+	connection_pool_init(&(session.pool));
+
+	LOG_DEBUG("Thread %u: HTTP/2 session %s on socket %i", (unsigned int) pthread_self(),
+			upgrade ? "upgraded" : "started", conn->sockfd);
+
+	if (hpack_table_init(&(session.decoder), HPACK_TABLE_SIZE) != 0 ||
+			hpack_table_init(&(session.encoder), HPACK_TABLE_SIZE) != 0)
+	{
+		LOG_ERROR("Unable to allocate the HPACK tables");
+		goto done;
+	}
+
+	// The server's preface is its SETTINGS frame
+	if (upgrade)
+	{
+		error = h2_upgrade(&session);
+	}
+	if (h2_frame(&session, H2_SETTINGS, 0, 0, serverSettings, sizeof(serverSettings)) != 0)
+	{
+		error = H2_INTERNAL_ERROR;
+	}
+	if (error == 0 && upgrade)
+	{
+		error = h2_dispatch(&session, session.streams);
+	}
+	if (error != 0 || connection_flush(conn) != 0)
+	{
+		goto done;
+	}
+
+	// The rest of the client's preface comes first; after an upgrade, all of it
+	preface = upgrade ? H2_PREFACE_LENGTH : H2_PREFACE_LENGTH - H2_PREFACE_HEADER;
+	conn->headerlen = 0;
+	connection_set_deadline(conn, CONN_TIMER_HEADER);
+	while (conn->inlen - conn->inpos < preface)
+	{
+		if (h2_fill(&session) <= 0)
+		{
+			goto done;
+		}
+	}
+	if (memcmp(conn->inbuf + conn->inpos, H2_PREFACE + H2_PREFACE_LENGTH - preface, preface) != 0)
+	{
+		error = H2_PROTOCOL_ERROR;
+		goto done;
+	}
+	conn->inpos += preface;
+
+	for (;;)
+	{
+		config_quiescent();
+
+		error = h2_read_frames(&session);
+		if (error != 0)
+		{
+			break;
+		}
+
+		// A draining server lets open streams finish and takes no new ones
+		if (server_draining() && !session.goawaySent && h2_goaway(&session, H2_NO_ERROR) != 0)
+		{
+			error = H2_INTERNAL_ERROR;
+			break;
+		}
+
+		for (round = 0; round < H2_SEND_BUDGET; round += sent)
+		{
+			sent = h2_send_data(&session);
+			if (sent <= 0)
+			{
+				break;
+			}
+		}
+		if (sent < 0 || connection_flush(conn) != 0)
+		{
+			break;
+		}
+
+		if (session.streamCount == 0 && (session.goawaySent || session.goawayReceived))
+		{
+			break;
+		}
+		connection_set_deadline(conn, session.streamCount > 0 ? CONN_TIMER_RESPONSE : CONN_TIMER_KEEPALIVE);
+
+		// Keep sending while there is more, unless frames are waiting
+		waitfds[0].fd = conn->sockfd;
+		waitfds[0].events = POLLIN;
+		if (sent > 0 && !tls_pending(conn) && poll(waitfds, 1, 0) <= 0)
+		{
+			continue;
+		}
+
+		// Otherwise wait for the client or the start of a drain
+		if (!tls_pending(conn))
+		{
+			waitfds[1].fd = session.goawaySent ? -1 : server_drain_fd();
+			waitfds[1].events = POLLIN;
+			config_offline();
+			count = coroutine_poll(waitfds, 2, -1);
+			config_quiescent();
+			if (count <= 0 || !(waitfds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			{
+				continue;
+			}
+		}
+
+		if (h2_fill(&session) <= 0)
+		{
+			break;
+		}
+	}
+
+done:
+	if (error != 0)
+	{
+		LOG_INFO("Thread %u: HTTP/2 connection error %d on socket %i", (unsigned int) pthread_self(), error,
+				conn->sockfd);
+		if (h2_goaway(&session, error) == 0)
+		{
+			connection_flush(conn);
+		}
+	}
+
+	while (session.streams != NULL)
+	{
+		h2_stream_free(&session, session.streams);
+	}
+	free(session.block);
+	hpack_table_destroy(&(session.decoder));
+	hpack_table_destroy(&(session.encoder));
+	connection_pool_destroy(&(session.pool));
+
+	conn->keepAlive = 0;
+	LOG_DEBUG("Thread %u: HTTP/2 session on socket %i closed", (unsigned int) pthread_self(), conn->sockfd);
+}
+
+/*
+ * Function: http2_start
+ * ----------------------------
+ *   Serves the connection as HTTP/2 if HTTP/2 is enabled and the client
+ *   sent the connection preface or asked to upgrade to h2c.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the first request header
+ *
+ *   Returns: 1 if the connection was served as HTTP/2 and is finished,
+ *   0 if the request is an HTTP/1.1 request
+ */
+int http2_start(connection *conn)
+{
+	int upgrade;
+
+	if (!config_current()->settings.http2)
+	{
+		return 0;
+	}
+
+	if (conn->headerlen == H2_PREFACE_HEADER && !memcmp(conn->inbuf, H2_PREFACE, H2_PREFACE_HEADER))
+	{
+		upgrade = 0;
+	}
+	else if (h2_upgrade_requested(conn))
+	{
+		upgrade = 1;
+	}
+	else
+	{
+		return 0;
+	}
+
+	h2_run(conn, upgrade);
+	return 1;
+}
@@ -10,41 +10,51 @@
  */
 
 #include "headerfile.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <stddef.h>
+
 /*
- * Function: listener
+ * Function prototypes for the listener.c file
+ */
+static int openListenerSocket(int port);
+static int openUnixSocket(const char *path, int mode, struct stat *file);
+static void tuneListenerSocket(int listenersocket);
+static int acceptConnections(threadpool *pool, int listenersocket, int local);
+
+/*
+ * Function: openListenerSocket
  * ----------------------------
- *   Listens for connections on the port parameter.
+ *   Creates, binds and listens on the listener socket.
  *
  *	 Parameters:
  *   port: The port number on which to listen for connections.
  *
- *   Returns: 0 for no error, > 0 for error. Socket errors prior to
- *   the infinite loop are considered "fatal" errors and result in an
- *   immediate return to the caller.
+ *   Returns: the listener socket, or -1 on error
  */
-int listener(int port)
+static int openListenerSocket(int port)
 {
-	int listenersocket,     // The listening socket
-	    handlersocket,      // The handler socket
-	    count;              // Loop var
-	    socklen_t length;   // Length of client addr
+    int listenersocket;     // The listening socket
+    int backlog = config_current()->settings.listenBacklog;
+    int somaxconn;
+    int on = 1;
+    FILE *limit;
 
-	    static struct sockaddr_in client_addr; // Client address structure
-	    static struct sockaddr_in server_addr; // Server address structure
+    static struct sockaddr_in server_addr; // Server address structure
 
-	threadpool *pool;
-	char logbuff[BUFSIZE];
+    char logbuff[BUFSIZE];
 
     // Log server startup message.
     sprintf(logbuff, "Server attempting to start on port %d.", port);
     logger(logbuff);
 
     // Create the listener socket.
-    if((listenersocket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if((listenersocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
     {
         // Log error message and exit.
         logger("Error on socket call. Program ending.");
-        return(SOCKET_ERR);
+        return(-1);
     }
     else
     {
@@ -53,6 +63,10 @@ int listener(int port)
         logger(logbuff);
     }
 
+    // A restarted server can bind while the last one's connections are
+    // still in TIME_WAIT
+    setsockopt(listenersocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
     // Populate server addr structure.
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -63,7 +77,7 @@ int listener(int port)
     {
         // Log error message and exit.
         logger("Error on bind call. Program ending.");
-        return(SOCKET_ERR);
+        return(-1);
     }
     else
     {
@@ -71,12 +85,24 @@ int listener(int port)
         logger("Socket bind successful.");
     }
 
+    // The kernel quietly shortens a backlog longer than it allows
+    limit = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (limit != NULL)
+    {
+        if (fscanf(limit, "%d", &somaxconn) == 1 && somaxconn < backlog)
+        {
+            sprintf(logbuff, "The listen backlog of %d is capped at %d by net.core.somaxconn.", backlog, somaxconn);
+            logger(logbuff);
+        }
+        fclose(limit);
+    }
+
     // Set the listener socket as passive listener with specified queue size (backlog).
-    if( listen(listenersocket, LISTENER_QUEUE_SIZE) < 0)
+    if( listen(listenersocket, backlog) < 0)
     {
         // Log error message and exit.
         logger("Error on listen call. Program ending.");
-        return(SOCKET_ERR);
+        return(-1);
     }
     else
     {
@@ -85,34 +111,442 @@ int listener(int port)
         logger(logbuff);
     }
 
+    return(listenersocket);
+}
+
+/*
+ * Function: openUnixSocket
+ * ----------------------------
+ *   Creates, binds and listens on a Unix domain socket. A path starting
+ *   with @ names a socket in the abstract namespace, which has no file
+ *   and goes away with the server. Otherwise a socket file left behind
+ *   by an earlier server is replaced, and the new one is given the mode.
+ *
+ *	 Parameters:
+ *   path: The socket's path, or @ and its abstract name
+ *   mode: The permissions of the socket file
+ *   file: Set to the socket file's status, so it can be told apart from
+ *   a file created by a later server
+ *
+ *   Returns: the listener socket, or -1 on error
+ */
+static int openUnixSocket(const char *path, int mode, struct stat *file)
+{
+    int listenersocket;
+    struct sockaddr_un address;
+    socklen_t length;
+    struct stat existing;
+    char logbuff[BUFSIZE];
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        logger("The Unix socket path is too long.");
+        return(-1);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    length = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    if (path[0] == '@')
+    {
+        // An abstract name starts with a zero byte and has no terminator
+        address.sun_path[0] = '\0';
+        length -= 1;
+    }
+    else if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode))
+    {
+        unlink(path);
+    }
+
+    if ((listenersocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        logger("Error on Unix socket call.");
+        return(-1);
+    }
+
+    if (bind(listenersocket, (struct sockaddr *) &address, length) < 0 ||
+            (path[0] != '@' && (chmod(path, mode) < 0 || stat(path, file) < 0)) ||
+            listen(listenersocket, config_current()->settings.listenBacklog) < 0)
+    {
+        sprintf(logbuff, "Error listening on Unix socket %.200s: %s", path, strerror(errno));
+        logger(logbuff);
+        close(listenersocket);
+        return(-1);
+    }
+
+    sprintf(logbuff, "Now listening on Unix socket %.200s.", path);
+    logger(logbuff);
+    return(listenersocket);
+}
+
+/*
+ * Function: tuneListenerSocket
+ * ----------------------------
+ *   Sets the options of the listening socket. Client sockets inherit
+ *   TCP_NODELAY and SO_BUSY_POLL from it, so they cost nothing per
+ *   connection. An option the kernel refuses is logged and left off.
+ *
+ *	 Parameters:
+ *   listenersocket: The listening socket
+ *
+ *   Returns: nothing
+ */
+static void tuneListenerSocket(int listenersocket)
+{
+    const server_settings *settings = &(config_current()->settings);
+    int value;
+
+    // Hold a connection back until its request arrives, so a worker is
+    // never handed a client that has not sent anything
+    value = settings->deferAccept;
+    if (value > 0 && setsockopt(listenersocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value)) != 0)
+    {
+        logger("TCP_DEFER_ACCEPT could not be set; connections are accepted at once.");
+    }
+
+    // Let returning clients send their request in the SYN
+    value = settings->fastOpen;
+    if (value > 0 && setsockopt(listenersocket, IPPROTO_TCP, TCP_FASTOPEN, &value, sizeof(value)) != 0)
+    {
+        logger("TCP Fast Open could not be turned on.");
+    }
+
+    value = settings->tcpNoDelay;
+    setsockopt(listenersocket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+
+#ifdef SO_BUSY_POLL
+    value = settings->busyPoll;
+    if (value > 0 && setsockopt(listenersocket, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0)
+    {
+        logger("SO_BUSY_POLL could not be set; it needs CAP_NET_ADMIN above net.core.busy_read.");
+    }
+#endif
+}
+
+/*
+ * Function: acceptConnections
+ * ----------------------------
+ *   Accepts everything waiting on a listening socket, up to a batch or
+ *   until the queue fills, so one wakeup serves a burst of connections.
+ *   The socket is non-blocking, so the batch ends once the backlog is
+ *   empty. Clients over their limits are turned away before they take
+ *   a worker; the Unix socket is not limited, since its one client is
+ *   a proxy speaking for many.
+ *
+ *	 Parameters:
+ *   pool: The thread pool
+ *   listenersocket: The listening socket
+ *   local: Nonzero for the Unix socket
+ *
+ *   Returns: the number of connections accepted
+ */
+static int acceptConnections(threadpool *pool, int listenersocket, int local)
+{
+    int handlersocket,      // The handler socket
+        batch;              // Connections accepted so far
+    socklen_t length;       // Length of client addr
+
+    struct sockaddr_storage client_addr; // Client address structure
+    unsigned int address;   // IPv4 client address, host order
+
+    unsigned long long accepted;	// when the connection was accepted
+    rate_keys limits;	// rate limiter buckets the connection is counted in
+
+    for (batch = 0; batch < ACCEPT_BATCH && threadpool_waiting(pool) < QUEUE_SIZE; batch++)
+    {
+        // Client sockets are non-blocking; a connection that has to wait
+        // lets its worker serve the others
+        length = sizeof(client_addr);
+        handlersocket = accept4(listenersocket, (struct sockaddr *) &client_addr, &length, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        accepted = trace_now();
+        PROBE2(accept, handlersocket, accepted);
+        if(handlersocket < 0)
+        {
+            // Log error message.  Do not exit.  Wait for the next connection.
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+            {
+                LOG_ERROR("Error on accept call.");
+            }
+            break;
+        }
+
+        // The configuration is read only here, so the listener is idle
+        // to reloads while it waits
+        limits.client = 0;
+        limits.network = 0;
+        address = local ? 0 : ntohl(((struct sockaddr_in *) &client_addr)->sin_addr.s_addr);
+        config_quiescent();
+        if (!local && rate_limit_admit(address, &limits) != 0)
+        {
+            config_offline();
+            PROBE2(ratelimit, handlersocket, address);
+            LOG_INFO_SAMPLED("Connection from %s refused; the client is over its limits.",
+                    inet_ntoa(((struct sockaddr_in *) &client_addr)->sin_addr));
+
+            // A TLS client cannot read a plaintext answer
+            if (!tls_active())
+            {
+                sendRejection(handlersocket, 429);
+            }
+            close(handlersocket);
+            continue;
+        }
+        config_offline();
+
+        // Add the valid connection to the thread pool queue, dropping it if
+        // the queue is full
+        if (add_connection(pool, handlersocket, accepted, &limits, local) != 0)
+        {
+            rate_limit_release(&limits);
+            close(handlersocket);
+            break;
+        }
+    }
+
+    return batch;
+}
+
+/*
+ * Function: listener
+ * ----------------------------
+ *   Listens for connections on the port parameter. If a handoff socket
+ *   is configured and a server is running on it, that server's listening
+ *   socket is taken over instead.
+ *
+ *	 Parameters:
+ *   port: The port number on which to listen for connections.
+ *
+ *   Returns: 0 for no error, > 0 for error. Socket errors prior to
+ *   the main loop are considered "fatal" errors and result in an
+ *   immediate return to the caller. The loop ends when a drain starts.
+ */
+int listener(int port)
+{
+	int listenersocket,     // The listening socket
+	    unixsocket,         // The Unix domain listening socket
+	    count,              // Connections accepted
+	    batch;              // Connections accepted since the last wakeup
+
+	threadpool *pool;
+	const char *bundle;
+	const char *handoff;
+	const char *unixPath;
+	struct stat unixFile;	// the socket file, to tell it from a later server's
+	struct stat existing;
+	struct pollfd waitfds[3];
+	struct timespec drainStart, drainNow;	// when the drain started, and now
+	int drainTimeout;	// seconds left for in-flight requests
+	char logbuff[BUFSIZE];
+
+    config_reader_register();
+
+    // Take over the listening socket of a running server being upgraded,
+    // or create one
+    listenersocket = -1;
+    handoff = config_current()->settings.handoff;
+    if (!config_current()->settings.tcpListen)
+    {
+        logger("Not listening on a TCP port.");
+    }
+    else if (handoff[0] != '\0' && (listenersocket = handoff_receive(handoff)) >= 0)
+    {
+        sprintf(logbuff, "Socket id %d taken over from the running server.", listenersocket);
+        logger(logbuff);
+    }
+    else if ((listenersocket = openListenerSocket(port)) < 0)
+    {
+        return(SOCKET_ERR);
+    }
+
+    if (listenersocket >= 0)
+    {
+        // A socket taken over keeps the old server's options until these are set
+        tuneListenerSocket(listenersocket);
+
+        // The socket may be shared with another server during an upgrade,
+        // so accept must not block once the other server has taken a connection
+        fcntl(listenersocket, F_SETFL, fcntl(listenersocket, F_GETFL) | O_NONBLOCK);
+    }
+
+    // Listen on the Unix socket as well, or instead
+    unixsocket = -1;
+    unixPath = config_current()->settings.unixSocket;
+    if (unixPath[0] != '\0')
+    {
+        if ((unixsocket = openUnixSocket(unixPath, config_current()->settings.unixSocketMode, &unixFile)) < 0)
+        {
+            return(SOCKET_ERR);
+        }
+        fcntl(unixsocket, F_SETFL, fcntl(unixsocket, F_GETFL) | O_NONBLOCK);
+    }
+    else if (listenersocket < 0)
+    {
+        logger("There is no socket to listen on. Program ending.");
+        return(SOCKET_ERR);
+    }
+
+    // Start the timer wheel that enforces connection deadlines
+    if (timer_wheel_start() != 0)
+    {
+        logger("Error starting the timer wheel. Program ending.");
+        return(SOCKET_ERR);
+    }
+
+    // Serve files from a bundle if one is configured
+    bundle = config_current()->settings.bundle;
+    if (bundle[0] != '\0' && bundle_open(bundle) != 0)
+    {
+        logger("Error opening the bundle. Program ending.");
+        return(SOCKET_ERR);
+    }
+
+    // Build the HPACK Huffman decoding tree for HTTP/2
+    hpack_init();
+
+    // Load the TLS certificate if connections are to be encrypted
+    if (tls_init() != 0)
+    {
+        logger("Error setting up TLS. Program ending.");
+        return(SOCKET_ERR);
+    }
+
+    // Build the error responses sent from memory
+    error_responses_init();
+
+    // Check the upstream servers of any proxied paths
+    if (proxy_start() != 0)
+    {
+        logger("Upstream servers will only leave rotation, not come back.");
+    }
+
+    // Start the workers of the FastCGI and SCGI backends the server runs
+    if (gateway_start() != 0)
+    {
+        logger("Some gateway backends have no workers; their requests will fail.");
+    }
+
+    // Watch the home directory so cached lookups are dropped as soon as files change
+    file_cache_init();
+    negative_cache_init();
+    docroot_index_init();
+    if (file_watcher_start() != 0)
+    {
+        logger("Cached files will be checked every filecachevalid seconds instead.");
+    }
+    docroot_index_build();
+
+    // Keep the phase times of recent and slow requests
+    trace_init();
+
     // Build the thread pool
     pool = threadpool_build();
+    if (pool == NULL)
+    {
+        logger("Error building the thread pool. Program ending.");
+        if (listenersocket >= 0)
+        {
+            close(listenersocket);
+        }
+        if (unixsocket >= 0)
+        {
+            close(unixsocket);
+            if (unixPath[0] != '@')
+            {
+                unlink(unixPath);
+            }
+        }
+        return(SOCKET_ERR);
+    }
 
-    // Main listener loop.  An infinite loop that accepts connections on the listener socket
-    // and creates a handler socket for each accepted connection.  The handler socket is
-    // passed to a handler function.
-    for(count = 1; ; count++)
+    // Stream large files from one thread, so they do not hold the workers
+    if (sender_start(pool) != 0)
     {
-        length = sizeof(client_addr);
+        logger("Large files will be streamed by the workers.");
+    }
 
-        // Accept a connection from the listener and create a new socket for it.
-        if((handlersocket = accept(listenersocket, (struct sockaddr *) &client_addr, &length)) < 0)
+    // Handle reload, log level and stop signals from now on
+    signal_handler_start();
+
+    // Offer the listening socket to the next server on the handoff socket
+    if (handoff[0] != '\0' && listenersocket >= 0)
+    {
+        handoff_start(handoff, listenersocket);
+    }
+
+    // Main listener loop.  Accepts connections on the listener sockets until a
+    // drain starts and passes each one to the thread pool. A socket that is
+    // not open is -1, which poll() passes over.
+    waitfds[0].fd = listenersocket;
+    waitfds[0].events = POLLIN;
+    waitfds[1].fd = unixsocket;
+    waitfds[1].events = POLLIN;
+    waitfds[2].fd = server_drain_fd();
+    waitfds[2].events = POLLIN;
+
+    count = 0;
+    while (!server_draining())
+    {
+        // While the queue is full, connections wait in the backlog rather
+        // than being accepted only to be dropped
+        if (threadpool_waiting(pool) >= QUEUE_SIZE)
         {
-        	// Log error message.  Do not exit.  Loop back to get next connection.
-            logger("Error on accept call.");
+            poll(&(waitfds[2]), 1, ACCEPT_RETRY_DELAY);
+            continue;
         }
-        else
+
+        // Wait for a connection or the start of a drain
+        if (poll(waitfds, 3, -1) <= 0)
         {
-        	// Log connection count.
-            sprintf(logbuff, "*** Connection %d accepted. ***", count);
-            logger(logbuff);
+            continue;
+        }
 
-            // Add the valid connection to the thread pool queue
-            add_connection(pool, handlersocket);
+        batch = 0;
+        if (waitfds[0].revents & POLLIN)
+        {
+            batch += acceptConnections(pool, listenersocket, 0);
+        }
+        if (waitfds[1].revents & POLLIN)
+        {
+            batch += acceptConnections(pool, unixsocket, 1);
         }
 
+        // Log connection count once per wakeup.
+        if (batch > 0)
+        {
+            count += batch;
+            LOG_DEBUG("*** %d connections accepted, %d in all. ***", batch, count);
+        }
+    }
+
+    // Stop accepting. A server that took the socket over keeps it open,
+    // so connections in the backlog are not lost.
+    if (listenersocket >= 0)
+    {
+        close(listenersocket);
     }
-    
-	threadpool_eliminate(pool);
+
+    // The socket file goes too, unless a newer server has replaced it
+    if (unixsocket >= 0)
+    {
+        close(unixsocket);
+        if (unixPath[0] != '@' && stat(unixPath, &existing) == 0 && existing.st_ino == unixFile.st_ino
+                && existing.st_dev == unixFile.st_dev)
+        {
+            unlink(unixPath);
+        }
+    }
+    handoff_stop();
+    logger("Listener stopped; finishing in-flight requests.");
+
+    // The sender finishes its transfers while the workers finish theirs,
+    // and gives kept-alive connections back only until the drain starts
+    config_quiescent();
+    drainTimeout = config_current()->settings.drainTimeout;
+    clock_gettime(CLOCK_MONOTONIC, &drainStart);
+    sender_stop(drainTimeout);
+    clock_gettime(CLOCK_MONOTONIC, &drainNow);
+    drainTimeout -= (int) (drainNow.tv_sec - drainStart.tv_sec);
+    threadpool_eliminate(pool, drainTimeout > 0 ? drainTimeout : 0);
     return(0);
 }
@@ -6,6 +6,19 @@
  */
 
 #include "headerfile.h"
+#include <stdarg.h>
+
+// The level currently logged, read by the LOG_ macros
+int logLevel = DEFAULT_LOG_LEVEL;
+
+// Sampled info lines are logged one in this many times
+static int logSample = DEFAULT_LOG_SAMPLE;
+
+// Sampled lines seen by this thread
+static __thread unsigned long sampleCount;
+
+// Level names for the config file, indexed by level
+static const char *levelNames[] = { "", "error", "warn", "info", "debug", "trace" };
 
 /*
  * Function: logger
@@ -35,3 +48,105 @@ void logger(char *message)
 		close(logfile_fd);
 	}
 }
+
+/*
+ * Function: log_write
+ * ----------------------------
+ *   Formats a message and adds it to the log file. The LOG_ macros call
+ *   this only once they know the message's level is being logged.
+ *
+ *	 Parameters:
+ *   format: The printf format of the message
+ *   ...: The values for the format
+ *
+ *   Returns: nothing
+ */
+void log_write(const char *format, ...)
+{
+	char message[BUFSIZE - 40];	// leaves room for the timestamp
+	va_list values;
+
+	va_start(values, format);
+	vsnprintf(message, sizeof(message), format, values);
+	va_end(values);
+
+	logger(message);
+}
+
+/*
+ * Function: log_sample
+ * ----------------------------
+ *   Determines if a sampled info line should be logged this time. Each
+ *   thread counts on its own, so no lock is taken.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 1 for one line in every logsample, 0 otherwise
+ */
+int log_sample()
+{
+	int sample = __atomic_load_n(&logSample, __ATOMIC_RELAXED);
+
+	sampleCount += 1;
+	return sample <= 1 || sampleCount % sample == 0;
+}
+
+/*
+ * Function: log_set_level
+ * ----------------------------
+ *   Sets the level logged and the sampling rate for per-request info
+ *   lines. Levels beyond the ones compiled in have no further effect.
+ *
+ *	 Parameters:
+ *   level: LOG_LEVEL_ERROR to LOG_LEVEL_TRACE
+ *   sample: Log one sampled line in this many, 1 to log them all
+ *
+ *   Returns: nothing
+ */
+void log_set_level(int level, int sample)
+{
+	if (level < LOG_LEVEL_ERROR)
+	{
+		level = LOG_LEVEL_ERROR;
+	}
+	if (level > LOG_LEVEL_TRACE)
+	{
+		level = LOG_LEVEL_TRACE;
+	}
+
+	__atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
+	__atomic_store_n(&logSample, sample > 0 ? sample : 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: log_level_parse
+ * ----------------------------
+ *   Translates a level name from the config file, or its number, into a
+ *   level.
+ *
+ *	 Parameters:
+ *   name: "error", "warn", "info", "debug" or "trace", or 1 to 5
+ *
+ *   Returns: the level, or -1 if the name is not a level
+ */
+int log_level_parse(const char *name)
+{
+	int level;
+
+	for (level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_TRACE; level++)
+	{
+		if (!strcasecmp(name, levelNames[level]))
+		{
+			return level;
+		}
+	}
+
+	level = atoi(name);
+	if (level >= LOG_LEVEL_ERROR && level <= LOG_LEVEL_TRACE)
+	{
+		return level;
+	}
+
+	return -1;
+}
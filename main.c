@@ -17,7 +17,6 @@ int setPort(char *, char *);
 int setHomeDir(char *, char *);
 
 // Initialize global variables
-filetypes_template filetypes[FILETYPES_ARRAY_SIZE];
 char logfilePathAndName[BUFSIZE];
 
 /*
@@ -245,11 +244,89 @@ void createDefaultConfigFile() {
 		fputs(
 				"// There should be no spaces at the beginning of a line (except for blank lines) and\n",
 				configFile);
-		fputs("// no spaces on either side of a delimiter.\n\n", configFile);
+		fputs("// no spaces on either side of a delimiter.\n", configFile);
+		fputs(
+				"// Send the server SIGHUP to reload this file. The port, home directory, bundle,\n",
+				configFile);
+		fputs("// handoff socket, TLS settings and error pages only change on a restart.\n\n", configFile);
 		fputs("port=5555\n", configFile);
 		fputs("home=", configFile);
 		fputs(get_current_dir_name(), configFile);
 		fputs("\n\n", configFile);
+		fputs("// Connection deadlines in seconds.\n", configFile);
+		fputs("headertimeout=10\n", configFile);
+		fputs("bodytimeout=30\n", configFile);
+		fputs("keepalivetimeout=5\n", configFile);
+		fputs("responsetimeout=300\n\n", configFile);
+		fputs("// Largest request body accepted, in bytes.\n", configFile);
+		fputs("maxbody=1048576\n\n", configFile);
+		fputs("// Open files kept in the cache (0 disables it), and seconds before one is checked again.\n", configFile);
+		fputs("filecache=1000\n", configFile);
+		fputs("filecachevalid=60\n", configFile);
+		fputs("// Missing paths and unknown extensions remembered (0 disables it).\n", configFile);
+		fputs("negativecache=4096\n", configFile);
+		fputs("// Most files indexed in the home directory (0 disables the index).\n", configFile);
+		fputs("docrootindex=100000\n\n", configFile);
+		fputs("// Custom error pages, as code&file. The file is read once at startup.\n", configFile);
+		fputs("// errorpage=404&errors/404.html\n\n", configFile);
+		fputs("// Serve files from a bundle made with -pack instead of the home directory.\n", configFile);
+		fputs("// bundle=/path/to/site.bundle\n\n", configFile);
+		fputs("// Log level: error, warn, info, debug or trace. SIGUSR1 logs more and SIGUSR2\n", configFile);
+		fputs("// less until the next reload. Per-request info lines are logged one in logsample.\n", configFile);
+		fputs("loglevel=info\n", configFile);
+		fputs("logsample=1\n\n", configFile);
+		fputs("// Requests kept in the request trace (0 disables it), and milliseconds after which\n", configFile);
+		fputs("// a request is also kept as a slow one. SIGWINCH writes the trace to trace.json;\n", configFile);
+		fputs("// traceendpoint serves it to clients on this machine.\n", configFile);
+		fputs("tracering=1024\n", configFile);
+		fputs("slowrequest=1000\n", configFile);
+		fputs("// traceendpoint=/server-trace\n\n", configFile);
+		fputs("// Connections the kernel queues for accepting (capped by net.core.somaxconn),\n", configFile);
+		fputs("// seconds a connection may wait for its request before it is accepted\n", configFile);
+		fputs("// (0 accepts at once), and TCP Fast Open requests queued (0 turns it off).\n", configFile);
+		fputs("listenbacklog=4096\n", configFile);
+		fputs("deferaccept=0\n", configFile);
+		fputs("fastopen=0\n", configFile);
+		fputs("// Send small writes at once, and hold a file's header back to share a packet\n", configFile);
+		fputs("// with the file. busypoll is microseconds of busy polling on reads (0 is off).\n", configFile);
+		fputs("tcpnodelay=1\n", configFile);
+		fputs("tcpnopush=1\n", configFile);
+		fputs("busypoll=0\n\n", configFile);
+		fputs("// Listen on a Unix socket as well, for a proxy on the same host. A name starting\n", configFile);
+		fputs("// with @ is in the abstract namespace and has no file. tcplisten=0 leaves the\n", configFile);
+		fputs("// TCP port closed.\n", configFile);
+		fputs("// unixsocket=/path/to/server.sock\n", configFile);
+		fputs("unixsocketmode=0660\n", configFile);
+		fputs("tcplisten=1\n\n", configFile);
+		fputs("// Files of this many bytes or more are streamed by a sender thread, so large\n", configFile);
+		fputs("// downloads do not hold the workers small requests need. 0 turns it off;\n", configFile);
+		fputs("// a response the client cannot take at once goes to the sender either way.\n", configFile);
+		fputs("largeresponse=1048576\n\n", configFile);
+		fputs("// Seconds in-flight requests are given to finish on SIGTERM or SIGQUIT.\n", configFile);
+		fputs("draintimeout=30\n", configFile);
+		fputs("// Unix socket a new server takes the listening socket over from, for upgrades\n", configFile);
+		fputs("// without dropping connections. Start the new binary with the same settings.\n", configFile);
+		fputs("// handoff=/path/to/server.handoff\n\n", configFile);
+		fputs("// Serve TLS with a PEM certificate chain and key (needs a build with -DUSE_TLS).\n", configFile);
+		fputs("// The key may be left out if it is in the certificate file.\n", configFile);
+		fputs("// tlscertificate=/path/to/server.crt\n", configFile);
+		fputs("// tlskey=/path/to/server.key\n", configFile);
+		fputs("tlssessioncache=20480\n\n", configFile);
+		fputs("// Offer HTTP/2: h2 over TLS, and h2c upgrades or prior knowledge in cleartext.\n", configFile);
+		fputs("http2=1\n\n", configFile);
+		fputs("// Send path prefixes to upstream servers: proxy=/prefix/&host:port,host:port\n", configFile);
+		fputs("// proxyhealth names a path to request when checking them; empty only connects.\n", configFile);
+		fputs("proxyhealth=\n\n", configFile);
+		fputs("// Send path prefixes to FastCGI or SCGI backends on Unix sockets:\n", configFile);
+		fputs("// fastcgi=/prefix/&/path/to.sock or scgi=/prefix/&/path/to.sock\n", configFile);
+		fputs("// Add &workers&command to have the server run the workers on that socket.\n\n", configFile);
+		fputs("// Limit each client address to a rate of requests per second, with an optional\n", configFile);
+		fputs("// burst (ratelimit=rate&burst), and to a number of open connections. A client\n", configFile);
+		fputs("// over either is answered 429 Too Many Requests. 0 is no limit.\n", configFile);
+		fputs("ratelimit=0\n", configFile);
+		fputs("connlimit=0\n", configFile);
+		fputs("// Give a network limits shared by all its clients: ratelimitnet=cidr&rate&burst&connections\n", configFile);
+		fputs("// ratelimitnet=10.0.0.0/8&1000&2000&500\n\n", configFile);
 		fputs("mimetype=css&text/css\n", configFile);
 		fputs("mimetype=doc&application/doc\n", configFile);
 		fputs("mimetype=docx&application/docx\n", configFile);
@@ -298,6 +375,9 @@ int main(int argc, char **argv) {
 	char commandLinePort[BUFSIZE] = "\0"; // command line port buffer
 	char commandLineDir[BUFSIZE] = "\0";  // command line home dir buffer
 	char logbuff[BUFSIZE];				  // the log buffer
+	char packPath[BUFSIZE] = "\0";       // bundle to write in pack mode
+	char *configFileName;				  // the config file read
+	server_config *config;				  // the configuration read at startup
 
 	// Get the startup directory
 	sprintf(logfilePathAndName, "%s", get_current_dir_name());
@@ -315,6 +395,19 @@ int main(int argc, char **argv) {
 		logger(logbuff);
 	}
 
+	// "-pack <bundle>" packs the home directory instead of serving it;
+	// any further arguments are the usual ones.
+	if (argc > 2 && !strcmp(argv[1], PACK_OPTION)) {
+		if (argv[2][0] == '/') {
+			snprintf(packPath, BUFSIZE, "%s", argv[2]);
+		} else {
+			snprintf(packPath, BUFSIZE, "%s/%s", get_current_dir_name(), argv[2]);
+		}
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+
 	// If too many command line arguments.
 	if (argc > CMD_LINE_ARG_MAX) {
 		// Print console messages and exit.
@@ -329,15 +422,21 @@ int main(int argc, char **argv) {
 	logger(logbuff);
 
 	// Read the configuration file.
+	config = config_create();
+	if (config == NULL) {
+		logger("Unable to allocate the configuration. Program ending.");
+		exit(CONFIG_FILE_ERR);
+	}
+
 	if (argc > 1) {
-		configFileResult = readConfigFile(argv[1], configFilePort,
-				configFileDir);
+		configFileName = argv[1];
 	} else {
 		createDefaultConfigFile();
 
-		configFileResult = readConfigFile(DEFAULT_CONFIG_FILE, configFilePort,
-				configFileDir);
+		configFileName = DEFAULT_CONFIG_FILE;
 	}
+	configFileResult = readConfigFile(configFileName, configFilePort,
+			configFileDir, config);
 
 	// If config file can't be found or opened
 	if (configFileResult != 0) {
@@ -347,6 +446,9 @@ int main(int argc, char **argv) {
 		exit(configFileResult);
 	}
 
+	// Remember the file for SIGHUP reloads before the directory changes
+	config_reload_init(configFileName);
+
 	// Set port and home directory
 	switch (argc) {
 	case 1: // <program name>
@@ -378,9 +480,23 @@ int main(int argc, char **argv) {
 		exit(setDirReturnCode);
 	}
 
+	// Put the configuration into effect
+	if (getcwd(config->home, BUFSIZE) == NULL) {
+		config->home[0] = '\0';
+	}
+	config_publish(config);
+
 	// For testing
 	//exit(0);
 
+	// In pack mode, write the bundle and stop.
+	if (packPath[0] != '\0') {
+		return (bundle_pack(packPath));
+	}
+
+	// Leave the reload, log level and stop signals to the signal thread
+	signal_handler_init();
+
 	// Call listener function.
 	listenerReturnCode = listener(port);
 
@@ -0,0 +1,228 @@
+/*
+ * negativeCache.c
+ *
+ * Contains the negative lookup cache. It remembers resource paths that
+ * were not found and file extensions that have no MIME type, so repeated
+ * requests for them (most often from bots probing for paths that never
+ * existed) are answered with a 404 or 415 without looking anything up
+ * again. The cache is a fixed number of slots indexed by hash; a new
+ * entry simply replaces whatever was in its slot, so its size is bounded
+ * however many different paths are requested.
+ *
+ * A missing path is trusted for the same time as a cached file. While
+ * the file watcher is running, a file appearing in the home directory
+ * drops its entry straight away, and a directory appearing drops every
+ * missing path since anything below it may now exist.
+ */
+
+#include "headerfile.h"
+#include <sys/inotify.h>
+
+// Define type of struct for a negative cache slot
+typedef struct negative_entry {
+	int kind;				// NEGATIVE_MISSING or NEGATIVE_TYPE, 0 if empty
+	unsigned long hash;		// hash of the key
+	char *key;				// the path or extension
+	time_t validUntil;		// monotonic time after which a missing path is ignored
+	} negative_entry;
+
+/*
+ * Struct that holds the slots and the lock protecting them.
+ */
+static struct {
+	pthread_mutex_t lock;
+	negative_entry *slots;	// NULL if the cache is disabled
+	unsigned long mask;		// slot count minus one
+} negative = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Function prototypes for the negativeCache.c file
+ */
+static void negative_cache_changed(const char *path, unsigned int mask);
+
+/*
+ * Function: negative_cache_init
+ * ----------------------------
+ *   Allocates the cache with the configured number of slots, rounded up
+ *   to a power of two, and subscribes it to changes in the home
+ *   directory.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void negative_cache_init()
+{
+	unsigned long slots = 1;
+	int size = config_current()->settings.negativeCacheSize;
+
+	if (size <= 0)
+	{
+		return;
+	}
+
+	while (slots < (unsigned long) size)
+	{
+		slots <<= 1;
+	}
+
+	negative.slots = (negative_entry *) calloc(slots, sizeof(negative_entry));
+	if (negative.slots == NULL)
+	{
+		logger("Unable to allocate the negative lookup cache");
+		return;
+	}
+	negative.mask = slots - 1;
+
+	file_watcher_subscribe(negative_cache_changed);
+}
+
+/*
+ * Function: negative_cache_lookup
+ * ----------------------------
+ *   Determines if a path is known to be missing or an extension is known
+ *   to have no MIME type.
+ *
+ *	 Parameters:
+ *   kind: NEGATIVE_MISSING for a path, NEGATIVE_TYPE for an extension
+ *   key: The path or extension
+ *
+ *   Returns: 1 if the key is in the cache, 0 otherwise
+ */
+int negative_cache_lookup(int kind, const char *key)
+{
+	unsigned long hash;
+	negative_entry *slot;
+	struct timespec now;
+	int found;
+
+	if (negative.slots == NULL)
+	{
+		return 0;
+	}
+
+	hash = hashString(key) ^ kind;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	pthread_mutex_lock(&(negative.lock));
+	slot = &(negative.slots[hash & negative.mask]);
+
+	// MIME types only change with the configuration, so they do not expire
+	found = (slot->kind == kind && slot->hash == hash &&
+			(kind == NEGATIVE_TYPE || now.tv_sec < slot->validUntil) && strcmp(slot->key, key) == 0);
+	pthread_mutex_unlock(&(negative.lock));
+
+	return found;
+}
+
+/*
+ * Function: negative_cache_add
+ * ----------------------------
+ *   Remembers a missing path or an extension with no MIME type,
+ *   replacing whatever was in its slot.
+ *
+ *	 Parameters:
+ *   kind: NEGATIVE_MISSING for a path, NEGATIVE_TYPE for an extension
+ *   key: The path or extension
+ *
+ *   Returns: nothing
+ */
+void negative_cache_add(int kind, const char *key)
+{
+	unsigned long hash;
+	negative_entry *slot;
+	struct timespec now;
+	char *copy;
+	char *old;
+
+	if (negative.slots == NULL || (copy = strdup(key)) == NULL)
+	{
+		return;
+	}
+
+	hash = hashString(key) ^ kind;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	pthread_mutex_lock(&(negative.lock));
+	slot = &(negative.slots[hash & negative.mask]);
+	old = slot->key;
+	slot->kind = kind;
+	slot->hash = hash;
+	slot->key = copy;
+	slot->validUntil = now.tv_sec + config_current()->settings.fileCacheValid;
+	pthread_mutex_unlock(&(negative.lock));
+
+	free(old);
+}
+
+/*
+ * Function: negative_cache_invalidate
+ * ----------------------------
+ *   Drops a missing path, or every entry of a kind if the key is NULL.
+ *
+ *	 Parameters:
+ *   kind: NEGATIVE_MISSING for a path, NEGATIVE_TYPE for an extension
+ *   key: The path or extension, or NULL
+ *
+ *   Returns: nothing
+ */
+void negative_cache_invalidate(int kind, const char *key)
+{
+	unsigned long hash;
+	unsigned long i;
+	negative_entry *slot;
+
+	if (negative.slots == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&(negative.lock));
+	if (key == NULL)
+	{
+		for (i = 0; i <= negative.mask; i++)
+		{
+			if (negative.slots[i].kind == kind)
+			{
+				negative.slots[i].kind = 0;
+			}
+		}
+	}
+	else
+	{
+		hash = hashString(key) ^ kind;
+		slot = &(negative.slots[hash & negative.mask]);
+		if (slot->kind == kind && slot->hash == hash && strcmp(slot->key, key) == 0)
+		{
+			slot->kind = 0;
+		}
+	}
+	pthread_mutex_unlock(&(negative.lock));
+}
+
+/*
+ * Function: negative_cache_changed
+ * ----------------------------
+ *   Called by the file watcher when something in the home directory
+ *   changes. Only new names matter to a cache of missing paths.
+ *
+ *	 Parameters:
+ *   path: The changed path, or NULL if anything may have changed
+ *   mask: The inotify event mask
+ *
+ *   Returns: nothing
+ */
+static void negative_cache_changed(const char *path, unsigned int mask)
+{
+	if (path == NULL || ((mask & IN_ISDIR) && (mask & (IN_CREATE | IN_MOVED_TO))))
+	{
+		negative_cache_invalidate(NEGATIVE_MISSING, NULL);
+		return;
+	}
+
+	if (mask & (IN_CREATE | IN_MOVED_TO))
+	{
+		negative_cache_invalidate(NEGATIVE_MISSING, path);
+	}
+}
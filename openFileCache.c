@@ -0,0 +1,444 @@
+/*
+ * openFileCache.c
+ *
+ * Contains the open file cache. Each entry keeps a file open along with
+ * the size, modification time and inode from fstat(), keyed by the
+ * resource path, so a request for a cached file needs no open() or
+ * stat() at all. The same descriptor serves both sizing and sending;
+ * it is only read with pread() and sendfile() at explicit offsets, so
+ * any number of requests can share it. Entries are reference counted
+ * and are closed once they have been dropped from the cache and the
+ * last request using them has finished.
+ *
+ * An entry is trusted for the configured time limit and then checked
+ * again with stat(). While the file watcher is running, changes in the
+ * home directory drop the affected entries straight away.
+ */
+
+#include "headerfile.h"
+#include <sys/inotify.h>
+
+/*
+ * Struct that holds the hash table, the least recently used list, and
+ * the lock protecting them.
+ */
+static struct {
+	pthread_mutex_t lock;
+	file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+	file_cache_entry *lruHead;	// most recently used
+	file_cache_entry *lruTail;	// least recently used
+	int count;					// entries in the table
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Function prototypes for the openFileCache.c file
+ */
+static void file_cache_unlink(file_cache_entry *entry);
+static void file_cache_changed(const char *path, unsigned int mask);
+
+/*
+ * Function: hashString
+ * ----------------------------
+ *   Computes the FNV-1a hash of a string.
+ *
+ *	 Parameters:
+ *   string: The string to hash
+ *
+ *   Returns: the hash
+ */
+unsigned long hashString(const char *string)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*string != '\0')
+	{
+		hash ^= (unsigned char) *string++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/*
+ * Function: monotonicSeconds
+ * ----------------------------
+ *   Gets the current monotonic clock time in seconds.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the time in seconds
+ */
+static time_t monotonicSeconds()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/*
+ * Function: file_cache_free
+ * ----------------------------
+ *   Closes an entry's file and frees it.
+ *
+ *	 Parameters:
+ *   entry: The entry
+ *
+ *   Returns: nothing
+ */
+static void file_cache_free(file_cache_entry *entry)
+{
+	close(entry->fd);
+	free(entry->path);
+	free(entry);
+}
+
+/*
+ * Function: file_cache_unlink
+ * ----------------------------
+ *   Removes an entry from the hash table and the LRU list. The entry is
+ *   freed now if no request holds it, or by the last release otherwise.
+ *   The cache lock must be held.
+ *
+ *	 Parameters:
+ *   entry: The entry to remove
+ *
+ *   Returns: nothing
+ */
+static void file_cache_unlink(file_cache_entry *entry)
+{
+	file_cache_entry **link = &(cache.buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)]);
+
+	while (*link != NULL && *link != entry)
+	{
+		link = &((*link)->hashNext);
+	}
+	if (*link == entry)
+	{
+		*link = entry->hashNext;
+	}
+
+	if (entry->lruPrev != NULL)
+	{
+		entry->lruPrev->lruNext = entry->lruNext;
+	}
+	else
+	{
+		cache.lruHead = entry->lruNext;
+	}
+	if (entry->lruNext != NULL)
+	{
+		entry->lruNext->lruPrev = entry->lruPrev;
+	}
+	else
+	{
+		cache.lruTail = entry->lruPrev;
+	}
+
+	entry->cached = 0;
+	cache.count -= 1;
+
+	if (entry->refs == 0)
+	{
+		file_cache_free(entry);
+	}
+}
+
+/*
+ * Function: file_cache_touch
+ * ----------------------------
+ *   Moves an entry to the front of the LRU list. The cache lock must be
+ *   held.
+ *
+ *	 Parameters:
+ *   entry: The entry
+ *
+ *   Returns: nothing
+ */
+static void file_cache_touch(file_cache_entry *entry)
+{
+	if (cache.lruHead == entry)
+	{
+		return;
+	}
+
+	// Unlink from the current position
+	entry->lruPrev->lruNext = entry->lruNext;
+	if (entry->lruNext != NULL)
+	{
+		entry->lruNext->lruPrev = entry->lruPrev;
+	}
+	else
+	{
+		cache.lruTail = entry->lruPrev;
+	}
+
+	// Link at the front
+	entry->lruPrev = NULL;
+	entry->lruNext = cache.lruHead;
+	cache.lruHead->lruPrev = entry;
+	cache.lruHead = entry;
+}
+
+/*
+ * Function: file_cache_lookup
+ * ----------------------------
+ *   Finds a cached entry for a path. The cache lock must be held.
+ *
+ *	 Parameters:
+ *   path: The resource path
+ *   hash: The hash of the path
+ *
+ *   Returns: the entry, or NULL if the path is not cached
+ */
+static file_cache_entry *file_cache_lookup(const char *path, unsigned long hash)
+{
+	file_cache_entry *entry = cache.buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+
+	while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0))
+	{
+		entry = entry->hashNext;
+	}
+
+	return entry;
+}
+
+/*
+ * Function: file_cache_init
+ * ----------------------------
+ *   Subscribes the cache to changes in the home directory.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void file_cache_init()
+{
+	file_watcher_subscribe(file_cache_changed);
+}
+
+/*
+ * Function: file_cache_open
+ * ----------------------------
+ *   Gets an open regular file for a resource path, from the cache if a
+ *   valid entry exists, otherwise by opening it and adding it to the
+ *   cache. The caller holds a reference until file_cache_release.
+ *
+ *	 Parameters:
+ *   path: The resource path
+ *
+ *   Returns: the entry, or NULL with errno set if the file cannot be
+ *   opened; errno is EISDIR if it is not a regular file
+ */
+file_cache_entry *file_cache_open(const char *path)
+{
+	unsigned long hash = hashString(path);
+	file_cache_entry *entry;
+	file_cache_entry *existing;
+	struct stat fileInfo;
+	time_t now = monotonicSeconds();
+	const server_settings *limits = &(config_current()->settings);
+	int fd;
+
+	pthread_mutex_lock(&(cache.lock));
+	entry = file_cache_lookup(path, hash);
+	if (entry != NULL && now < entry->validUntil)
+	{
+		// A current entry needs no system calls at all
+		entry->refs += 1;
+		file_cache_touch(entry);
+		pthread_mutex_unlock(&(cache.lock));
+		return entry;
+	}
+	pthread_mutex_unlock(&(cache.lock));
+
+	// An expired entry is kept if the file has not changed
+	if (entry != NULL && stat(path, &fileInfo) == 0)
+	{
+		pthread_mutex_lock(&(cache.lock));
+		existing = file_cache_lookup(path, hash);
+		if (existing != NULL && existing->ino == fileInfo.st_ino && existing->dev == fileInfo.st_dev &&
+				existing->size == fileInfo.st_size && existing->mtime == fileInfo.st_mtime)
+		{
+			existing->validUntil = now + limits->fileCacheValid;
+			existing->refs += 1;
+			file_cache_touch(existing);
+			pthread_mutex_unlock(&(cache.lock));
+			return existing;
+		}
+		pthread_mutex_unlock(&(cache.lock));
+	}
+
+	// Open the file outside the lock
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (fstat(fd, &fileInfo) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	if (!S_ISREG(fileInfo.st_mode))
+	{
+		close(fd);
+		errno = EISDIR;
+		return NULL;
+	}
+
+	entry = (file_cache_entry *) calloc(1, sizeof(file_cache_entry));
+	if (entry == NULL || (entry->path = strdup(path)) == NULL)
+	{
+		free(entry);
+		close(fd);
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->fd = fd;
+	entry->size = fileInfo.st_size;
+	entry->mtime = fileInfo.st_mtime;
+	entry->ino = fileInfo.st_ino;
+	entry->dev = fileInfo.st_dev;
+	entry->validUntil = now + limits->fileCacheValid;
+	entry->refs = 1;
+
+	// With caching turned off the entry belongs to this request alone
+	if (limits->fileCacheSize <= 0)
+	{
+		return entry;
+	}
+
+	pthread_mutex_lock(&(cache.lock));
+
+	// Replace whatever is cached for the path
+	existing = file_cache_lookup(path, hash);
+	if (existing != NULL)
+	{
+		file_cache_unlink(existing);
+	}
+
+	entry->cached = 1;
+	entry->hashNext = cache.buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+	cache.buckets[hash & (FILE_CACHE_BUCKETS - 1)] = entry;
+	entry->lruPrev = NULL;
+	entry->lruNext = cache.lruHead;
+	if (cache.lruHead != NULL)
+	{
+		cache.lruHead->lruPrev = entry;
+	}
+	cache.lruHead = entry;
+	if (cache.lruTail == NULL)
+	{
+		cache.lruTail = entry;
+	}
+	cache.count += 1;
+
+	// Drop the least recently used entries once the cache is full
+	while (cache.count > limits->fileCacheSize && cache.lruTail != entry)
+	{
+		file_cache_unlink(cache.lruTail);
+	}
+
+	pthread_mutex_unlock(&(cache.lock));
+	return entry;
+}
+
+/*
+ * Function: file_cache_retain
+ * ----------------------------
+ *   Takes another reference to an entry that is already held.
+ *
+ *	 Parameters:
+ *   entry: The entry
+ *
+ *   Returns: nothing
+ */
+void file_cache_retain(file_cache_entry *entry)
+{
+	pthread_mutex_lock(&(cache.lock));
+	entry->refs += 1;
+	pthread_mutex_unlock(&(cache.lock));
+}
+
+/*
+ * Function: file_cache_release
+ * ----------------------------
+ *   Gives up a reference taken by file_cache_open. An entry that has
+ *   left the cache is closed when its last reference goes.
+ *
+ *	 Parameters:
+ *   entry: The entry
+ *
+ *   Returns: nothing
+ */
+void file_cache_release(file_cache_entry *entry)
+{
+	int unused;
+
+	pthread_mutex_lock(&(cache.lock));
+	entry->refs -= 1;
+	unused = (entry->refs == 0 && !entry->cached);
+	pthread_mutex_unlock(&(cache.lock));
+
+	if (unused)
+	{
+		file_cache_free(entry);
+	}
+}
+
+/*
+ * Function: file_cache_invalidate
+ * ----------------------------
+ *   Drops the entry for a path, or every entry if the path is NULL.
+ *
+ *	 Parameters:
+ *   path: The resource path, or NULL
+ *
+ *   Returns: nothing
+ */
+void file_cache_invalidate(const char *path)
+{
+	file_cache_entry *entry;
+
+	pthread_mutex_lock(&(cache.lock));
+	if (path == NULL)
+	{
+		while (cache.lruHead != NULL)
+		{
+			file_cache_unlink(cache.lruHead);
+		}
+	}
+	else if ((entry = file_cache_lookup(path, hashString(path))) != NULL)
+	{
+		file_cache_unlink(entry);
+	}
+	pthread_mutex_unlock(&(cache.lock));
+}
+
+/*
+ * Function: file_cache_changed
+ * ----------------------------
+ *   Called by the file watcher when something in the home directory
+ *   changes. Any change to a file, and any rename or removal of a
+ *   directory, drops what is cached for it.
+ *
+ *	 Parameters:
+ *   path: The changed path, or NULL if anything may have changed
+ *   mask: The inotify event mask
+ *
+ *   Returns: nothing
+ */
+static void file_cache_changed(const char *path, unsigned int mask)
+{
+	// Entries below a moved or deleted directory cannot be found by path
+	if (path == NULL || ((mask & IN_ISDIR) && (mask & (IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF))))
+	{
+		file_cache_invalidate(NULL);
+		return;
+	}
+
+	file_cache_invalidate(path);
+}
@@ -0,0 +1,1285 @@
+/*
+ * proxy.c
+ *
+ * Contains the reverse proxy. A proxy line in the config file sends
+ * every request whose path starts with a prefix to one of a list of
+ * upstream HTTP servers, the healthy one with the fewest requests in
+ * flight. Connections to each upstream server are kept alive and pooled
+ * between requests, so most requests skip the connect.
+ *
+ * Request and response bodies with a known length are moved from socket
+ * to socket with splice() through a pipe, without being copied through
+ * the server. Each body has a pipe of its own while it moves, since the
+ * worker serves other connections whenever a socket makes it wait. Chunked bodies, and bodies for TLS and HTTP/2 clients, are
+ * copied a piece at a time with the body reader.
+ *
+ * A health thread checks every upstream server each
+ * PROXY_HEALTH_INTERVAL seconds, by connecting to it or, if proxyhealth
+ * names a path, by requesting that path. A server that fails a check or
+ * cannot be reached for a request is out of rotation until it passes a
+ * check again. Routes are set up once at startup.
+ */
+
+#include "headerfile.h"
+#include <netdb.h>
+#include <netinet/tcp.h>
+
+// Results of exchanging a request and response with an upstream server
+#define PROXY_DONE 0 // the response was relayed, or the client went away
+#define PROXY_STALE 1 // a pooled connection had closed; nothing was used up
+#define PROXY_FAILED 2 // the upstream server failed before the response started
+
+// Results of moving a body with splice()
+#define SPLICE_OK 0
+#define SPLICE_READ_FAILED -1 // the side being read closed, failed or timed out
+#define SPLICE_WRITE_FAILED -2 // the side being written closed or failed
+
+// Define type of struct for an upstream server
+typedef struct proxy_upstream {
+	char name[PROXY_NAME_SIZE];		// host:port as configured
+	struct sockaddr_storage address;
+	socklen_t addressLength;
+	pthread_mutex_t lock;			// guards the idle connections
+	int idle[PROXY_POOL_SIZE];		// idle keep-alive connections, the newest last
+	int idleCount;
+	int outstanding;				// requests in flight
+	int healthy;					// nonzero while the server is in rotation
+	} proxy_upstream;
+
+// Define type of struct for a proxied path prefix
+typedef struct proxy_route {
+	char prefix[PROXY_NAME_SIZE];
+	size_t prefixLength;
+	int upstreams[PROXY_MAX_UPSTREAMS];	// the route's servers in the upstream table
+	int upstreamCount;
+	unsigned int next;				// where the next pick starts, so ties take turns
+	} proxy_route;
+
+/*
+ * Struct that holds the routes, the upstream servers and the health
+ * thread.
+ */
+static struct {
+	proxy_route routes[PROXY_MAX_ROUTES];
+	int routeCount;
+	proxy_upstream upstreams[PROXY_MAX_UPSTREAMS];
+	int upstreamCount;
+	pthread_t thread;
+} proxy;
+
+// The calling worker's contexts for upstream connections
+static __thread connection_pool contexts;
+
+// The calling worker's empty pipes for splice()
+static __thread int sparePipes[PROXY_SPARE_PIPES][2];
+static __thread int spareCount;
+
+/*
+ * Function prototypes for the proxy.c file
+ */
+static int proxy_upstream_add(const char *name);
+static proxy_route *proxy_find(connection *c);
+static proxy_upstream *proxy_pick(proxy_route *route);
+static int proxy_open(proxy_upstream *server, int seconds);
+static int proxy_connect(proxy_upstream *server, int *reused);
+static void proxy_keep(proxy_upstream *server, int fd);
+static void proxy_failed(proxy_upstream *server);
+static int proxy_pipe(int pipefds[2]);
+static void proxy_pipe_put(int pipefds[2]);
+static int proxy_splice(connection *reader, connection *writer, long long length, int pipefds[2]);
+static int proxy_hop_by_hop(const char *line, size_t length);
+static int proxy_send_request(connection *c, connection *up);
+static int proxy_read_response(connection *up);
+static int proxy_send_response(connection *c, connection *up, int head, int *reusable);
+static int proxy_exchange(connection *c, connection *up, int head, int replayable, int *reusable);
+static int proxy_check(proxy_upstream *server);
+static void *proxy_health_thread(void *arg);
+
+/*
+ * Function: proxy_upstream_add
+ * ----------------------------
+ *   Finds an upstream server in the upstream table, adding it if it is
+ *   not there yet. The name is resolved once, here.
+ *
+ *	 Parameters:
+ *   name: The server as host:port, optionally starting with http://
+ *
+ *   Returns: the server's index in the table, or -1 if the name cannot
+ *   be resolved or the table is full
+ */
+static int proxy_upstream_add(const char *name)
+{
+	proxy_upstream *server;
+	struct addrinfo hints;
+	struct addrinfo *found;
+	char host[PROXY_NAME_SIZE];
+	char *port;
+	int i;
+
+	if (!strncmp(name, "http://", 7))
+	{
+		name += 7;
+	}
+
+	for (i = 0; i < proxy.upstreamCount; i++)
+	{
+		if (!strcmp(proxy.upstreams[i].name, name))
+		{
+			return i;
+		}
+	}
+
+	if (proxy.upstreamCount == PROXY_MAX_UPSTREAMS || strlen(name) >= sizeof(host))
+	{
+		return -1;
+	}
+
+	// The port follows the last colon, so a bracketed IPv6 address works
+	strcpy(host, name);
+	port = strrchr(host, ':');
+	if (port == NULL || port == host)
+	{
+		return -1;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']')
+	{
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &found) != 0)
+	{
+		return -1;
+	}
+
+	server = &(proxy.upstreams[proxy.upstreamCount]);
+	snprintf(server->name, sizeof(server->name), "%s", name);
+	memcpy(&(server->address), found->ai_addr, found->ai_addrlen);
+	server->addressLength = found->ai_addrlen;
+	pthread_mutex_init(&(server->lock), NULL);
+	server->idleCount = 0;
+	server->outstanding = 0;
+	server->healthy = 1;
+	freeaddrinfo(found);
+
+	return proxy.upstreamCount++;
+}
+
+/*
+ * Function: proxy_route_add
+ * ----------------------------
+ *   Sends requests for a path prefix to a list of upstream servers.
+ *   Called while the config file is read at startup.
+ *
+ *	 Parameters:
+ *   prefix: The path prefix, such as /api/
+ *   servers: The upstream servers as a comma separated list of host:port
+ *
+ *   Returns: 0 if successful, -1 if the route cannot be added or none of
+ *   its servers can be resolved
+ */
+int proxy_route_add(char *prefix, char *servers)
+{
+	proxy_route *route;
+	char logbuff[BUFSIZE];
+	char *name;
+	char *rest;
+	int index;
+
+	if (proxy.routeCount == PROXY_MAX_ROUTES || prefix[0] != '/' || strlen(prefix) >= PROXY_NAME_SIZE)
+	{
+		return -1;
+	}
+
+	route = &(proxy.routes[proxy.routeCount]);
+	strcpy(route->prefix, prefix);
+	route->prefixLength = strlen(prefix);
+	route->upstreamCount = 0;
+	route->next = 0;
+
+	for (name = strtok_r(servers, ", ", &rest); name != NULL; name = strtok_r(NULL, ", ", &rest))
+	{
+		index = proxy_upstream_add(name);
+		if (index < 0 || route->upstreamCount == PROXY_MAX_UPSTREAMS)
+		{
+			sprintf(logbuff, "Upstream server %.200s for %.200s cannot be used.", name, prefix);
+			logger(logbuff);
+			continue;
+		}
+		route->upstreams[route->upstreamCount] = index;
+		route->upstreamCount += 1;
+	}
+
+	if (route->upstreamCount == 0)
+	{
+		return -1;
+	}
+
+	sprintf(logbuff, "Requests for %.200s are sent to %d upstream servers.", prefix, route->upstreamCount);
+	logger(logbuff);
+	proxy.routeCount += 1;
+	return 0;
+}
+
+/*
+ * Function: proxy_start
+ * ----------------------------
+ *   Starts the thread that checks the health of the upstream servers,
+ *   if any routes are configured.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if successful, -1 if the thread cannot be started
+ */
+int proxy_start()
+{
+	if (proxy.routeCount == 0)
+	{
+		return 0;
+	}
+
+	if (pthread_create(&(proxy.thread), NULL, proxy_health_thread, NULL) != 0)
+	{
+		logger("Unable to start the upstream health check thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: proxy_find
+ * ----------------------------
+ *   Finds the route for a request. The longest matching prefix wins.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header
+ *
+ *   Returns: the route, or NULL if the request is not proxied
+ */
+static proxy_route *proxy_find(connection *c)
+{
+	proxy_route *best = NULL;
+	char *path = memchr(c->inbuf, ' ', c->headerlen);
+	size_t length;
+	int i;
+
+	if (path == NULL)
+	{
+		return NULL;
+	}
+	path++;
+	length = strcspn(path, " ?\r\n");
+
+	for (i = 0; i < proxy.routeCount; i++)
+	{
+		if (proxy.routes[i].prefixLength <= length && !memcmp(path, proxy.routes[i].prefix,
+				proxy.routes[i].prefixLength) && (best == NULL || proxy.routes[i].prefixLength > best->prefixLength))
+		{
+			best = &(proxy.routes[i]);
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Function: proxy_requested
+ * ----------------------------
+ *   Determines if a request is for a proxied path.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header
+ *
+ *   Returns: 1 if the request goes to an upstream server, 0 otherwise
+ */
+int proxy_requested(connection *c)
+{
+	return proxy.routeCount > 0 && proxy_find(c) != NULL;
+}
+
+/*
+ * Function: proxy_pick
+ * ----------------------------
+ *   Picks the healthy server of a route with the fewest requests in
+ *   flight and counts the new request against it. Servers that tie take
+ *   turns.
+ *
+ *	 Parameters:
+ *   route: The route
+ *
+ *   Returns: the server, or NULL if none is healthy
+ */
+static proxy_upstream *proxy_pick(proxy_route *route)
+{
+	proxy_upstream *best = NULL;
+	proxy_upstream *server;
+	unsigned int start = __atomic_fetch_add(&(route->next), 1, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < route->upstreamCount; i++)
+	{
+		server = &(proxy.upstreams[route->upstreams[(start + i) % route->upstreamCount]]);
+		if (__atomic_load_n(&(server->healthy), __ATOMIC_RELAXED) && (best == NULL ||
+				__atomic_load_n(&(server->outstanding), __ATOMIC_RELAXED) <
+				__atomic_load_n(&(best->outstanding), __ATOMIC_RELAXED)))
+		{
+			best = server;
+		}
+	}
+
+	if (best != NULL)
+	{
+		__atomic_add_fetch(&(best->outstanding), 1, __ATOMIC_RELAXED);
+	}
+	return best;
+}
+
+/*
+ * Function: proxy_open
+ * ----------------------------
+ *   Opens a new non-blocking connection to an upstream server.
+ *
+ *	 Parameters:
+ *   server: The server
+ *   seconds: The longest time to wait for the connect
+ *
+ *   Returns: the socket, or -1 if the server cannot be reached
+ */
+static int proxy_open(proxy_upstream *server, int seconds)
+{
+	struct pollfd waitfd;
+	socklen_t length = sizeof(int);
+	int error = 0;
+	int on = 1;
+	int fd = socket(server->address.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	// The wait bounds the connect; the caller's deadlines apply after
+	if (connect(fd, (struct sockaddr *) &(server->address), server->addressLength) != 0)
+	{
+		waitfd.fd = fd;
+		waitfd.events = POLLOUT;
+		if (errno != EINPROGRESS || coroutine_poll(&waitfd, 1, seconds * 1000) <= 0 ||
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return fd;
+}
+
+/*
+ * Function: proxy_connect
+ * ----------------------------
+ *   Gets a connection to an upstream server, an idle one from its pool
+ *   if there is one still open, or a new one.
+ *
+ *	 Parameters:
+ *   server: The server
+ *   reused: Set to 1 if the connection came from the pool, 0 if it is new
+ *
+ *   Returns: the socket, or -1 if the server cannot be reached
+ */
+static int proxy_connect(proxy_upstream *server, int *reused)
+{
+	char peek;
+	int fd;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&(server->lock));
+		fd = server->idleCount > 0 ? server->idle[--server->idleCount] : -1;
+		pthread_mutex_unlock(&(server->lock));
+
+		if (fd < 0)
+		{
+			break;
+		}
+
+		// A server that closed the connection, or sent something unasked,
+		// has made it useless
+		if (recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			*reused = 1;
+			return fd;
+		}
+		close(fd);
+	}
+
+	*reused = 0;
+	return proxy_open(server, PROXY_CONNECT_TIMEOUT);
+}
+
+/*
+ * Function: proxy_keep
+ * ----------------------------
+ *   Puts a connection back in its server's pool, or closes it if the
+ *   pool is full.
+ *
+ *	 Parameters:
+ *   server: The server
+ *   fd: The connection, positioned at the start of the next response
+ *
+ *   Returns: nothing
+ */
+static void proxy_keep(proxy_upstream *server, int fd)
+{
+	pthread_mutex_lock(&(server->lock));
+	if (server->idleCount < PROXY_POOL_SIZE)
+	{
+		server->idle[server->idleCount++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&(server->lock));
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+/*
+ * Function: proxy_failed
+ * ----------------------------
+ *   Takes a server that could not be reached out of rotation until it
+ *   passes a health check.
+ *
+ *	 Parameters:
+ *   server: The server
+ *
+ *   Returns: nothing
+ */
+static void proxy_failed(proxy_upstream *server)
+{
+	if (__atomic_exchange_n(&(server->healthy), 0, __ATOMIC_RELAXED))
+	{
+		LOG_WARN("Upstream server %s failed; it is out of rotation.", server->name);
+	}
+}
+
+/*
+ * Function: proxy_pipe
+ * ----------------------------
+ *   Gets an empty pipe for splice(), one of the calling worker's spares
+ *   or a new one.
+ *
+ *	 Parameters:
+ *   pipefds: Set to the pipe's read and write ends
+ *
+ *   Returns: 0 if successful, -1 if a pipe cannot be created
+ */
+static int proxy_pipe(int pipefds[2])
+{
+	if (spareCount > 0)
+	{
+		spareCount -= 1;
+		pipefds[0] = sparePipes[spareCount][0];
+		pipefds[1] = sparePipes[spareCount][1];
+		return 0;
+	}
+
+	if (pipe2(pipefds, O_CLOEXEC) != 0)
+	{
+		return -1;
+	}
+
+	// A larger pipe moves more with each call; the default still works
+	fcntl(pipefds[1], F_SETPIPE_SZ, STREAM_CHUNK_SIZE);
+	return 0;
+}
+
+/*
+ * Function: proxy_pipe_put
+ * ----------------------------
+ *   Gives a pipe back to the calling worker's spares, or closes it if
+ *   the worker has PROXY_SPARE_PIPES already.
+ *
+ *	 Parameters:
+ *   pipefds: The pipe, or -1 if proxy_splice() closed it
+ *
+ *   Returns: nothing
+ */
+static void proxy_pipe_put(int pipefds[2])
+{
+	if (pipefds[0] < 0)
+	{
+		return;
+	}
+
+	if (spareCount < PROXY_SPARE_PIPES)
+	{
+		sparePipes[spareCount][0] = pipefds[0];
+		sparePipes[spareCount][1] = pipefds[1];
+		spareCount += 1;
+		return;
+	}
+
+	close(pipefds[0]);
+	close(pipefds[1]);
+}
+
+/*
+ * Function: proxy_splice
+ * ----------------------------
+ *   Moves bytes from one connection's socket to another's through a
+ *   pipe, so the data never leaves the kernel. Each piece is held to the
+ *   reader's body deadline and the writer's response deadline, and the
+ *   connection waits whenever a socket has nothing to read or no room.
+ *   Both sockets must be plain.
+ *
+ *	 Parameters:
+ *   reader: The connection to read from
+ *   writer: The connection to write to
+ *   length: The number of bytes to move
+ *   pipefds: An empty pipe from proxy_pipe(). A failed write may leave
+ *   data in it, so then it is closed and set to -1.
+ *
+ *   Returns: SPLICE_OK, SPLICE_READ_FAILED if the reader closed, failed
+ *   or timed out before length bytes arrived, or SPLICE_WRITE_FAILED if
+ *   the writer failed
+ */
+static int proxy_splice(connection *reader, connection *writer, long long length, int pipefds[2])
+{
+	ssize_t in;
+	ssize_t out;
+
+	while (length > 0)
+	{
+		connection_set_deadline(reader, CONN_TIMER_BODY);
+		connection_set_deadline(writer, CONN_TIMER_RESPONSE);
+
+		for (;;)
+		{
+			in = splice(reader->sockfd, NULL, pipefds[1], NULL,
+					length < STREAM_CHUNK_SIZE ? (size_t) length : STREAM_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (in >= 0 || (errno != EINTR &&
+					((errno != EAGAIN && errno != EWOULDBLOCK) || connection_wait(reader, POLLIN) != 0)))
+			{
+				break;
+			}
+		}
+		if (in <= 0)
+		{
+			return SPLICE_READ_FAILED;
+		}
+		length -= in;
+		reader->bytesIn += in;
+
+		while (in > 0)
+		{
+			out = splice(pipefds[0], NULL, writer->sockfd, NULL, in,
+					SPLICE_F_MOVE | (length > 0 ? SPLICE_F_MORE : 0));
+			if (out < 0 && (errno == EINTR ||
+					((errno == EAGAIN || errno == EWOULDBLOCK) && connection_wait(writer, POLLOUT) == 0)))
+			{
+				continue;
+			}
+			if (out <= 0)
+			{
+				close(pipefds[0]);
+				close(pipefds[1]);
+				pipefds[0] = -1;
+				pipefds[1] = -1;
+				return SPLICE_WRITE_FAILED;
+			}
+			in -= out;
+			writer->bytesOut += out;
+		}
+	}
+
+	return SPLICE_OK;
+}
+
+/*
+ * Function: proxy_hop_by_hop
+ * ----------------------------
+ *   Determines if a header line is one that applies only to a single
+ *   connection, or one whose framing the proxy sets itself, and so is
+ *   not passed on.
+ *
+ *	 Parameters:
+ *   line: The header line
+ *   length: The length of the line
+ *
+ *   Returns: 1 if the line is not passed on, 0 otherwise
+ */
+static int proxy_hop_by_hop(const char *line, size_t length)
+{
+	static const char *names[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+			"Upgrade", "Transfer-Encoding", "Content-Length", "Expect", NULL };
+	size_t nameLength;
+	int i;
+
+	for (i = 0; names[i] != NULL; i++)
+	{
+		nameLength = strlen(names[i]);
+		if (length > nameLength && line[nameLength] == ':' && !strncasecmp(line, names[i], nameLength))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Function: proxy_send_request
+ * ----------------------------
+ *   Sends the client's request to an upstream server: the request line
+ *   as HTTP/1.1, the end-to-end header fields, the forwarding fields,
+ *   and the body. The client's body must have been checked with
+ *   body_reader_init.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   up: The upstream connection
+ *
+ *   Returns: PROXY_DONE if the request was sent, PROXY_FAILED if the
+ *   upstream server failed, or -1 if the client's body could not be read
+ */
+static int proxy_send_request(connection *c, connection *up)
+{
+	struct sockaddr_storage peer;
+	socklen_t peerLength = sizeof(peer);
+	char address[INET6_ADDRSTRLEN];
+	char field[200];
+	char *line = c->inbuf;
+	char *end = c->inbuf + c->headerlen;
+	char *next;
+	char *version;
+	char *data;
+	ssize_t count;
+	int pipefds[2];
+	int chunked = c->bodyMode == BODY_CHUNKED;
+	int size;
+	int result;
+
+	// The request line, spoken as HTTP/1.1 whatever the client used
+	next = memchr(line, '\n', end - line);
+	version = memrchr(line, ' ', next - line);
+	if (version == NULL)
+	{
+		return -1;
+	}
+	connection_write(up, line, version - line);
+	connection_write(up, " HTTP/1.1\r\n", 11);
+
+	// The header fields that are not about this connection
+	for (line = next + 1; line < end; line = next + 1)
+	{
+		next = memchr(line, '\n', end - line);
+		if (next == NULL || line[0] == '\r' || line[0] == '\n')
+		{
+			break;
+		}
+		if (!proxy_hop_by_hop(line, next - line))
+		{
+			connection_write(up, line, next - line);
+			connection_write(up, next[-1] == '\r' ? "\n" : "\r\n", next[-1] == '\r' ? 1 : 2);
+		}
+	}
+
+	// Who the request came from, and how
+	if (getpeername(c->sockfd, (struct sockaddr *) &peer, &peerLength) == 0 &&
+			((peer.ss_family == AF_INET && inet_ntop(AF_INET, &(((struct sockaddr_in *) &peer)->sin_addr),
+			address, sizeof(address)) != NULL) || (peer.ss_family == AF_INET6 && inet_ntop(AF_INET6,
+			&(((struct sockaddr_in6 *) &peer)->sin6_addr), address, sizeof(address)) != NULL)))
+	{
+		size = sprintf(field, "X-Forwarded-For: %s\r\n", address);
+		connection_write(up, field, size);
+	}
+	size = sprintf(field, "X-Forwarded-Proto: %s\r\n", c->secure ? "https" : "http");
+	connection_write(up, field, size);
+
+	// The body's framing, kept as the client sent it
+	if (c->bodyMode == BODY_LENGTH)
+	{
+		size = sprintf(field, "Content-Length: %lld\r\n", c->bodyRemaining);
+		connection_write(up, field, size);
+	}
+	else if (chunked)
+	{
+		connection_write(up, "Transfer-Encoding: chunked\r\n", 28);
+	}
+	if (connection_write(up, "Connection: keep-alive\r\n\r\n", 26) != 0)
+	{
+		return -1;
+	}
+
+	// Body bytes that arrived with the header go out with it
+	while (c->bodyMode == BODY_LENGTH && c->inpos < c->inlen && (count = body_next(c, &data)) > 0)
+	{
+		connection_write(up, data, count);
+	}
+	if (connection_flush(up) != 0)
+	{
+		return PROXY_FAILED;
+	}
+
+	// The rest of a plain client's body goes from socket to socket
+	if (c->bodyMode == BODY_LENGTH && c->bodyRemaining > 0 && c->tls == NULL && !c->http2
+			&& proxy_pipe(pipefds) == 0)
+	{
+		result = proxy_splice(c, up, c->bodyRemaining, pipefds);
+		proxy_pipe_put(pipefds);
+		if (result != SPLICE_OK)
+		{
+			c->keepAlive = 0;
+			return result == SPLICE_WRITE_FAILED ? PROXY_FAILED : -1;
+		}
+		c->bodyTotal += c->bodyRemaining;
+		c->bodyRemaining = 0;
+	}
+
+	// Anything else is copied, chunked bodies a chunk at a time
+	while ((count = body_next(c, &data)) > 0)
+	{
+		if (chunked)
+		{
+			size = sprintf(field, "%zx\r\n", (size_t) count);
+			connection_write(up, field, size);
+			connection_write(up, data, count);
+			connection_write(up, "\r\n", 2);
+		}
+		else
+		{
+			connection_write(up, data, count);
+		}
+
+		// The server needs the whole body before it answers, so pieces are
+		// gathered into larger sends
+		if (up->outlen >= STREAM_CHUNK_SIZE && connection_flush(up) != 0)
+		{
+			c->keepAlive = 0;
+			return PROXY_FAILED;
+		}
+	}
+	if (count < 0)
+	{
+		c->keepAlive = 0;
+		return -1;
+	}
+	if (chunked)
+	{
+		connection_write(up, "0\r\n\r\n", 5);
+	}
+	if (connection_flush(up) != 0)
+	{
+		return PROXY_FAILED;
+	}
+
+	return PROXY_DONE;
+}
+
+/*
+ * Function: proxy_read_response
+ * ----------------------------
+ *   Receives the header of an upstream server's response, skipping any
+ *   interim 1xx responses. Bytes that arrive after the header stay in
+ *   the input buffer.
+ *
+ *	 Parameters:
+ *   up: The upstream connection
+ *
+ *   Returns: CONN_OK if a complete header was received, CONN_ERR_CLOSED
+ *   if the server closed the connection or sent something else,
+ *   CONN_ERR_TIMEOUT if the response deadline passed, or
+ *   CONN_ERR_TOO_LARGE if the header exceeded MAX_HEADER_SIZE
+ */
+static int proxy_read_response(connection *up)
+{
+	size_t searchFrom = 0;
+	char *end;
+
+	connection_set_deadline(up, CONN_TIMER_RESPONSE);
+
+	for (;;)
+	{
+		if ((end = memmem(up->inbuf + searchFrom, up->inlen - searchFrom, "\r\n\r\n", 4)) != NULL ||
+				(end = memmem(up->inbuf + searchFrom, up->inlen - searchFrom, "\n\n", 2)) != NULL)
+		{
+			up->headerlen = end + (*end == '\r' ? 4 : 2) - up->inbuf;
+			up->inpos = up->headerlen;
+			if (up->inlen < 12 || strncmp(up->inbuf, "HTTP/1.", 7) != 0)
+			{
+				return CONN_ERR_CLOSED;
+			}
+
+			// An interim response is followed by the real one
+			if (up->inbuf[9] != '1')
+			{
+				return CONN_OK;
+			}
+			connection_next_request(up);
+			searchFrom = 0;
+			continue;
+		}
+
+		if (up->inlen > MAX_HEADER_SIZE)
+		{
+			return CONN_ERR_TOO_LARGE;
+		}
+		searchFrom = up->inlen > 3 ? up->inlen - 3 : 0;
+		if (connection_fill(up) <= 0)
+		{
+			return up->timedOut ? CONN_ERR_TIMEOUT : CONN_ERR_CLOSED;
+		}
+	}
+}
+
+/*
+ * Function: proxy_send_response
+ * ----------------------------
+ *   Relays an upstream server's response to the client: the status line
+ *   as HTTP/1.1, the end-to-end header fields, and the body. A body of
+ *   known length goes from socket to socket to a plain client; a chunked
+ *   body is chunked again for an HTTP/1.1 client, and a body that runs
+ *   until the server closes ends the client's connection too. An HTTP/2
+ *   client's response is gathered for its session to frame.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   up: The upstream connection holding the response header
+ *   head: Nonzero if the request was HEAD
+ *   reusable: Set to 1 if the upstream connection can take another request
+ *
+ *   Returns: PROXY_DONE if the response was relayed or the client went
+ *   away, PROXY_FAILED if the response header is malformed
+ */
+static int proxy_send_response(connection *c, connection *up, int head, int *reusable)
+{
+	char *line;
+	char *end = up->inbuf + up->headerlen;
+	char *next;
+	char *value;
+	char *data;
+	char field[40];
+	ssize_t count;
+	int pipefds[2];
+	int status;
+	int upstreamKeepAlive;
+	int oldClient;
+	int chunked;
+	int size;
+	int result;
+
+	// The status line must hold a three digit code after the version
+	if (up->inbuf[9] < '0' || up->inbuf[9] > '9' || up->inbuf[10] < '0' || up->inbuf[10] > '9'
+			|| up->inbuf[11] < '0' || up->inbuf[11] > '9')
+	{
+		return PROXY_FAILED;
+	}
+	status = atoi(up->inbuf + 9);
+
+	if (body_reader_response(up, head || status == 204 || status == 304) != 0)
+	{
+		return PROXY_FAILED;
+	}
+
+	// The server keeps the connection open unless it says otherwise
+	value = connection_header(up, "Connection");
+	upstreamKeepAlive = up->inbuf[7] == '1' ? !(value != NULL && !strncasecmp(value, "close", 5))
+			: (value != NULL && !strncasecmp(value, "keep-alive", 10));
+
+	// A body that ends when the server closes ends the client's connection,
+	// and so does a chunked one for an HTTP/1.0 client, which cannot read it
+	line = memchr(c->inbuf, '\n', c->headerlen);
+	oldClient = !c->http2 && line != NULL && memmem(c->inbuf, line - c->inbuf, " HTTP/1.0", 9) != NULL;
+	chunked = up->bodyMode == BODY_CHUNKED && !c->http2 && !oldClient;
+	if (up->bodyMode == BODY_CLOSE)
+	{
+		upstreamKeepAlive = 0;
+	}
+	if (up->bodyMode == BODY_CLOSE || (up->bodyMode == BODY_CHUNKED && oldClient))
+	{
+		c->keepAlive = 0;
+	}
+
+	next = memchr(up->inbuf, '\n', end - up->inbuf);
+	line = memchr(up->inbuf, ' ', next - up->inbuf);
+	if (line == NULL)
+	{
+		return PROXY_FAILED;
+	}
+
+	c->outlen = 0;
+	c->span.status = status;
+	connection_write(c, "HTTP/1.1", 8);
+	connection_write(c, line, next - line);
+	if (next[-1] != '\r')
+	{
+		connection_write(c, "\r", 1);
+	}
+	connection_write(c, "\n", 1);
+
+	for (line = next + 1; line < end; line = next + 1)
+	{
+		next = memchr(line, '\n', end - line);
+		if (next == NULL || line[0] == '\r' || line[0] == '\n')
+		{
+			break;
+		}
+		if (!proxy_hop_by_hop(line, next - line) ||
+				(up->bodyMode != BODY_CHUNKED && !strncasecmp(line, "Content-Length:", 15)))
+		{
+			connection_write(c, line, next - line);
+			connection_write(c, next[-1] == '\r' ? "\n" : "\r\n", next[-1] == '\r' ? 1 : 2);
+		}
+	}
+	if (chunked)
+	{
+		connection_write(c, "Transfer-Encoding: chunked\r\n", 28);
+	}
+	if (connection_write(c, c->keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n",
+			c->keepAlive ? 26 : 21) != 0)
+	{
+		c->keepAlive = 0;
+		return PROXY_DONE;
+	}
+	LOG_DEBUG("Thread %u: Upstream answered with %d", (unsigned int) pthread_self(), status);
+
+	// Body bytes that arrived with the header go out with it
+	while (up->bodyMode == BODY_LENGTH && up->inpos < up->inlen && (count = body_next(up, &data)) > 0)
+	{
+		connection_write(c, data, count);
+	}
+
+	// The rest of a known length goes from socket to socket to a plain client
+	if (up->bodyMode == BODY_LENGTH && up->bodyRemaining > 0 && c->tls == NULL && !c->http2
+			&& proxy_pipe(pipefds) == 0)
+	{
+		if (connection_flush(c) != 0)
+		{
+			proxy_pipe_put(pipefds);
+			c->keepAlive = 0;
+			return PROXY_DONE;
+		}
+		result = proxy_splice(up, c, up->bodyRemaining, pipefds);
+		proxy_pipe_put(pipefds);
+		if (result != SPLICE_OK)
+		{
+			c->keepAlive = 0;
+			return PROXY_DONE;
+		}
+		up->bodyTotal += up->bodyRemaining;
+		up->bodyRemaining = 0;
+	}
+
+	// Anything else is copied a piece at a time
+	while ((count = body_next(up, &data)) > 0)
+	{
+		if (chunked)
+		{
+			size = sprintf(field, "%zx\r\n", (size_t) count);
+			connection_write(c, field, size);
+			connection_write(c, data, count);
+			connection_write(c, "\r\n", 2);
+		}
+		else if (connection_write(c, data, count) != 0)
+		{
+			count = -1;
+			break;
+		}
+
+		// An HTTP/2 session sends the whole response once it is gathered
+		if (connection_flush(c) != 0)
+		{
+			c->keepAlive = 0;
+			return PROXY_DONE;
+		}
+	}
+
+	// The client cannot be told the body is short, so its connection ends
+	if (count < 0)
+	{
+		c->keepAlive = 0;
+		return PROXY_DONE;
+	}
+	// The end of the response is sent by the worker once this returns
+	if (chunked)
+	{
+		connection_write(c, "0\r\n\r\n", 5);
+	}
+
+	*reusable = upstreamKeepAlive && up->inpos == up->inlen;
+	return PROXY_DONE;
+}
+
+/*
+ * Function: proxy_exchange
+ * ----------------------------
+ *   Sends the client's request over an upstream connection and relays
+ *   the response.
+ *
+ *	 Parameters:
+ *   c: The client connection
+ *   up: The upstream connection
+ *   head: Nonzero if the request is HEAD
+ *   replayable: Nonzero if the request has no body, so it can be sent
+ *   again on another connection
+ *   reusable: Set to 1 if the upstream connection can take another request
+ *
+ *   Returns: PROXY_DONE, PROXY_STALE if the connection turned out to be
+ *   closed before anything of the request was used up, or PROXY_FAILED
+ *   if the server failed before the response started; the client has
+ *   been sent nothing in the last two cases
+ */
+static int proxy_exchange(connection *c, connection *up, int head, int replayable, int *reusable)
+{
+	int result;
+
+	*reusable = 0;
+
+	result = proxy_send_request(c, up);
+	if (result < 0)
+	{
+		LOG_INFO("Thread %u: Request body incomplete or invalid.", (unsigned int) pthread_self());
+		sendError(c, 400);
+		return PROXY_DONE;
+	}
+	if (result == PROXY_FAILED)
+	{
+		return replayable ? PROXY_STALE : PROXY_FAILED;
+	}
+
+	// The wait is bounded by the server's deadline alone, so the client is
+	// still there to be told if the server runs out of time
+	timer_cancel(&(c->timer));
+	result = proxy_read_response(up);
+	connection_set_deadline(c, CONN_TIMER_RESPONSE);
+	if (result == CONN_ERR_CLOSED && replayable && up->inlen == 0 && !up->timedOut)
+	{
+		return PROXY_STALE;
+	}
+	if (result != CONN_OK)
+	{
+		LOG_WARN("Thread %u: No response from the upstream server%s.", (unsigned int) pthread_self(),
+				result == CONN_ERR_TIMEOUT ? " in time" : "");
+		return PROXY_FAILED;
+	}
+
+	return proxy_send_response(c, up, head, reusable);
+}
+
+/*
+ * Function: processProxy
+ * ----------------------------
+ *   Sends a request for a proxied path to an upstream server and relays
+ *   the response. A pooled connection that turns out to have been closed
+ *   is replaced by a new one, and a server that cannot be reached is
+ *   taken out of rotation and the request tried on another. The client
+ *   is sent 502 if no server answers, 503 if none is healthy, and 504 if
+ *   the answer does not come in time.
+ *
+ *	 Parameters:
+ *   c: The connection holding the request header
+ *
+ *   Returns: nothing
+ */
+void processProxy(connection *c)
+{
+	proxy_route *route = proxy_find(c);
+	proxy_upstream *server;
+	connection *up;
+	int head = !strncmp(c->inbuf, "HEAD ", 5);
+	int replayable;
+	int reused;
+	int reusable;
+	int attempts;
+	int result;
+	int status = 503;	// sent if no server answers
+	int fd;
+
+	// Only a request that says it has a body has one
+	c->bodyMode = BODY_NONE;
+	if (connection_header(c, "Transfer-Encoding") != NULL || connection_header(c, "Content-Length") != NULL)
+	{
+		status = body_reader_init(c);
+		if (status != 0)
+		{
+			LOG_INFO("Thread %u: Request body refused with status %i.", (unsigned int) pthread_self(), status);
+			sendError(c, status);
+			return;
+		}
+		status = 503;
+	}
+	replayable = c->bodyMode == BODY_NONE || (c->bodyMode == BODY_LENGTH && c->bodyRemaining == 0);
+
+	// Each server gets one try; a pooled connection the server had
+	// already closed does not count
+	for (attempts = 0; attempts < route->upstreamCount; )
+	{
+		server = proxy_pick(route);
+		if (server == NULL)
+		{
+			break;
+		}
+
+		fd = proxy_connect(server, &reused);
+		if (fd < 0)
+		{
+			proxy_failed(server);
+			__atomic_sub_fetch(&(server->outstanding), 1, __ATOMIC_RELAXED);
+			status = 502;
+			attempts++;
+			continue;
+		}
+
+		up = connection_acquire(&contexts, fd);
+		if (up == NULL)
+		{
+			close(fd);
+			__atomic_sub_fetch(&(server->outstanding), 1, __ATOMIC_RELAXED);
+			sendError(c, 500);
+			return;
+		}
+		PROBE2(proxy, c->sockfd, fd);
+
+		result = proxy_exchange(c, up, head, replayable, &reusable);
+		status = up->timedOut ? 504 : 502;
+
+		// The deadline must be off before the socket is pooled or closed
+		timer_cancel(&(up->timer));
+		if (result == PROXY_DONE && reusable)
+		{
+			proxy_keep(server, fd);
+			up->sockfd = -1;
+		}
+		connection_release(&contexts, up);
+		__atomic_sub_fetch(&(server->outstanding), 1, __ATOMIC_RELAXED);
+
+		if (result == PROXY_DONE)
+		{
+			return;
+		}
+		if (result == PROXY_STALE && reused)
+		{
+			continue;
+		}
+
+		// A server that timed out is slow rather than gone, and a request
+		// whose body has been used up cannot be sent again
+		if (status == 502)
+		{
+			proxy_failed(server);
+		}
+		if (!replayable || status == 504)
+		{
+			break;
+		}
+		attempts++;
+	}
+
+	if (status == 503)
+	{
+		LOG_WARN("Thread %u: No healthy upstream server for the request.", (unsigned int) pthread_self());
+	}
+	sendError(c, status);
+}
+
+/*
+ * Function: proxy_check
+ * ----------------------------
+ *   Checks an upstream server by connecting to it and, if proxyhealth
+ *   names a path, requesting that path. A server answering with a status
+ *   below 500 is healthy.
+ *
+ *	 Parameters:
+ *   server: The server
+ *
+ *   Returns: 1 if the server is healthy, 0 otherwise
+ */
+static int proxy_check(proxy_upstream *server)
+{
+	const char *path = config_current()->settings.proxyHealth;
+	struct timeval wait = { PROXY_CONNECT_TIMEOUT, 0 };
+	char buffer[BUFSIZE];
+	ssize_t count;
+	size_t received = 0;
+	int size;
+	int fd = proxy_open(server, PROXY_CONNECT_TIMEOUT);
+	int healthy = 0;
+
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	if (path[0] == '\0')
+	{
+		close(fd);
+		return 1;
+	}
+
+	// The check blocks, bounded by socket timeouts
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+	size = snprintf(buffer, sizeof(buffer), "GET %.4000s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+			path, server->name);
+	if (send(fd, buffer, size, MSG_NOSIGNAL) == size)
+	{
+		while (received < 12 && (count = recv(fd, buffer + received, sizeof(buffer) - received - 1, 0)) > 0)
+		{
+			received += count;
+		}
+		buffer[received] = '\0';
+		healthy = received >= 12 && !strncmp(buffer, "HTTP/1.", 7) && atoi(buffer + 9) >= 100
+				&& atoi(buffer + 9) < 500;
+	}
+
+	close(fd);
+	return healthy;
+}
+
+/*
+ * Function: proxy_health_thread
+ * ----------------------------
+ *   Checks every upstream server each PROXY_HEALTH_INTERVAL seconds and
+ *   puts it in or takes it out of rotation.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *
+ *   Returns: nothing, the thread runs until the program ends
+ */
+static void *proxy_health_thread(void *arg)
+{
+	proxy_upstream *server;
+	int healthy;
+	int i;
+
+	config_reader_register();
+
+	for (;;)
+	{
+		config_offline();
+		sleep(PROXY_HEALTH_INTERVAL);
+		config_quiescent();
+
+		for (i = 0; i < proxy.upstreamCount; i++)
+		{
+			server = &(proxy.upstreams[i]);
+			healthy = proxy_check(server);
+			if (__atomic_exchange_n(&(server->healthy), healthy, __ATOMIC_RELAXED) != healthy)
+			{
+				LOG_WARN("Upstream server %s is %s.", server->name, healthy ? "back in rotation" : "out of rotation");
+			}
+		}
+	}
+
+	return NULL;
+}
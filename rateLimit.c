@@ -0,0 +1,526 @@
+/*
+ * rateLimit.c
+ *
+ * Contains the rate limiter. Each client address has a token bucket for
+ * its request rate and a count of its open connections, and so does
+ * each network named by a ratelimitnet line, shared by every client in
+ * it. A new connection is checked by the listener before it is queued,
+ * so a client over its limits never takes a worker; its connection is
+ * answered with a prebuilt 429 and closed. Further requests on a
+ * kept-alive connection are charged by the worker that reads them.
+ *
+ * The buckets live in a hash table split into RATE_SHARDS stripes, each
+ * with its own lock, so the listener and the workers rarely wait for
+ * one another. Buckets are never removed. A bucket that has refilled
+ * and has no connections open is as good as new, so a client that needs
+ * a slot takes it over; a table with no such slot left lets the client
+ * in uncounted rather than turn it away.
+ */
+
+#include "headerfile.h"
+
+// Define type of struct for a client's or network's bucket
+typedef struct rate_entry {
+	unsigned long long key;		// the address and prefix length, 0 if never used
+	long long tokens;			// requests left, in thousandths
+	long long updated;			// milliseconds when the tokens were last topped up
+	long long idleAt;			// milliseconds when the bucket will be full again
+	int connections;			// connections open
+	} rate_entry;
+
+// Define type of struct for one stripe of the table
+typedef struct rate_shard {
+	pthread_mutex_t lock;		// guards the stripe's buckets
+	rate_entry entries[RATE_SHARD_SIZE];
+	} __attribute__ ((aligned(64))) rate_shard;
+
+/*
+ * Struct that holds the stripes of the bucket table.
+ */
+static struct {
+	rate_shard shards[RATE_SHARDS];
+	int initialized;
+} limiter;
+
+static pthread_once_t limiterOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Function prototypes for the rateLimit.c file
+ */
+static void rate_init();
+static long long rate_now();
+static unsigned long long rate_key(unsigned int address, int prefixLength);
+static const rate_rule *rate_rule_find(const server_settings *settings, unsigned int address);
+static const rate_rule *rate_rule_for(const server_settings *settings, unsigned long long key);
+static rate_shard *rate_shard_for(unsigned long long key, unsigned int *slot);
+static rate_entry *rate_entry_find(rate_shard *shard, unsigned int slot, unsigned long long key, long long now);
+static int rate_take(unsigned long long key, int rate, int burst, int connectionLimit, int connect);
+static void rate_give_back(unsigned long long key, int token, int connect);
+
+/*
+ * Function: rate_init
+ * ----------------------------
+ *   Initializes the locks of the table's stripes.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+static void rate_init()
+{
+	int i;
+
+	for (i = 0; i < RATE_SHARDS; i++)
+	{
+		pthread_mutex_init(&(limiter.shards[i].lock), NULL);
+	}
+	limiter.initialized = 1;
+}
+
+/*
+ * Function: rate_now
+ * ----------------------------
+ *   Gets a coarse monotonic time, which is all a bucket needs.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the time in milliseconds
+ */
+static long long rate_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Function: rate_key
+ * ----------------------------
+ *   Makes the table key of a client or network. The prefix length is
+ *   part of the key, so a network never shares a bucket with the
+ *   client whose address it starts with, and no key is 0.
+ *
+ *	 Parameters:
+ *   address: The address, host order
+ *   prefixLength: 32 for a client, the network's for a network
+ *
+ *   Returns: the key
+ */
+static unsigned long long rate_key(unsigned int address, int prefixLength)
+{
+	return ((unsigned long long) (prefixLength + 1) << 32) | address;
+}
+
+/*
+ * Function: rate_rule_parse
+ * ----------------------------
+ *   Reads the limits of a network from a ratelimitnet line, given as
+ *   address/length and rate&burst&connections. A burst of 0 allows one
+ *   second's requests at once.
+ *
+ *	 Parameters:
+ *   network: The network, such as 10.1.0.0/16
+ *   limits: The limits, such as 100&200&50
+ *   rule: Set to the rule
+ *
+ *   Returns: 0 if successful, -1 if the line is invalid
+ */
+int rate_rule_parse(char *network, char *limits, rate_rule *rule)
+{
+	struct in_addr address;
+	char *slash = strchr(network, '/');
+
+	if (slash == NULL)
+	{
+		return -1;
+	}
+	*slash = '\0';
+	rule->prefixLength = atoi(slash + 1);
+	if (inet_pton(AF_INET, network, &address) != 1 || rule->prefixLength < 0 || rule->prefixLength > 32)
+	{
+		return -1;
+	}
+
+	rule->burst = 0;
+	rule->connections = 0;
+	if (sscanf(limits, "%d&%d&%d", &(rule->rate), &(rule->burst), &(rule->connections)) < 1 ||
+			rule->rate < 0 || rule->burst < 0 || rule->connections < 0)
+	{
+		return -1;
+	}
+
+	rule->mask = rule->prefixLength == 0 ? 0 : 0xFFFFFFFFu << (32 - rule->prefixLength);
+	rule->network = ntohl(address.s_addr) & rule->mask;
+	return 0;
+}
+
+/*
+ * Function: rate_rule_find
+ * ----------------------------
+ *   Finds the rule for a client. The longest matching network wins.
+ *
+ *	 Parameters:
+ *   settings: The settings in effect
+ *   address: The client's address, host order
+ *
+ *   Returns: the rule, or NULL if the client's network has none
+ */
+static const rate_rule *rate_rule_find(const server_settings *settings, unsigned int address)
+{
+	const rate_rule *best = NULL;
+	int i;
+
+	for (i = 0; i < settings->rateRuleCount; i++)
+	{
+		if ((address & settings->rateRules[i].mask) == settings->rateRules[i].network &&
+				(best == NULL || settings->rateRules[i].prefixLength > best->prefixLength))
+		{
+			best = &(settings->rateRules[i]);
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Function: rate_rule_for
+ * ----------------------------
+ *   Finds the rule a network's bucket was made for, which a reload may
+ *   have removed.
+ *
+ *	 Parameters:
+ *   settings: The settings in effect
+ *   key: The network's bucket
+ *
+ *   Returns: the rule, or NULL if there is none now
+ */
+static const rate_rule *rate_rule_for(const server_settings *settings, unsigned long long key)
+{
+	int i;
+
+	for (i = 0; i < settings->rateRuleCount; i++)
+	{
+		if (rate_key(settings->rateRules[i].network, settings->rateRules[i].prefixLength) == key)
+		{
+			return &(settings->rateRules[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Function: rate_shard_for
+ * ----------------------------
+ *   Finds the stripe a key lives in and the first slot to look at.
+ *
+ *	 Parameters:
+ *   key: The key
+ *   slot: Set to the first slot in the stripe
+ *
+ *   Returns: the stripe
+ */
+static rate_shard *rate_shard_for(unsigned long long key, unsigned int *slot)
+{
+	// Fibonacci hashing spreads neighbouring addresses over the stripes
+	unsigned long long hash = key * 0x9E3779B97F4A7C15ULL;
+
+	*slot = (unsigned int) (hash >> 32) & (RATE_SHARD_SIZE - 1);
+	return &(limiter.shards[hash >> 58 & (RATE_SHARDS - 1)]);
+}
+
+/*
+ * Function: rate_entry_find
+ * ----------------------------
+ *   Finds a key's bucket in a stripe, taking over an unused slot or a
+ *   bucket gone idle if it has none. The stripe must be locked.
+ *
+ *	 Parameters:
+ *   shard: The stripe
+ *   slot: The first slot to look at
+ *   key: The key
+ *   now: The time in milliseconds
+ *
+ *   Returns: the bucket, or NULL if the key has none and there is no
+ *   room for one
+ */
+static rate_entry *rate_entry_find(rate_shard *shard, unsigned int slot, unsigned long long key, long long now)
+{
+	rate_entry *entry;
+	rate_entry *reusable = NULL;
+	int i;
+
+	// A slot is never emptied once used, so the key cannot be past an
+	// unused one
+	for (i = 0; i < RATE_PROBE; i++)
+	{
+		entry = &(shard->entries[(slot + i) & (RATE_SHARD_SIZE - 1)]);
+		if (entry->key == key)
+		{
+			return entry;
+		}
+		if (entry->key == 0)
+		{
+			reusable = reusable == NULL ? entry : reusable;
+			break;
+		}
+		if (reusable == NULL && entry->connections == 0 && now >= entry->idleAt)
+		{
+			reusable = entry;
+		}
+	}
+
+	if (reusable != NULL)
+	{
+		reusable->key = key;
+		reusable->tokens = -1;	// filled by the caller
+		reusable->updated = now;
+		reusable->idleAt = now;
+		reusable->connections = 0;
+	}
+	return reusable;
+}
+
+/*
+ * Function: rate_take
+ * ----------------------------
+ *   Takes a request's token from a bucket and, for a new connection,
+ *   counts the connection, if both are within the limits.
+ *
+ *	 Parameters:
+ *   key: The bucket
+ *   rate: Requests per second, 0 for no limit
+ *   burst: Requests allowed at once, 0 for one second's worth
+ *   connectionLimit: Connections allowed open, 0 for no limit
+ *   connect: Nonzero if the request opens a new connection
+ *
+ *   Returns: 1 if allowed, 0 if allowed without being counted because
+ *   the table is full, or -1 if a limit is reached
+ */
+static int rate_take(unsigned long long key, int rate, int burst, int connectionLimit, int connect)
+{
+	rate_shard *shard;
+	rate_entry *entry;
+	unsigned int slot;
+	long long now = rate_now();
+	long long capacity;
+	int result = 1;
+
+	if (burst <= 0)
+	{
+		burst = rate > 0 ? rate : 1;
+	}
+	capacity = (long long) burst * 1000;
+
+	shard = rate_shard_for(key, &slot);
+	pthread_mutex_lock(&(shard->lock));
+
+	entry = rate_entry_find(shard, slot, key, now);
+	if (entry == NULL)
+	{
+		pthread_mutex_unlock(&(shard->lock));
+		LOG_INFO_SAMPLED("The rate limiter's table is full; a client is let in uncounted.");
+		return 0;
+	}
+
+	// Top the bucket up for the time since it was last used
+	if (entry->tokens < 0)
+	{
+		entry->tokens = capacity;
+	}
+	else if (rate > 0)
+	{
+		entry->tokens += (now - entry->updated) * rate;
+	}
+	if (entry->tokens > capacity || rate == 0)
+	{
+		entry->tokens = capacity;
+	}
+	entry->updated = now;
+
+	if ((rate > 0 && entry->tokens < 1000) || (connect && connectionLimit > 0 && entry->connections >= connectionLimit))
+	{
+		result = -1;
+	}
+	else
+	{
+		entry->tokens -= rate > 0 ? 1000 : 0;
+		entry->connections += connect ? 1 : 0;
+	}
+
+	// The bucket is as good as new once it has refilled
+	entry->idleAt = now + (rate > 0 ? (capacity - entry->tokens + rate - 1) / rate : 0);
+
+	pthread_mutex_unlock(&(shard->lock));
+	return result;
+}
+
+/*
+ * Function: rate_give_back
+ * ----------------------------
+ *   Returns a request's token to a bucket, or stops counting a
+ *   connection, or both.
+ *
+ *	 Parameters:
+ *   key: The bucket
+ *   token: Nonzero to return a token
+ *   connect: Nonzero to stop counting a connection
+ *
+ *   Returns: nothing
+ */
+static void rate_give_back(unsigned long long key, int token, int connect)
+{
+	rate_shard *shard;
+	rate_entry *entry;
+	unsigned int slot;
+	int i;
+
+	shard = rate_shard_for(key, &slot);
+	pthread_mutex_lock(&(shard->lock));
+	for (i = 0; i < RATE_PROBE; i++)
+	{
+		entry = &(shard->entries[(slot + i) & (RATE_SHARD_SIZE - 1)]);
+		if (entry->key == key)
+		{
+			entry->tokens += token ? 1000 : 0;
+			if (connect && entry->connections > 0)
+			{
+				entry->connections -= 1;
+			}
+			break;
+		}
+		if (entry->key == 0)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(shard->lock));
+}
+
+/*
+ * Function: rate_limit_admit
+ * ----------------------------
+ *   Decides whether a new connection is let in, charging its first
+ *   request to the client's bucket and its network's. Called by the
+ *   listener before the connection is queued.
+ *
+ *	 Parameters:
+ *   address: The client's IPv4 address, host order
+ *   keys: Set to the buckets the connection is counted in, which must
+ *   be passed to rate_limit_release when it closes
+ *
+ *   Returns: 0 if the connection is let in, -1 if it is over a limit
+ */
+int rate_limit_admit(unsigned int address, rate_keys *keys)
+{
+	const server_settings *settings = &(config_current()->settings);
+	const rate_rule *rule;
+	int result;
+
+	keys->client = 0;
+	keys->network = 0;
+
+	// Nothing is counted while no limit is set
+	if (settings->rateLimit == 0 && settings->connLimit == 0 && settings->rateRuleCount == 0)
+	{
+		return 0;
+	}
+	pthread_once(&limiterOnce, rate_init);
+
+	if (settings->rateLimit > 0 || settings->connLimit > 0)
+	{
+		result = rate_take(rate_key(address, 32), settings->rateLimit, settings->rateBurst, settings->connLimit, 1);
+		if (result < 0)
+		{
+			return -1;
+		}
+		keys->client = result > 0 ? rate_key(address, 32) : 0;
+	}
+
+	rule = rate_rule_find(settings, address);
+	if (rule != NULL && (rule->rate > 0 || rule->connections > 0))
+	{
+		result = rate_take(rate_key(rule->network, rule->prefixLength), rule->rate, rule->burst, rule->connections, 1);
+		if (result < 0)
+		{
+			// The client's own bucket gives back what it was charged
+			if (keys->client != 0)
+			{
+				rate_give_back(keys->client, settings->rateLimit > 0, 1);
+				keys->client = 0;
+			}
+			return -1;
+		}
+		keys->network = result > 0 ? rate_key(rule->network, rule->prefixLength) : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: rate_limit_request
+ * ----------------------------
+ *   Charges another request on a kept-alive connection to the buckets
+ *   the connection is counted in.
+ *
+ *	 Parameters:
+ *   keys: The connection's buckets
+ *
+ *   Returns: 0 if the request is let in, -1 if it is over a rate limit
+ */
+int rate_limit_request(rate_keys *keys)
+{
+	const server_settings *settings;
+	const rate_rule *rule;
+
+	if (keys->client == 0 && keys->network == 0)
+	{
+		return 0;
+	}
+	settings = &(config_current()->settings);
+
+	if (keys->client != 0 && settings->rateLimit > 0 &&
+			rate_take(keys->client, settings->rateLimit, settings->rateBurst, 0, 0) < 0)
+	{
+		return -1;
+	}
+
+	rule = keys->network != 0 ? rate_rule_for(settings, keys->network) : NULL;
+	if (rule != NULL && rule->rate > 0 && rate_take(keys->network, rule->rate, rule->burst, 0, 0) < 0)
+	{
+		if (keys->client != 0 && settings->rateLimit > 0)
+		{
+			rate_give_back(keys->client, 1, 0);
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: rate_limit_release
+ * ----------------------------
+ *   Stops counting a closed connection against its buckets.
+ *
+ *	 Parameters:
+ *   keys: The connection's buckets, cleared on return
+ *
+ *   Returns: nothing
+ */
+void rate_limit_release(rate_keys *keys)
+{
+	if (keys->client != 0)
+	{
+		rate_give_back(keys->client, 0, 1);
+	}
+	if (keys->network != 0)
+	{
+		rate_give_back(keys->network, 0, 1);
+	}
+	keys->client = 0;
+	keys->network = 0;
+}
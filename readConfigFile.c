@@ -11,11 +11,11 @@
 // Function prototypes
 void getNameValuePair(char *, char *, char *);
 void getExtensionTypePair(char *, char *, char *);
-int addFiletype(char *);
-void initFiletypeArray();
-void printFiletypeArrayElement(int);
-void printLoadedFiletypes();
-void logLoadedFiletypes();
+int addFiletype(filetypes_template *, char *);
+void initFiletypeArray(filetypes_template *);
+void printFiletypeArrayElement(filetypes_template *, int);
+void printLoadedFiletypes(filetypes_template *);
+void logLoadedFiletypes(filetypes_template *);
 
 /*
  * Function: getNameValuePair
@@ -99,11 +99,12 @@ void getExtensionTypePair(char *pair, char *extension, char *type)
  *   Adds a file type extension/type pair to the filetypes array.
  *
  *	 Parameters:
+ *   filetypes - the filetypes array
  *   etpair - the "unsplit" extension/type pair
  *
  *   Returns: the index of the filetypes array where the data was added
  */
-int addFiletype(char *etpair)
+int addFiletype(filetypes_template *filetypes, char *etpair)
 {
 	char extensionbuff[BUFSIZE]; // the file extension
 	char typebuff[BUFSIZE]; // the file type
@@ -137,11 +138,12 @@ int addFiletype(char *etpair)
  * ----------------------------
  *   Initializes the elements in the the filetypes array.
  *
- *	 Parameters: none
+ *	 Parameters:
+ *	 filetypes - the filetypes array
  *
  *   Returns: nothing
  */
-void initFiletypeArray()
+void initFiletypeArray(filetypes_template *filetypes)
 {
 	int i;
 
@@ -159,11 +161,12 @@ void initFiletypeArray()
  *   Prints a filetypes array element to the console.
  *
  *	 Parameters:
+ *	 filetypes - the filetypes array
  *	 index - the index containing the element to access
  *
  *   Returns: nothing
  */
-void printFiletypeArrayElement(int index)
+void printFiletypeArrayElement(filetypes_template *filetypes, int index)
 {
 	printf("%d>\t %s \t %s\n", filetypes[index].index, filetypes[index].extension, filetypes[index].type);
 }
@@ -173,11 +176,12 @@ void printFiletypeArrayElement(int index)
  * ----------------------------
  *   Prints the loaded file types to the console.
  *
- *	 Parameters: none
+ *	 Parameters:
+ *	 filetypes - the filetypes array
  *
  *   Returns: nothing
  */
-void printLoadedFiletypes()
+void printLoadedFiletypes(filetypes_template *filetypes)
 {
 	int i = 0;
 
@@ -197,11 +201,12 @@ void printLoadedFiletypes()
  * ----------------------------
  *   Lists the loaded file types to the log file.
  *
- *	 Parameters: none
+ *	 Parameters:
+ *	 filetypes - the filetypes array
  *
  *   Returns: nothing
  */
-void logLoadedFiletypes()
+void logLoadedFiletypes(filetypes_template *filetypes)
 {
 	int i = 0;
 	char logbuff[BUFSIZE];		// the log buffer
@@ -227,10 +232,11 @@ void logLoadedFiletypes()
  *	 filename - the configuration file name
  *	 port - the port
  *	 dir - the home directory
+ *	 config - the configuration to fill in
  *
  *   Returns: 0 for no error, >0 for error
  */
-int readConfigFile(char *filename, char *port, char *dir)
+int readConfigFile(char *filename, char *port, char *dir, server_config *config)
 {
 	char fileline[BUFSIZE];		// line from the file
 	char namebuff[BUFSIZE];		// name buffer
@@ -240,7 +246,7 @@ int readConfigFile(char *filename, char *port, char *dir)
 	printf("Config file name: %s\n", filename);
 
 	// Initialize the filetypes array
-	initFiletypeArray();
+	initFiletypeArray(config->filetypes);
 
 	// Open the file for reading
 	FILE *configFile = fopen(filename, "r");
@@ -282,19 +288,255 @@ int readConfigFile(char *filename, char *port, char *dir)
 					strcpy(dir, valuebuff);
 				}
 
-				// If this is a mimetype line
+				// If this is a connection deadline line
+				if (!strcmp(namebuff, "headertimeout") && atoi(valuebuff) > 0)
+				{
+					config->settings.headerTimeout = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "bodytimeout") && atoi(valuebuff) > 0)
+				{
+					config->settings.bodyTimeout = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "keepalivetimeout") && atoi(valuebuff) > 0)
+				{
+					config->settings.keepaliveTimeout = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "responsetimeout") && atoi(valuebuff) > 0)
+				{
+					config->settings.responseTimeout = atoi(valuebuff);
+				}
+
+				// If this is a maximum body size line
+				if (!strcmp(namebuff, "maxbody") && atoll(valuebuff) >= 0)
+				{
+					config->settings.maxBodySize = atoll(valuebuff);
+				}
+
+				// Open file cache size and revalidation interval
+				if (!strcmp(namebuff, "filecache") && atoi(valuebuff) >= 0)
+				{
+					config->settings.fileCacheSize = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "filecachevalid") && atoi(valuebuff) > 0)
+				{
+					config->settings.fileCacheValid = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "negativecache") && atoi(valuebuff) >= 0)
+				{
+					config->settings.negativeCacheSize = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "docrootindex") && atoi(valuebuff) >= 0)
+				{
+					config->settings.docrootIndexSize = atoi(valuebuff);
+				}
+
+				// If this is a bundle line
+				if (!strcmp(namebuff, "bundle"))
+				{
+					strcpy(config->settings.bundle, valuebuff);
+				}
+
+				// Seconds allowed for in-flight requests when stopping
+				if (!strcmp(namebuff, "draintimeout") && atoi(valuebuff) >= 0)
+				{
+					config->settings.drainTimeout = atoi(valuebuff);
+				}
+
+				// Log level and the sampling of per-request info lines
+				if (!strcmp(namebuff, "loglevel"))
+				{
+					if (log_level_parse(valuebuff) > 0)
+					{
+						config->settings.logLevel = log_level_parse(valuebuff);
+					}
+					else
+					{
+						sprintf(logbuff, "Unknown log level %.100s; using the default.", valuebuff);
+						logger(logbuff);
+					}
+				}
+				if (!strcmp(namebuff, "logsample") && atoi(valuebuff) > 0)
+				{
+					config->settings.logSample = atoi(valuebuff);
+				}
+
+				// Request trace size, slow request threshold and endpoint
+				if (!strcmp(namebuff, "tracering") && atoi(valuebuff) >= 0)
+				{
+					config->settings.traceRingSize = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "slowrequest") && atoi(valuebuff) >= 0)
+				{
+					config->settings.slowRequest = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "traceendpoint"))
+				{
+					strcpy(config->settings.traceEndpoint, valuebuff);
+				}
+
+				// TLS certificate chain, private key and session cache size
+				if (!strcmp(namebuff, "tlscertificate"))
+				{
+					strcpy(config->settings.tlsCertificate, valuebuff);
+				}
+				if (!strcmp(namebuff, "tlskey"))
+				{
+					strcpy(config->settings.tlsKey, valuebuff);
+				}
+				if (!strcmp(namebuff, "tlssessioncache") && atoi(valuebuff) >= 0)
+				{
+					config->settings.tlsSessionCache = atoi(valuebuff);
+				}
+
+				// If this is an HTTP/2 line
+				if (!strcmp(namebuff, "http2"))
+				{
+					config->settings.http2 = atoi(valuebuff) != 0;
+				}
+
+				// If this is a rate limit line: requests per second from one
+				// client, optionally with the burst it may make at once
+				if (!strcmp(namebuff, "ratelimit") && atoi(valuebuff) >= 0)
+				{
+					config->settings.rateLimit = atoi(valuebuff);
+					config->settings.rateBurst = strchr(valuebuff, ET_DELIMITER) != NULL
+							? atoi(strchr(valuebuff, ET_DELIMITER) + 1) : 0;
+				}
+				if (!strcmp(namebuff, "connlimit") && atoi(valuebuff) >= 0)
+				{
+					config->settings.connLimit = atoi(valuebuff);
+				}
+
+				// If this is a network's rate limit line
+				if (!strcmp(namebuff, "ratelimitnet") && strchr(valuebuff, ET_DELIMITER) != NULL)
+				{
+					char networkbuff[BUFSIZE];
+					char limitbuff[BUFSIZE];
+					getExtensionTypePair(valuebuff, networkbuff, limitbuff);
+					if (config->settings.rateRuleCount >= RATE_MAX_RULES ||
+							rate_rule_parse(networkbuff, limitbuff, &(config->settings.rateRules[config->settings.rateRuleCount])) != 0)
+					{
+						sprintf(logbuff, "Rate limit line ignored: %.200s", valuebuff);
+						logger(logbuff);
+					}
+					else
+					{
+						config->settings.rateRuleCount += 1;
+					}
+				}
+
+				// If this is a listening socket line
+				if (!strcmp(namebuff, "listenbacklog") && atoi(valuebuff) > 0)
+				{
+					config->settings.listenBacklog = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "deferaccept") && atoi(valuebuff) >= 0)
+				{
+					config->settings.deferAccept = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "fastopen") && atoi(valuebuff) >= 0)
+				{
+					config->settings.fastOpen = atoi(valuebuff);
+				}
+				if (!strcmp(namebuff, "tcpnodelay"))
+				{
+					config->settings.tcpNoDelay = atoi(valuebuff) != 0;
+				}
+				if (!strcmp(namebuff, "tcpnopush"))
+				{
+					config->settings.tcpNoPush = atoi(valuebuff) != 0;
+				}
+				if (!strcmp(namebuff, "busypoll") && atoi(valuebuff) >= 0)
+				{
+					config->settings.busyPoll = atoi(valuebuff);
+				}
+
+				// If this is a large response line
+				if (!strcmp(namebuff, "largeresponse") && atoll(valuebuff) >= 0)
+				{
+					config->settings.largeResponse = atoll(valuebuff);
+				}
+
+				// If this is a Unix socket line
+				if (!strcmp(namebuff, "tcplisten"))
+				{
+					config->settings.tcpListen = atoi(valuebuff) != 0;
+				}
+				if (!strcmp(namebuff, "unixsocket"))
+				{
+					strcpy(config->settings.unixSocket, valuebuff);
+				}
+				if (!strcmp(namebuff, "unixsocketmode"))
+				{
+					config->settings.unixSocketMode = (int) strtol(valuebuff, NULL, 8) & 0777;
+				}
+
+				// If this is a handoff socket line
+				if (!strcmp(namebuff, "handoff"))
+				{
+					strcpy(config->settings.handoff, valuebuff);
+				}
+
+				// If this is a custom error page line. Error pages are built
+				// once at startup, so a reload leaves them as they are.
+				if (!strcmp(namebuff, "errorpage") && config_current() == NULL && strchr(valuebuff, ET_DELIMITER) != NULL)
+				{
+					char codebuff[BUFSIZE];
+					char pagebuff[BUFSIZE];
+					getExtensionTypePair(valuebuff, codebuff, pagebuff);
+					if (error_page_set(atoi(codebuff), pagebuff) != 0)
+					{
+						sprintf(logbuff, "No error page can be set for %d.", atoi(codebuff));
+						logger(logbuff);
+					}
+				}
+
+				// If this is a reverse proxy line. Routes are set up once at
+				// startup, so a reload leaves them as they are.
+				if (!strcmp(namebuff, "proxy") && config_current() == NULL && strchr(valuebuff, ET_DELIMITER) != NULL)
+				{
+					char prefixbuff[BUFSIZE];
+					char serversbuff[BUFSIZE];
+					getExtensionTypePair(valuebuff, prefixbuff, serversbuff);
+					if (proxy_route_add(prefixbuff, serversbuff) != 0)
+					{
+						sprintf(logbuff, "No proxy route can be set for %.200s.", prefixbuff);
+						logger(logbuff);
+					}
+				}
+				// If this is a FastCGI or SCGI line. Routes are set up once
+				// at startup, so a reload leaves them as they are.
+				if ((!strcmp(namebuff, "fastcgi") || !strcmp(namebuff, "scgi")) && config_current() == NULL
+						&& strchr(valuebuff, ET_DELIMITER) != NULL)
+				{
+					char prefixbuff[BUFSIZE];
+					char backendbuff[BUFSIZE];
+					getExtensionTypePair(valuebuff, prefixbuff, backendbuff);
+					if (gateway_route_add(!strcmp(namebuff, "fastcgi") ? GATEWAY_FASTCGI : GATEWAY_SCGI,
+							prefixbuff, backendbuff) != 0)
+					{
+						sprintf(logbuff, "No %.20s route can be set for %.200s.", namebuff, prefixbuff);
+						logger(logbuff);
+					}
+				}
+				if (!strcmp(namebuff, "proxyhealth"))
+				{
+					strcpy(config->settings.proxyHealth, valuebuff);
+				}
+
+								// If this is a mimetype line
 				if (!strcmp(namebuff, "mimetype"))
 				{
 					// printf("Called addFiletype\n");
 					int i = -1;
-					i = addFiletype(valuebuff);
+					i = addFiletype(config->filetypes, valuebuff);
 					//printFiletypeArrayElement(i);
 				}
 			}
 		}
 
-		printLoadedFiletypes();
-		logLoadedFiletypes();
+		printLoadedFiletypes(config->filetypes);
+		logLoadedFiletypes(config->filetypes);
 
 		// Close the file
 		fclose (configFile);
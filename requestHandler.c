@@ -1,4 +1,5 @@
 #include "headerfile.h"
+#include <limits.h>
 
 /*
  * Function: getContentType
@@ -8,205 +9,502 @@
  *	 Parameters:
  *   resource: The file being requested with filetype extension
  *
- *   Returns: MIME type of the file being requested
+ *   Returns: MIME type of the file being requested, or an empty string
+ *   if the extension has no type
  */
 char* getContentType(char *resource)
 {
-	int periodLoc = strlen(resource);
-	for (; resource[periodLoc] != '.'; periodLoc--)
-		;
+	char *extension = strrchr(resource, '.');
 
-	char* contentType = "\0";
+	if (extension == NULL || strchr(extension, '/') != NULL)
+	{
+		return "";
+	}
+	extension++;
 
+	// Extensions already known to have no type skip the search
+	if (negative_cache_lookup(NEGATIVE_TYPE, extension))
+	{
+		return "";
+	}
+
+	const filetypes_template *filetypes = config_current()->filetypes;
 	int i;
 	for (i = 0; filetypes[i].index != -1 && i < FILETYPES_ARRAY_SIZE; i++)
 	{
-		if (strcmp(filetypes[i].extension, resource + periodLoc + 1) == 0)
+		if (strcmp(filetypes[i].extension, extension) == 0)
 		{
-			contentType = strdup(filetypes[i].type);
-			break;
+			return (char *) filetypes[i].type;
 		}
 	}
-	return contentType;
+
+	negative_cache_add(NEGATIVE_TYPE, extension);
+	return "";
+}
+
+/*
+ * Function: normalizePath
+ * ----------------------------
+ *   Turns a URL path into the path of a file below the home directory.
+ *   Percent escapes are decoded, empty and "." segments are dropped, and
+ *   each ".." removes the segment before it. The result has no leading
+ *   or trailing '/', so it can never name anything outside the home
+ *   directory, and each file has exactly one name.
+ *
+ *	 Parameters:
+ *   path: The URL path
+ *   length: The length of the URL path
+ *   normalized: Set to the file path; must hold length + 1 bytes
+ *
+ *   Returns: 0 if successful, -1 if the path has an invalid escape or
+ *   a null byte, or climbs above the home directory
+ */
+int normalizePath(const char *path, size_t length, char *normalized)
+{
+	size_t i;
+	size_t out = 0;				// bytes written to normalized
+	size_t segmentStart = 0;	// where the current segment starts in normalized
+	int high, low;
+	char c;
+
+	for (i = 0; i <= length; i++)
+	{
+		c = i < length ? path[i] : '/';
+		if (c == '%')
+		{
+			if (i + 2 >= length || (high = hexDigit(path[i + 1])) < 0 || (low = hexDigit(path[i + 2])) < 0)
+			{
+				return -1;
+			}
+			c = (char) (high * 16 + low);
+			if (c == '\0')
+			{
+				return -1;
+			}
+			i += 2;
+		}
+
+		if (c != '/')
+		{
+			normalized[out++] = c;
+			continue;
+		}
+
+		// A segment has ended; drop it or climb out of the one before
+		if (out == segmentStart || (out - segmentStart == 1 && normalized[segmentStart] == '.'))
+		{
+			out = segmentStart;
+		}
+		else if (out - segmentStart == 2 && normalized[segmentStart] == '.' && normalized[segmentStart + 1] == '.')
+		{
+			if (segmentStart == 0)
+			{
+				return -1;
+			}
+			out = segmentStart - 1;
+			while (out > 0 && normalized[out - 1] != '/')
+			{
+				out--;
+			}
+		}
+		else
+		{
+			normalized[out++] = '/';
+		}
+		segmentStart = out;
+	}
+
+	// Remove the separator after the last segment
+	if (out > 0)
+	{
+		out--;
+	}
+	normalized[out] = '\0';
+	return 0;
 }
 
 /*
  * Function: getResourceName
  * ----------------------------
- *   Gets the name of the requested resource
+ *   Gets the name of the requested resource, normalized to a path
+ *   relative to the home directory
  *
  *	 Parameters:
- *   resourceName: The string to store the resource name into
+ *   resourceName: The string to store the resource name into, PATH_MAX
+ *   bytes long
  *   requestData: The data from the request
+ *
+ *   Returns: 0 if successful, -1 if the request line or path is invalid
+ *   or the path is PATH_MAX bytes or longer
  */
-void getResourceName(char *resourceName, char *requestData)
+int getResourceName(char *resourceName, char *requestData)
 {
-	char *resourceStart = strchr(requestData, ' ') + 1;
+	char *lineEnd = requestData + strcspn(requestData, "\r\n");
+	char *resourceStart = memchr(requestData, ' ', lineEnd - requestData);
+	char *resourceEnd;
+	char *scheme;
 
-	// if we're not starting with a "/" we have an absolute URL
-	if (*resourceStart != '/') {
-		// move past http://
-		resourceStart += 7;
-		// look for the next "/"
-		resourceStart = strchr(resourceStart, '/');
+	if (resourceStart == NULL)
+	{
+		return -1;
 	}
-
 	resourceStart++;
 
-	// find potential form data
-	char *resourceEnd = strchr(resourceStart, '?');
+	// if we're not starting with a "/" we have an absolute URL
+	if (*resourceStart != '/')
+	{
+		// move past the scheme and look for the next "/"
+		scheme = strstr(resourceStart, "://");
+		if (scheme == NULL || scheme > lineEnd)
+		{
+			return -1;
+		}
+		resourceStart = memchr(scheme + 3, '/', lineEnd - (scheme + 3));
+		if (resourceStart == NULL)
+		{
+			resourceStart = lineEnd;
+		}
+	}
 
-	// if we didn't find form data or there is a space before the form data
-	// use that location instead
-	if (resourceEnd == NULL || strchr(resourceStart, ' ') < resourceEnd)
+	// the path ends at the form data or the space before the version
+	resourceEnd = resourceStart + strcspn(resourceStart, "? \r\n");
+	if (resourceEnd > lineEnd)
 	{
-		resourceEnd = strchr(resourceStart, ' ');
+		resourceEnd = lineEnd;
+	}
+	if (resourceEnd - resourceStart >= PATH_MAX)
+	{
+		return -1;
 	}
 
-	// if we have a resource, use it
-	if (resourceEnd - resourceStart > 0)
+	if (normalizePath(resourceStart, resourceEnd - resourceStart, resourceName) != 0)
 	{
-		strncpy(resourceName, resourceStart, resourceEnd - resourceStart);
+		return -1;
 	}
-	else
+
+	// if there is no resource, use the default
+	if (resourceName[0] == '\0')
 	{
-		// otherwise use the default
 		strcpy(resourceName, DEFAULT_START);
 	}
 
 	// log
-	char logbuff[BUFSIZE];
-	sprintf(logbuff, "Thread %u: Resource requested: %s.", (unsigned int) pthread_self(), resourceName);
-	logger(logbuff);
+	LOG_INFO_SAMPLED("Thread %u: Resource requested: %s.", (unsigned int) pthread_self(), resourceName);
+	return 0;
 }
 
 /*
  * Function: getFormData
  * ----------------------------
- *   Gets form data, if any
+ *   Gets form data from the query string of a GET request, if any.
+ *   Every field is decoded into the request arena.
  *
  *	 Parameters:
- *   formData[]: A 3 slot char * array for the form data to be placed into.
- *   requestData: The data from the request
+ *   conn: The connection holding the request
+ *
+ *   Returns: the first decoded field, or NULL if there is no form data
  */
-void getFormData(char *formData[], char *requestData)
+form_field *getFormData(connection *conn)
 {
+	form_parser parser;		// the form decoder
+	char *requestLine = conn->inbuf;
+	char *lineEnd = memchr(requestLine, '\n', conn->headerlen);
 	char *formDataStart;
 	char *formDataEnd;
 
-	char *p;
+	form_parser_init(&parser, &(conn->requestArena));
 
-	if (!strncmp(requestData, "GET ", 4))
-	{
-		formDataStart = strchr(requestData, '?');
-		formDataEnd = strchr(requestData + 4, ' ');
+	// The query string runs from the '?' to the space ending the URI
+	formDataEnd = lineEnd != NULL ? memchr(requestLine + 4, ' ', lineEnd - requestLine - 4) : NULL;
+	formDataStart = formDataEnd != NULL ? memchr(requestLine, '?', formDataEnd - requestLine) : NULL;
 
-		if (formDataStart != NULL && formDataStart < formDataEnd)
+	if (formDataStart != NULL)
+	{
+		formDataStart++;
+		if (form_parser_feed(&parser, formDataStart, formDataEnd - formDataStart) != 0 ||
+				form_parser_finish(&parser) != 0)
 		{
-			formData[0] = strchr(formDataStart, '=') + 1;
-			formData[1] = strchr(formData[0], '=') + 1;
-			formData[2] = strchr(formData[1], '=') + 1;
-
-			p = strchr(formData[0], '&');
-			p[0] = '\0';
-			p = strchr(formData[1], '&');
-			p[0] = '\0';
-			p = strchr(formData[2], ' ');
-			p[0] = '\0';
+			parser.first = NULL;
 		}
 	}
-	else if (!strncmp(requestData, "POST ", 5))
+
+	// log
+	if (parser.first != NULL)
 	{
-		formDataStart = strrchr(requestData, '\n');
+		LOG_DEBUG("Thread %u: Form data found: %d fields.", (unsigned int) pthread_self(), parser.count);
+	}
+	else
+	{
+		LOG_DEBUG("Thread %u: No form data found.", (unsigned int) pthread_self());
+	}
 
-		formData[0] = strchr(formDataStart, '=') + 1;
-		formData[1] = strchr(formData[0], '=') + 1;
-		formData[2] = strchr(formData[1], '=') + 1;
+	return parser.first;
+}
 
-		p = strchr(formData[0], '&');
-		p[0] = '\0';
-		p = strchr(formData[1], '&');
-		p[0] = '\0';
-		// no need to terminate last one since it already
-		// is at the end of the requestData
+/*
+ * Function: getPostFormData
+ * ----------------------------
+ *   Reads the body of a POST request and decodes it as form data. The
+ *   body is decoded piece by piece as it arrives, into the request arena.
+ *
+ *	 Parameters:
+ *   formData: Set to the first decoded field, or NULL if there is none
+ *   conn: The connection holding the request
+ *
+ *   Returns: 0 if successful, otherwise the HTTP status code to send
+ */
+int getPostFormData(form_field **formData, connection *conn)
+{
+	form_parser parser;		// the form decoder
+	char *piece;			// the current piece of the body
+	ssize_t count;			// the size of the piece
+	int status;				// result of examining the body framing
+
+	*formData = NULL;
+
+	status = body_reader_init(conn);
+	if (status != 0)
+	{
+		LOG_INFO("Thread %u: Request body refused with status %i.", (unsigned int) pthread_self(), status);
+		return status;
 	}
 
-	if (formData[0] != NULL)
+	form_parser_init(&parser, &(conn->requestArena));
+
+	while ((count = body_next(conn, &piece)) > 0)
 	{
-		// reformat email
-		if (strstr(formData[2], "%40") != NULL)
+		if (form_parser_feed(&parser, piece, count) != 0)
 		{
-			char *part1 = strtok(formData[2], "%40");
-			char *part2 = strtok(NULL, "%40");
-			sprintf(formData[2], "%s@%s", part1, part2);
+			return 500;
 		}
-		// log
-		char logbuff[BUFSIZE];
-		sprintf(logbuff, "Thread %u: Form data found: %s, %s, %s.",
-				(unsigned int) pthread_self(), formData[0], formData[1], formData[2]);
-		logger(logbuff);
+	}
+
+	if (count < 0)
+	{
+		LOG_INFO("Thread %u: Request body incomplete or invalid.", (unsigned int) pthread_self());
+		return 400;
+	}
+
+	if (form_parser_finish(&parser) != 0)
+	{
+		return 500;
+	}
+
+	*formData = parser.first;
+	if (parser.first != NULL)
+	{
+		LOG_DEBUG("Thread %u: Form data found: %d fields, %lld bytes.",
+				(unsigned int) pthread_self(), parser.count, conn->bodyTotal);
 	}
 	else
 	{
-		char logbuff[BUFSIZE];
-		sprintf(logbuff, "Thread %u: No form data found.", (unsigned int) pthread_self());
-		logger(logbuff);
+		LOG_DEBUG("Thread %u: No form data found.", (unsigned int) pthread_self());
 	}
+
+	return 0;
 }
 
 /*
- * Function: getResponseSize
+ * Function: openResource
  * ----------------------------
- *   Gets the size of the response
+ *   Takes the requested file from the open file cache and keeps it on
+ *   the connection. Paths missing from the home directory index, or
+ *   already known to be missing, are refused without looking at the
+ *   file system, and newly found missing paths are remembered.
  *
  *	 Parameters:
  *   resourceName: The path of the resource.
- *   formData[]: Form data, if any
- *   socket: The socket to write to if the file cannot be sent.
+ *   conn: The connection to write to if the file cannot be sent.
  *
- *   Returns: the size of the response or -1 if an error was thrown and the socket closed.
+ *   Returns: 0 if the file is open, -1 if an error was sent.
  */
-int getResponseSize(char *resourceName, char *formData[], int socket)
+static int openResource(char *resourceName, connection *conn)
 {
-	int result = -1;
-	char logbuff[BUFSIZE];
+	int found;
+
+	connection_close_file(conn);
 
-	FILE *targetFile = fopen(resourceName, "r");
-	if (targetFile != NULL)
+	// The index answers for the whole home directory when it is running
+	found = docroot_index_lookup(resourceName);
+	if (found == 0 || (found < 0 && negative_cache_lookup(NEGATIVE_MISSING, resourceName)))
 	{
-		fseek(targetFile, 0, SEEK_END);
-		result = ftell(targetFile);
-		fclose(targetFile);
+		sendError(conn, 404);
+		return -1;
+	}
 
-		sprintf(logbuff, "Thread %u: - %s - found with size: %i", (unsigned int) pthread_self(), resourceName, result);
-		logger(logbuff);
+	conn->file = file_cache_open(resourceName);
+	if (conn->file == NULL)
+	{
+		// Only remember paths whose absence a new file can change
+		if (errno == ENOENT || errno == ENOTDIR || errno == EISDIR)
+		{
+			negative_cache_add(NEGATIVE_MISSING, resourceName);
+		}
+		LOG_DEBUG("Thread %u: - %s - not found.", (unsigned int) pthread_self(), resourceName);
+		sendError(conn, 404);
+		return -1;
+	}
+
+	trace_mark(conn, SPAN_OPENED);
+	return 0;
+}
+
+/*
+ * Function: getResponseSize
+ * ----------------------------
+ *   Gets the size of the response. The file is taken from the open file
+ *   cache and kept on the connection so the same descriptor sends it.
+ *
+ *	 Parameters:
+ *   resourceName: The path of the resource.
+ *   conn: The connection to write to if the file cannot be sent.
+ *
+ *   Returns: the size of the response or -1 if an error was sent.
+ */
+off_t getResponseSize(char *resourceName, connection *conn)
+{
+	const bundle_entry *entry;
+	size_t length;
 
-		if (formData[0] != NULL)
+	// A bundled file's size is in its entry
+	if (bundle_active())
+	{
+		entry = bundle_lookup(resourceName);
+		if (entry == NULL)
 		{
-			result += strlen(formData[0]) + strlen(formData[1]) + strlen(formData[2]);
-			result -= 6;
+			sendError(conn, 404);
+			return -1;
 		}
+		bundle_body(entry, &length);
+		trace_mark(conn, SPAN_OPENED);
+		return length;
+	}
+
+	if (openResource(resourceName, conn) != 0)
+	{
+		return -1;
+	}
 
-		// Check to ensure it's smaller than the max file size, log message
-		if (result <= MAX_GET_REQUEST_SIZE)
+	LOG_DEBUG("Thread %u: - %s - found with size: %lld", (unsigned int) pthread_self(), resourceName, (long long) conn->file->size);
+	return conn->file->size;
+}
+
+/*
+ * Function: renderTemplate
+ * ----------------------------
+ *   Fills in a page template with form data. Each "%s" in the template
+ *   is replaced by the next field's value, or by nothing once the values
+ *   run out, and "%%" becomes "%". Everything else is copied as is. The
+ *   page is rendered into the request arena so its exact length is known
+ *   before the header is sent.
+ *
+ *	 Parameters:
+ *   resourceName: The path of the template.
+ *   formData: The first form field
+ *   conn: The connection to write to if the page cannot be sent.
+ *   page: Set to the rendered page
+ *
+ *   Returns: the size of the rendered page or -1 if an error was sent.
+ *   Templates and pages are limited to MAX_GET_REQUEST_SIZE.
+ */
+off_t renderTemplate(char *resourceName, form_field *formData, connection *conn, char **page)
+{
+	const char *template;	// the template file's contents
+	const char *percent;	// the next '%' in the template
+	char *buffer;			// the template read from disk
+	const bundle_entry *entry;
+	size_t position = 0;	// the next template byte to copy
+	size_t length = 0;		// length of the rendered page
+	ssize_t count;
+	size_t loaded = 0;
+
+	*page = NULL;
+
+	if (bundle_active())
+	{
+		// A bundled template is used where it is mapped
+		entry = bundle_lookup(resourceName);
+		if (entry == NULL)
 		{
-			sprintf(logbuff, "Thread %u: - %s - can be sent.", (unsigned int) pthread_self(), resourceName);
-			logger(logbuff);
+			sendError(conn, 404);
+			return -1;
 		}
-		else
+		template = bundle_body(entry, &loaded);
+		trace_mark(conn, SPAN_OPENED);
+		if (loaded > MAX_GET_REQUEST_SIZE)
 		{
-			sprintf(logbuff, "Thread %u: - %s - Too large, can NOT be sent.", (unsigned int) pthread_self(), resourceName);
-			logger(logbuff);
-			sendError(socket, 403);
+			LOG_WARN("Thread %u: - %s - Too large, can NOT be sent.", (unsigned int) pthread_self(), resourceName);
+			sendError(conn, 403);
+			return -1;
 		}
 	}
 	else
 	{
-		sprintf(logbuff, "Thread %u: - %s - not found.", (unsigned int) pthread_self(), resourceName);
-		logger(logbuff);
-		sendError(socket, 404);
+		if (openResource(resourceName, conn) != 0)
+		{
+			return -1;
+		}
+
+		// Check to ensure the template is smaller than the max size, log message
+		if (conn->file->size > MAX_GET_REQUEST_SIZE ||
+				(buffer = (char *) arena_alloc(&(conn->requestArena), conn->file->size + 1)) == NULL)
+		{
+			LOG_WARN("Thread %u: - %s - Too large, can NOT be sent.", (unsigned int) pthread_self(), resourceName);
+			sendError(conn, 403);
+			return -1;
+		}
+
+		// The descriptor is shared, so read at explicit offsets
+		while (loaded < (size_t) conn->file->size &&
+				(count = pread(conn->file->fd, buffer + loaded, conn->file->size - loaded, loaded)) > 0)
+		{
+			loaded += count;
+		}
+		template = buffer;
 	}
-	return result;
+
+	// Copy literal text up to each '%' and substitute the placeholders
+	*page = arena_append(&(conn->requestArena), NULL, &length, "", 0);
+	while (*page != NULL && position < loaded)
+	{
+		percent = memchr(template + position, '%', loaded - position);
+		if (percent == NULL || percent + 1 == template + loaded)
+		{
+			*page = arena_append(&(conn->requestArena), *page, &length, template + position, loaded - position);
+			break;
+		}
+
+		*page = arena_append(&(conn->requestArena), *page, &length, template + position, percent - (template + position));
+		if (*page != NULL && percent[1] == 's')
+		{
+			if (formData != NULL)
+			{
+				*page = arena_append(&(conn->requestArena), *page, &length, formData->value, formData->valueLen);
+				formData = formData->next;
+			}
+			position = percent + 2 - template;
+		}
+		else if (*page != NULL && percent[1] == '%')
+		{
+			*page = arena_append(&(conn->requestArena), *page, &length, "%", 1);
+			position = percent + 2 - template;
+		}
+		else if (*page != NULL)
+		{
+			*page = arena_append(&(conn->requestArena), *page, &length, "%", 1);
+			position = percent + 1 - template;
+		}
+	}
+
+	if (*page == NULL || length > MAX_GET_REQUEST_SIZE)
+	{
+		LOG_WARN("Thread %u: - %s - Too large, can NOT be sent.", (unsigned int) pthread_self(), resourceName);
+		sendError(conn, 403);
+		return -1;
+	}
+
+	LOG_DEBUG("Thread %u: - %s - rendered with size: %lu", (unsigned int) pthread_self(), resourceName, (unsigned long) length);
+	return length;
 }
 
 /*
@@ -218,139 +516,192 @@ int getResponseSize(char *resourceName, char *formData[], int socket)
  *   resourceName: The path of the resource.
  *   contentType: The mime type for the content.
  *   responseSize: The size of the response.
- *   socket: The socket to send the response to.
+ *   conn: The connection to send the response to. The header is queued in
+ *   the connection's output buffer and goes out with the first block of data.
  */
-void sendResponseHeader(char *resourceName, char *contentType, int responseSize, int socket)
+void sendResponseHeader(char *resourceName, char *contentType, off_t responseSize, connection *conn)
 {
-	char response[200];
-	char logbuff[BUFSIZE];
+	char response[256];
 
-	char dateAndTime[29];
-	getTimestamp2(dateAndTime);
+	char dateAndTime[30];
+	getHttpDate(dateAndTime);
 
 	// Craft response for a file
 	int size = sprintf(response,
-			"HTTP/1.1 200 OK\nDate: %s\nContent-Type: %s\nContent-Length: %i\r\n\r\n",
-			dateAndTime, contentType, responseSize);
+			"HTTP/1.1 200 OK\r\nDate: %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\nConnection: %s\r\n\r\n",
+			dateAndTime, contentType, (long long) responseSize, conn->keepAlive ? "keep-alive" : "close");
 
-	sprintf(logbuff, "Thread %u: Sent header information to socket %i", (unsigned int) pthread_self(), socket);
-	logger(logbuff);
-	write(socket, response, size);
+	LOG_TRACE("Thread %u: Sent header information to socket %i", (unsigned int) pthread_self(), conn->sockfd);
+	connection_write(conn, response, size);
 }
 
 /*
  * Function: sendData
  * ----------------------------
- *   Sends data to the socket.
+ *   Sends a file to the socket. The file sized by getResponseSize is
+ *   attached behind the queued header, and once the handler returns the
+ *   worker streams it with sendfile() one slice at a time, yielding to
+ *   other connections between slices.
  *
  *	 Parameters:
  *   resourceName: The resource to be sent.
- *   formData[]: the data for the form
- *   socket: The socket to send the data to.
+ *   conn: The connection to send the data to.
  */
-void sendData(char *resourceName, char *formData[], int socket)
+void sendData(char *resourceName, connection *conn)
 {
-	char logbuff[BUFSIZE];
-	char buffer[BUFSIZE];
-	int bufferCount;
-	bzero(buffer, BUFSIZE);
-
-	FILE *readableFile = fopen(resourceName, "r");
 
-	sprintf(logbuff, "Thread %u: Sending file information to socket %i", (unsigned int) pthread_self(), socket);
-	logger(logbuff);
+	LOG_TRACE("Thread %u: Sending file information to socket %i", (unsigned int) pthread_self(), conn->sockfd);
 
-	// Write out the file to the socket
-	while ((bufferCount = read(fileno(readableFile), buffer, BUFSIZE)) > 0)
+	if (conn->file == NULL)
 	{
-		if (formData[0] == NULL)
-		{
-			//sprintf(logbuff, "Sending block of data.");
-			//logger(logbuff);
-			write(socket, buffer, bufferCount);
-		}
-		else
-		{
-			//sprintf(logbuff, "Sending block of form data.");
-			//logger(logbuff);
-			char bufferWithData[BUFSIZE];
-			sprintf(bufferWithData, buffer, formData[0], formData[1], formData[2]);
-			write(socket, bufferWithData, strlen(bufferWithData));
-		}
-
-		bzero(buffer, BUFSIZE);
+		conn->keepAlive = 0;
+		return;
 	}
 
-	// Close the file
-	fclose(readableFile);
+	PROBE3(send__file, conn->sockfd, resourceName, (long long) conn->file->size);
+
+	// The worker streams the file behind the header, or hands it to the
+	// sender if it is large
+	connection_attach_file(conn, 0, conn->file->size);
 }
 
 /*
- * Function: processGet
+ * Function: sendBundled
  * ----------------------------
- *   Call to process GET requests
+ *   Sends a file from the bundle.
  *
  *	 Parameters:
- *   socket: The socket to send data out to.
- *   requestData: The data from the request.
+ *   resourceName: The path of the resource.
+ *   conn: The connection to send the response to.
  */
-void processGet(int socket, char *requestData)
+static void sendBundled(char *resourceName, connection *conn)
 {
-	char resourceName[strlen(requestData)];
-	bzero(resourceName, strlen(requestData));
-	getResourceName(resourceName, requestData);
+	const bundle_entry *entry = bundle_lookup(resourceName);
 
-	char *formData[3];
-	formData[0] = NULL;
-	getFormData(formData, requestData);
+	if (entry == NULL)
+	{
+		sendError(conn, 404);
+		return;
+	}
+	trace_mark(conn, SPAN_OPENED);
 
-	int responseSize = getResponseSize(resourceName, formData, socket);
+	LOG_DEBUG("Thread %u: - %s - sent from the bundle", (unsigned int) pthread_self(), resourceName);
+	bundle_send(conn, entry);
+}
 
-	if (responseSize != -1)
+/*
+ * Function: sendResource
+ * ----------------------------
+ *   Sends the requested resource: a page template filled in with the
+ *   form data if there is any, otherwise the file itself. The answer to
+ *   a HEAD request has the same header and no body.
+ *
+ *	 Parameters:
+ *   resourceName: The path of the resource.
+ *   formData: The first form field, or NULL
+ *   head: Nonzero to send only the header
+ *   conn: The connection to send the response to.
+ */
+static void sendResource(char *resourceName, form_field *formData, int head, connection *conn)
+{
+	char *page = NULL;		// the rendered template, if any
+	char *contentType = getContentType(resourceName);
+	off_t responseSize;
+
+	// The type is checked first since it needs no file system access
+	if (strlen(contentType) == 0)
 	{
-		char *contentType = getContentType(resourceName);
+		sendError(conn, 415);
+		return;
+	}
 
-		if (strlen(contentType) == 0)
+	// Files in a bundle carry their own prebuilt headers
+	if (formData == NULL && bundle_active())
+	{
+		sendBundled(resourceName, conn);
+		if (head)
 		{
-			sendError(socket, 415);
-			return;
+			connection_close_file(conn);
 		}
+		return;
+	}
 
-		sendResponseHeader(resourceName, contentType, responseSize, socket);
-		sendData(resourceName, formData, socket);
-		close(socket);
+	if (formData != NULL)
+	{
+		responseSize = renderTemplate(resourceName, formData, conn, &page);
+	}
+	else
+	{
+		responseSize = getResponseSize(resourceName, conn);
+	}
+
+	if (responseSize != -1)
+	{
+		sendResponseHeader(resourceName, contentType, responseSize, conn);
+		if (head)
+		{
+			connection_close_file(conn);
+		}
+		else if (page != NULL)
+		{
+			connection_write(conn, page, responseSize);
+		}
+		else
+		{
+			sendData(resourceName, conn);
+		}
 	}
 }
 
 /*
- * Function: processHead
+ * Function: processGet
  * ----------------------------
- *   Call to process HEAD requests
+ *   Call to process GET requests
  *
  *	 Parameters:
- *   socket: The socket to send data out to.
- *   requestData: The data from the request.
+ *   conn: The connection to send data out to. The request header is
+ *   held in the connection's input buffer.
  */
-void processHead(int socket, char *requestData)
+void processGet(connection *conn)
 {
-	char resourceName[strlen(requestData)];
-	getResourceName(resourceName, requestData);
+	char *requestData = conn->inbuf;
+	char resourceName[PATH_MAX];
+	bzero(resourceName, sizeof(resourceName));
+	if (getResourceName(resourceName, requestData) != 0)
+	{
+		sendError(conn, 400);
+		return;
+	}
 
-	int responseSize = getResponseSize(resourceName, NULL, socket);
+	form_field *formData = getFormData(conn);
 
-	if (responseSize != -1)
+	sendResource(resourceName, formData, 0, conn);
+}
+
+/*
+ * Function: processHead
+ * ----------------------------
+ *   Call to process HEAD requests, answered with the header a GET for the
+ *   same resource would get
+ *
+ *	 Parameters:
+ *   conn: The connection to send data out to. The request header is
+ *   held in the connection's input buffer.
+ */
+void processHead(connection *conn)
+{
+	char *requestData = conn->inbuf;
+	char resourceName[PATH_MAX];
+	bzero(resourceName, sizeof(resourceName));
+	if (getResourceName(resourceName, requestData) != 0)
 	{
-		char *contentType = getContentType(resourceName);
+		sendError(conn, 400);
+		return;
+	}
 
-		if (strlen(contentType) == 0)
-		{
-			sendError(socket, 415);
-			return;
-		}
+	form_field *formData = getFormData(conn);
 
-		sendResponseHeader(resourceName, contentType, responseSize, socket);
-		close(socket);
-	}
+	sendResource(resourceName, formData, 1, conn);
 }
 
 /*
@@ -359,33 +710,29 @@ void processHead(int socket, char *requestData)
  *   Call to process POST requests
  *
  *	 Parameters:
- *   socket: The socket to send data out to.
- *   requestData: The data from the request.
+ *   conn: The connection to send data out to. The request header is
+ *   held in the connection's input buffer.
  */
-void processPost(int socket, char *requestData)
+void processPost(connection *conn)
 {
-	char resourceName[strlen(requestData)];
-	bzero(resourceName, strlen(requestData));
-	getResourceName(resourceName, requestData);
-
-	char *formData[3];
-	formData[0] = NULL;
-	getFormData(formData, requestData);
-
-	int responseSize = getResponseSize(resourceName, formData, socket);
-
-	if (responseSize != -1)
+	char *requestData = conn->inbuf;
+	char resourceName[PATH_MAX];
+	bzero(resourceName, sizeof(resourceName));
+	if (getResourceName(resourceName, requestData) != 0)
 	{
-		char *contentType = getContentType(resourceName);
-
-		if (strlen(contentType) == 0)
-		{
-			sendError(socket, 415);
-			return;
-		}
+		sendError(conn, 400);
+		return;
+	}
 
-		sendResponseHeader(resourceName, contentType, responseSize, socket);
-		sendData(resourceName, formData, socket);
-		close(socket);
+	// The body is read into the input buffer after this, so the
+	// request data must not be used again
+	form_field *formData;
+	int status = getPostFormData(&formData, conn);
+	if (status != 0)
+	{
+		sendError(conn, status);
+		return;
 	}
+
+	sendResource(resourceName, formData, 0, conn);
 }
@@ -0,0 +1,482 @@
+/*
+ * requestTrace.c
+ *
+ * Contains the request trace. Each connection carries a fixed-size span
+ * with the monotonic time at which its current request reached each
+ * phase: accepted, queued, taken by a worker, header parsed, file
+ * opened, header sent and body sent. When the response is finished the
+ * span is copied into a ring holding the last requests, and into a
+ * second, smaller ring if the request took longer than slowrequest
+ * milliseconds, so outliers survive however busy the server is.
+ *
+ * Writers claim a slot with one atomic increment and publish it with a
+ * sequence number, so recording a span takes no lock. A reader copies a
+ * slot and keeps the copy only if its sequence number did not change.
+ *
+ * The rings are written out as Chrome trace JSON, which chrome://tracing
+ * and Perfetto show as a flame chart, on SIGWINCH (to trace.json next to
+ * the log file) or from the traceendpoint path for local clients.
+ */
+
+#include "headerfile.h"
+
+#define TRACE_SLOW_SIZE 64 // slow requests kept apart from the ring
+
+// Define type of struct for a ring slot
+typedef struct trace_slot {
+	unsigned long sequence;		// odd while being written, 0 if never written
+	request_span span;
+	} trace_slot;
+
+// Define type of struct for a ring of spans
+typedef struct trace_ring {
+	trace_slot *slots;
+	unsigned long mask;			// slot count minus one
+	unsigned long next;			// tickets handed out
+	} trace_ring;
+
+/*
+ * Struct that holds the rings.
+ */
+static struct {
+	trace_ring recent;			// the last requests
+	trace_ring slow;			// the last requests slower than slowrequest
+} trace;
+
+// The interval ending at each phase, as shown in the trace
+static const char *phaseNames[SPAN_PHASES] = { "accept", "enqueue", "queue wait", "read request",
+		"open file", "send header", "send body" };
+
+/*
+ * Function prototypes for the requestTrace.c file
+ */
+static int trace_ring_init(trace_ring *ring, unsigned long size);
+static void trace_ring_add(trace_ring *ring, const request_span *span);
+static void trace_write_ring(FILE *out, trace_ring *ring, int pid, int *first);
+
+/*
+ * Function: trace_now
+ * ----------------------------
+ *   Gets the monotonic clock time in nanoseconds.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the time
+ */
+unsigned long long trace_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Function: trace_ring_init
+ * ----------------------------
+ *   Allocates a ring with at least the given number of slots, rounded up
+ *   to a power of two.
+ *
+ *	 Parameters:
+ *   ring: The ring
+ *   size: The number of slots wanted
+ *
+ *   Returns: 0 if successful, -1 if the ring cannot be allocated
+ */
+static int trace_ring_init(trace_ring *ring, unsigned long size)
+{
+	unsigned long slots = 1;
+
+	while (slots < size)
+	{
+		slots <<= 1;
+	}
+
+	ring->slots = (trace_slot *) calloc(slots, sizeof(trace_slot));
+	if (ring->slots == NULL)
+	{
+		return -1;
+	}
+	ring->mask = slots - 1;
+	return 0;
+}
+
+/*
+ * Function: trace_init
+ * ----------------------------
+ *   Allocates the rings with the configured size.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void trace_init()
+{
+	const server_settings *limits = &(config_current()->settings);
+
+	if (limits->traceRingSize <= 0)
+	{
+		return;
+	}
+
+	if (trace_ring_init(&(trace.recent), limits->traceRingSize) != 0 ||
+			trace_ring_init(&(trace.slow), TRACE_SLOW_SIZE) != 0)
+	{
+		logger("Unable to allocate the request trace");
+		free(trace.recent.slots);
+		trace.recent.slots = NULL;
+	}
+}
+
+/*
+ * Function: trace_mark
+ * ----------------------------
+ *   Records the time a request reached a phase.
+ *
+ *	 Parameters:
+ *   conn: The connection handling the request
+ *   phase: SPAN_ACCEPT to SPAN_DONE
+ *
+ *   Returns: nothing
+ */
+void trace_mark(connection *conn, int phase)
+{
+	conn->span.at[phase] = trace_now();
+}
+
+/*
+ * Function: trace_request
+ * ----------------------------
+ *   Records that a request header has been parsed, along with the start
+ *   of its request line.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header
+ *
+ *   Returns: nothing
+ */
+void trace_request(connection *conn)
+{
+	size_t length = 0;
+	int spaces = 0;
+
+	conn->span.at[SPAN_PARSED] = trace_now();
+	conn->span.status = 200;
+
+	// The method and the path, up to the second space
+	while (length < conn->headerlen && length < SPAN_REQUEST_SIZE - 1 && conn->inbuf[length] != '\r' &&
+			conn->inbuf[length] != '\n' && (conn->inbuf[length] != ' ' || ++spaces < 2))
+	{
+		conn->span.request[length] = conn->inbuf[length];
+		length++;
+	}
+	conn->span.request[length] = '\0';
+}
+
+/*
+ * Function: trace_ring_add
+ * ----------------------------
+ *   Copies a span into the next slot of a ring.
+ *
+ *	 Parameters:
+ *   ring: The ring
+ *   span: The span
+ *
+ *   Returns: nothing
+ */
+static void trace_ring_add(trace_ring *ring, const request_span *span)
+{
+	unsigned long ticket = __atomic_fetch_add(&(ring->next), 1, __ATOMIC_RELAXED);
+	trace_slot *slot = &(ring->slots[ticket & ring->mask]);
+
+	__atomic_store_n(&(slot->sequence), 2 * ticket + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->span = *span;
+	__atomic_store_n(&(slot->sequence), 2 * ticket + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function: trace_finish
+ * ----------------------------
+ *   Records that a response is complete and adds the request's span to
+ *   the rings. Connections that closed without a request are ignored.
+ *
+ *	 Parameters:
+ *   conn: The connection that handled the request
+ *
+ *   Returns: nothing
+ */
+void trace_finish(connection *conn)
+{
+	request_span *span = &(conn->span);
+	unsigned long long start = 0;
+	int i;
+
+	if (span->at[SPAN_PARSED] != 0)
+	{
+		PROBE3(done, conn->sockfd, span->status, (long long) conn->bytesOut);
+	}
+
+	if (span->at[SPAN_PARSED] != 0 && trace.recent.slots != NULL)
+	{
+		span->at[SPAN_DONE] = trace_now();
+		span->thread = (unsigned int) pthread_self();
+		trace_ring_add(&(trace.recent), span);
+
+		for (i = 0; i < SPAN_PHASES && start == 0; i++)
+		{
+			start = span->at[i];
+		}
+		if (span->at[SPAN_DONE] - start >= (unsigned long long) config_current()->settings.slowRequest * 1000000ULL)
+		{
+			trace_ring_add(&(trace.slow), span);
+		}
+	}
+
+	memset(span->at, 0, sizeof(span->at));
+}
+
+/*
+ * Function: trace_write_string
+ * ----------------------------
+ *   Writes a string as a JSON string.
+ *
+ *	 Parameters:
+ *   out: The stream to write to
+ *   string: The string
+ *
+ *   Returns: nothing
+ */
+static void trace_write_string(FILE *out, const char *string)
+{
+	fputc('"', out);
+	for (; *string != '\0'; string++)
+	{
+		if (*string == '"' || *string == '\\')
+		{
+			fprintf(out, "\\%c", *string);
+		}
+		else if ((unsigned char) *string < 0x20)
+		{
+			fprintf(out, "\\u%04x", (unsigned char) *string);
+		}
+		else
+		{
+			fputc(*string, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/*
+ * Function: trace_write_ring
+ * ----------------------------
+ *   Writes the spans in a ring as Chrome trace events: one for the whole
+ *   request and one for each phase it went through.
+ *
+ *	 Parameters:
+ *   out: The stream to write to
+ *   ring: The ring
+ *   pid: The process id the events are shown under
+ *   first: Set to 0 once an event has been written
+ *
+ *   Returns: nothing
+ */
+static void trace_write_ring(FILE *out, trace_ring *ring, int pid, int *first)
+{
+	request_span span;
+	unsigned long before;
+	unsigned long i;
+	int previous;
+	int phase;
+
+	for (i = 0; i <= ring->mask; i++)
+	{
+		// Copy the slot and keep the copy only if no writer touched it
+		before = __atomic_load_n(&(ring->slots[i].sequence), __ATOMIC_ACQUIRE);
+		span = ring->slots[i].span;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (before == 0 || (before & 1) || before != __atomic_load_n(&(ring->slots[i].sequence), __ATOMIC_RELAXED))
+		{
+			continue;
+		}
+
+		for (previous = 0; previous < SPAN_DONE && span.at[previous] == 0; previous++)
+		{
+			// find the first phase reached
+		}
+
+		fprintf(out, "%s\n{\"name\":", *first ? "" : ",");
+		trace_write_string(out, span.request);
+		fprintf(out, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,"
+				"\"args\":{\"status\":%d}}", span.at[previous] / 1000.0,
+				(span.at[SPAN_DONE] - span.at[previous]) / 1000.0, pid, span.thread, span.status);
+		*first = 0;
+
+		for (phase = previous + 1; phase < SPAN_PHASES; phase++)
+		{
+			if (span.at[phase] == 0)
+			{
+				continue;
+			}
+			fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+					"\"pid\":%d,\"tid\":%u}", phaseNames[phase], span.at[previous] / 1000.0,
+					(span.at[phase] - span.at[previous]) / 1000.0, pid, span.thread);
+			previous = phase;
+		}
+	}
+}
+
+/*
+ * Function: trace_write
+ * ----------------------------
+ *   Writes both rings as a Chrome trace JSON document. Recent requests
+ *   are shown as one process and slow requests as another.
+ *
+ *	 Parameters:
+ *   out: The stream to write to
+ *
+ *   Returns: nothing
+ */
+void trace_write(FILE *out)
+{
+	int first = 1;
+
+	fputs("{\"traceEvents\":[", out);
+	if (trace.recent.slots != NULL)
+	{
+		fputs("\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"recent requests\"}},"
+				"\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"slow requests\"}}", out);
+		first = 0;
+		trace_write_ring(out, &(trace.recent), 1, &first);
+		trace_write_ring(out, &(trace.slow), 2, &first);
+	}
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", out);
+}
+
+/*
+ * Function: trace_dump
+ * ----------------------------
+ *   Writes the trace to trace.json in the directory of the log file,
+ *   replacing the last one in a single rename.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void trace_dump()
+{
+	char path[BUFSIZE];
+	char temporary[BUFSIZE + 4];
+	char *slash;
+	FILE *out;
+
+	snprintf(path, sizeof(path), "%s", logfilePathAndName);
+	slash = strrchr(path, '/');
+	snprintf(slash != NULL ? slash + 1 : path, sizeof(path) - (slash != NULL ? slash + 1 - path : 0), "trace.json");
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+	out = fopen(temporary, "w");
+	if (out == NULL)
+	{
+		logger("Unable to write the request trace");
+		return;
+	}
+	trace_write(out);
+	if (fclose(out) != 0 || rename(temporary, path) != 0)
+	{
+		logger("Unable to write the request trace");
+		unlink(temporary);
+		return;
+	}
+
+	LOG_INFO("Request trace written to %s", path);
+}
+
+/*
+ * Function: trace_requested
+ * ----------------------------
+ *   Determines if a request is for the trace endpoint from a client on
+ *   this machine.
+ *
+ *	 Parameters:
+ *   conn: The connection holding the request header
+ *
+ *   Returns: 1 if the trace should be sent, 0 otherwise
+ */
+int trace_requested(connection *conn)
+{
+	const char *endpoint = config_current()->settings.traceEndpoint;
+	size_t length = strlen(endpoint);
+	struct sockaddr_storage peer;
+	socklen_t peerLength = sizeof(peer);
+	char after;
+
+	if (length == 0 || strncmp(conn->inbuf, "GET ", 4) != 0 || strncmp(conn->inbuf + 4, endpoint, length) != 0)
+	{
+		return 0;
+	}
+	after = conn->inbuf[4 + length];
+	if (after != ' ' && after != '?')
+	{
+		return 0;
+	}
+
+	if (getpeername(conn->sockfd, (struct sockaddr *) &peer, &peerLength) != 0)
+	{
+		return 0;
+	}
+	if (peer.ss_family == AF_INET)
+	{
+		return (ntohl(((struct sockaddr_in *) &peer)->sin_addr.s_addr) >> 24) == 127;
+	}
+	if (peer.ss_family == AF_INET6)
+	{
+		return !memcmp(&(((struct sockaddr_in6 *) &peer)->sin6_addr), &in6addr_loopback, sizeof(struct in6_addr));
+	}
+	return peer.ss_family == AF_UNIX;
+}
+
+/*
+ * Function: trace_send
+ * ----------------------------
+ *   Sends the trace as the response to a request, then closes the
+ *   connection.
+ *
+ *	 Parameters:
+ *   conn: The connection to send the trace to
+ *
+ *   Returns: nothing
+ */
+void trace_send(connection *conn)
+{
+	struct iovec pieces[2];
+	char header[200];
+	char dateAndTime[30];
+	char *body = NULL;
+	size_t length = 0;
+	FILE *out;
+
+	out = open_memstream(&body, &length);
+	if (out == NULL)
+	{
+		sendError(conn, 500);
+		return;
+	}
+	trace_write(out);
+	fclose(out);
+
+	getHttpDate(dateAndTime);
+	conn->keepAlive = 0;
+	pieces[0].iov_base = header;
+	pieces[0].iov_len = sprintf(header, "HTTP/1.1 200 OK\r\nDate: %s\r\nContent-Type: application/json\r\n"
+			"Content-Length: %lu\r\nConnection: close\r\n\r\n", dateAndTime, (unsigned long) length);
+	pieces[1].iov_base = body;
+	pieces[1].iov_len = length;
+	connection_sendv(conn, pieces, 2);
+
+	free(body);
+}
@@ -0,0 +1,374 @@
+/*
+ * sender.c
+ *
+ * Contains the sender, a thread that finishes responses so that neither
+ * large files nor slow clients hold a worker while small requests wait
+ * behind them. Once a worker has sized a response at largeresponse
+ * bytes or more and written its header, or has found the client's
+ * socket full partway through a response, it hands the connection over
+ * and goes back to the queue.
+ *
+ * The sender watches every transfer's socket with one epoll set.
+ * Whenever a socket can take more it is sent the rest of the output
+ * buffer and then the file with sendfile(), a slice per turn so
+ * transfers share the thread fairly. A
+ * transfer only waits on epoll when its socket is full, so an idle
+ * sender makes no system calls.
+ *
+ * When a transfer ends the connection goes back to the thread pool,
+ * where a worker reads its next request or closes it and keeps its
+ * context. TLS connections and HTTP/2 streams are left to their workers.
+ */
+
+#include "headerfile.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/*
+ * Struct that holds the sender's thread, its epoll set, and the
+ * transfers it has been given.
+ */
+static struct {
+	threadpool *pool;			// where kept-alive connections go back to
+	pthread_t thread;
+	pthread_mutex_t lock;		// guards submitted, running and stopping
+	connection *submitted;		// connections handed over since the sender last looked
+	int running;				// set while transfers are taken
+	int stopping;				// set when the sender should exit once its transfers end
+	int epollfd;				// sockets waiting until they can take more
+	int wakefd;					// eventfd that wakes the sender for a submission or a stop
+	connection *ready;			// transfers that can go on at once, oldest first
+	connection *readyTail;
+	int active;					// transfers in progress, only touched by the sender
+} sender = { .lock = PTHREAD_MUTEX_INITIALIZER, .epollfd = -1, .wakefd = -1 };
+
+/*
+ * Function prototypes for the sender.c file
+ */
+static void *sender_thread(void *arg);
+static void sender_ready(connection *conn);
+static void sender_wait(connection *conn);
+static void sender_finish(connection *conn);
+
+/*
+ * Function: sender_start
+ * ----------------------------
+ *   Starts the sender thread.
+ *
+ *	 Parameters:
+ *   pool: The thread pool kept-alive connections are given back to
+ *
+ *   Returns: 0 if successful, -1 if the sender could not be started
+ */
+int sender_start(threadpool *pool)
+{
+	struct epoll_event event;
+
+	sender.pool = pool;
+	sender.epollfd = epoll_create1(EPOLL_CLOEXEC);
+	sender.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (sender.epollfd < 0 || sender.wakefd < 0)
+	{
+		logger("Unable to create the sender's epoll set");
+		return -1;
+	}
+
+	// The wake descriptor is the one event without a connection
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(sender.epollfd, EPOLL_CTL_ADD, sender.wakefd, &event) != 0)
+	{
+		logger("Unable to create the sender's epoll set");
+		return -1;
+	}
+
+	sender.running = 1;
+	if (pthread_create(&(sender.thread), NULL, sender_thread, NULL) != 0)
+	{
+		sender.running = 0;
+		logger("Unable to start the sender thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: sender_stop
+ * ----------------------------
+ *   Stops taking transfers and waits for those in progress to finish.
+ *   Workers stream any file the sender refuses from now on.
+ *
+ *	 Parameters:
+ *   seconds: The longest time to wait
+ *
+ *   Returns: 0 if every transfer finished, -1 if the time ran out
+ */
+int sender_stop(int seconds)
+{
+	struct timespec deadline;
+	unsigned long long one = 1;
+
+	pthread_mutex_lock(&(sender.lock));
+	if (!sender.running)
+	{
+		pthread_mutex_unlock(&(sender.lock));
+		return 0;
+	}
+	sender.running = 0;
+	sender.stopping = 1;
+	pthread_mutex_unlock(&(sender.lock));
+
+	if (write(sender.wakefd, &one, sizeof(one)) < 0)
+	{
+		logger("Unable to wake the sender to stop it");
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += seconds;
+	if (pthread_timedjoin_np(sender.thread, NULL, &deadline) != 0)
+	{
+		logger("The sender still has transfers in progress; exiting anyway.");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Function: sender_wanted
+ * ----------------------------
+ *   Determines if a connection's file transfer goes to the sender at
+ *   once: a plaintext HTTP/1 connection sending at least largeresponse
+ *   bytes. Any other plaintext response goes there only if the client
+ *   cannot take it as fast as it is sent.
+ *
+ *	 Parameters:
+ *   conn: The connection, with its file attached
+ *
+ *   Returns: 1 if the sender will take it, 0 otherwise
+ */
+int sender_wanted(connection *conn)
+{
+	long long largeResponse = config_current()->settings.largeResponse;
+
+	return __atomic_load_n(&(sender.running), __ATOMIC_RELAXED) && conn->state == CONN_SENDING &&
+			conn->tls == NULL && !conn->http2 && largeResponse > 0 && conn->fileRemaining >= largeResponse;
+}
+
+/*
+ * Function: sender_submit
+ * ----------------------------
+ *   Hands the rest of a plaintext HTTP/1 connection's response to the
+ *   sender. On success the sender owns the connection and the caller
+ *   must not touch it again.
+ *
+ *	 Parameters:
+ *   conn: The connection, with its output queued and any file attached
+ *
+ *   Returns: 0 if the sender took the connection, -1 if the caller is to
+ *   send it
+ */
+int sender_submit(connection *conn)
+{
+	unsigned long long one = 1;
+
+	if (conn->state != CONN_SENDING || conn->tls != NULL || conn->http2)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&(sender.lock));
+	if (!sender.running)
+	{
+		pthread_mutex_unlock(&(sender.lock));
+		return -1;
+	}
+	conn->next = sender.submitted;
+	sender.submitted = conn;
+	pthread_mutex_unlock(&(sender.lock));
+
+	PROBE2(sender__submit, conn->sockfd, (long long) (conn->fileRemaining + conn->outlen - conn->outpos));
+	if (write(sender.wakefd, &one, sizeof(one)) < 0)
+	{
+		LOG_ERROR("Unable to wake the sender");
+	}
+	return 0;
+}
+
+/*
+ * Function: sender_thread
+ * ----------------------------
+ *   Runs the sender: takes submitted transfers, gives each one that can
+ *   go on a turn, and waits on epoll for full sockets to drain.
+ *
+ *	 Parameters:
+ *   arg: Unused
+ *
+ *   Returns: NULL
+ */
+static void *sender_thread(void *arg)
+{
+	struct epoll_event events[SENDER_MAX_EVENTS];
+	connection *conn;
+	connection *next;
+	unsigned long long value;
+	int count;
+	int result;
+	int i;
+
+	(void) arg;
+	config_reader_register();
+
+	for (;;)
+	{
+		// A sender with nothing to send does not hold up a reload
+		if (sender.ready == NULL)
+		{
+			config_offline();
+		}
+		count = epoll_wait(sender.epollfd, events, SENDER_MAX_EVENTS, sender.ready != NULL ? 0 : -1);
+		config_quiescent();
+
+		for (i = 0; i < count; i++)
+		{
+			if (events[i].data.ptr == NULL)
+			{
+				if (read(sender.wakefd, &value, sizeof(value)) < 0)
+				{
+					// Already drained by an earlier wakeup
+				}
+				continue;
+			}
+			sender_ready((connection *) events[i].data.ptr);
+		}
+
+		// Take the transfers handed over since the last look
+		pthread_mutex_lock(&(sender.lock));
+		conn = sender.submitted;
+		sender.submitted = NULL;
+		if (sender.stopping && conn == NULL && sender.ready == NULL && sender.active == 0)
+		{
+			pthread_mutex_unlock(&(sender.lock));
+			break;
+		}
+		pthread_mutex_unlock(&(sender.lock));
+		for (; conn != NULL; conn = next)
+		{
+			next = conn->next;
+			sender.active += 1;
+			sender_ready(conn);
+		}
+
+		// Give each transfer that can go on one turn. One that yields
+		// goes to the back, behind any that became ready meanwhile.
+		conn = sender.ready;
+		sender.ready = NULL;
+		sender.readyTail = NULL;
+		for (; conn != NULL; conn = next)
+		{
+			next = conn->next;
+			result = connection_send_file(conn);
+			if (result == SEND_YIELDED)
+			{
+				sender_ready(conn);
+			}
+			else if (result == SEND_BLOCKED)
+			{
+				sender_wait(conn);
+			}
+			else
+			{
+				sender_finish(conn);
+			}
+		}
+	}
+
+	close(sender.epollfd);
+	close(sender.wakefd);
+	config_offline();
+	return NULL;
+}
+
+/*
+ * Function: sender_ready
+ * ----------------------------
+ *   Adds a transfer to the end of the list of those that can go on.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+static void sender_ready(connection *conn)
+{
+	conn->next = NULL;
+	if (sender.readyTail == NULL)
+	{
+		sender.ready = conn;
+	}
+	else
+	{
+		sender.readyTail->next = conn;
+	}
+	sender.readyTail = conn;
+}
+
+/*
+ * Function: sender_wait
+ * ----------------------------
+ *   Waits for a full socket to take more. The socket is watched for one
+ *   event at a time, so a transfer is never both waiting and ready. A
+ *   socket that cannot be watched ends its transfer as failed.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+static void sender_wait(connection *conn)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	event.data.ptr = conn;
+	if (epoll_ctl(sender.epollfd, EPOLL_CTL_MOD, conn->sockfd, &event) != 0 &&
+			(errno != ENOENT || epoll_ctl(sender.epollfd, EPOLL_CTL_ADD, conn->sockfd, &event) != 0))
+	{
+		// Without a watch the transfer would never resume
+		LOG_ERROR("Unable to watch socket %i for the sender", conn->sockfd);
+		connection_close_file(conn);
+		conn->outlen = 0;
+		conn->outpos = 0;
+		conn->keepAlive = 0;
+		conn->state = CONN_DONE;
+		sender_finish(conn);
+	}
+}
+
+/*
+ * Function: sender_finish
+ * ----------------------------
+ *   Ends a transfer that has been sent or has failed. The connection goes
+ *   back to the thread pool, whose worker reads its next request or
+ *   closes it and keeps its context for another connection. It is closed
+ *   here only if the queue is full.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+static void sender_finish(connection *conn)
+{
+	epoll_ctl(sender.epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+	sender.active -= 1;
+	trace_finish(conn);
+
+	// The connection belongs to a worker again once it is requeued
+	if (threadpool_requeue(sender.pool, conn) != 0)
+	{
+		connection_discard(conn);
+	}
+}
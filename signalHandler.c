@@ -0,0 +1,208 @@
+/*
+ * signalHandler.c
+ *
+ * Contains the signal thread and the server's drain state. SIGHUP,
+ * SIGTERM and SIGQUIT are blocked in every thread and taken with
+ * sigwait() by one thread, so handling them is ordinary code with no
+ * async-signal-safety limits.
+ *
+ * SIGHUP reloads the configuration, and the thread frees each replaced
+ * configuration once no request still uses it. SIGUSR1 and SIGUSR2 log one level
+ * more or less until the next reload. SIGWINCH writes out the request
+ * trace. SIGTERM and SIGQUIT start a graceful
+ * drain: the listener stops accepting, queued and in-flight requests are
+ * finished, keep-alive connections are closed after their current
+ * response, and the server exits once the workers are done or the drain
+ * time limit passes. A second SIGTERM or SIGQUIT exits straight away.
+ * SIGPIPE is ignored, so a peer that goes away shows up as a failed
+ * write rather than ending the server.
+ */
+
+#include "headerfile.h"
+#include <sys/eventfd.h>
+
+/*
+ * Struct that holds the handled signals and the drain state.
+ */
+static struct {
+	sigset_t signals;		// the signals taken by the signal thread
+	pthread_t thread;
+	int draining;			// set once a drain has started
+	int wakefd;				// eventfd that becomes readable when the drain starts
+} handler = { .wakefd = -1 };
+
+/*
+ * Function prototypes for the signalHandler.c file
+ */
+static void *signal_thread(void *arg);
+
+/*
+ * Function: signal_handler_init
+ * ----------------------------
+ *   Blocks the handled signals in the calling thread. Must be called
+ *   before any other thread is started, since threads inherit the signal
+ *   mask.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void signal_handler_init()
+{
+	sigemptyset(&(handler.signals));
+	sigaddset(&(handler.signals), SIGHUP);
+	sigaddset(&(handler.signals), SIGTERM);
+	sigaddset(&(handler.signals), SIGQUIT);
+	sigaddset(&(handler.signals), SIGUSR1);
+	sigaddset(&(handler.signals), SIGUSR2);
+	sigaddset(&(handler.signals), SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &(handler.signals), NULL);
+
+	// sendfile() and splice() have no MSG_NOSIGNAL
+	signal(SIGPIPE, SIG_IGN);
+
+	handler.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (handler.wakefd < 0)
+	{
+		logger("Unable to create the drain eventfd");
+	}
+}
+
+/*
+ * Function: signal_handler_start
+ * ----------------------------
+ *   Starts the thread that handles the signals.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if successful, -1 if the thread cannot be started
+ */
+int signal_handler_start()
+{
+	if (pthread_create(&(handler.thread), NULL, signal_thread, NULL) != 0)
+	{
+		logger("Unable to start the signal thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: server_drain
+ * ----------------------------
+ *   Starts a graceful drain. The listener is woken through the drain
+ *   eventfd.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+void server_drain()
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&(handler.draining), 1, __ATOMIC_SEQ_CST);
+	if (handler.wakefd >= 0 && write(handler.wakefd, &one, sizeof(one)) < 0)
+	{
+		logger("Unable to wake the listener for the drain");
+	}
+}
+
+/*
+ * Function: server_draining
+ * ----------------------------
+ *   Determines if a drain has started.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 1 if the server is draining, 0 otherwise
+ */
+int server_draining()
+{
+	return __atomic_load_n(&(handler.draining), __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: server_drain_fd
+ * ----------------------------
+ *   Gets the descriptor that becomes readable when a drain starts, for
+ *   the listener to poll alongside its sockets.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: the eventfd, or -1 if there is none
+ */
+int server_drain_fd()
+{
+	return handler.wakefd;
+}
+
+/*
+ * Function: signal_thread
+ * ----------------------------
+ *   Waits for the handled signals and acts on each as it arrives.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *
+ *   Returns: nothing, the thread runs until the program ends
+ */
+static void *signal_thread(void *arg)
+{
+	struct timespec reap = { CONFIG_REAP_INTERVAL, 0 };
+	char logbuff[BUFSIZE];
+	int signal;
+
+	for (;;)
+	{
+		// While a replaced configuration is still in use, wake up now
+		// and then to free it
+		if (config_reclaim() > 0)
+		{
+			signal = sigtimedwait(&(handler.signals), NULL, &reap);
+			if (signal < 0)
+			{
+				continue;
+			}
+		}
+		else if (sigwait(&(handler.signals), &signal) != 0)
+		{
+			continue;
+		}
+
+		if (signal == SIGHUP)
+		{
+			config_reload();
+		}
+		else if (signal == SIGWINCH)
+		{
+			trace_dump();
+		}
+		else if (signal == SIGUSR1 || signal == SIGUSR2)
+		{
+			log_set_level(logLevel + (signal == SIGUSR1 ? 1 : -1), config_current()->settings.logSample);
+			sprintf(logbuff, "Log level is now %d.", logLevel);
+			logger(logbuff);
+		}
+		else if (server_draining())
+		{
+			logger("Second stop signal received; exiting without waiting for connections.");
+			exit(0);
+		}
+		else
+		{
+			sprintf(logbuff, "%s received; finishing in-flight requests before exiting.",
+					signal == SIGTERM ? "SIGTERM" : "SIGQUIT");
+			logger(logbuff);
+			server_drain();
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+#
+# reload_inflight.py
+#
+# Reloads the configuration while a request is still in flight. The
+# request's body arrives slowly, so its configuration cannot be freed
+# until it finishes. The reload must not wait for it: the server must
+# log the reload, keep answering other requests, and act on SIGTERM
+# while the request is still unfinished. The request must then be
+# answered.
+#
+# Usage: python3 tests/reload_inflight.py <server binary>
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+def free_port():
+	s = socket.socket()
+	s.bind(('127.0.0.1', 0))
+	port = s.getsockname()[1]
+	s.close()
+	return port if port >= 2000 else free_port()
+
+def listening(port):
+	probe = socket.socket()
+	try:
+		return probe.connect_ex(('127.0.0.1', port)) == 0
+	finally:
+		probe.close()
+
+def read(path):
+	try:
+		with open(path) as f:
+			return f.read()
+	except FileNotFoundError:
+		return ''
+
+def wait_for(condition, timeout):
+	end = time.time() + timeout
+	while time.time() < end:
+		if condition():
+			return True
+		time.sleep(0.05)
+	return False
+
+def main():
+	if len(sys.argv) != 2:
+		print('usage: reload_inflight.py <server binary>')
+		return 2
+	server = os.path.abspath(sys.argv[1])
+	home = tempfile.mkdtemp()
+	port = free_port()
+	config = os.path.join(home, 'config.txt')
+	with open(config, 'w') as f:
+		f.write('port=%d\nhome=%s\nmimetype=html&text/html\nbodytimeout=5\n' % (port, home))
+	with open(os.path.join(home, 'index.html'), 'w') as f:
+		f.write('<html>hello</html>\n')
+	with open(os.path.join(home, 'form.html'), 'w') as f:
+		f.write('Name %s Age %s\n')
+	log = os.path.join(home, 'server.log')
+
+	process = subprocess.Popen([server, config, str(port), home], cwd=home,
+			stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	try:
+		if not wait_for(lambda: listening(port), 5):
+			print('FAIL: server did not start')
+			return 1
+
+		# Start a request and leave its body unfinished
+		slow = socket.create_connection(('127.0.0.1', port))
+		slow.sendall(b'POST /form.html HTTP/1.1\r\nHost: x\r\nContent-Length: 12\r\n\r\nName=1')
+		time.sleep(0.3)
+
+		process.send_signal(signal.SIGHUP)
+		if not wait_for(lambda: 'Configuration reloaded.' in read(log), 2):
+			print('FAIL: the reload waited for the request in flight')
+			return 1
+
+		other = socket.create_connection(('127.0.0.1', port))
+		other.settimeout(2)
+		other.sendall(b'GET /index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n')
+		if not other.recv(100).startswith(b'HTTP/1.1 200'):
+			print('FAIL: another request was not answered after the reload')
+			return 1
+
+		# The signal thread must still be free to start a drain
+		process.send_signal(signal.SIGTERM)
+		if not wait_for(lambda: 'SIGTERM received' in read(log), 2):
+			print('FAIL: SIGTERM was not handled while the request was in flight')
+			return 1
+
+		slow.settimeout(5)
+		slow.sendall(b'&Age=2')
+		if not slow.recv(100).startswith(b'HTTP/1.1 200'):
+			print('FAIL: the request in flight was not answered')
+			return 1
+
+		if process.wait(10) != 0:
+			print('FAIL: server did not exit cleanly')
+			return 1
+	finally:
+		if process.poll() is None:
+			process.kill()
+
+	print('PASS')
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main())
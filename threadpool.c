@@ -7,30 +7,77 @@
  * queue that need to be processed, and destroying the thread
  * pool when the program ends.
  *
+ * Each worker serves every connection it takes in a coroutine of its
+ * own and schedules them on one epoll set, so a worker holds up to
+ * COROUTINE_MAX connections at once and one waiting on its client does
+ * not keep the others waiting. The queue's eventfd is in the same epoll
+ * set, so a worker with room for more is woken for a new connection as
+ * for any of its sockets.
+ *
  * Kevin Dugan
  * 11/23/2012
  */
 #include "headerfile.h"
+#include <sys/eventfd.h>
+
+/*
+ * Struct that holds one queued connection. New connections carry only
+ * the socket and the times it was accepted and queued; connections put
+ * back in the middle of a file transfer carry their context as well.
+ */
+typedef struct queue_entry {
+	int socketfd;
+	connection *conn;
+	unsigned long long accepted;
+	unsigned long long enqueued;
+	rate_keys limits;	// rate limiter buckets a new connection is counted in
+	int local;			// nonzero if a new connection came in on the Unix socket
+} queue_entry;
+
+/*
+ * Struct that holds one lane of the queue, a ring of QUEUE_SIZE entries.
+ */
+typedef struct queue_lane {
+	queue_entry *entries;
+	int head;
+	int tail;
+	int count;
+} queue_lane;
 
 /*
  * Struct that holds the mutual exclusion lock, threads, and queue for
- * the threadpool.
+ * the threadpool. The queue has two lanes: new connections and those
+ * coming back for their next request wait in the interactive lane, and
+ * transfers put back between slices wait in the bulk lane, so a few
+ * large downloads cannot crowd out small requests. While both lanes
+ * wait, the bulk lane is served once in every SCHED_BULK_SHARE turns.
+ * The eventfd holds a token for each entry queued and wakes the workers.
  */
 struct threadpool {
 	pthread_mutex_t thread_lock;
-	pthread_cond_t signal;
+	int wakefd;		// semaphore eventfd, readable while entries are queued
 	pthread_t *threads;
-	int *connection_queue;
-	int queue_head;
-	int queue_tail;
-	int connection_count;
+	queue_lane lanes[2];	// LANE_INTERACTIVE and LANE_BULK
+	int turns;		// interactive entries served while the bulk lane waited
+	int draining;	// set when the pool is told to finish its queue and exit
 };
 
+// The calling worker's pool and its idle connection contexts
+static __thread threadpool *owner;
+static __thread connection_pool contexts;
+
 /*
  * Function prototypes for the threadpool.c file
  */
 static void *worker_thread(void *t_pool);
 
+static void worker_serve(void *arg);
+
+static int threadpool_enqueue(threadpool *pool, int socketfd, connection *conn, unsigned long long accepted,
+		rate_keys *limits, int local);
+
+static int threadpool_transfers(threadpool *pool);
+
 void threadpool_deallocate(threadpool *t_pool);
 
 /*
@@ -42,25 +89,51 @@ void threadpool_deallocate(threadpool *t_pool);
  *	 Parameters:
  *   none
  *
- *   Returns: the threadpool
+ *   Returns: the threadpool, or NULL if it could not be built
  */
 threadpool *threadpool_build()
 {
 	threadpool *pool;	//the threadpool
+	unsigned long long tokens;
 	int i;	//loop variable
+	int j;
 	int valid_thread = 0;	//flag to check that a thread was created properly
 
 	// Allocate memory
-	pool = (threadpool *)malloc(sizeof(threadpool));
+	pool = (threadpool *) calloc(1, sizeof(threadpool));
+	if (pool == NULL)
+	{
+		logger("Unable to allocate the thread pool");
+		return NULL;
+	}
+	pool->wakefd = -1;
+	pthread_mutex_init(&(pool->thread_lock), NULL);
 	pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * MAX_THREADS);
-	pool->connection_queue = (int *) malloc(sizeof(int) * QUEUE_SIZE);
+	pool->lanes[LANE_INTERACTIVE].entries = (queue_entry *) malloc(sizeof(queue_entry) * QUEUE_SIZE);
+	pool->lanes[LANE_BULK].entries = (queue_entry *) malloc(sizeof(queue_entry) * QUEUE_SIZE);
+	if (pool->threads == NULL || pool->lanes[LANE_INTERACTIVE].entries == NULL || pool->lanes[LANE_BULK].entries == NULL)
+	{
+		logger("Unable to allocate the thread pool");
+		threadpool_deallocate(pool);
+		return NULL;
+	}
 
 	// Initialize components
-	pool->queue_head = 0;
-	pool->queue_tail = 0;
-	pool->connection_count = 0;
-	pthread_mutex_init(&(pool->thread_lock), NULL);
-	pthread_cond_init(&(pool->signal), NULL);
+	for (i = 0; i < 2; i++)
+	{
+		pool->lanes[i].head = 0;
+		pool->lanes[i].tail = 0;
+		pool->lanes[i].count = 0;
+	}
+	pool->turns = 0;
+	pool->draining = 0;
+	pool->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (pool->wakefd < 0)
+	{
+		logger("Unable to create the thread pool's eventfd");
+		threadpool_deallocate(pool);
+		return NULL;
+	}
 
 	// Build the threads
 	for (i = 0; i < MAX_THREADS; i++)
@@ -69,7 +142,22 @@ threadpool *threadpool_build()
 		valid_thread = pthread_create(&(pool->threads[i]), NULL, worker_thread, (void*) pool);
 		if (valid_thread != 0)
 		{
-			//threadpool_eliminate(pool);
+			logger("Unable to start the thread pool's threads");
+
+			// The threads already started find an empty, draining queue and exit
+			pthread_mutex_lock(&(pool->thread_lock));
+			pool->draining = 1;
+			pthread_mutex_unlock(&(pool->thread_lock));
+			tokens = i;
+			if (i > 0 && write(pool->wakefd, &tokens, sizeof(tokens)) < 0)
+			{
+				logger("Unable to wake the threads to stop them");
+			}
+			for (j = 0; j < i; j++)
+			{
+				pthread_join(pool->threads[j], NULL);
+			}
+			threadpool_deallocate(pool);
 			return NULL;
 		}
 	}
@@ -81,7 +169,9 @@ threadpool *threadpool_build()
 /*
  * Function: worker_thread
  * ----------------------------
- *   Readies the worker thread to process a socket connection.
+ *   Readies the worker thread to process socket connections. Each one
+ *   taken from the queue is started in a coroutine, and between takes
+ *   the worker runs its coroutines and waits for their sockets.
  *
  *	 Parameters:
  *   t_pool: The threadpool
@@ -91,45 +181,238 @@ threadpool *threadpool_build()
 static void *worker_thread(void *t_pool)
 {
 	threadpool *pool = (threadpool *) t_pool;
-	int connection;
+	queue_entry entry;
+	queue_lane *lane;
+	connection *conn;
 	char logbuff[200];
+	int taken;
 
 	sprintf(logbuff, "Thread %u started", (unsigned int) pthread_self());
 	logger(logbuff);
 
+	owner = pool;
+	connection_pool_init(&contexts);
+	config_reader_register();
+	if (coroutine_scheduler_init(pool->wakefd) != 0)
+	{
+		LOG_ERROR("Thread %u cannot run coroutines; it serves one connection at a time",
+				(unsigned int) pthread_self());
+	}
+
 	for(;;)
 	{
-		//pthread_mutex_lock(&(pool->thread_lock));
-		while (pool->connection_count == 0)
+		// The worker holds nothing from the configuration between
+		// connections; its coroutines have slots of their own
+		config_offline();
+		taken = 0;
+
+		pthread_mutex_lock(&(pool->thread_lock));
+
+		// A draining pool lets its workers go once the queue is empty and
+		// their connections are finished
+		if (pool->draining && pool->lanes[LANE_INTERACTIVE].count == 0 && pool->lanes[LANE_BULK].count == 0
+				&& coroutine_count() == 0)
 		{
-			sprintf(logbuff, "Thread %u in wait status", (unsigned int) pthread_self());
-			logger(logbuff);
-			pthread_cond_wait(&(pool->signal), &(pool->thread_lock));
+			pthread_mutex_unlock(&(pool->thread_lock));
+			break;
 		}
 
-		// Get the first connection from the front of the queue
-		connection = pool->connection_queue[pool->queue_head];
-		pool->queue_head += 1;	//move the head to the next item in the queue
-
-		// If the head marker was just at the last item in the queue, send
-		// it back to the front of the queue.
-		if (pool->queue_head == QUEUE_SIZE)
+		// Take a connection while the worker has room for it. Pick a lane:
+		// interactive first, but a waiting transfer is not passed over
+		// more than SCHED_BULK_SHARE - 1 times in a row
+		if ((pool->lanes[LANE_INTERACTIVE].count > 0 || pool->lanes[LANE_BULK].count > 0)
+				&& coroutine_count() < COROUTINE_MAX)
 		{
-			pool->queue_head = 0;
+			lane = &(pool->lanes[LANE_INTERACTIVE]);
+			if (pool->lanes[LANE_BULK].count > 0)
+			{
+				if (lane->count == 0 || pool->turns >= SCHED_BULK_SHARE - 1)
+				{
+					lane = &(pool->lanes[LANE_BULK]);
+					pool->turns = 0;
+				}
+				else
+				{
+					pool->turns += 1;
+				}
+			}
+
+			// Get the first connection from the front of the lane
+			entry = lane->entries[lane->head];
+			lane->head += 1;	//move the head to the next item in the queue
+
+			// If the head marker was just at the last item in the queue, send
+			// it back to the front of the queue.
+			if (lane->head == QUEUE_SIZE)
+			{
+				lane->head = 0;
+			}
+
+			lane->count -= 1;	//subtract from the connections left to be processed
+			taken = 1;
 		}
+		pthread_mutex_unlock(&(pool->thread_lock));
 
-		pool->connection_count -= 1;	//subtract from the connections left to be processed
-		//pthread_mutex_unlock(&(pool->thread_lock));
+		if (taken)
+		{
+			// Each connection starts with the configuration now in effect
+			config_quiescent();
 
-		// Send the connection to the router for processing
-		(*(router))((void*)connection);
+			// A requeued connection brings its own context; a new one
+			// gets one from this worker's pool
+			conn = entry.conn;
+			if (conn == NULL)
+			{
+				conn = connection_acquire(&contexts, entry.socketfd);
+				if (conn == NULL)
+				{
+					LOG_ERROR("Unable to allocate a connection context");
+					rate_limit_release(&(entry.limits));
+					close(entry.socketfd);
+					continue;
+				}
+				conn->limits = entry.limits;
+				conn->local = entry.local;
+				conn->span.at[SPAN_ACCEPT] = entry.accepted;
+				conn->span.at[SPAN_ENQUEUE] = entry.enqueued;
+				trace_mark(conn, SPAN_DEQUEUE);
+			}
+			PROBE3(dequeue, entry.socketfd, entry.enqueued, entry.conn != NULL);
 
+			// Without a coroutine the connection is served here and now
+			if (coroutine_start(worker_serve, conn) != 0)
+			{
+				worker_serve(conn);
+			}
+			config_offline();
+		}
+		else if (coroutine_count() == 0)
+		{
+			LOG_TRACE("Thread %u in wait status", (unsigned int) pthread_self());
+		}
+
+		// Run the connections that can go on, then wait for sockets or
+		// the queue; a worker that just took one looks for more at once
+		coroutine_schedule(taken);
 	}
 
+	coroutine_scheduler_destroy();
+	connection_pool_destroy(&contexts);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+/*
+ * Function: worker_serve
+ * ----------------------------
+ *   Serves a connection until it is closed, handed to the sender or
+ *   requeued. Runs in the connection's coroutine, where every wait on a
+ *   socket lets the worker's other connections go on, or on the worker's
+ *   own stack if no coroutine could be started.
+ *
+ *	 Parameters:
+ *   arg: The connection
+ *
+ *   Returns: nothing
+ */
+static void worker_serve(void *arg)
+{
+	connection *conn = (connection *) arg;
+	threadpool *pool = owner;
+	int shared = coroutine_active();	// nonzero if the worker serves others meanwhile
+	int result;
+
+	config_quiescent();
+
+	// Send the connection to the router for processing. Keep-alive
+	// connections stay in their coroutine while they wait for the next
+	// request; one served on the worker's own stack stays only while no
+	// other connection is waiting for the worker.
+	for (;;)
+	{
+		// A connection the sender finished has waited its turn in the
+		// queue, so its next request is read at once. One that is not
+		// kept alive comes back only to be closed here.
+		if (conn->state == CONN_DONE)
+		{
+			if (!conn->keepAlive || conn->timedOut || server_draining())
+			{
+				break;
+			}
+			connection_next_request(conn);
+		}
+
+		if (conn->state != CONN_SENDING)
+		{
+			(*(router))((void*)conn);
+
+			// The handler only queued its response; it is sent below
+			if (conn->state == CONN_DONE && conn->outlen > 0)
+			{
+				conn->state = CONN_SENDING;
+			}
+		}
+
+		// Hand large files to the sender, which streams them without
+		// holding a worker. Anything else is sent here a slice at a
+		// time, yielding the worker to other connections and transfers
+		// after each slice. A client that cannot take more is left to the
+		// sender too rather than waited on.
+		while (conn->state == CONN_SENDING)
+		{
+			if (sender_wanted(conn) && sender_submit(conn) == 0)
+			{
+				conn = NULL;
+				break;
+			}
+			result = connection_send_file(conn);
+			if (result == SEND_BLOCKED)
+			{
+				if (sender_submit(conn) == 0)
+				{
+					conn = NULL;
+					break;
+				}
+
+				// Once the sender has stopped the connection waits itself
+				connection_wait(conn, POLLOUT);
+			}
+			else if (result == SEND_YIELDED && shared)
+			{
+				coroutine_yield();
+			}
+			else if (result == SEND_YIELDED && (threadpool_waiting(pool) > 0 || threadpool_transfers(pool) > 0)
+					&& threadpool_requeue(pool, conn) == 0)
+			{
+				conn = NULL;
+				break;
+			}
+			config_quiescent();
+		}
+
+		// A requeued transfer is finished by the worker that completes it
+		if (conn != NULL)
+		{
+			trace_finish(conn);
+		}
+
+		if (conn == NULL || !conn->keepAlive || conn->timedOut || server_draining()
+				|| (!shared && threadpool_waiting(pool) > 0))
+		{
+			break;
+		}
+
+		connection_next_request(conn);
+		config_quiescent();
+	}
+
+	// Close the socket and keep the context for the next connection
+	if (conn != NULL)
+	{
+		connection_release(&contexts, conn);
+	}
+}
+
 /*
  * Function: add_connection
  * ----------------------------
@@ -138,16 +421,67 @@ static void *worker_thread(void *t_pool)
  *	 Parameters:
  *   pool: The threadpool
  *   socketfd: The socket file descriptor for the connection
+ *   accepted: When the connection was accepted, from trace_now()
+ *   limits: The rate limiter buckets the connection is counted in
+ *   local: Nonzero if the connection came in on the Unix socket
  *
  *   Returns: 0 if successful
  */
-int add_connection(threadpool *pool, int socketfd)
+int add_connection(threadpool *pool, int socketfd, unsigned long long accepted, rate_keys *limits, int local)
 {
+	return threadpool_enqueue(pool, socketfd, NULL, accepted, limits, local);
+}
+
+/*
+ * Function: threadpool_requeue
+ * ----------------------------
+ *   Puts a connection that is part way through a file transfer at the
+ *   end of the bulk lane so the worker can serve others, or one the
+ *   sender has finished with at the end of the interactive lane. The
+ *   connection's context goes with it and the next worker resumes the
+ *   transfer or reads the next request.
+ *
+ *	 Parameters:
+ *   pool: The threadpool
+ *   conn: The connection to requeue
+ *
+ *   Returns: 0 if successful, -1 if the queue is full
+ */
+int threadpool_requeue(threadpool *pool, connection *conn)
+{
+	return threadpool_enqueue(pool, conn->sockfd, conn, 0, NULL, 0);
+}
+
+/*
+ * Function: threadpool_enqueue
+ * ----------------------------
+ *   Inserts an entry at the end of the connection queue and wakes a
+ *   worker.
+ *
+ *	 Parameters:
+ *   pool: The threadpool
+ *   socketfd: The socket file descriptor for the connection
+ *   conn: The connection context, or NULL for a new connection
+ *   accepted: When a new connection was accepted
+ *   limits: The rate limiter buckets a new connection is counted in
+ *   local: Nonzero if a new connection came in on the Unix socket
+ *
+ *   Returns: 0 if successful, -1 if the queue is full
+ */
+static int threadpool_enqueue(threadpool *pool, int socketfd, connection *conn, unsigned long long accepted,
+		rate_keys *limits, int local)
+{
+	// A transfer between slices waits in the bulk lane; anything else,
+	// including a connection back for its next request, is interactive
+	queue_lane *lane = &(pool->lanes[conn != NULL && conn->state == CONN_SENDING ? LANE_BULK : LANE_INTERACTIVE]);
+	unsigned long long one = 1;
 	int result = 0;
 	int next;
 
+	pthread_mutex_lock(&(pool->thread_lock));
+
 	// Increment the 'next' pointer
-	next = pool->queue_tail + 1;
+	next = lane->tail + 1;
 
 	// If the 'next' pointer is at the end of the queue, recycle to the
 	//beginning of the queue.
@@ -159,46 +493,159 @@ int add_connection(threadpool *pool, int socketfd)
 	do
 	{
 		// Check that we can accept another connection
-		if (pool->connection_count == QUEUE_SIZE)
+		if (lane->count == QUEUE_SIZE)
 		{
-			logger("The queue is full");
+			LOG_WARN("The queue is full");
 			result = -1;
 			break;
 		}
 
 		// Insert the connection into the end of the queue
-		pool->connection_queue[pool->queue_tail] = socketfd;
-		pool->queue_tail = next;
-		pool->connection_count += 1;
-
-		// Signal the thread pool that a connection is waiting
-		pthread_cond_signal(&(pool->signal));
+		lane->entries[lane->tail].socketfd = socketfd;
+		lane->entries[lane->tail].conn = conn;
+		lane->entries[lane->tail].accepted = accepted;
+		lane->entries[lane->tail].enqueued = conn == NULL ? trace_now() : 0;
+		if (limits != NULL)
+		{
+			lane->entries[lane->tail].limits = *limits;
+		}
+		lane->entries[lane->tail].local = local;
+		lane->tail = next;
+		lane->count += 1;
+		PROBE3(enqueue, socketfd, lane->count, conn != NULL);
 
 	}while(0);
 
+	pthread_mutex_unlock(&(pool->thread_lock));
+
+	// Signal the thread pool that a connection is waiting
+	if (result == 0 && write(pool->wakefd, &one, sizeof(one)) < 0)
+	{
+		LOG_ERROR("Unable to wake a worker");
+	}
+
 	return result;
 }
 
+/*
+ * Function: threadpool_waiting
+ * ----------------------------
+ *   Gets the number of connections waiting in the interactive lane, the
+ *   ones a worker should make way for.
+ *
+ *	 Parameters:
+ *   pool: The threadpool
+ *
+ *   Returns: the number of waiting connections
+ */
+int threadpool_waiting(threadpool *pool)
+{
+	int count;
+
+	pthread_mutex_lock(&(pool->thread_lock));
+	count = pool->lanes[LANE_INTERACTIVE].count;
+	pthread_mutex_unlock(&(pool->thread_lock));
+
+	return count;
+}
+
+/*
+ * Function: threadpool_transfers
+ * ----------------------------
+ *   Gets the number of transfers waiting in the bulk lane.
+ *
+ *	 Parameters:
+ *   pool: The threadpool
+ *
+ *   Returns: the number of waiting transfers
+ */
+static int threadpool_transfers(threadpool *pool)
+{
+	int count;
+
+	pthread_mutex_lock(&(pool->thread_lock));
+	count = pool->lanes[LANE_BULK].count;
+	pthread_mutex_unlock(&(pool->thread_lock));
+
+	return count;
+}
+
 /*
  * Function: threadpool_eliminate
  * ----------------------------
- *   Destroys the thread pool upon program exit
+ *   Destroys the thread pool upon program exit. Workers finish the
+ *   connections already queued and in progress, then exit.
  *
  *	 Parameters:
- *   None
+ *   t_pool: The threadpool
+ *   seconds: The longest time to wait for the workers
  *
- *   Returns: nothing
+ *   Returns: 0 if every worker finished, -1 if the time ran out
  */
-void threadpool_eliminate(threadpool *t_pool)
+int threadpool_eliminate(threadpool *t_pool, int seconds)
 {
 	threadpool *pool = t_pool;
+	struct timespec deadline;
+	unsigned long long tokens = MAX_THREADS;
+	char logbuff[200];
+	int remaining = 0;
 	int i;
 
+	pthread_mutex_lock(&(pool->thread_lock));
+	pool->draining = 1;
+	pthread_mutex_unlock(&(pool->thread_lock));
+
+	// One token for each worker, so every one wakes to see the drain
+	if (write(pool->wakefd, &tokens, sizeof(tokens)) < 0)
+	{
+		logger("Unable to wake the workers to stop them");
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += seconds;
+
 	logger("Joining threads to terminate all thread pool threads");
 	for(i = 0; i < MAX_THREADS; i++)
 	{
-		pthread_join(pool->threads[i], NULL);
+		if (pthread_timedjoin_np(pool->threads[i], NULL, &deadline) != 0)
+		{
+			remaining += 1;
+		}
+	}
+
+	// Workers still busy may be using the pool, so it is left allocated
+	if (remaining > 0)
+	{
+		sprintf(logbuff, "%d threads still busy after %d seconds; exiting anyway.", remaining, seconds);
+		logger(logbuff);
+		return -1;
 	}
 
+	threadpool_deallocate(pool);
+	return 0;
+}
+
+/*
+ * Function: threadpool_deallocate
+ * ----------------------------
+ *   Frees the thread pool once none of its threads are running.
+ *
+ *	 Parameters:
+ *   t_pool: The threadpool
+ *
+ *   Returns: nothing
+ */
+void threadpool_deallocate(threadpool *t_pool)
+{
+	threadpool *pool = t_pool;
+
+	if (pool->wakefd >= 0)
+	{
+		close(pool->wakefd);
+	}
+	pthread_mutex_destroy(&(pool->thread_lock));
+	free(pool->lanes[LANE_INTERACTIVE].entries);
+	free(pool->lanes[LANE_BULK].entries);
+	free(pool->threads);
 	free(pool);
 }
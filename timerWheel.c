@@ -0,0 +1,317 @@
+/*
+ * timerWheel.c
+ *
+ * Contains a hierarchical timer wheel used to enforce connection
+ * deadlines. Timers are intrusive list nodes, so arming, re-arming and
+ * cancelling a timer is O(1) and never allocates. A single timer thread
+ * advances the wheel once per TIMER_TICK_MS; that sleep is the only
+ * system call the wheel makes no matter how many timers are armed.
+ *
+ * Level 0 holds timers due within the next TIMER_WHEEL_SLOTS ticks, and
+ * each higher level covers TIMER_WHEEL_SLOTS times the span of the one
+ * below it. When the lower level wraps around, the next slot of the level
+ * above is cascaded down so its timers land in their exact tick.
+ */
+
+#include "headerfile.h"
+
+/*
+ * Struct that holds the wheel levels, the current tick, and the lock
+ * protecting them.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	unsigned long long now;		// current tick
+	unsigned long count;		// number of armed timers
+	timer_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];	// list heads
+} wheel;
+
+/*
+ * Function prototypes for the timerWheel.c file
+ */
+static void timer_link(timer_node *timer);
+static void timer_unlink(timer_node *timer);
+static void timer_advance();
+static void *timer_thread(void *arg);
+
+/*
+ * Function: timer_link
+ * ----------------------------
+ *   Places an armed timer in the slot for its expiry tick.
+ *   The wheel lock must be held.
+ *
+ *	 Parameters:
+ *   timer: The timer to place
+ *
+ *   Returns: nothing
+ */
+static void timer_link(timer_node *timer)
+{
+	unsigned long long delta;
+	unsigned long long expires = timer->expires;
+	timer_node *head;
+	int level = 0;
+
+	// Timers that are already due go in the next slot to fire
+	if (expires <= wheel.now)
+	{
+		expires = wheel.now + 1;
+	}
+
+	// Find the lowest level whose span reaches the expiry tick
+	delta = expires - wheel.now;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+			delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+	{
+		level++;
+	}
+
+	// Clamp timers beyond the top level to its furthest slot
+	if (level == TIMER_WHEEL_LEVELS - 1 &&
+			delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+	{
+		expires = wheel.now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	}
+
+	head = &(wheel.slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)]);
+
+	// Insert at the tail of the slot list
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+/*
+ * Function: timer_unlink
+ * ----------------------------
+ *   Removes a timer from its slot list. The wheel lock must be held.
+ *
+ *	 Parameters:
+ *   timer: The timer to remove
+ *
+ *   Returns: nothing
+ */
+static void timer_unlink(timer_node *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+/*
+ * Function: timer_wheel_start
+ * ----------------------------
+ *   Initializes the wheel and starts the timer thread.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if successful, -1 if the timer thread could not be created
+ */
+int timer_wheel_start()
+{
+	int level, slot;
+
+	pthread_mutex_init(&(wheel.lock), NULL);
+	wheel.now = 0;
+	wheel.count = 0;
+
+	// Each slot is an empty circular list
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+		{
+			wheel.slots[level][slot].next = &(wheel.slots[level][slot]);
+			wheel.slots[level][slot].prev = &(wheel.slots[level][slot]);
+		}
+	}
+
+	if (pthread_create(&(wheel.thread), NULL, timer_thread, NULL) != 0)
+	{
+		logger("Unable to start the timer thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Function: timer_set
+ * ----------------------------
+ *   Arms a timer to fire after the given number of milliseconds,
+ *   replacing any earlier deadline. The callback runs on the timer
+ *   thread with the wheel locked, so it must be short and must not
+ *   call back into the wheel.
+ *
+ *	 Parameters:
+ *   timer: The timer to arm
+ *   msec: Milliseconds until the timer fires
+ *   callback: The function to call when the timer fires
+ *   arg: The argument passed to the callback
+ *
+ *   Returns: nothing
+ */
+void timer_set(timer_node *timer, unsigned int msec, void (*callback)(void *), void *arg)
+{
+	pthread_mutex_lock(&(wheel.lock));
+
+	if (timer->next != NULL)
+	{
+		timer_unlink(timer);
+		wheel.count -= 1;
+	}
+
+	// Round up so a timer never fires early
+	timer->expires = wheel.now + (msec + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	timer->callback = callback;
+	timer->arg = arg;
+	timer_link(timer);
+	wheel.count += 1;
+
+	pthread_mutex_unlock(&(wheel.lock));
+}
+
+/*
+ * Function: timer_cancel
+ * ----------------------------
+ *   Disarms a timer. Once this returns the callback is not running and
+ *   will not run.
+ *
+ *	 Parameters:
+ *   timer: The timer to disarm
+ *
+ *   Returns: nothing
+ */
+void timer_cancel(timer_node *timer)
+{
+	pthread_mutex_lock(&(wheel.lock));
+
+	if (timer->next != NULL)
+	{
+		timer_unlink(timer);
+		wheel.count -= 1;
+	}
+
+	pthread_mutex_unlock(&(wheel.lock));
+}
+
+/*
+ * Function: timer_advance
+ * ----------------------------
+ *   Moves the wheel forward one tick, cascading higher levels down when
+ *   a lower level wraps, and fires every timer due on the new tick.
+ *   The wheel lock must be held.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: nothing
+ */
+static void timer_advance()
+{
+	timer_node *head;
+	timer_node *timer;
+	timer_node pending;
+	int level;
+
+	wheel.now += 1;
+
+	// Cascade each level whose lower neighbour just wrapped around
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		if ((wheel.now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+		{
+			break;
+		}
+
+		head = &(wheel.slots[level][(wheel.now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)]);
+
+		// Detach the slot's list, then re-insert each timer at its proper level
+		if (head->next == head)
+		{
+			continue;
+		}
+		pending.next = head->next;
+		pending.prev = head->prev;
+		pending.next->prev = &pending;
+		pending.prev->next = &pending;
+		head->next = head;
+		head->prev = head;
+
+		while ((timer = pending.next) != &pending)
+		{
+			timer_unlink(timer);
+			timer_link(timer);
+		}
+	}
+
+	// Fire everything in the current level 0 slot
+	head = &(wheel.slots[0][wheel.now & (TIMER_WHEEL_SLOTS - 1)]);
+	while ((timer = head->next) != head)
+	{
+		timer_unlink(timer);
+		wheel.count -= 1;
+		timer->callback(timer->arg);
+	}
+}
+
+/*
+ * Function: timer_thread
+ * ----------------------------
+ *   Advances the wheel in step with the monotonic clock. If the thread
+ *   falls behind it catches up one tick at a time so no slot is skipped.
+ *
+ *	 Parameters:
+ *   arg: not used
+ *
+ *   Returns: nothing, the thread runs until the program ends
+ */
+static void *timer_thread(void *arg)
+{
+	struct timespec start, next, current;
+	unsigned long long target;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+
+	for (;;)
+	{
+		// Sleep until the start of the next tick
+		next.tv_nsec += TIMER_TICK_MS * 1000000L;
+		while (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec += 1;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		// Work out which tick the clock has reached
+		clock_gettime(CLOCK_MONOTONIC, &current);
+		target = ((unsigned long long) (current.tv_sec - start.tv_sec) * 1000ULL +
+				(current.tv_nsec - start.tv_nsec) / 1000000L) / TIMER_TICK_MS;
+
+		pthread_mutex_lock(&(wheel.lock));
+		while (wheel.now < target)
+		{
+			// With nothing armed there is nothing to cascade or fire
+			if (wheel.count == 0)
+			{
+				wheel.now = target;
+				break;
+			}
+			timer_advance();
+		}
+		pthread_mutex_unlock(&(wheel.lock));
+
+		// Resynchronize if the thread was descheduled for several ticks
+		if (current.tv_sec > next.tv_sec + 1)
+		{
+			next = current;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,497 @@
+/*
+ * tls.c
+ *
+ * Contains TLS termination with OpenSSL. When a certificate is configured
+ * every connection on the listening socket starts with a TLS handshake,
+ * done by the worker before it reads the first request. Sessions can be
+ * resumed from the server's session cache or from a session ticket.
+ *
+ * After the handshake OpenSSL is asked to hand record encryption to the
+ * kernel (kTLS). Where the kernel and OpenSSL support it, file bodies are
+ * still sent with sendfile() and never pass through user space; where
+ * they do not, files are read and written through OpenSSL a record at a
+ * time.
+ *
+ * Sockets are non-blocking. Whenever OpenSSL needs to read or write the
+ * socket before a call can go on, the connection waits for it and the
+ * call is repeated, so callers see calls that block as before.
+ *
+ * ALPN offers h2 ahead of http/1.1 when HTTP/2 is enabled.
+ *
+ * TLS is built in only with -DUSE_TLS (link with -lssl -lcrypto).
+ * Without it a configured certificate stops the server from starting,
+ * rather than serving plaintext where TLS was expected.
+ */
+
+#include "headerfile.h"
+
+#ifdef USE_TLS
+
+#include <limits.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_RECORD_SIZE 16384 // largest TLS record payload
+
+/*
+ * Struct that holds the server's TLS context.
+ */
+static struct {
+	SSL_CTX *context;		// the context every connection is made from, or NULL
+	int ktlsLogged;			// set once kTLS use has been logged
+} tls;
+
+/*
+ * Function prototypes for the tls.c file
+ */
+static void tls_log_errors(const char *message);
+
+static int tls_wait(connection *conn, int result);
+
+static int tls_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *arg);
+
+/*
+ * Function: tls_log_errors
+ * ----------------------------
+ *   Logs a message followed by the first error OpenSSL recorded, and
+ *   clears the calling thread's error queue.
+ *
+ *	 Parameters:
+ *   message: What was being done
+ *
+ *   Returns: nothing
+ */
+static void tls_log_errors(const char *message)
+{
+	char reason[256];
+	unsigned long error = ERR_get_error();
+
+	if (error != 0)
+	{
+		ERR_error_string_n(error, reason, sizeof(reason));
+		LOG_WARN("%s: %s", message, reason);
+	}
+	else
+	{
+		LOG_WARN("%s", message);
+	}
+	ERR_clear_error();
+}
+
+/*
+ * Function: tls_select_protocol
+ * ----------------------------
+ *   Chooses the application protocol from those the client offers over
+ *   ALPN, in the server's order of preference.
+ *
+ *	 Parameters:
+ *   ssl: The connection
+ *   out: Where to put the chosen protocol
+ *   outlen: Where to put its length
+ *   in: The protocols the client offers
+ *   inlen: Their length
+ *   arg: not used
+ *
+ *   Returns: SSL_TLSEXT_ERR_OK if a protocol was chosen,
+ *   SSL_TLSEXT_ERR_NOACK to carry on without one
+ */
+static int tls_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *arg)
+{
+	static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+	const unsigned char *server = protocols;
+	unsigned int length = sizeof(protocols) - 1;
+
+	// Without HTTP/2 only http/1.1 is offered
+	if (!config_current()->settings.http2)
+	{
+		server += 3;
+		length -= 3;
+	}
+
+	if (SSL_select_next_proto((unsigned char **) out, outlen, server, length, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+	{
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/*
+ * Function: tls_init
+ * ----------------------------
+ *   Loads the certificate and key and creates the TLS context, if a
+ *   certificate is configured.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if successful or TLS is not configured, -1 otherwise
+ */
+int tls_init()
+{
+	const server_settings *limits = &(config_current()->settings);
+	static const unsigned char sessionContext[] = "webserver";
+
+	if (limits->tlsCertificate[0] == '\0')
+	{
+		return 0;
+	}
+
+	tls.context = SSL_CTX_new(TLS_server_method());
+	if (tls.context == NULL)
+	{
+		tls_log_errors("Unable to create the TLS context");
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(tls.context, TLS1_2_VERSION);
+
+	if (SSL_CTX_use_certificate_chain_file(tls.context, limits->tlsCertificate) != 1 ||
+			SSL_CTX_use_PrivateKey_file(tls.context,
+					limits->tlsKey[0] != '\0' ? limits->tlsKey : limits->tlsCertificate, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(tls.context) != 1)
+	{
+		tls_log_errors("Unable to load the TLS certificate and key");
+		SSL_CTX_free(tls.context);
+		tls.context = NULL;
+		return -1;
+	}
+
+	// Resumption from the session cache or from tickets, which OpenSSL
+	// issues by default
+	SSL_CTX_set_session_id_context(tls.context, sessionContext, sizeof(sessionContext) - 1);
+	SSL_CTX_set_session_cache_mode(tls.context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(tls.context, limits->tlsSessionCache);
+
+	// Records are written whole, and kTLS is used where it can be
+	SSL_CTX_set_mode(tls.context, SSL_MODE_AUTO_RETRY);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(tls.context, SSL_OP_ENABLE_KTLS);
+#endif
+
+	SSL_CTX_set_alpn_select_cb(tls.context, tls_select_protocol, NULL);
+
+	logger("TLS enabled.");
+	return 0;
+}
+
+/*
+ * Function: tls_active
+ * ----------------------------
+ *   Determines if connections start with a TLS handshake.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 1 if TLS is enabled, 0 otherwise
+ */
+int tls_active()
+{
+	return tls.context != NULL;
+}
+
+/*
+ * Function: tls_wait
+ * ----------------------------
+ *   Waits for the socket if a call failed only because OpenSSL has to
+ *   read or write it first.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   result: What the OpenSSL call returned
+ *
+ *   Returns: 1 if the call should be repeated, 0 if it failed
+ */
+static int tls_wait(connection *conn, int result)
+{
+	switch (SSL_get_error((SSL *) conn->tls, result))
+	{
+		case SSL_ERROR_WANT_READ:
+			return connection_wait(conn, POLLIN) == 0;
+		case SSL_ERROR_WANT_WRITE:
+			return connection_wait(conn, POLLOUT) == 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Function: tls_handshake
+ * ----------------------------
+ *   Performs the server side of the TLS handshake on a new connection.
+ *   The caller arms the deadline it must finish within.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: 0 if successful, -1 if the handshake failed
+ */
+int tls_handshake(connection *conn)
+{
+	SSL *ssl = SSL_new(tls.context);
+	int result;
+
+	if (ssl == NULL || SSL_set_fd(ssl, conn->sockfd) != 1)
+	{
+		tls_log_errors("Unable to start a TLS connection");
+		SSL_free(ssl);
+		return -1;
+	}
+	conn->tls = ssl;
+
+	do
+	{
+		result = SSL_accept(ssl);
+	} while (result != 1 && tls_wait(conn, result));
+	if (result != 1)
+	{
+		if (!conn->timedOut)
+		{
+			LOG_DEBUG("Thread %u: TLS handshake failed on socket %i", (unsigned int) pthread_self(), conn->sockfd);
+		}
+		ERR_clear_error();
+		return -1;
+	}
+
+	conn->secure = 1;
+	conn->ktls = BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+	if (!__atomic_exchange_n(&(tls.ktlsLogged), 1, __ATOMIC_RELAXED))
+	{
+		logger(conn->ktls ? "TLS records are encrypted by the kernel; files are sent with sendfile()."
+				: "Kernel TLS is not available; files are encrypted by OpenSSL.");
+	}
+	LOG_DEBUG("Thread %u: %s %s handshake on socket %i%s", (unsigned int) pthread_self(), SSL_get_version(ssl),
+			SSL_session_reused(ssl) ? "resumed" : "full", conn->sockfd, conn->ktls ? " with kTLS" : "");
+	return 0;
+}
+
+/*
+ * Function: tls_recv
+ * ----------------------------
+ *   Receives decrypted data from a TLS connection, like recv().
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   buffer: Where to put the data
+ *   length: The most bytes to receive
+ *
+ *   Returns: the number of bytes received, 0 if the peer closed the
+ *   connection, or -1 on error
+ */
+ssize_t tls_recv(connection *conn, void *buffer, size_t length)
+{
+	int received;
+
+	do
+	{
+		received = SSL_read((SSL *) conn->tls, buffer, length > INT_MAX ? INT_MAX : (int) length);
+	} while (received <= 0 && tls_wait(conn, received));
+
+	if (received > 0)
+	{
+		return received;
+	}
+
+	switch (SSL_get_error((SSL *) conn->tls, received))
+	{
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			// errno is left as the socket call set it
+			ERR_clear_error();
+			return received == 0 ? 0 : -1;
+		default:
+			ERR_clear_error();
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+/*
+ * Function: tls_pending
+ * ----------------------------
+ *   Determines if OpenSSL holds received data not yet read, which a poll
+ *   on the socket would not show.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: 1 if data is waiting, 0 otherwise
+ */
+int tls_pending(connection *conn)
+{
+	return conn->tls != NULL && SSL_pending((SSL *) conn->tls) > 0;
+}
+
+/*
+ * Function: tls_send
+ * ----------------------------
+ *   Sends data over a TLS connection, like send().
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   data: The data to send
+ *   length: The number of bytes to send
+ *
+ *   Returns: the number of bytes sent, or -1 on error
+ */
+ssize_t tls_send(connection *conn, const void *data, size_t length)
+{
+	size_t sent = 0;
+	int result;
+
+	do
+	{
+		result = SSL_write_ex((SSL *) conn->tls, data, length, &sent);
+	} while (result != 1 && tls_wait(conn, result));
+	if (result != 1)
+	{
+		ERR_clear_error();
+		if (errno == 0 || errno == EINTR)
+		{
+			errno = EPIPE;
+		}
+		return -1;
+	}
+
+	return sent;
+}
+
+/*
+ * Function: tls_sendfile
+ * ----------------------------
+ *   Sends part of a file over a TLS connection. With kTLS the kernel
+ *   encrypts the file as sendfile() sends it; otherwise one record's
+ *   worth is read and sent through OpenSSL.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *   fd: The file
+ *   offset: The first byte to send, advanced past the bytes sent
+ *   count: The most bytes to send
+ *
+ *   Returns: the number of bytes sent, 0 at the end of the file, or -1
+ *   on error
+ */
+ssize_t tls_sendfile(connection *conn, int fd, off_t *offset, size_t count)
+{
+	char record[TLS_RECORD_SIZE];
+	ssize_t sent;
+
+	if (conn->ktls)
+	{
+		do
+		{
+			sent = SSL_sendfile((SSL *) conn->tls, fd, *offset, count, 0);
+		} while (sent < 0 && tls_wait(conn, (int) sent));
+		if (sent < 0)
+		{
+			ERR_clear_error();
+			return -1;
+		}
+	}
+	else
+	{
+		sent = pread(fd, record, count < sizeof(record) ? count : sizeof(record), *offset);
+		if (sent > 0)
+		{
+			sent = tls_send(conn, record, sent);
+		}
+	}
+
+	if (sent > 0)
+	{
+		*offset += sent;
+	}
+	return sent;
+}
+
+/*
+ * Function: tls_close
+ * ----------------------------
+ *   Sends a TLS close notification, unless the connection timed out, and
+ *   frees the connection's TLS state.
+ *
+ *	 Parameters:
+ *   conn: The connection
+ *
+ *   Returns: nothing
+ */
+void tls_close(connection *conn)
+{
+	if (conn->tls == NULL)
+	{
+		return;
+	}
+
+	if (!conn->timedOut)
+	{
+		SSL_shutdown((SSL *) conn->tls);
+	}
+	ERR_clear_error();
+	SSL_free((SSL *) conn->tls);
+	conn->tls = NULL;
+	conn->ktls = 0;
+}
+
+#else
+
+/*
+ * Function: tls_init
+ * ----------------------------
+ *   Refuses a configured certificate, since TLS is not built in.
+ *
+ *	 Parameters:
+ *   none
+ *
+ *   Returns: 0 if TLS is not configured, -1 otherwise
+ */
+int tls_init()
+{
+	if (config_current()->settings.tlsCertificate[0] != '\0')
+	{
+		logger("A TLS certificate is configured but TLS is not built in; rebuild with -DUSE_TLS.");
+		return -1;
+	}
+	return 0;
+}
+
+int tls_active()
+{
+	return 0;
+}
+
+int tls_handshake(connection *conn)
+{
+	return -1;
+}
+
+ssize_t tls_recv(connection *conn, void *buffer, size_t length)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int tls_pending(connection *conn)
+{
+	return 0;
+}
+
+ssize_t tls_send(connection *conn, const void *data, size_t length)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t tls_sendfile(connection *conn, int fd, off_t *offset, size_t count)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+void tls_close(connection *conn)
+{
+}
+
+#endif